@@ -8,10 +8,44 @@
 
 #define TEXT5 "палка, палкой огуречик вот и вышел человечек"
 
+static void
+print_lemmas(const char *const tokens[], morph_lemmas_t *lemmas)
+{
+    size_t i, j;
+    
+    for (i = 0; i < lemmas->tokens_count; i++) {
+        printf("\"%s\":", tokens[i]);
+        for (j = 0; j < lemmas->tokens[i].count; j++) {
+            printf(" \"%s\"", lemmas->text + lemmas->offsets[lemmas->tokens[i].first + j]);
+        }
+        printf("\n");
+    }
+}
+
+static void
+print_tags(morph_tags_t *tags)
+{
+    size_t i;
+    
+    for (i = 0; i < tags->tags_count; i++) {
+        printf("%s pos = %u grammemes = %#llx\n", tags->text + tags->tags[i].lemma,
+               (unsigned int)tags->tags[i].pos, (unsigned long long)tags->tags[i].grammemes);
+    }
+}
+
 int
 main(int argc, char **argv)
 {
     double pr = 0.0;
+    /* Повторы, пустой токен и токен с неверным UTF-8 */
+    const char *const tokens[] = {"палкой", "", "Палкой", "палкой", "\xff\xfe", "человечек", "\xd0"};
+    morph_lemmas_t lemmas;
+    morph_tags_t tags;
+    morph_t *lazy;
+    char *normal;
+    
+    memset(&lemmas, 0, sizeof(lemmas));
+    memset(&tags, 0, sizeof(tags));
     
     morph_t *morph = morph_new(MORPH_PATH_DICTS);
 	if (morph == NULL) {
@@ -45,6 +79,63 @@ main(int argc, char **argv)
 
 	puts(morph_normalize_form(TEXT5, morph, strlen(TEXT5)));
 	
+    if (morph_lemmatize_batch(morph, tokens, sizeof(tokens)/sizeof(tokens[0]), &lemmas) != MORPH_OK) {
+        fprintf(stderr, "Lemmatize batch failed.\n");
+        return -1;
+    }
+    print_lemmas(tokens, &lemmas);
+    
+    /* Существительные в родительном падеже */
+    if (morph_analyze_word(morph, "палки", MORPH_POS_MASK(MORPH_POS_NOUN), MORPH_GRAM_GENITIVE, &tags) != MORPH_OK) {
+        fprintf(stderr, "Analyze word failed.\n");
+        return -1;
+    }
+    print_tags(&tags);
+    
+    /* Только существительные, в любой форме */
+    if (morph_analyze_word(morph, "палки", MORPH_POS_MASK(MORPH_POS_NOUN), 0, &tags) != MORPH_OK) {
+        fprintf(stderr, "Analyze word failed.\n");
+        return -1;
+    }
+    print_tags(&tags);
+    
+    /* Документ держит свою версию словарей и переживает перезагрузку */
+    if (morph_reload(morph, NULL) != MORPH_OK || morph_reload_wait(morph) != MORPH_OK) {
+        fprintf(stderr, "Reload failed.\n");
+        return -1;
+    }
+    morph_doc_delete(search);
+    search = morph_doc_new(morph, TEXT, strlen(TEXT), 0);
+	if (search == NULL) {
+		fprintf(stderr, "Allocated failed.\n");
+        return -1;
+	}
+	
+    pr = morph_doc_intersect_doc(doc, search);
+    printf("pr after reload = %lf\n", pr);
+    
+    pr = morph_str_intersect_str(morph, TEXT1, TEXT);
+    printf("pr after reload = %lf\n", pr);
+    
+    /* Второстепенные языки загружаются при первом обращении, язык документа закрепляется */
+    lazy = morph_new_ex(MORPH_PATH_DICTS, MORPH_LAZY_LOAD | MORPH_PIN_LANGUAGE);
+	if (lazy == NULL) {
+		fprintf(stderr, "Allocated failed.\n");
+        return -1;
+	}
+    
+    pr = morph_str_intersect_str(lazy, TEXT1, TEXT);
+    printf("pr lazy = %lf\n", pr);
+    
+    normal = morph_normalize_form(TEXT5, lazy, strlen(TEXT5));
+    puts(normal);
+    free(normal);
+    
+    morph_delete(lazy);
+    
+    morph_tags_free(&tags);
+    morph_lemmas_free(&lemmas);
+    
     morph_doc_delete(doc);
     morph_doc_delete(search);
     
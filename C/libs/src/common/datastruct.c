@@ -168,6 +168,16 @@ void array_list_shrink(ArrayList *list, size_t new_size) {
     array_list_resize(list, new_size);
 }
 
+/* Опустошает список, сохраняя выделенную под элементы память */
+void array_list_clear(ArrayList *list) {
+  list->size = 0;
+}
+
+/* Оставляет в списке первые new_size элементов, не трогая память */
+void array_list_truncate(ArrayList *list, size_t new_size) {
+  if (new_size < list->size) list->size = new_size;
+}
+
 void *array_list_append(ArrayList *list, const void *data) {
   if (list->capacity <= list->size) {
     array_list_resize(list, list->capacity ? (list->capacity << 1) : list->initial_capacity);
@@ -63,6 +63,8 @@ size_t array_list_capacity(ArrayList *list);
 void array_list_minimize(ArrayList *list);
 void array_list_foreach(ArrayList *list, void (*func)(void *item));
 void array_list_shrink(ArrayList *list, size_t new_size);
+void array_list_clear(ArrayList *list);
+void array_list_truncate(ArrayList *list, size_t new_size);
 void *array_list_iter(ArrayList *list, void **memo);
 ssize_t array_list_index(ArrayList *list, void *data, EqFunction eqfunc);
 
@@ -0,0 +1,68 @@
+/* Двоичные образы (автоматов, правил, таблиц словоформ) в файлах. Образ
+ * пишется во временный файл рядом с целевым, который затем атомарно
+ * подменяет старый: процессы, уже отобразившие прежнюю версию в память,
+ * продолжают спокойно с ней работать, а оборванная запись не оставляет
+ * битого файла. Читаются образы не разбором, а отображением в память. */
+
+#include "common/fileimage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common/strict_alloc.h"
+
+/* Имя временного файла для записи file_name (освобождается вызывающим) */
+char *make_temp_file_name(const char *file_name) {
+  size_t name_length = strlen(file_name);
+  char *temp_file_name = strict_malloc(name_length + sizeof(".tmp"));
+  memcpy(temp_file_name, file_name, name_length);
+  memcpy(temp_file_name + name_length, ".tmp", sizeof(".tmp"));
+  return temp_file_name;
+}
+
+/* Сохраняет image_size байт образа image в файл file_name через временный
+ * файл. Возвращает 0 при успехе. */
+int save_file_image(const void *image, size_t image_size, const char *file_name) {
+  char *temp_file_name = make_temp_file_name(file_name);
+  FILE *file = fopen(temp_file_name, "wb");
+  int error = 0;
+  if (file == NULL) {
+    strict_free(temp_file_name);
+    return -1;
+  }
+  if (fwrite(image, 1, image_size, file) != image_size) error = 1;
+  if (fclose(file) != 0) error = 1;
+  if (!error && rename(temp_file_name, file_name) != 0) error = 1;
+  if (error) unlink(temp_file_name);
+  strict_free(temp_file_name);
+  return error ? -1 : 0;
+}
+
+/* Отображает файл file_name в память только для чтения: страницы образа
+ * разделяются между всеми процессами, открывшими тот же файл. В image_size
+ * записывается размер образа. Возвращает NULL, если файла нет, он короче
+ * min_size байт или его не удалось отобразить. */
+void *map_file_image(const char *file_name, size_t min_size, size_t *image_size) {
+  struct stat file_stat;
+  void *image;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) return NULL;
+  if (fstat(fd, &file_stat) != 0 || (size_t)file_stat.st_size < min_size || file_stat.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  image = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) return NULL;
+  *image_size = (size_t)file_stat.st_size;
+  return image;
+}
+
+/* Освобождает образ, отображённый map_file_image */
+void unmap_file_image(void *image, size_t image_size) {
+  munmap(image, image_size);
+}
@@ -0,0 +1,13 @@
+/* Двоичные образы в файлах: атомарная запись и отображение в память */
+
+#ifndef __COMMON_FILEIMAGE_H__
+#define __COMMON_FILEIMAGE_H__
+
+#include <stdlib.h>
+
+char *make_temp_file_name(const char *file_name);
+int save_file_image(const void *image, size_t image_size, const char *file_name);
+void *map_file_image(const char *file_name, size_t min_size, size_t *image_size);
+void unmap_file_image(void *image, size_t image_size);
+
+#endif /* __COMMON_FILEIMAGE_H__ */
@@ -0,0 +1,84 @@
+/* Выполнение набора независимых заданий (например, загрузки или сборки
+ * словарей разных языков) на ограниченном числе потоков. Потоки берут
+ * задания из общей очереди по порядку, так что результаты, записанные по
+ * номеру задания, не зависят от того, какой поток что выполнил. */
+
+#include "common/parallel.h"
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "common/strict_alloc.h"
+
+typedef struct {
+  ParallelJob job;
+  void *data;
+  size_t jobs_count;
+  size_t next_job;
+  pthread_mutex_t mutex;
+} JobQueue;
+
+static void *parallel_worker(void *data) {
+  JobQueue *queue = data;
+  size_t index;
+  while (1) {
+    pthread_mutex_lock(&queue->mutex);
+    index = queue->next_job;
+    if (index < queue->jobs_count) {
+      queue->next_job++;
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    if (index >= queue->jobs_count) break;
+    queue->job(index, queue->data);
+  }
+  return NULL;
+}
+
+/* Число потоков для jobs_count заданий: не больше числа процессоров (или
+ * threads_limit, если он не 0) и не больше числа самих заданий */
+size_t parallel_threads_count(size_t jobs_count, size_t threads_limit) {
+  size_t result = threads_limit;
+  if (result == 0) {
+    long int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    result = (cpus > 0) ? (size_t)cpus : 1;
+  }
+  if (result > jobs_count) {
+    result = jobs_count;
+  }
+  return result;
+}
+
+/* Выполняет задания 0..jobs_count-1 функцией job и дожидается завершения
+ * всех. threads_limit - максимальное число потоков, 0 - по числу процессоров.
+ * Если потоки создать не удалось, задания выполняются в текущем потоке. */
+void run_parallel(size_t jobs_count, size_t threads_limit, ParallelJob job, void *data) {
+  size_t i, started = 0, threads_count = parallel_threads_count(jobs_count, threads_limit);
+  pthread_t *threads;
+  JobQueue queue;
+  if (threads_count <= 1) {
+    for (i = 0; i < jobs_count; i++) {
+      job(i, data);
+    }
+    return;
+  }
+  queue.job = job;
+  queue.data = data;
+  queue.jobs_count = jobs_count;
+  queue.next_job = 0;
+  pthread_mutex_init(&queue.mutex, NULL);
+  threads = strict_malloc(sizeof(*threads)*threads_count);
+  for (i = 0; i < threads_count; i++) {
+    /* Если поток создать не удалось, его задания разберут остальные */
+    if (pthread_create(threads + started, NULL, parallel_worker, &queue) == 0) {
+      started++;
+    }
+  }
+  if (started == 0) {
+    parallel_worker(&queue);
+  }
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  strict_free(threads);
+  pthread_mutex_destroy(&queue.mutex);
+}
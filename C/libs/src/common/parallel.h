@@ -0,0 +1,14 @@
+/* Выполнение набора независимых заданий на ограниченном числе потоков */
+
+#ifndef __COMMON_PARALLEL_H__
+#define __COMMON_PARALLEL_H__
+
+#include <stdlib.h>
+
+/* Задание номер index. data - общие для всех заданий данные */
+typedef void (*ParallelJob)(size_t index, void *data);
+
+size_t parallel_threads_count(size_t jobs_count, size_t threads_limit);
+void run_parallel(size_t jobs_count, size_t threads_limit, ParallelJob job, void *data);
+
+#endif /* __COMMON_PARALLEL_H__ */
@@ -15,15 +15,38 @@
 #include <wctype.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "common/strict_alloc.h"
 #include "common/datastruct.h"
 
+/* Преобразования кодировок и регистра выполняются в локали
+ * MORPHOLOGY_DEFAULT_LOCALE. Переключать её через setlocale нельзя: это
+ * настройка всего процесса, и параллельно работающие потоки сбивали бы её
+ * друг другу. uselocale меняет локаль только текущего потока. */
+static locale_t morphology_locale = (locale_t)0;
+static pthread_once_t morphology_locale_once = PTHREAD_ONCE_INIT;
+
+static void init_morphology_locale(void) {
+  morphology_locale = newlocale(LC_CTYPE_MASK, MORPHOLOGY_DEFAULT_LOCALE, (locale_t)0);
+}
+
+/* Включает в текущем потоке локаль MORPHOLOGY_DEFAULT_LOCALE и возвращает
+ * прежнюю, которую потом нужно вернуть через uselocale. Если такой локали в
+ * системе нет, остаётся текущая. */
+locale_t use_morphology_locale(void) {
+  pthread_once(&morphology_locale_once, init_morphology_locale);
+  if (morphology_locale == (locale_t)0) {
+    return uselocale((locale_t)0);
+  }
+  return uselocale(morphology_locale);
+}
+
 /* Преобразовывает UTF-8-строку text в UNICODE-строку (UTF-32), которая и возвращается.
 Возвращённую строку можно использовать повторно, передав её в result при следующем
 вызове функции. Её размер будет скорректирован, чтобы вместить результат. */
 wchar_t *to_wide_string(const char *text, wchar_t *result, size_t *result_length) {
-  char *old_locale = setlocale(LC_CTYPE, MORPHOLOGY_DEFAULT_LOCALE);
+  locale_t old_locale = use_morphology_locale();
   size_t length, buf_size;
   mbstate_t state;
   memset(&state, 0, sizeof(state));
@@ -37,7 +60,7 @@ wchar_t *to_wide_string(const char *text, wchar_t *result, size_t *result_length
     result = strict_realloc(result, (length + 1)*sizeof(wchar_t));
   }
   *result_length = length;
-  setlocale(LC_CTYPE, old_locale);
+  uselocale(old_locale);
   return result;
 }
 
@@ -46,7 +69,7 @@ wchar_t *to_wide_string(const char *text, wchar_t *result, size_t *result_length
  * строки text, что позволяет конвертировать не завершённые терминатором '\0'
  * строки или части строк. */
 wchar_t *to_wide_string_exact(const char *text, size_t length, size_t *result_length) {
-  char *old_locale = setlocale(LC_CTYPE, MORPHOLOGY_DEFAULT_LOCALE);
+  locale_t old_locale = use_morphology_locale();
   wchar_t *result = strict_malloc(sizeof(*result)*(length + 1));
   mbstate_t state;
   size_t converted;
@@ -60,7 +83,7 @@ wchar_t *to_wide_string_exact(const char *text, size_t length, size_t *result_le
   if (converted < length) {
     result = strict_realloc(result, sizeof(*result)*(converted + 1));
   }
-  setlocale(LC_CTYPE, old_locale);
+  uselocale(old_locale);
   return result;
 }
 
@@ -69,7 +92,8 @@ wchar_t *to_wide_string_exact(const char *text, size_t length, size_t *result_le
 char *to_multibyte_string(const wchar_t *text, size_t *result_length) {
   const size_t temp_buffer_size = 1024;
   size_t converted;
-  char *result, *old_locale = setlocale(LC_CTYPE, MORPHOLOGY_DEFAULT_LOCALE);
+  char *result;
+  locale_t old_locale = use_morphology_locale();
   StringBuffer *buffer = create_string_buffer();
   const wchar_t *text_cursor = text;
   mbstate_t ps;
@@ -77,6 +101,7 @@ char *to_multibyte_string(const wchar_t *text, size_t *result_length) {
   while (1) {
     char *temp_buffer = strict_malloc(temp_buffer_size * sizeof(char));
     if (temp_buffer == NULL) {
+        uselocale(old_locale);
         return NULL;
     }
     converted = wcsrtombs(temp_buffer, &text_cursor, temp_buffer_size - 1, &ps);
@@ -90,7 +115,7 @@ char *to_multibyte_string(const wchar_t *text, size_t *result_length) {
   }
   result = join_string_buffer(buffer, result_length);
   free_string_buffer(buffer);
-  setlocale(LC_CTYPE, old_locale);
+  uselocale(old_locale);
   return result;
 }
 
@@ -140,12 +165,12 @@ wchar_t *ultowcs(unsigned long num, unsigned char base, wchar_t *result) {
 
 /* Преобразует строку к нижнему регистру */
 wchar_t *wcslower(wchar_t *string) {
-  char *old_locale = setlocale(LC_CTYPE, MORPHOLOGY_DEFAULT_LOCALE);
+  locale_t old_locale = use_morphology_locale();
   wchar_t *cursor;
   for(cursor=string; *cursor; cursor++) {
     *cursor = (wchar_t)towlower((wint_t)*cursor);
   }
-  setlocale(LC_CTYPE, old_locale);
+  uselocale(old_locale);
   return string;
 }
 
@@ -188,12 +213,43 @@ int is_garbage_word(const wchar_t *word, size_t length) {
   const wchar_t kExtraAllowedInWord[] = {L'-', L'\'', L'`', 0L};
   const wchar_t *next_char;
   size_t i;
+  int result = 0;
+  locale_t old_locale = use_morphology_locale();
   for (i = 0, next_char = word; i < length; ++i, ++next_char) {
     if (!(iswalpha((wint_t)*next_char) || wcsrchr(kExtraAllowedInWord, *next_char))) {
-      return 1;
+      result = 1;
+      break;
     }
   }
-  return 0;
+  uselocale(old_locale);
+  return result;
+}
+
+/* Письменность символа c: SCRIPT_LATIN, SCRIPT_CYRILLIC или SCRIPT_OTHER.
+ * Определяется по блокам Unicode, без обращения к локали. */
+unsigned int char_script(wchar_t c) {
+  if ((c >= L'a' && c <= L'z') || (c >= L'A' && c <= L'Z') ||
+      (c >= 0x00C0 && c <= 0x024F && c != 0x00D7 && c != 0x00F7) ||
+      (c >= 0x1E00 && c <= 0x1EFF)) {
+    return SCRIPT_LATIN;
+  }
+  if ((c >= 0x0400 && c <= 0x052F) || (c >= 0x1C80 && c <= 0x1C8F) ||
+      (c >= 0x2DE0 && c <= 0x2DFF) || (c >= 0xA640 && c <= 0xA69F)) {
+    return SCRIPT_CYRILLIC;
+  }
+  return SCRIPT_OTHER;
+}
+
+/* Возвращает объединение письменностей (SCRIPT_...) всех символов слова.
+ * Слово "чистое", если результат - ровно одна из SCRIPT_LATIN и
+ * SCRIPT_CYRILLIC. */
+unsigned int word_scripts(const wchar_t *word, size_t length) {
+  unsigned int result = 0;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    result |= char_script(word[i]);
+  }
+  return result;
 }
 
 char *strict_strndup(const char *text, size_t length) {
@@ -7,9 +7,16 @@
 #define __MORPHOLOGY_UTILS_H__
 
 #include <wchar.h>
+#include <locale.h>
 
 #define MORPHOLOGY_DEFAULT_LOCALE "ru_RU.UTF-8"
 
+/* Письменности символов слова (см. word_scripts) */
+#define SCRIPT_LATIN 0x01
+#define SCRIPT_CYRILLIC 0x02
+#define SCRIPT_OTHER 0x04 /* Всё остальное, включая дефисы и апострофы */
+
+locale_t use_morphology_locale(void);
 wchar_t *to_wide_string(const char *text, wchar_t *result, size_t *result_length);
 char *to_multibyte_string(const wchar_t *text, size_t *result_length);
 void wcssubreverse(wchar_t *start, wchar_t *end);
@@ -21,6 +28,8 @@ void strip_text(char *text, const char *strip_chars);
 void strip_line(char *line);
 wchar_t *to_wide_string_exact(const char *text, size_t length, size_t *result_length);
 int is_garbage_word(const wchar_t *word, size_t length);
+unsigned int char_script(wchar_t c);
+unsigned int word_scripts(const wchar_t *word, size_t length);
 char *strict_strndup(const char *text, size_t length);
 char *join_path(unsigned int chunks_count, ...);
 
@@ -7,10 +7,24 @@
 
 #include "morph.h"
 
+#include <unistd.h>
+#include <wchar.h>
+
+#include "common/hashtable.h"
+#include "common/strict_alloc.h"
+#include "common/strtools.h"
+#include "morphology/multilang.h"
+
 #define CACHE_SIZE 150
 
 morph_t *
 morph_new(const char *dictionary_dir)
+{
+    return morph_new_ex(dictionary_dir, 0);
+}
+
+morph_t *
+morph_new_ex(const char *dictionary_dir, int flags)
 {   
     morph_t *morph;
     morph = (morph_t *) calloc(1, sizeof(morph_t));
@@ -21,51 +35,206 @@ morph_new(const char *dictionary_dir)
     morph->morphology       = NULL;
  
     if (dictionary_dir == NULL) {
-        
-        //if ((morph->morphology = init_morphology_bases(dictionary_dir, CACHE_SIZE)) == NULL) {
-        //    fprintf(stderr, "Morphology base loading failed1.\n");
-        //    return NULL;
-        //}
-        char *path = (char *) malloc(strlen(MORPH_PATH_DICTS));
-        if (path == NULL) {
-            fprintf(stderr, "Allocated failed.\n");
-            return NULL;
+        dictionary_dir = MORPH_PATH_DICTS;
+    }
+    
+    if ((morph->multi_morphology = init_multi_morphology(dictionary_dir, CACHE_SIZE,
+                                                         (flags & MORPH_LAZY_LOAD) != 0)) == NULL) {
+        fprintf(stderr, "Morphology base loading failed.\n");
+        free(morph);
+        return NULL;
+    }
+    
+    morph->dictionary_dir = strdup(dictionary_dir);
+    morph->flags          = flags;
+    morph->reload_result  = MORPH_OK;
+    pthread_mutex_init(&morph->mutex, NULL);
+    pthread_mutex_init(&morph->reload_mutex, NULL);
+            
+    return morph;
+}
+
+/* Захватывает текущую версию словарей. Её нужно отпустить через
+ * release_multi_morphology, после этого перезагрузка может её освободить. */
+static MultiMorphology *
+morph_acquire(morph_t *morph)
+{
+    MultiMorphology *result;
+    
+    pthread_mutex_lock(&morph->mutex);
+    result = acquire_multi_morphology(morph->multi_morphology);
+    pthread_mutex_unlock(&morph->mutex);
+    
+    return result;
+}
+
+/* Проверяет, что в новой версии словарей fresh есть все языки текущей
+ * current: словарь, не загрузившийся из-за одного испорченного файла, не
+ * должен молча пропасть под нагрузкой. Новые языки допускаются. */
+static int
+morph_reload_keeps_languages(MultiMorphology *current, MultiMorphology *fresh)
+{
+    size_t i, j;
+    const char *name;
+    
+    if (fresh->languages_count == 0 || fresh->languages_count < current->languages_count) {
+        fprintf(stderr, "Morphology reload loaded %lu languages instead of %lu.\n",
+                (unsigned long) fresh->languages_count, (unsigned long) current->languages_count);
+        return 0;
+    }
+    for (i = 0; i < current->languages_count; i++) {
+        name = dictionary_name(current->languages[i]);
+        for (j = 0; j < fresh->languages_count; j++) {
+            if (strcmp(name, dictionary_name(fresh->languages[j])) == 0) {
+                break;
+            }
         }
-        memcpy(path, MORPH_PATH_DICTS, strlen(MORPH_PATH_DICTS));
-        //puts(PATH_DICTS);
-        
-        if ((morph->multi_morphology = init_multi_morphology(path, CACHE_SIZE)) == NULL) {
-            fprintf(stderr, "Morphology base loading failed.\n");
-            free(path);
-            return NULL;
+        if (j == fresh->languages_count) {
+            fprintf(stderr, "Morphology reload lost language %s.\n", name);
+            return 0;
         }
-        
-        free(path);
+    }
+    
+    return 1;
+}
+
+static void *
+morph_reload_thread(void *data)
+{
+    morph_t *morph = (morph_t *) data;
+    MultiMorphology *fresh, *old, *current;
+    int keeps_languages;
+    
+    fresh = init_multi_morphology(morph->dictionary_dir, CACHE_SIZE, (morph->flags & MORPH_LAZY_LOAD) != 0);
+    current = morph_acquire(morph);
+    keeps_languages = morph_reload_keeps_languages(current, fresh);
+    release_multi_morphology(current);
+    if (!keeps_languages) {
+        fprintf(stderr, "Morphology reload from %s failed, keeping current dictionaries.\n", morph->dictionary_dir);
+        release_multi_morphology(fresh);
+        morph->reload_result = MORPH_FAIL;
     } else {
-        //if ((morph->morphology = init_morphology_bases(dictionary_dir, CACHE_SIZE)) == NULL) {
-        //    fprintf(stderr, "Morphology base loading failed1.\n");
-        //    return NULL;
-        //}
+        pthread_mutex_lock(&morph->mutex);
+        old = morph->multi_morphology;
+        morph->multi_morphology = fresh;
+        pthread_mutex_unlock(&morph->mutex);
+        /* Освободится, когда её отпустит последний читатель */
+        release_multi_morphology(old);
+        morph->reload_result = MORPH_OK;
+    }
     
-        if ((morph->multi_morphology = init_multi_morphology(dictionary_dir, CACHE_SIZE)) == NULL) {
-            fprintf(stderr, "Morphology base loading failed.\n");
-            return NULL;
-        }        
+    __atomic_store_n(&morph->reload_running, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int
+morph_reload(morph_t *morph, const char *dictionary_dir)
+{
+    int result = MORPH_OK;
+    
+    pthread_mutex_lock(&morph->reload_mutex);
+    do {
+        if (__atomic_load_n(&morph->reload_running, __ATOMIC_ACQUIRE)) {
+            fprintf(stderr, "Morphology reload is already in progress.\n");
+            result = MORPH_FAIL;
+            break;
+        }
+        if (morph->reload_started) {
+            pthread_join(morph->reload_thread, NULL);
+            morph->reload_started = 0;
+        }
+        if (dictionary_dir != NULL) {
+            /* Ошибка чтения каталога при загрузке прерывает процесс, а
+             * работающий сервис из-за опечатки в пути ронять нельзя */
+            if (access(dictionary_dir, R_OK | X_OK) != 0) {
+                fprintf(stderr, "Can't read dictionaries directory %s.\n", dictionary_dir);
+                result = morph->reload_result = MORPH_FAIL;
+                break;
+            }
+            free(morph->dictionary_dir);
+            morph->dictionary_dir = strdup(dictionary_dir);
+        }
+        morph->reload_running = 1;
+        if (pthread_create(&morph->reload_thread, NULL, morph_reload_thread, morph) != 0) {
+            morph->reload_running = 0;
+            result = morph->reload_result = MORPH_FAIL;
+            break;
+        }
+        morph->reload_started = 1;
+    } while (0);
+    pthread_mutex_unlock(&morph->reload_mutex);
+    
+    return result;
+}
+
+int
+morph_reload_wait(morph_t *morph)
+{
+    int result;
+    
+    pthread_mutex_lock(&morph->reload_mutex);
+    if (morph->reload_started) {
+        pthread_join(morph->reload_thread, NULL);
+        morph->reload_started = 0;
     }
-            
-    return morph;
+    result = morph->reload_result;
+    pthread_mutex_unlock(&morph->reload_mutex);
+    
+    return result;
 }
 
 void 
 morph_delete(morph_t *morphology)
 {
+    morph_reload_wait(morphology);
+    
     if (morphology->morphology) {
         unload_morphology_bases(morphology->morphology);
     }
 
     if (morphology->multi_morphology) {
-        free_multi_morphology(morphology->multi_morphology);
+        release_multi_morphology(morphology->multi_morphology);
     }
+    
+    pthread_mutex_destroy(&morphology->mutex);
+    pthread_mutex_destroy(&morphology->reload_mutex);
+    free(morphology->dictionary_dir);
+    free(morphology);
+}
+
+int
+morph_compile(const char *dictionary_dir, size_t threads_count, int flags)
+{
+    return morph_compile_ex(dictionary_dir, threads_count, flags, 0);
+}
+
+int
+morph_compile_ex(const char *dictionary_dir, size_t threads_count, int flags, size_t memory_budget_mb)
+{
+    return morph_compile_profiled(dictionary_dir, threads_count, flags, memory_budget_mb, NULL);
+}
+
+int
+morph_compile_profiled(const char *dictionary_dir, size_t threads_count, int flags, size_t memory_budget_mb,
+                       const char *corpus_file)
+{
+    if (dictionary_dir == NULL) {
+        dictionary_dir = MORPH_PATH_DICTS;
+    }
+    
+    if (compile_dictionaries(dictionary_dir, threads_count, flags, memory_budget_mb << 20, corpus_file) != 0) {
+        fprintf(stderr, "Dictionaries compilation failed.\n");
+        return MORPH_FAIL;
+    }
+    
+    return MORPH_OK;
+}
+
+/* Флаги документов (DOC_...) по флагам анализатора */
+static uint16_t
+document_flags_of(morph_t *morphology)
+{
+    return (morphology->flags & MORPH_PIN_LANGUAGE) ? DOC_PIN_LANGUAGE : 0;
 }
 
 morph_doc_t *
@@ -83,6 +252,7 @@ morph_doc_new(morph_t *morphology, const char *str, size_t len, int cache_on)
     
     morph_doc->len        = len;
     morph_doc->morphology = morphology;
+    morph_doc->multi_morphology = morph_acquire(morphology);
     
     morph_doc->str = (char *) calloc(normal_len+1, sizeof(char));
     if (morph_doc->str == NULL) {
@@ -92,7 +262,7 @@ morph_doc_new(morph_t *morphology, const char *str, size_t len, int cache_on)
     memcpy((void *) (morph_doc->str), (void *) normal_str, normal_len);
     
     if (cache_on) {
-        morph_doc->doc_header = (DocumentHeader *) make_document(normal_str, 0, morph_doc->morphology->multi_morphology, &normal_len);
+        morph_doc->doc_header = (DocumentHeader *) make_document(normal_str, document_flags_of(morphology), morph_doc->multi_morphology, &normal_len);
     } else {
         morph_doc->doc_header = NULL;
     }
@@ -118,6 +288,7 @@ morph_doc_new_dont_normal(morph_t *morphology, const char *str, size_t len, int
     
     morph_doc->len        = len;
     morph_doc->morphology = morphology;
+    morph_doc->multi_morphology = morph_acquire(morphology);
     
     morph_doc->str = (char *) calloc(len+1, sizeof(char));
     if (morph_doc->str == NULL) {
@@ -127,7 +298,7 @@ morph_doc_new_dont_normal(morph_t *morphology, const char *str, size_t len, int
     memcpy((void *) (morph_doc->str), (void *) str, len);
     
     if (cache_on) {
-        morph_doc->doc_header = (DocumentHeader *) make_document(str, 0, morph_doc->morphology->multi_morphology, &_len);
+        morph_doc->doc_header = (DocumentHeader *) make_document(str, document_flags_of(morphology), morph_doc->multi_morphology, &_len);
     } else {
         morph_doc->doc_header = NULL;
     }
@@ -201,6 +372,7 @@ morph_doc_array_new(morph_t *morphology, const char *str, size_t len, const char
 
         morph_doc_array->morph_doc[i]->len        = strlen(token);
         morph_doc_array->morph_doc[i]->morphology = morphology;
+        morph_doc_array->morph_doc[i]->multi_morphology = morph_acquire(morphology);
     
         morph_doc_array->morph_doc[i]->str = (char *) calloc(normal_len+1, sizeof(char));
         if (morph_doc_array->morph_doc[i]->str == NULL) {
@@ -210,7 +382,7 @@ morph_doc_array_new(morph_t *morphology, const char *str, size_t len, const char
 
         memcpy((void *) (morph_doc_array->morph_doc[i]->str), (void *) normal_str, normal_len);
         
-        morph_doc_array->morph_doc[i]->doc_header = (DocumentHeader *) make_document(normal_str, 0, morph_doc_array->morph_doc[i]->morphology->multi_morphology, &normal_len);
+        morph_doc_array->morph_doc[i]->doc_header = (DocumentHeader *) make_document(normal_str, document_flags_of(morphology), morph_doc_array->morph_doc[i]->multi_morphology, &normal_len);
         
         free(normal_str);
     }
@@ -226,6 +398,9 @@ morph_doc_delete(morph_doc_t *morph_doc)
     if (morph_doc != NULL) {
         free(morph_doc->str);
         free_document(morph_doc->doc_header);
+        if (morph_doc->multi_morphology != NULL) {
+            release_multi_morphology(morph_doc->multi_morphology);
+        }
     
         free(morph_doc);
     }
@@ -273,7 +448,7 @@ morph_doc_intersect_doc(morph_doc_t *doc, morph_doc_t *search)
             break;
         }
         
-        result = document_find_multi_intersection(doc->doc_header, doc->morphology->multi_morphology, token, &search_result_length);
+        result = document_find_multi_intersection(doc->doc_header, doc->multi_morphology, token, &search_result_length);
         if (result != NULL) {
             i += (strlen(result));
         }
@@ -311,7 +486,7 @@ morph_doc_intersect_doc2(morph_doc_t *doc, morph_doc_t *search)
             break;
         }
         
-        result = document_find_multi_intersection(doc->doc_header, doc->morphology->multi_morphology, token, &search_result_length);
+        result = document_find_multi_intersection(doc->doc_header, doc->multi_morphology, token, &search_result_length);
         if (result != NULL) {
             i += (strlen(result));
         }
@@ -392,7 +567,7 @@ morph_doc_case_doc(morph_doc_t *doc, morph_doc_t *search)
     size_t search_result_length;
     int i;
        
-    result = document_find_multi_intersection(doc->doc_header, doc->morphology->multi_morphology, search->str, &search_result_length);
+    result = document_find_multi_intersection(doc->doc_header, doc->multi_morphology, search->str, &search_result_length);
     if (result != NULL) {
         free(result);
         return 1;
@@ -418,7 +593,7 @@ morph_str_case_str(morph_t *morph, char *doc_s, char *search_s)
             break;
         }
         
-        result = document_find_multi_intersection(doc->doc_header, doc->morphology->multi_morphology, search->str, &search_result_length);
+        result = document_find_multi_intersection(doc->doc_header, doc->multi_morphology, search->str, &search_result_length);
         
     } while(0);
     
@@ -433,9 +608,269 @@ morph_str_case_str(morph_t *morph, char *doc_s, char *search_s)
     return 0;
 }
 
-inline char *
+char *
 morph_normalize_form(const char *source_text, morph_t* morph, size_t text_size)
 {
-    return normalize_morph_form(source_text, morph->multi_morphology, text_size);
+    MultiMorphology *multi_morphology = morph_acquire(morph);
+    char *result = normalize_morph_form(source_text, multi_morphology, text_size);
+    
+    release_multi_morphology(multi_morphology);
+    
+    return result;
+}
+
+/* Дописывает в буфер text слово word в UTF-8 с '\0' и возвращает его
+ * смещение. Вызывается под локалью морфологии (use_morphology_locale). */
+static size_t
+append_multibyte_word(char **text, size_t *text_size, size_t *text_capacity,
+                      const wchar_t *word, size_t word_length)
+{
+    size_t i, converted, offset = *text_size, needed = *text_size + MB_CUR_MAX*word_length + 1;
+    mbstate_t state;
+    
+    if (needed > *text_capacity) {
+        *text_capacity = *text_capacity*2 > needed ? *text_capacity*2 : needed;
+        *text = strict_realloc(*text, *text_capacity);
+    }
+    
+    memset(&state, 0, sizeof(state));
+    for (i = 0; i < word_length; i++) {
+        converted = wcrtomb(*text + *text_size, word[i], &state);
+        if (converted != (size_t)-1) {
+            *text_size += converted;
+        }
+    }
+    (*text)[(*text_size)++] = '\0';
+    
+    return offset;
+}
+
+/* Добавляет в lemmas лемму word */
+static void
+morph_lemmas_append(morph_lemmas_t *lemmas, const wchar_t *word, size_t word_length)
+{
+    if (lemmas->lemmas_count == lemmas->offsets_capacity) {
+        lemmas->offsets_capacity = lemmas->offsets_capacity == 0 ? 256 : lemmas->offsets_capacity*2;
+        lemmas->offsets = strict_realloc(lemmas->offsets, sizeof(size_t)*lemmas->offsets_capacity);
+    }
+    lemmas->offsets[lemmas->lemmas_count++] =
+        append_multibyte_word(&lemmas->text, &lemmas->text_size, &lemmas->text_capacity, word, word_length);
+}
+
+/* Номер первого вхождения в пачку токена tokens[i] длиной token_length по
+ * открытой хэш-таблице lemmas->token_slots из 2^slots_power мест. Если
+ * токен встретился впервые, он заносится в таблицу и возвращается i. */
+static size_t
+morph_lemmas_first_token(morph_lemmas_t *lemmas, const char *const tokens[], size_t i, size_t token_length,
+                         uint8_t slots_power)
+{
+    size_t mask = lemmas->token_slots_capacity - 1;
+    size_t slot = (size_t)(((uint64_t)hash_of_key(tokens[i], token_length)*0x9E3779B97F4A7C15ULL) >> (64 - slots_power));
+    
+    for (;; slot = (slot + 1) & mask) {
+        if (lemmas->token_slots[slot] == 0) {
+            lemmas->token_slots[slot] = i + 1;
+            return i;
+        }
+        if (strcmp(tokens[lemmas->token_slots[slot] - 1], tokens[i]) == 0) {
+            return lemmas->token_slots[slot] - 1;
+        }
+    }
+}
+
+/* Повторяющиеся токены разбираются один раз: по хэш-таблице токенов
+ * находится первое вхождение токена, и его леммы (уже записанные в
+ * результат) просто переиспользуются. "Мусорные" токены не
+ * лемматизируются вовсе, остальные разбираются в рабочей памяти out,
+ * без выделения памяти на каждое слово. */
+int
+morph_lemmatize_batch(morph_t *morph, const char *const tokens[], size_t n, morph_lemmas_t *out)
+{
+    MultiMorphology *multi_morphology;
+    Dictionary *suggest_language = NULL, *detected_language;
+    ArrayList *lemmas;
+    WordForm *form;
+    wchar_t *word = NULL;
+    const char *token;
+    size_t i, j, first, token_length, word_length, word_capacity = 0, lemmas_count;
+    uint8_t slots_power = near_int_log2(n) + 1;
+    mbstate_t state;
+    locale_t old_locale;
+    
+    if (morph == NULL || out == NULL || (tokens == NULL && n > 0)) {
+        fprintf(stderr, "morph_lemmatize_batch () Invalid arguments.\n");
+        return MORPH_FAIL;
+    }
+    
+    out->text_size    = 0;
+    out->lemmas_count = 0;
+    out->tokens_count = 0;
+    if (n == 0) {
+        return MORPH_OK;
+    }
+    if (n > out->tokens_capacity) {
+        out->tokens_capacity = n;
+        out->tokens = strict_realloc(out->tokens, sizeof(morph_token_lemmas_t)*n);
+    }
+    if (((size_t)1 << slots_power) > out->token_slots_capacity) {
+        out->token_slots_capacity = (size_t)1 << slots_power;
+        strict_free(out->token_slots);
+        out->token_slots = strict_malloc(sizeof(size_t)*out->token_slots_capacity);
+    }
+    slots_power = near_int_log2(out->token_slots_capacity) - 1;
+    memset(out->token_slots, 0, sizeof(size_t)*out->token_slots_capacity);
+    if (out->scratch == NULL) {
+        out->scratch = make_analysis_scratch();
+    }
+    
+    multi_morphology = morph_acquire(morph);
+    old_locale       = use_morphology_locale();
+    
+    for (i = 0; i < n; i++) {
+        token        = tokens[i];
+        token_length = strlen(token);
+        if ((first = morph_lemmas_first_token(out, tokens, i, token_length, slots_power)) != i) {
+            out->tokens[i] = out->tokens[first];
+            continue;
+        }
+        
+        if (token_length + 1 > word_capacity) {
+            word_capacity = token_length + 1;
+            word = strict_realloc(word, sizeof(wchar_t)*word_capacity);
+        }
+        memset(&state, 0, sizeof(state));
+        word_length = mbsnrtowcs(word, &token, token_length, token_length, &state);
+        if (word_length == (size_t)-1) {
+            word_length = 0;
+        }
+        word[word_length] = L'\0';
+        wcslower(word);
+        
+        out->tokens[i].first = out->lemmas_count;
+        lemmas_count = 0;
+        if (word_length > 0 && !is_garbage_word(word, word_length)) {
+            /* Язык первого слова, для которого он определился, становится
+             * предпочтительным для остальных */
+            lemmas = multilang_word_lemmas_scratch(multi_morphology, suggest_language, word, word_length,
+                                                   out->scratch, &detected_language);
+            if (suggest_language == NULL) {
+                suggest_language = detected_language;
+            }
+            lemmas_count = array_list_size(lemmas);
+            for (j = 0; j < lemmas_count; j++) {
+                form = array_list_get(lemmas, j);
+                morph_lemmas_append(out, form->word, form->word_length);
+            }
+        }
+        if (lemmas_count == 0) {
+            morph_lemmas_append(out, word, word_length);
+        }
+        out->tokens[i].count = out->lemmas_count - out->tokens[i].first;
+    }
+    out->tokens_count = n;
+    
+    uselocale(old_locale);
+    release_multi_morphology(multi_morphology);
+    strict_free(word);
+    
+    return MORPH_OK;
+}
+
+void
+morph_lemmas_free(morph_lemmas_t *lemmas)
+{
+    strict_free(lemmas->text);
+    strict_free(lemmas->offsets);
+    strict_free(lemmas->tokens);
+    strict_free(lemmas->token_slots);
+    if (lemmas->scratch != NULL) {
+        free_analysis_scratch(lemmas->scratch);
+    }
+    memset(lemmas, 0, sizeof(*lemmas));
+}
+
+/* Все разборы слова проходят фильтр, а лемма, общая для нескольких
+ * разборов подряд, записывается в text один раз. */
+int
+morph_analyze_word(morph_t *morph, const char *token, uint32_t pos_mask, uint64_t grammemes_mask,
+                   morph_tags_t *out)
+{
+    MultiMorphology *multi_morphology;
+    Dictionary *detected_language;
+    ArrayList *forms;
+    WordForm *form;
+    morph_tag_t *tag;
+    wchar_t *word;
+    size_t i, forms_count, word_length, last_lemma = 0;
+    uint8_t pos;
+    uint64_t grammemes;
+    const wchar_t *last_word = NULL;
+    size_t last_word_length = 0;
+    locale_t old_locale;
+    
+    if (morph == NULL || token == NULL || out == NULL) {
+        fprintf(stderr, "morph_analyze_word () Invalid arguments.\n");
+        return MORPH_FAIL;
+    }
+    
+    out->text_size  = 0;
+    out->tags_count = 0;
+    
+    word = to_wide_string_exact(token, strlen(token), &word_length);
+    wcslower(word);
+    if (word_length == 0 || is_garbage_word(word, word_length)) {
+        strict_free(word);
+        return MORPH_OK;
+    }
+    if (out->scratch == NULL) {
+        out->scratch = make_analysis_scratch();
+    }
+    
+    multi_morphology = morph_acquire(morph);
+    forms = multilang_word_tags_scratch(multi_morphology, NULL, word, word_length, out->scratch,
+                                        &detected_language);
+    forms_count = array_list_size(forms);
+    
+    old_locale = use_morphology_locale();
+    for (i = 0; i < forms_count; i++) {
+        form = array_list_get(forms, i);
+        pos       = form->grammar != NULL ? form->grammar->pos : MORPH_POS_UNKNOWN;
+        grammemes = form->grammar != NULL ? form->grammar->grammeme_bits : 0;
+        if ((pos_mask != 0 && (pos_mask & MORPH_POS_MASK(pos)) == 0) ||
+            (grammemes & grammemes_mask) != grammemes_mask) {
+            continue;
+        }
+        if (last_word == NULL || last_word_length != form->word_length ||
+            wmemcmp(last_word, form->word, form->word_length) != 0) {
+            last_lemma = append_multibyte_word(&out->text, &out->text_size, &out->text_capacity,
+                                               form->word, form->word_length);
+            last_word        = form->word;
+            last_word_length = form->word_length;
+        }
+        if (out->tags_count == out->tags_capacity) {
+            out->tags_capacity = out->tags_capacity == 0 ? 16 : out->tags_capacity*2;
+            out->tags = strict_realloc(out->tags, sizeof(morph_tag_t)*out->tags_capacity);
+        }
+        tag = out->tags + out->tags_count++;
+        tag->lemma     = last_lemma;
+        tag->pos       = pos;
+        tag->grammemes = grammemes;
+    }
+    uselocale(old_locale);
+    
+    release_multi_morphology(multi_morphology);
+    strict_free(word);
+    
+    return MORPH_OK;
 }
 
+void
+morph_tags_free(morph_tags_t *tags)
+{
+    strict_free(tags->text);
+    strict_free(tags->tags);
+    if (tags->scratch != NULL) {
+        free_analysis_scratch(tags->scratch);
+    }
+    memset(tags, 0, sizeof(*tags));
+}
@@ -4,8 +4,10 @@
 #include <stddef.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 
 #include "morphology/helpers.h"
+#include "morphology/compiler.h"
 #include "textprocessor/document.h"
 #include "common/timer.h"
 /*
@@ -22,6 +24,27 @@
 #define MORPH_OK    0
 #define MORPH_FAIL -1
 
+/* Флаги morph_new_ex */
+/* Сразу загружать только основной (первый) язык, остальные - при первом обращении */
+#define MORPH_LAZY_LOAD 0x01
+/* Закреплять язык документа: когда по первым словам ясно, что документ на
+ * одном языке, остальные его слова разбираются только этим языком, без
+ * определения языка каждого незнакомого слова. Быстрее, но вкрапления
+ * других языков в таком документе разбираются (предсказываются) как слова
+ * основного языка документа */
+#define MORPH_PIN_LANGUAGE 0x02
+
+/* Флаги morph_compile */
+/* Собирать ещё и сжатый автомат automat.louds: он медленнее, но занимает
+ * в 2-3 раза меньше памяти и при загрузке предпочитается плоскому */
+#define MORPH_COMPILE_SUCCINCT COMPILE_SUCCINCT
+/* Собирать хэш-таблицу словоформ wordforms.hash: словарные слова
+ * разбираются по ней одним обращением, без прохода по автомату */
+#define MORPH_COMPILE_WORD_HASH COMPILE_WORD_HASH
+/* Собирать вместе с хэш-таблицей словоформ фильтр Блума wordforms.bloom:
+ * незнакомые слова отсеиваются им, не обращаясь к таблице */
+#define MORPH_COMPILE_WORD_FILTER COMPILE_WORD_FILTER
+
 /**
  * @brief Структура морфолгического анализатора.
  */
@@ -36,6 +59,16 @@ typedef struct morph_doc_s          morph_doc_t;
  * @brief Структура с массивом @ref morph_doc_t строк.
  */
 typedef struct morph_doc_array_s    morph_doc_array_t;
+
+/**
+ * @brief Леммы пачки токенов (@ref morph_lemmatize_batch).
+ */
+typedef struct morph_lemmas_s       morph_lemmas_t;
+
+/**
+ * @brief Разборы слова с частью речи и граммемами (@ref morph_analyze_word).
+ */
+typedef struct morph_tags_s         morph_tags_t;
 
 /**
  * @brief Загрузка морфолгического анализатора.
@@ -44,10 +77,80 @@ typedef struct morph_doc_array_s    morph_doc_array_t;
  */
 morph_t *morph_new(const char *dictionary_dir);
 
+/**
+ * @brief Загрузка морфолгического анализатора с дополнительными флагами.
+ * @param Путь до словарей языков, NULL - @ref MORPH_PATH_DICTS.
+ * @param Флаги: @ref MORPH_LAZY_LOAD, @ref MORPH_PIN_LANGUAGE.
+ * @return Указатель на @ref morph_t.
+ */
+morph_t *morph_new_ex(const char *dictionary_dir, int flags);
+
 /**
  * @brief Удаление морфологического анализатора.
  */
 void morph_delete(morph_t *m);
+
+/**
+ * @brief Перезагрузка словарей без остановки работы.
+ * Новые словари загружаются в фоновом потоке и подменяют текущие, только
+ * если загрузились успешно и среди них есть все текущие языки. Старые словари освобождаются, когда их отпустят
+ * все использующие их документы и вызовы.
+ * @param Указатель на @ref morph_t.
+ * @param Путь до словарей языков, NULL - прежний путь.
+ * @return @ref MORPH_OK, если перезагрузка начата, @ref MORPH_FAIL, если
+ * предыдущая перезагрузка ещё не закончилась или поток не удалось создать.
+ */
+int morph_reload(morph_t *morph, const char *dictionary_dir);
+
+/**
+ * @brief Ожидание завершения начатой перезагрузки словарей.
+ * @param Указатель на @ref morph_t.
+ * @return @ref MORPH_OK, если последняя перезагрузка удалась (или её не было),
+ * @ref MORPH_FAIL, если она не удалась или не была начата из-за ошибки.
+ */
+int morph_reload_wait(morph_t *morph);
+
+/**
+ * @brief Сборка словарей: автомат разбора и двоичные образы для быстрой загрузки.
+ * Выполняется заранее (утилита morph-compile), а не при @ref morph_new.
+ * @param Путь до словарей языков, NULL - @ref MORPH_PATH_DICTS.
+ * @param Число потоков сборки, 0 - по числу процессоров.
+ * @param Флаги: @ref MORPH_COMPILE_SUCCINCT, @ref MORPH_COMPILE_WORD_HASH,
+ *        @ref MORPH_COMPILE_WORD_FILTER.
+ * @return @ref MORPH_OK или @ref MORPH_FAIL, если хотя бы один словарь не собран.
+ */
+int morph_compile(const char *dictionary_dir, size_t threads_count, int flags);
+
+/**
+ * @brief Сборка словарей с ограничением памяти под словоформы.
+ * Словоформы, не уместившиеся в бюджет, сортируются во временных файлах в
+ * каталоге словаря, так что словари можно собирать на машинах с небольшой
+ * памятью. Автомат и сам словарь в бюджет не входят.
+ * @param Путь до словарей языков, NULL - @ref MORPH_PATH_DICTS.
+ * @param Число потоков сборки, 0 - по числу процессоров.
+ * @param Флаги: @ref MORPH_COMPILE_SUCCINCT, @ref MORPH_COMPILE_WORD_HASH,
+ *        @ref MORPH_COMPILE_WORD_FILTER.
+ * @param Мегабайт на словоформы одного словаря, 0 - по умолчанию (256).
+ * @return @ref MORPH_OK или @ref MORPH_FAIL, если хотя бы один словарь не собран.
+ */
+int morph_compile_ex(const char *dictionary_dir, size_t threads_count, int flags, size_t memory_budget_mb);
+
+/**
+ * @brief Сборка словарей с раскладкой автоматов по образцу текстов.
+ * Слова образца проводятся по автомату каждого словаря так же, как при
+ * разборе, и состояния, через которые они проходят чаще всего, ставятся в
+ * начало automat.flat подряд, путями. На текстах, похожих на образец, разбор
+ * реже промахивается мимо кэша. Результаты разбора от раскладки не меняются.
+ * @param Путь до словарей языков, NULL - @ref MORPH_PATH_DICTS.
+ * @param Число потоков сборки, 0 - по числу процессоров.
+ * @param Флаги: @ref MORPH_COMPILE_SUCCINCT, @ref MORPH_COMPILE_WORD_HASH,
+ *        @ref MORPH_COMPILE_WORD_FILTER.
+ * @param Мегабайт на словоформы одного словаря, 0 - по умолчанию (256).
+ * @param Файл образца текстов в UTF-8, NULL - без раскладки.
+ * @return @ref MORPH_OK или @ref MORPH_FAIL, если хотя бы один словарь не собран.
+ */
+int morph_compile_profiled(const char *dictionary_dir, size_t threads_count, int flags, size_t memory_budget_mb,
+                           const char *corpus_file);
 
 /**
  * @brief Создание структуры описывающей нормализованную строку.
@@ -160,13 +263,75 @@ int    morph_str_case_str(morph_t *morph, char *doc_s, char *search_s);
  * @return 1 - построка содержится, 0 - подстрока не содержится.
  */
 extern char  *morph_normalize_form(const char *source_text, morph_t* morph, size_t text_size);
+
+/**
+ * @brief Лемматизация пачки токенов.
+ * Токены приводятся к нижнему регистру, повторы внутри пачки разбираются
+ * один раз. Язык определяется по первым токенам и дальше считается
+ * предпочтительным: токены этого языка лемматизируются вместе, язык
+ * определяется заново только для остальных. Токен без лемм (незнакомый
+ * или "мусорный" - число, адрес и т.п.) даёт одну лемму - сам себя.
+ * Буферы результата переиспользуются от вызова к вызову и растут по мере
+ * надобности, так что @ref morph_lemmas_t стоит завести одну на поток.
+ * @param Указатель на @ref morph_t.
+ * @param Токены в UTF-8, каждый завершён '\0'.
+ * @param Число токенов.
+ * @param Результат: обнулённая или оставшаяся от прошлого вызова
+ *        @ref morph_lemmas_t. Леммы i-го токена - строки
+ *        text + offsets[tokens[i].first + j], j < tokens[i].count.
+ * @return @ref MORPH_OK или @ref MORPH_FAIL при неверных аргументах.
+ */
+int    morph_lemmatize_batch(morph_t *morph, const char *const tokens[], size_t n, morph_lemmas_t *out);
+
+/**
+ * @brief Морфологический разбор слова: леммы с частью речи и граммемами.
+ * Для каждой возможной формы слова выдаётся тройка (лемма, часть речи
+ * MORPH_POS_..., граммемы MORPH_GRAM_...). Часть речи и граммемы
+ * переводятся в числа один раз, при загрузке словаря, так что отбор
+ * разборов - сравнение масок. Остаются только разборы, часть речи которых
+ * есть в pos_mask (@ref MORPH_POS_MASK; 0 - любая), а граммемы содержат
+ * все граммемы grammemes_mask ("существительные в родительном падеже" -
+ * MORPH_POS_MASK(MORPH_POS_NOUN) и MORPH_GRAM_GENITIVE).
+ * У незнакомых и "мусорных" слов разборов нет.
+ * @param Указатель на @ref morph_t.
+ * @param Слово в UTF-8.
+ * @param Маска частей речи, 0 - любые.
+ * @param Граммемы, которые должны быть у разбора, 0 - любые.
+ * @param Результат: обнулённая или оставшаяся от прошлого вызова
+ *        @ref morph_tags_t. Лемма i-го разбора - text + tags[i].lemma.
+ * @return @ref MORPH_OK или @ref MORPH_FAIL при неверных аргументах.
+ */
+int    morph_analyze_word(morph_t *morph, const char *token, uint32_t pos_mask, uint64_t grammemes_mask,
+                          morph_tags_t *out);
+
+/**
+ * @brief Освобождает буферы @ref morph_tags_t (но не саму структуру).
+ */
+void   morph_tags_free(morph_tags_t *tags);
+
+/**
+ * @brief Освобождает буферы @ref morph_lemmas_t (но не саму структуру).
+ * Одна @ref morph_lemmas_t не может использоваться в нескольких потоках сразу.
+ */
+void   morph_lemmas_free(morph_lemmas_t *lemmas);
 
 /**
  * @brief Структураморфологического анализатора.
  */
 struct morph_s {
     Morphology      *morphology;
+	/** Текущая версия словарей. Читатели захватывают её через mutex и
+	 *  acquire_multi_morphology, перезагрузка подменяет её под тем же mutex. */
     MultiMorphology *multi_morphology;
+    pthread_mutex_t  mutex;
+    char            *dictionary_dir;
+    int              flags;
+	/** Фоновая перезагрузка словарей (@ref morph_reload). */
+    pthread_mutex_t  reload_mutex;
+    pthread_t        reload_thread;
+    int              reload_started;
+    int              reload_running;
+    int              reload_result;
 };
 
 /**
@@ -175,6 +340,8 @@ struct morph_s {
 struct morph_doc_s {
 	/** Указатель на морфолгический анализатор. */
     morph_t        *morphology;
+	/** Версия словарей, захваченная документом на всё время его жизни. */
+    MultiMorphology *multi_morphology;
 	/** Строка. Может быть нормализованная или нет. */
     char           *str;
     unsigned int    str_crc32;
@@ -203,4 +370,66 @@ struct morph_doc_array_s {
     morph_doc_t   **morph_doc;
 };
 
+/**
+ * @brief Леммы одного токена в @ref morph_lemmas_t.
+ */
+typedef struct {
+	/** Номер первой леммы токена в offsets. */
+    size_t          first;
+	/** Число лемм токена. Одинаковые токены делят одни и те же леммы. */
+    size_t          count;
+} morph_token_lemmas_t;
+
+/**
+ * @brief Леммы пачки токенов (@ref morph_lemmatize_batch).
+ */
+struct morph_lemmas_s {
+	/** Леммы в UTF-8 подряд, каждая завершена '\0'. */
+    char                 *text;
+    size_t                text_size;
+	/** Смещения лемм в text. */
+    size_t               *offsets;
+    size_t                lemmas_count;
+	/** Леммы каждого токена, по порядку токенов. */
+    morph_token_lemmas_t *tokens;
+    size_t                tokens_count;
+	/** Выделено под text, offsets и tokens. */
+    size_t                text_capacity;
+    size_t                offsets_capacity;
+    size_t                tokens_capacity;
+	/** Хэш-таблица токенов пачки: номер первого вхождения + 1 или 0. */
+    size_t               *token_slots;
+    size_t                token_slots_capacity;
+	/** Рабочая память разбора слов. */
+    AnalysisScratch      *scratch;
+};
+
+/**
+ * @brief Один разбор слова в @ref morph_tags_t.
+ */
+typedef struct {
+	/** Смещение леммы в text. */
+    size_t          lemma;
+	/** Часть речи, MORPH_POS_... */
+    uint8_t         pos;
+	/** Граммемы, MORPH_GRAM_... */
+    uint64_t        grammemes;
+} morph_tag_t;
+
+/**
+ * @brief Разборы слова (@ref morph_analyze_word).
+ */
+struct morph_tags_s {
+	/** Леммы в UTF-8, каждая завершена '\0'. */
+    char            *text;
+    size_t           text_size;
+    size_t           text_capacity;
+	/** Разборы. */
+    morph_tag_t     *tags;
+    size_t           tags_count;
+    size_t           tags_capacity;
+	/** Рабочая память разбора слов. */
+    AnalysisScratch *scratch;
+};
+
 #endif // MORPH_H
\ No newline at end of file
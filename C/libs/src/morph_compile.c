@@ -0,0 +1,59 @@
+/*
+ * Утилита заблаговременной сборки словарей.
+ *
+ * Использование: morph-compile [-j потоков] [-s] [-w] [-b] [-m мегабайт] [-p образец] [каталог словарей]
+ * По умолчанию собираются словари из MORPH_PATH_DICTS, в число потоков по
+ * числу процессоров. С -s собирается ещё и сжатый автомат automat.louds
+ * (см. MORPH_COMPILE_SUCCINCT), с -w - хэш-таблица словоформ wordforms.hash
+ * (см. MORPH_COMPILE_WORD_HASH), с -b - она же и фильтр Блума словоформ
+ * wordforms.bloom (см. MORPH_COMPILE_WORD_FILTER). -m ограничивает память под словоформы
+ * каждого словаря (см. morph_compile_ex), -p раскладывает автоматы по
+ * образцу текстов (см. morph_compile_profiled). Код возврата отличен от нуля, если хотя бы один
+ * словарь собрать не удалось.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "morph.h"
+
+int
+main(int argc, char **argv)
+{
+    const char *dictionary_dir = MORPH_PATH_DICTS, *corpus_file = NULL;
+    size_t threads_count = 0, memory_budget_mb = 0;
+    int option, flags = 0;
+
+    while ((option = getopt(argc, argv, "j:swbm:p:h")) != -1) {
+        switch (option) {
+            case 'j':
+                threads_count = (size_t) strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                flags |= MORPH_COMPILE_SUCCINCT;
+                break;
+            case 'w':
+                flags |= MORPH_COMPILE_WORD_HASH;
+                break;
+            case 'b':
+                flags |= MORPH_COMPILE_WORD_FILTER;
+                break;
+            case 'm':
+                memory_budget_mb = (size_t) strtoul(optarg, NULL, 10);
+                break;
+            case 'p':
+                corpus_file = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-s] [-w] [-b] [-m megabytes] [-p corpus] [dictionaries dir]\n", argv[0]);
+                return option == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if (optind < argc) {
+        dictionary_dir = argv[optind];
+    }
+
+    return morph_compile_profiled(dictionary_dir, threads_count, flags, memory_budget_mb, corpus_file) == MORPH_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+}
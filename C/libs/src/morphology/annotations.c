@@ -0,0 +1,86 @@
+/* Чтение и запись таблицы аннотаций в конце файла полного автомата
+   (automat.save).
+
+   save_automat пишет только состояния, а load_automat_process читает ровно
+   столько состояний, сколько указано в начале файла, так что таблица
+   просто дописывается в конец:
+     uint32_t codes[count] | uint32_t count | char signature[8]
+   и ищется по подписи в последних байтах файла. */
+
+#include "morphology/annotations.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common/strict_alloc.h"
+
+typedef struct {
+  uint32_t count;
+  char signature[8];
+} AnnotationTableTrailer;
+
+/* Дописывает таблицу table в конец файла автомата automat_file_name.
+   Возвращает 0 при успехе. */
+int append_annotation_table(const char *automat_file_name, const AnnotationTable *table) {
+  AnnotationTableTrailer trailer;
+  int error = 0;
+  FILE *file = fopen(automat_file_name, "ab");
+  if (file == NULL) return -1;
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.count = table->count;
+  memcpy(trailer.signature, ANNOTATION_TABLE_SIGNATURE, sizeof(ANNOTATION_TABLE_SIGNATURE));
+  if (fwrite(table->codes, sizeof(uint32_t), table->count, file) != table->count ||
+      fwrite(&trailer, sizeof(trailer), 1, file) != 1) {
+    error = 1;
+  }
+  if (fclose(file) != 0) error = 1;
+  return error ? -1 : 0;
+}
+
+/* Читает таблицу аннотаций из конца файла автомата automat_file_name в
+   table. Если таблицы в файле нет (автомат старого формата), table
+   остаётся пустой. Возвращает -1, если файл не читается или таблица
+   повреждена. */
+int read_annotation_table(const char *automat_file_name, AnnotationTable *table) {
+  AnnotationTableTrailer trailer;
+  uint32_t *codes;
+  long int file_size;
+  FILE *file = fopen(automat_file_name, "rb");
+  table->codes = NULL;
+  table->count = 0;
+  if (file == NULL) return -1;
+  if (fseek(file, 0, SEEK_END) != 0 || (file_size = ftell(file)) < 0) {
+    fclose(file);
+    return -1;
+  }
+  if ((size_t)file_size < sizeof(trailer) ||
+      fseek(file, -(long int)sizeof(trailer), SEEK_END) != 0 ||
+      fread(&trailer, sizeof(trailer), 1, file) != 1 ||
+      memcmp(trailer.signature, ANNOTATION_TABLE_SIGNATURE, sizeof(ANNOTATION_TABLE_SIGNATURE)) != 0) {
+    fclose(file);
+    return 0;
+  }
+  if ((size_t)file_size < sizeof(trailer) + sizeof(uint32_t)*(size_t)trailer.count) {
+    fclose(file);
+    return -1;
+  }
+  codes = strict_malloc(sizeof(uint32_t)*((size_t)trailer.count + 1));
+  if (fseek(file, -(long int)(sizeof(trailer) + sizeof(uint32_t)*(size_t)trailer.count), SEEK_END) != 0 ||
+      fread(codes, sizeof(uint32_t), trailer.count, file) != trailer.count) {
+    strict_free(codes);
+    fclose(file);
+    return -1;
+  }
+  fclose(file);
+  table->codes = codes;
+  table->count = trailer.count;
+  return 0;
+}
+
+/* Освобождает таблицу, прочитанную read_annotation_table или собранную
+   generate_all_words */
+void free_annotation_table(AnnotationTable *table) {
+  strict_free((void *)table->codes);
+  table->codes = NULL;
+  table->count = 0;
+}
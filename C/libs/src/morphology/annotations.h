@@ -0,0 +1,58 @@
+/* Таблица морфологических аннотаций автомата.
+
+   После разделителя ANNOTATION_DELIMITER в автомате записан номер
+   аннотации - тройки (флективная модель, длина окончания, длина основы) - в
+   таблице аннотаций словаря, 36-ичными цифрами одинаковой длины. Таблица
+   хранится вместе с автоматом: в конце automat.save и внутри образов
+   automat.flat и automat.louds. При обходе автомата номер сразу собирается
+   в целое число, без копирования и разбора строк.
+
+   В автоматах, собранных до появления таблицы, после разделителя записана
+   сама упакованная аннотация (см. pack_annotation). Такой автомат таблицы не
+   имеет, и номер считается самой аннотацией.
+*/
+
+#ifndef __MORPHOLOGY_ANNOTATIONS_H__
+#define __MORPHOLOGY_ANNOTATIONS_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <wchar.h>
+
+#define ANNOTATION_TABLE_SIGNATURE "MORPHAN"
+/* Основание системы счисления номеров аннотаций в автомате */
+#define ANNOTATION_RADIX 36
+/* Номер, которого нет в таблице */
+#define ANNOTATION_NONE UINT32_MAX
+
+typedef struct {
+  const uint32_t *codes; /* Упакованные аннотации, по номерам */
+  uint32_t count; /* 0 - таблицы нет, номер и есть аннотация */
+} AnnotationTable;
+
+/* Используя допущения, что число флективных моделей не больше 65536 (в
+   русском словаре их всего ~2600), а окончания и основы не могут быть
+   длиннее 255 символов, аннотацию можно упаковать в 4-байтовое целое */
+static inline uint32_t pack_annotation(uint16_t flex_model_index, uint8_t flexion_size, uint8_t base_size) {
+  return ((uint32_t)flex_model_index << 16) | ((uint32_t)flexion_size << 8) | (uint32_t)base_size;
+}
+
+/* Возвращает упакованную аннотацию с номером annotation или
+   ANNOTATION_NONE, если номер вне таблицы */
+static inline uint32_t annotation_code(const AnnotationTable *table, uint32_t annotation) {
+  if (table->count == 0) return annotation;
+  return annotation < table->count ? table->codes[annotation] : ANNOTATION_NONE;
+}
+
+/* Значение 36-ичной цифры номера или -1, если label - не цифра */
+static inline int annotation_digit(wchar_t label) {
+  if (label >= L'0' && label <= L'9') return (int)(label - L'0');
+  if (label >= L'A' && label <= L'Z') return (int)(label - L'A') + 10;
+  return -1;
+}
+
+int append_annotation_table(const char *automat_file_name, const AnnotationTable *table);
+int read_annotation_table(const char *automat_file_name, AnnotationTable *table);
+void free_annotation_table(AnnotationTable *table);
+
+#endif /* __MORPHOLOGY_ANNOTATIONS_H__ */
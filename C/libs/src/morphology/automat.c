@@ -12,89 +12,86 @@
 #include <string.h>
 
 #include "common/strict_alloc.h"
-#include "common/hashtable.h"
 #include "common/datastruct.h"
 
 #define StatesCount uint32_t
 #define StateDescriptionSize uint64_t
 
-/* Классы эквивалентности */
-static void add_to_equivalence_class(EquivalenceClass *_class, State *state) {
-  StateListItem *item = strict_malloc(sizeof(StateListItem));
-  item->next = _class->state_list;
-  item->state = state;
-  _class->state_list = item;
-  _class->count++;
-}
-
-static void remove_from_equivalence_class(EquivalenceClass *_class, State *state) {
-  StateListItem *item = _class->state_list, *prev_item = NULL;
-  while (item != NULL) {
-    if (item->state == state) {
-      if (prev_item != NULL) {
-	prev_item->next = item->next;
-      } else {
-	_class->state_list = item->next;
-      }
-      strict_free(item);
-      break;
-    }
-    prev_item = item;
-    item = item->next;
+/* Память под состояния и переходы строящегося автомата.
+
+   За время построения создаются и удаляются (при замене на эквивалентные)
+   десятки миллионов состояний, и почти у всех по одному переходу. Поэтому
+   состояния и массивы переходов не выделяются поштучно через malloc, а
+   нарезаются из больших блоков. Освобождённые состояния и массивы
+   переходов складываются в списки свободных (массивы - по размерам,
+   степеням двойки) и выдаются повторно. Вся память автомата освобождается
+   разом вместе с блоками. */
+
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define ARENA_ALIGNMENT 8
+/* Наибольший массив переходов - 2^(ARENA_SIZE_CLASSES - 1) переходов */
+#define ARENA_SIZE_CLASSES 24
+
+/* Свободный кусок памяти. Пока кусок свободен, в нём хранится ссылка на
+   следующий. */
+typedef struct free_chunk {
+  struct free_chunk *next;
+} FreeChunk;
+
+typedef struct arena_block {
+  struct arena_block *next;
+  size_t size;
+  size_t used;
+} ArenaBlock;
+
+struct state_arena {
+  ArenaBlock *blocks;
+  FreeChunk *free_states;
+  FreeChunk *free_transitions[ARENA_SIZE_CLASSES];
+};
+
+static StateArena *make_state_arena(void) {
+  return strict_calloc(1, sizeof(StateArena));
+}
+
+static void free_state_arena(StateArena *arena) {
+  ArenaBlock *block = arena->blocks, *next;
+  while (block != NULL) {
+    next = block->next;
+    strict_free(block);
+    block = next;
   }
-}
-
-static inline int8_t is_empty_equivalence_class(EquivalenceClass *_class) {
-  return _class->state_list == NULL;
-}
-
-static EquivalenceClass *add_equivalence_class(EquivalenceClassList *list, void *key, size_t key_size) {
-  EquivalenceClass *_class = strict_malloc(sizeof(EquivalenceClass));
-  _class->count = 0;
-  _class->state_list = NULL;
-  hash_table_chain_put(*list, key, key_size, _class);
-  return _class;
-}
-
-static void remove_equivalence_class(EquivalenceClassList list, void *key, size_t key_size) {
-  hash_table_chain_delete(list, key, key_size);
-}
-
-static State *any_state_from_class(EquivalenceClass *_class) {
-  return (_class->state_list == NULL) ? NULL : _class->state_list->state;
-}
-
-static void free_state_list(StateListItem *item) {
-  StateListItem *next;
-  while (item != NULL) {
-    next = item->next;
-    strict_free(item);
-    item = next;
+  strict_free(arena);
+}
+
+static void *arena_allocate(StateArena *arena, size_t size) {
+  ArenaBlock *block = arena->blocks;
+  size_t block_size, header_size = (sizeof(ArenaBlock) + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  void *result;
+  size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+  if (block == NULL || block->used + size > block->size) {
+    block_size = size > ARENA_BLOCK_SIZE - header_size ? size + header_size : ARENA_BLOCK_SIZE;
+    block = strict_malloc(block_size);
+    block->size = block_size;
+    block->used = header_size;
+    block->next = arena->blocks;
+    arena->blocks = block;
   }
+  result = (int8_t *)block + block->used;
+  block->used += size;
+  return result;
 }
 
-static void free_class_list(EquivalenceClassList list) {
-  void *state = NULL, *key;
-  size_t key_size;
-  EquivalenceClass *_class;
-  while ((_class = hash_table_chain_iter_items(list, &key, &key_size, &state)) != NULL) {
-    free_state_list(_class->state_list);
-    strict_free(_class);
-  }
-  free_hash_table(list);
+/* Номер размера массива переходов: наименьшее k, при котором в массив из
+   2^k переходов помещается count переходов */
+static inline unsigned int size_class(uint32_t count) {
+  unsigned int k = 0;
+  while (((uint32_t)1 << k) < count) k++;
+  return k;
 }
 
 /* Переходы */
 
-static Transition *make_transition(Label label, State *target, Transition *transition) {
-  if (transition == NULL) {
-    transition = strict_malloc(sizeof(Transition));
-  }
-  transition->label = label;
-  transition->target = target;
-  return transition;
-}
-
 inline State *transition_target(Transition *transition) {
   return transition->target;
 }
@@ -107,41 +104,70 @@ inline Label transition_label(Transition *transition) {
   return transition->label;
 }
 
-/* Списки переходов на другие состояния */
+/* Списки переходов на другие состояния. Если arena == NULL (автомат
+   загружен из файла), память под них берётся у malloc. */
 
-static TransitionList *make_transition_list(void) {
-  TransitionList *result = make_array_list(sizeof(Transition), 5);
-  return result;
+static void free_transition_list(StateArena *arena, TransitionList *list) {
+  unsigned int k;
+  FreeChunk *chunk;
+  if (list->items == NULL) return;
+  if (arena == NULL) {
+    strict_free(list->items);
+  } else {
+    k = size_class(list->capacity);
+    chunk = (FreeChunk *)list->items;
+    chunk->next = arena->free_transitions[k];
+    arena->free_transitions[k] = chunk;
+  }
+  list->items = NULL;
+  list->size = list->capacity = 0;
 }
 
-static void free_transition_list(TransitionList *list) {
-  free_array_list(list);
+static Transition *allocate_transitions(StateArena *arena, uint32_t capacity) {
+  unsigned int k = size_class(capacity);
+  FreeChunk *chunk = arena->free_transitions[k];
+  if (chunk != NULL) {
+    arena->free_transitions[k] = chunk->next;
+    return (Transition *)chunk;
+  }
+  return arena_allocate(arena, sizeof(Transition) << k);
 }
 
 Transition *next_transition(TransitionList *list, void **memo) {
-  return array_list_iter(list, memo);
+  Transition *transition = (*memo == NULL) ? list->items : (Transition *)*memo + 1;
+  if (transition >= list->items + list->size) return NULL;
+  *memo = transition;
+  return transition;
 }
 
-static TransitionList *extend_transition_list(TransitionList *list, Label label, State *to_state) {
-  Transition *new_transition = array_list_append(list, NULL);
-  make_transition(label, to_state, new_transition);
-  return list;
+static void extend_transition_list(StateArena *arena, TransitionList *list, Label label, State *to_state) {
+  Transition *items;
+  uint32_t capacity, size = list->size;
+  if (size == list->capacity) {
+    capacity = list->capacity == 0 ? 1 : list->capacity*2;
+    if (arena == NULL) {
+      items = strict_realloc(list->items, sizeof(Transition)*capacity);
+    } else {
+      items = allocate_transitions(arena, capacity);
+      if (size > 0) memcpy(items, list->items, sizeof(Transition)*size);
+      free_transition_list(arena, list);
+    }
+    list->items = items;
+    list->size = size;
+    list->capacity = capacity;
+  }
+  list->items[list->size].label = label;
+  list->items[list->size].target = to_state;
+  list->size++;
 }
 
 static Transition *last_transition(TransitionList *list) {
-  size_t list_size = array_list_size(list);
-  return list_size > 0 ? array_list_get(list, list_size - 1) : NULL;
-}
-
-static size_t transition_list_size(TransitionList *list) {
-  return list->size;
+  return list->size > 0 ? list->items + list->size - 1 : NULL;
 }
 
 Transition *find_transition(TransitionList *list, Label label) {
-  size_t i, list_size = array_list_size(list);
-  Transition *transition;
-  for (i = 0; i < list_size; i++) {
-    transition = array_list_get(list, i);
+  Transition *transition, *end = list->items + list->size;
+  for (transition = list->items; transition < end; transition++) {
     if (transition->label == label) return transition;
   }
   return NULL;
@@ -149,11 +175,21 @@ Transition *find_transition(TransitionList *list, Label label) {
 
 /* Состояния */
 
-State *make_state(uint32_t id, State *prev_state) {
-  State *result = strict_malloc(sizeof(State));
-  result->transition_list = make_transition_list();
+static State *make_state(StateArena *arena, uint32_t id, State *prev_state) {
+  State *result;
+  if (arena == NULL) {
+    result = strict_malloc(sizeof(State));
+  } else if (arena->free_states != NULL) {
+    result = (State *)arena->free_states;
+    arena->free_states = arena->free_states->next;
+  } else {
+    result = arena_allocate(arena, sizeof(State));
+  }
+  result->transition_list.items = NULL;
+  result->transition_list.size = 0;
+  result->transition_list.capacity = 0;
   result->flags = UNMARKED_STATE;
-  result->_class = NULL;
+  result->signature = 0;
   result->id = id;
   if (prev_state == NULL) {
     result->next = result;
@@ -167,9 +203,16 @@ State *make_state(uint32_t id, State *prev_state) {
   return result;
 }
 
-void free_state(State *state) {
-  free_transition_list(state->transition_list);
-  strict_free(state);
+static void free_state(StateArena *arena, State *state) {
+  FreeChunk *chunk;
+  free_transition_list(arena, &state->transition_list);
+  if (arena == NULL) {
+    strict_free(state);
+  } else {
+    chunk = (FreeChunk *)state;
+    chunk->next = arena->free_states;
+    arena->free_states = chunk;
+  }
 }
 
 inline static void set_state_id(State *state, uint32_t id) {
@@ -177,15 +220,11 @@ inline static void set_state_id(State *state, uint32_t id) {
 }
 
 inline TransitionList *state_transitions(State *state) {
-  return state->transition_list;
-}
-
-void update_state_transitions(State *state, TransitionList *list) {
-  state->transition_list = list;
+  return &state->transition_list;
 }
 
 size_t transitions_count(State *state) {
-  return transition_list_size(state_transitions(state));
+  return state->transition_list.size;
 }
 
 int8_t has_children(State *state) {
@@ -193,11 +232,11 @@ int8_t has_children(State *state) {
 }
 
 State *last_child(State *state) {
-  return transition_target(last_transition(state->transition_list));
+  return transition_target(last_transition(&state->transition_list));
 }
 
 void set_last_child(State *state, State *child) {
-  set_transition_target(last_transition(state->transition_list), child);
+  set_transition_target(last_transition(&state->transition_list), child);
 }
 
 void mark_as_final(State *state) {
@@ -216,72 +255,115 @@ int8_t is_marked_as_registered(State *state) {
   return (state->flags & REGISTERED_STATE) ? 1 : 0;
 }
 
-State *append_new_state(State *to_state, Label label, uint32_t id, State *prev_state) {
-  State *new_state = make_state(id, prev_state);
-  TransitionList *transitions = state_transitions(to_state);
-  update_state_transitions(to_state, extend_transition_list(transitions, label, new_state));
+static State *append_new_state(Automat *automat, State *to_state, Label label, uint32_t id, State *prev_state) {
+  State *new_state = make_state(automat->arena, id, prev_state);
+  extend_transition_list(automat->arena, &to_state->transition_list, label, new_state);
   return new_state;
 }
 
-void append_state(State *from_state, State *to_state, Label label) {
-  TransitionList *transitions = state_transitions(from_state);
-  update_state_transitions(from_state, extend_transition_list(transitions, label, to_state));
+static void append_state(State *from_state, State *to_state, Label label) {
+  extend_transition_list(NULL, &from_state->transition_list, label, to_state);
 }
 
-
-/* Используется для сортировки описаний переходов. См. state_description_key */
-static int transition_descriptor_comparer(const void *obj1, const void *obj2) {
-  struct class_transition_descriptor 
-    *td1 = (struct class_transition_descriptor *) obj1, 
-    *td2 = (struct class_transition_descriptor *) obj2;
-  if (td1->label == td2->label) return 0;
-    return td1->label < td2->label ? -1 : 1;
-  return 0;
+static inline uint64_t mix_signature(uint64_t value) {
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
 }
 
-/* Генерирует байтовый массив, который можно трактовать как универсальный идентификатор состояния - 
-   - он описывает его переходы и метки, куда идут переходы, является ли состояние конечным.
-  Используется для построения реестра состояний. Позволяет быстро сравнивать состояния по 
-  принадлежности к классу эквивалентности.
-  Указатель на массив записывается в result, а в result_size помещается размер буфера.
-  После использования, буфер надо освободить через free.
-*/
-void state_description_key(State *state, int8_t **result, size_t *result_size) {
-  size_t links_count = transitions_count(state);
-  struct class_transition_descriptor transition_descriptor;
-  int8_t *result_cursor, *transitions_block_start, is_final = is_final_state(state);
-  Transition *transition;
-  TransitionList *transition_list;
-  void *loop_memo = NULL;
-  *result_size = sizeof(is_final) + links_count * sizeof(struct class_transition_descriptor);
-  result_cursor = *result = strict_malloc(*result_size);
-  memset(&transition_descriptor, 0, sizeof(transition_descriptor));
-  memcpy(result_cursor, &is_final, sizeof(is_final)); result_cursor += sizeof(is_final);
-  transitions_block_start = result_cursor;
-  transition_list = state_transitions(state);
-  while ((transition = next_transition(transition_list, &loop_memo))!= NULL) {
-    transition_descriptor.label = transition_label(transition);
-    transition_descriptor.target_id = transition_target(transition)->id;
-    memcpy(result_cursor, &transition_descriptor, sizeof(struct class_transition_descriptor)); result_cursor += sizeof(transition_descriptor);
+/* Вычисляет 64-битную подпись состояния - по тому, конечное ли оно, и по
+  меткам его переходов вместе с номерами состояний, куда они ведут.
+  У эквивалентных состояний подписи совпадают. Подписи переходов
+  складываются, так что порядок переходов на подпись не влияет. */
+uint64_t state_signature(State *state) {
+  Transition *transition, *end = state->transition_list.items + state->transition_list.size;
+  uint64_t signature = mix_signature(((uint64_t)state->transition_list.size << 1) | (uint64_t)is_final_state(state));
+  for (transition = state->transition_list.items; transition < end; transition++) {
+    signature += mix_signature(((uint64_t)(uint32_t)transition->label << 32) | transition->target->id);
   }
-  qsort(transitions_block_start, links_count, sizeof(struct class_transition_descriptor), transition_descriptor_comparer);
+  return signature;
 }
 
-void print_state_sign(int8_t *key, size_t key_size) {
-  int8_t *cursor;
-  size_t i;
-  for (i = 0, cursor = key; i < key_size; i++, cursor++) {
-    fprintf(stderr, "%d,", *cursor);
+/* Эквивалентны ли состояния: оба конечные или нет, и у них одни и те же
+   переходы в одни и те же состояния */
+static int8_t is_equivalent_state(State *state1, State *state2) {
+  Transition *transition, *other, *end = state1->transition_list.items + state1->transition_list.size;
+  if (is_final_state(state1) != is_final_state(state2) ||
+      state1->transition_list.size != state2->transition_list.size) {
+    return 0;
+  }
+  for (transition = state1->transition_list.items; transition < end; transition++) {
+    other = find_transition(&state2->transition_list, transition->label);
+    if (other == NULL || other->target != transition->target) return 0;
   }
-  fprintf(stderr, "\n");
+  return 1;
 }
 
-void print_state_sign2(State *state) {
-  int8_t *key;
-  size_t key_size;
-  state_description_key(state, &key, &key_size);
-  print_state_sign(key, key_size);
-  strict_free(key);
+/* Реестр состояний: открытая адресация с линейным пробированием. Рядом с
+   состоянием хранится его подпись, так что при поиске до самих состояний
+   дело доходит только при совпадении подписей. */
+
+#define REGISTER_INITIAL_CAPACITY (1 << 16)
+
+static StateRegister *make_state_register(void) {
+  StateRegister *state_register = strict_malloc(sizeof(StateRegister));
+  state_register->capacity = REGISTER_INITIAL_CAPACITY;
+  state_register->count = 0;
+  state_register->states = strict_calloc(state_register->capacity, sizeof(State *));
+  state_register->signatures = strict_malloc(state_register->capacity*sizeof(uint64_t));
+  return state_register;
+}
+
+static void free_state_register(StateRegister *state_register) {
+  strict_free(state_register->states);
+  strict_free(state_register->signatures);
+  strict_free(state_register);
+}
+
+static void register_insert(StateRegister *state_register, State *state, uint64_t signature) {
+  size_t mask = state_register->capacity - 1, i = (size_t)signature & mask;
+  while (state_register->states[i] != NULL) i = (i + 1) & mask;
+  state_register->states[i] = state;
+  state_register->signatures[i] = signature;
+  state_register->count++;
+}
+
+static void grow_state_register(StateRegister *state_register) {
+  State **states = state_register->states;
+  uint64_t *signatures = state_register->signatures;
+  size_t i, capacity = state_register->capacity;
+  state_register->capacity = capacity*2;
+  state_register->count = 0;
+  state_register->states = strict_calloc(state_register->capacity, sizeof(State *));
+  state_register->signatures = strict_malloc(state_register->capacity*sizeof(uint64_t));
+  for (i = 0; i < capacity; i++) {
+    if (states[i] != NULL) register_insert(state_register, states[i], signatures[i]);
+  }
+  strict_free(states);
+  strict_free(signatures);
+}
+
+/* Убирает из реестра состояние state, зарегистрированное с подписью
+   state->signature. Следующие за ним элементы той же цепочки сдвигаются
+   назад, так что пометок об удалении не требуется. */
+static void register_remove(StateRegister *state_register, State *state) {
+  size_t mask = state_register->capacity - 1, i = (size_t)state->signature & mask, j, home;
+  while (state_register->states[i] != NULL && state_register->states[i] != state) i = (i + 1) & mask;
+  if (state_register->states[i] == NULL) return;
+  for (j = (i + 1) & mask; state_register->states[j] != NULL; j = (j + 1) & mask) {
+    home = (size_t)state_register->signatures[j] & mask;
+    /* Элемент j можно перенести в i, если i лежит между home и j */
+    if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+      state_register->states[i] = state_register->states[j];
+      state_register->signatures[i] = state_register->signatures[j];
+      i = j;
+    }
+  }
+  state_register->states[i] = NULL;
+  state_register->count--;
 }
 
 #ifndef _GNU_SOURCE
@@ -291,8 +373,7 @@ void *mempcpy(void *dest, const void *src, size_t n) {
 }
 #endif
 
-/* Функция, аналогичная state_description_key, но генерирующая
-   полное описание состояния, по которому его можно будет
+/* Генерирует полное описание состояния, по которому его можно будет
    целиком восстановить. */
 int serialize_state(State *state, MemBuffer *buffer) {
   size_t links_count = transitions_count(state);
@@ -308,7 +389,7 @@ int serialize_state(State *state, MemBuffer *buffer) {
   append_to_mem_buffer(buffer, &state->id, sizeof(state->id));
   append_to_mem_buffer(buffer, &is_final, sizeof(is_final));
   transition_list = state_transitions(state);
-  transitions_count = (uint32_t)transition_list_size(transition_list);
+  transitions_count = transition_list->size;
   append_to_mem_buffer(buffer, &transitions_count, sizeof(transitions_count));
   while ((transition = next_transition(transition_list, &loop_memo))!= NULL) {
     transition_descriptor.label = transition_label(transition);
@@ -327,7 +408,7 @@ static void *deserialize_state(void *data, void *prev_state) {
   State *state;
   int8_t *cursor = description;
   memcpy(&state_id, cursor, sizeof(state_id)); cursor += sizeof(state_id);
-  state = make_state(state_id, (State *)prev_state);
+  state = make_state(NULL, state_id, (State *)prev_state);
   memcpy(&is_final, cursor, sizeof(is_final));
   if (is_final) mark_as_final(state);
   return state;
@@ -377,11 +458,19 @@ void print_tree(State *root) {
 
 /* Автомат в целом */
 
-Automat *make_automat(void) {
+static Automat *make_empty_automat(StateArena *arena) {
   Automat *automat = strict_malloc(sizeof(Automat));
   automat->last_state_id = 0;
-  automat->initial_state = make_state(++automat->last_state_id, NULL);
-  automat->class_list = make_hash_table(19);
+  automat->arena = arena;
+  automat->state_register = NULL;
+  automat->initial_state = NULL;
+  return automat;
+}
+
+Automat *make_automat(void) {
+  Automat *automat = make_empty_automat(make_state_arena());
+  automat->initial_state = make_state(automat->arena, ++automat->last_state_id, NULL);
+  automat->state_register = make_state_register();
   return automat;
 }
 
@@ -391,13 +480,17 @@ State *initial_state(Automat *automat) {
 
 void free_automat(Automat *automat) {
   State *next, *state = automat->initial_state;
-  do {
-    next = state->next;
-    free_state(state);
-    state = next;
-  } while (state != automat->initial_state);
-  if (automat->class_list != NULL) {
-    free_class_list(automat->class_list);
+  if (automat->arena != NULL) {
+    free_state_arena(automat->arena);
+  } else if (state != NULL) {
+    do {
+      next = state->next;
+      free_state(NULL, state);
+      state = next;
+    } while (state != automat->initial_state);
+  }
+  if (automat->state_register != NULL) {
+    free_state_register(automat->state_register);
   }
   strict_free(automat);
 }
@@ -427,53 +520,35 @@ void common_prefix(Automat *automat, Label word[], size_t word_length, size_t *p
   }
 }
 
-
-/* Регистрирует новый класс эквивалентности состояний, в который
- сразу включается состояние state. */
+/* Регистрирует состояние state в реестре */
 void add_to_register(Automat *automat, State *state) {
-  EquivalenceClass *_class;
-  int8_t *class_key;
-  size_t class_key_size;
-  state_description_key(state, &class_key, &class_key_size);
-  _class = add_equivalence_class(&automat->class_list, class_key, class_key_size);
-  add_to_equivalence_class(_class, state);
-  state->_class = _class;
-  strict_free(class_key);
+  StateRegister *state_register = automat->state_register;
+  if (state_register->count*2 >= state_register->capacity) {
+    grow_state_register(state_register);
+  }
+  state->signature = state_signature(state);
+  register_insert(state_register, state, state->signature);
 }
 
 /* Ищет состояние, эквивалентное состоянию state. Т.е. одинакового вида (оба - финальные или нет),
-   имеющее то же количество переходов, которые ведут на те же состояния, которые уникальны
-   в своём классе эквивалентности. */
+   имеющее то же количество переходов, которые ведут на те же состояния. */
 State *find_equivalent(Automat *automat, State *state) {
-  EquivalenceClass *_class = NULL;
-  int8_t *class_key;
-  size_t class_key_size;
-  state_description_key(state, &class_key, &class_key_size);
-  _class = hash_table_chain_get(automat->class_list, class_key, class_key_size);
-  strict_free(class_key);
-  if (_class != NULL) {
-    return any_state_from_class(_class);
+  StateRegister *state_register = automat->state_register;
+  uint64_t signature = state_signature(state);
+  size_t mask = state_register->capacity - 1, i = (size_t)signature & mask;
+  for (; state_register->states[i] != NULL; i = (i + 1) & mask) {
+    if (state_register->signatures[i] == signature && is_equivalent_state(state_register->states[i], state)) {
+      return state_register->states[i];
+    }
   }
   return NULL;
 }
 
-static void re_register_state(Automat *automat, State *state, int8_t *old_class_key, size_t old_class_key_size) {
-  int8_t *class_key;
-  size_t class_key_size;
-  EquivalenceClass *_class;
-  _class = hash_table_chain_get(automat->class_list, old_class_key, old_class_key_size);
-  remove_from_equivalence_class(_class, state);
-  if (is_empty_equivalence_class(_class)) {
-    remove_equivalence_class(automat->class_list, old_class_key, old_class_key_size);
-  }
-  state_description_key(state, &class_key, &class_key_size);
-  _class = hash_table_chain_get(automat->class_list, class_key, class_key_size);
-  if (_class != NULL) {
-    add_to_equivalence_class(_class, state);
-  } else {
-    add_to_register(automat, state);
-  }
-  strict_free(class_key);
+/* Перерегистрирует уже зарегистрированное состояние state после изменения
+   его переходов */
+static void re_register_state(Automat *automat, State *state) {
+  register_remove(automat->state_register, state);
+  add_to_register(automat, state);
 }
 
 /* Добавляет ветвь автомата, соответствующую последовательности current_suffix с финальным
@@ -482,63 +557,52 @@ static void re_register_state(Automat *automat, State *state, int8_t *old_class_
 static void add_suffix(Automat *automat, State *last_state, Label current_suffix[], size_t suffix_size) {
   size_t label_index;
   State *forked_state = last_state;
-  int8_t *class_key;
-  size_t class_key_size;
-  if (is_marked_as_registered(forked_state)) {
-    state_description_key(forked_state, &class_key, &class_key_size);
-  }
   for (label_index = 0; label_index < suffix_size; label_index++) {
-    last_state = append_new_state(last_state, 
+    last_state = append_new_state(automat,
+				  last_state, 
 				  current_suffix[label_index], 
 				  ++automat->last_state_id, 
 				  automat->initial_state);
   }
   mark_as_final(last_state);
   if (is_marked_as_registered(forked_state)) {
-    re_register_state(automat, forked_state, class_key, class_key_size);
-    strict_free(class_key);
+    re_register_state(automat, forked_state);
   }
 }
 
 /* Удаляет ветвь автомата до первого состояния, зарегистрированного
-   в классах эквивалентности. Используется в минимизации автомата. */
-void delete_branch(State *state) {
+   в реестре. Используется в минимизации автомата. */
+static void delete_branch(Automat *automat, State *state) {
   Transition *transition;
   TransitionList *transition_list = state_transitions(state);
   void *loop_memo = NULL;
   if (!is_marked_as_registered(state)) {
     while ((transition = next_transition(transition_list, &loop_memo))!= NULL) {
-      delete_branch(transition_target(transition));
+      delete_branch(automat, transition_target(transition));
     }
     state->prev->next = state->next;
     state->next->prev = state->prev;
-    free_state(state);
+    free_state(automat->arena, state);
   }
 }
 
 /* Ядро минимизации автомата. Ищет состояния, которые можно 
    исключить, не меняя выводимый автоматом язык, и удаляет их.
-   Новые и уникальные состояния регистрируются в классах эквивалентности,
+   Новые и уникальные состояния регистрируются в реестре,
    чтобы опираться на них при удалении будущих дублей. */
 void replace_or_register(Automat *automat, State *state) {
   State *child = last_child(state);
   State *equivalent;
-  int8_t *class_key;
-  size_t class_key_size;
   if (!is_marked_as_registered(child)) {
     if (has_children(child)) {
       replace_or_register(automat, child);
     }
     equivalent = find_equivalent(automat, child);
     if (equivalent != NULL) {
-      if (is_marked_as_registered(state)) {
-	state_description_key(state, &class_key, &class_key_size);
-      }
-      delete_branch(child);
+      delete_branch(automat, child);
       set_last_child(state, equivalent);
       if (is_marked_as_registered(state)) {
-	re_register_state(automat, state, class_key, class_key_size);
-	strict_free(class_key);
+	re_register_state(automat, state);
       }
     } else {
       add_to_register(automat, child);
@@ -557,8 +621,6 @@ void automat_add_word(Automat *automat, Label word[], size_t size) {
   State *first_state, *last_state;
   Label *current_suffix;
   common_prefix(automat, word, size, &prefix_size, &first_state, &last_state);
-  /*printf("Last state:%p\n", (void *) last_state);
-    printf("Prefix_size:%ld\n", prefix_size);*/
   current_suffix = &word[prefix_size];
   if (has_children(last_state)) {
     replace_or_register(automat, last_state);
@@ -569,9 +631,12 @@ void automat_add_word(Automat *automat, Label word[], size_t size) {
 /* Завершает построение автомата. Функция должна быть вызвана после
    добавления последнего слова через automat_add_word. */
 void complete_automat(Automat *automat) {
-  replace_or_register(automat, initial_state(automat));
-  free_class_list(automat->class_list);
-  automat->class_list = NULL;
+  /* В автомате без слов регистрировать нечего */
+  if (has_children(initial_state(automat))) {
+    replace_or_register(automat, initial_state(automat));
+  }
+  free_state_register(automat->state_register);
+  automat->state_register = NULL;
 }
 
 /* Перенумеровывает идентификаторы состояний так чтобы они начинались 
@@ -613,8 +678,7 @@ long int save_automat(Automat *automat, char *file_name) {
 }
 
 static void *deserialize_automat(void **states_map, size_t states_count) {
-  Automat *automat = make_automat();
-  free_state(automat->initial_state);
+  Automat *automat = make_empty_automat(NULL);
   automat->initial_state = states_map[0];
   return automat;
 }
@@ -13,8 +13,6 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-#include "../common/hashtable.h"
-#include "../common/datastruct.h"
 
 enum automate_state_markers {UNMARKED_STATE = 00, FINAL_STATE = 01, REGISTERED_STATE = 02};
 
@@ -25,44 +23,50 @@ typedef struct transition {
   struct state *target;
 } Transition;
 
-typedef ArrayList TransitionList;
-
+/* Переходы состояния лежат в одном массиве, без отдельного
+   выделения на каждый */
+typedef struct {
+  Transition *items;
+  uint32_t size;
+  uint32_t capacity;
+} TransitionList;
 
 typedef struct state {
-  TransitionList *transition_list;
+  TransitionList transition_list;
+  /* Подпись состояния в реестре (см. state_signature) */
+  uint64_t signature;
   uint32_t id;
   int8_t flags;
-  struct equivalence_class *_class;
   /* Используются для обхода состояний при сохранении 
      или освобождении памяти автомата */
   struct state *next;
   struct state *prev;
 } State;
 
-typedef struct state_list_item {
-  State *state;
-  struct state_list_item *next;
-} StateListItem;
-
-typedef struct equivalence_class {
-  size_t count;
-  struct equivalence_class *next;
-  StateListItem *state_list;
-} EquivalenceClass;
-
-/* Описатель перехода, используемый в state_description_key для
-   генерации ключа-описателя класса эквивалентности */
+/* Описатель перехода в сохранённом описании состояния */
 struct class_transition_descriptor {
   Label label; 
   uint32_t target_id;
 };
 
-typedef HashTable *EquivalenceClassList;
+/* Память под состояния и переходы строящегося автомата, выделяемая
+   крупными блоками */
+typedef struct state_arena StateArena;
+
+/* Реестр уникальных состояний: открытая адресация по 64-битной
+   подписи состояния */
+typedef struct {
+  State **states;
+  uint64_t *signatures;
+  size_t capacity;
+  size_t count;
+} StateRegister;
 
 typedef struct {
   State *initial_state;
   uint32_t last_state_id;
-  EquivalenceClassList class_list;
+  StateRegister *state_register; /* Только на время построения */
+  StateArena *arena; /* NULL у загруженного автомата */
 } Automat;
 
 typedef void *(*DeserializeStateFunction)(void *data, void *prev_state);
@@ -74,10 +78,8 @@ State *transition_target(Transition *transition);
 
 void print_tree(State *root);
 void print_state(State *state);
-void print_state_sign(int8_t *key, size_t key_size);
-void print_state_sign2(State *state);
 State *initial_state(Automat *automat);
-void state_description_key(State *state, int8_t **result, size_t *result_size);
+uint64_t state_signature(State *state);
 int8_t is_final_state(State *state);
 TransitionList *state_transitions(State *state);
 Transition *next_transition(TransitionList *list, void **memo);
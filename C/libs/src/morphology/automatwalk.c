@@ -0,0 +1,193 @@
+/* Перебор выводов автомата морфологии.
+
+   Раньше выводы собирались рекурсивным обходом в глубину: при предсказании
+   для короткого незнакомого слова он перебирал всё поддерево под
+   найденным префиксом - десятки тысяч состояний, по вызову on_complete
+   (с копированием вывода) на каждое конечное. Теперь обход идёт с явным
+   стеком и очередью и останавливается, дойдя до ограничений
+   AutomatOutputLimits.
+
+   Точный разбор (is_prediction == 0) обходит в глубину только аннотации
+   за разделителем и выдаёт их в прежнем порядке. Предсказание перебирает
+   продолжения слова в ширину, по возрастанию длины достроенной части:
+   первыми идут выводы, которым для совпадения со словарным словом нужно
+   меньше всего лишних букв, - самые правдоподобные. Так ограничение
+   отсекает самые далёкие от слова варианты.
+
+   Вывод целиком нигде не собирается: для предсказания важна только длина
+   достроенной части, а цифры номера аннотации за разделителем сразу
+   складываются в число (см. annotations.h). */
+
+#include "morphology/automatwalk.h"
+
+#include <string.h>
+
+#include "common/strict_alloc.h"
+
+/* Столько элементов стека обхода аннотаций лежат прямо в AutomatWalk (в
+   кадре стека вызова); память выделяется, только если их не хватило */
+#define AUTOMAT_WALK_INLINE_ITEMS 64
+
+/* Состояние, ждущее обхода аннотаций в глубину */
+typedef struct {
+  uint32_t state;
+  uint32_t depth; /* Число цифр номера аннотации */
+  uint32_t annotation; /* Номер аннотации по этим цифрам */
+} WalkItem;
+
+/* Продолжение слова при предсказании */
+typedef struct {
+  uint32_t state;
+  uint32_t depth;
+} WalkNode;
+
+typedef struct {
+  const void *automat;
+  const AutomatWalkOps *ops;
+  const AutomatOutputLimits *limits;
+  AutomatOutputProcessor on_complete;
+  void *data;
+  char is_prediction;
+  size_t prefix_size;
+  size_t prediction_size;
+  size_t outputs_count;
+  size_t states_count;
+  WalkItem *stack;
+  size_t stack_size;
+  size_t stack_capacity;
+  WalkItem inline_stack[AUTOMAT_WALK_INLINE_ITEMS];
+  Label labels[AUTOMAT_WALK_MAX_FANOUT];
+  uint32_t targets[AUTOMAT_WALK_MAX_FANOUT];
+} AutomatWalk;
+
+static inline int walk_is_over(const AutomatWalk *walk) {
+  return (walk->limits->max_outputs > 0 && walk->outputs_count >= walk->limits->max_outputs) ||
+    (walk->limits->max_states > 0 && walk->states_count >= walk->limits->max_states);
+}
+
+static inline void walk_output(AutomatWalk *walk, uint32_t annotation) {
+  walk->on_complete(walk->is_prediction, walk->prefix_size, walk->prediction_size, annotation, walk->data);
+  walk->outputs_count++;
+}
+
+static void push_item(AutomatWalk *walk, uint32_t state, uint32_t depth, uint32_t annotation) {
+  if (walk->stack_size == walk->stack_capacity) {
+    walk->stack_capacity *= 2;
+    if (walk->stack == walk->inline_stack) {
+      walk->stack = strict_malloc(walk->stack_capacity*sizeof(*walk->stack));
+      memcpy(walk->stack, walk->inline_stack, sizeof(walk->inline_stack));
+    } else {
+      walk->stack = strict_realloc(walk->stack, walk->stack_capacity*sizeof(*walk->stack));
+    }
+  }
+  walk->stack[walk->stack_size].state = state;
+  walk->stack[walk->stack_size].depth = depth;
+  walk->stack[walk->stack_size].annotation = annotation;
+  walk->stack_size++;
+}
+
+/* Обход в глубину номеров аннотаций от состояния state сразу за
+   разделителем. Порядок выводов тот же, что у прежнего рекурсивного
+   обхода. */
+static void walk_depth_first(AutomatWalk *walk, uint32_t state) {
+  WalkItem item;
+  uint32_t i, count;
+  int digit;
+  push_item(walk, state, 0, 0);
+  while (walk->stack_size > 0 && !walk_is_over(walk)) {
+    item = walk->stack[--walk->stack_size];
+    walk->states_count++;
+    if (walk->ops->is_final(walk->automat, item.state)) {
+      walk_output(walk, item.annotation);
+      if (!walk->is_prediction) continue;
+    }
+    if (walk->prediction_size + item.depth + 2 < MAX_AUTOMAT_OUTPUT_SIZE) {
+      count = walk->ops->transitions(walk->automat, item.state, walk->labels, walk->targets);
+      /* В обратном порядке, чтобы первым со стека снялся меньший */
+      for (i = count; i > 0; i--) {
+        if ((digit = annotation_digit(walk->labels[i - 1])) >= 0) {
+          push_item(walk, walk->targets[i - 1], item.depth + 1,
+                    item.annotation*ANNOTATION_RADIX + (uint32_t)digit);
+        }
+      }
+    }
+  }
+  walk->stack_size = 0;
+}
+
+/* Предсказание: обход продолжений слова в ширину. Аннотации каждого
+   продолжения выводятся сразу, как только до него дошла очередь. */
+static void walk_breadth_first(AutomatWalk *walk, uint32_t start) {
+  WalkNode inline_nodes[AUTOMAT_WALK_INLINE_NODES], *nodes = inline_nodes, node;
+  size_t nodes_count = 1, nodes_capacity = AUTOMAT_WALK_INLINE_NODES, head;
+  Label labels[AUTOMAT_WALK_MAX_FANOUT];
+  uint32_t targets[AUTOMAT_WALK_MAX_FANOUT], i, count;
+  nodes[0].state = start;
+  nodes[0].depth = 0;
+  for (head = 0; head < nodes_count && !walk_is_over(walk); head++) {
+    node = nodes[head];
+    walk->states_count++;
+    if (node.depth + 1 >= MAX_AUTOMAT_OUTPUT_SIZE) continue;
+    count = walk->ops->transitions(walk->automat, node.state, labels, targets);
+    for (i = 0; i < count && !walk_is_over(walk); i++) {
+      if (labels[i] == ANNOTATION_DELIMITER) {
+        walk->prediction_size = node.depth;
+        walk_depth_first(walk, targets[i]);
+      } else if (walk->limits->max_states == 0 || nodes_count < walk->limits->max_states) {
+        if (nodes_count == nodes_capacity) {
+          nodes_capacity *= 2;
+          if (nodes == inline_nodes) {
+            nodes = strict_malloc(nodes_capacity*sizeof(*nodes));
+            memcpy(nodes, inline_nodes, sizeof(inline_nodes));
+          } else {
+            nodes = strict_realloc(nodes, nodes_capacity*sizeof(*nodes));
+          }
+        }
+        nodes[nodes_count].state = targets[i];
+        nodes[nodes_count].depth = node.depth + 1;
+        nodes_count++;
+      }
+    }
+  }
+  if (nodes != inline_nodes) strict_free(nodes);
+}
+
+/* Генерирует выводы автомата, начиная с состояния state, в котором
+   закончился разбор слова (prefix_size - длина разобранной части). Для
+   каждого вывода вызывается on_complete. Если is_prediction == 0, слово
+   разобрано целиком и выводятся только его аннотации. limits ограничивает
+   число выводов и пройденных состояний. Конечные состояния до разделителя
+   (в автомате морфологии их нет) выводов не дают. */
+void walk_automat_outputs(const void *automat, const AutomatWalkOps *ops,
+                          uint32_t state, char is_prediction, size_t prefix_size,
+                          const AutomatOutputLimits *limits,
+                          AutomatOutputProcessor on_complete,
+                          void *data) {
+  AutomatWalk walk_data, *walk = &walk_data;
+  uint32_t i, count;
+  walk->automat = automat;
+  walk->ops = ops;
+  walk->limits = limits;
+  walk->on_complete = on_complete;
+  walk->data = data;
+  walk->is_prediction = is_prediction;
+  walk->prefix_size = prefix_size;
+  walk->prediction_size = 0;
+  walk->outputs_count = 0;
+  walk->states_count = 0;
+  walk->stack = walk->inline_stack;
+  walk->stack_size = 0;
+  walk->stack_capacity = AUTOMAT_WALK_INLINE_ITEMS;
+  if (is_prediction) {
+    walk_breadth_first(walk, state);
+  } else {
+    count = ops->transitions(automat, state, walk->labels, walk->targets);
+    for (i = 0; i < count; i++) {
+      if (walk->labels[i] == ANNOTATION_DELIMITER) {
+        walk_depth_first(walk, walk->targets[i]);
+        break;
+      }
+    }
+  }
+  if (walk->stack != walk->inline_stack) strict_free(walk->stack);
+}
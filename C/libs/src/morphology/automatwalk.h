@@ -0,0 +1,34 @@
+/* Перебор выводов автомата морфологии без рекурсии и с ограничениями -
+   общий для всех представлений автомата (miniautomat.c, succinctautomat.c).
+*/
+
+#ifndef __MORPHOLOGY_AUTOMATWALK_H__
+#define __MORPHOLOGY_AUTOMATWALK_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "automat.h"
+#include "wordforms.h"
+
+#define MAX_AUTOMAT_OUTPUT_SIZE 255
+/* Наибольшее число переходов из одного состояния (по размеру алфавита) */
+#define AUTOMAT_WALK_MAX_FANOUT 256
+/* Столько продолжений слова предсказание перебирает, не выделяя памяти */
+#define AUTOMAT_WALK_INLINE_NODES 256
+
+/* Доступ к состояниям конкретного представления автомата */
+typedef struct {
+  int (*is_final)(const void *automat, uint32_t state);
+  /* Записывает переходы состояния в labels и targets в порядке возрастания
+     меток и возвращает их число */
+  uint32_t (*transitions)(const void *automat, uint32_t state, Label labels[], uint32_t targets[]);
+} AutomatWalkOps;
+
+void walk_automat_outputs(const void *automat, const AutomatWalkOps *ops,
+                          uint32_t state, char is_prediction, size_t prefix_size,
+                          const AutomatOutputLimits *limits,
+                          AutomatOutputProcessor on_complete,
+                          void *data);
+
+#endif /* __MORPHOLOGY_AUTOMATWALK_H__ */
@@ -0,0 +1,459 @@
+/* Скомпилированный двоичный образ морфологической базы.
+ *
+ * Разбор morphs.mrd - это построчное чтение, преобразование каждой строки в
+ * широкую строку и сотни тысяч мелких выделений памяти под правила. Но для
+ * анализа слов (в отличие от построения автомата) из словаря нужны только
+ * модели словообразования, модели префиксов и грамматики, и они не меняются
+ * от запуска к запуску. Поэтому они один раз сохраняются в образ без
+ * указателей (только смещения), а при запуске образ отображается в память
+ * через mmap. Строки правил используются прямо из образа, а сами правила
+ * раскладываются по нескольким общим массивам.
+ *
+ * Структура образа:
+ *  +-----------------------------+
+ *  | Заголовок                   |
+ *  +-----------------------------+
+ *  | Грамматики                  |
+ *  +-----------------------------+
+ *  | Границы моделей             |
+ *  +-----------------------------+
+ *  | Флективные правила          |
+ *  +-----------------------------+
+ *  | Границы моделей префиксов   |
+ *  +-----------------------------+
+ *  | Префиксы (по моделям)       |
+ *  +-----------------------------+
+ *  | Префиксы (по алфавиту)      |
+ *  +-----------------------------+
+ *  | Пул строк                   |
+ *  +-----------------------------+
+ */
+
+#include "morphology/baseimage.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common/strict_alloc.h"
+#include "common/fileimage.h"
+#include "common/datastruct.h"
+#include "common/hashtable.h"
+
+/* Все блоки образа выравниваются на эту границу */
+#define IMAGE_ALIGNMENT 8
+
+static inline uint64_t align_offset(uint64_t offset) {
+  return (offset + IMAGE_ALIGNMENT - 1) & ~(uint64_t)(IMAGE_ALIGNMENT - 1);
+}
+
+/* Пул строк образа. Одинаковые строки (а окончания и коды повторяются в
+   моделях постоянно) хранятся в нём только один раз. */
+typedef struct {
+  ArrayList *chars;
+  HashTable *index;
+} StringPool;
+
+static void make_string_pool(StringPool *pool) {
+  pool->chars = make_array_list(sizeof(wchar_t), 65536);
+  pool->index = make_hash_table(16);
+}
+
+static void free_string_pool(StringPool *pool) {
+  free_array_list(pool->chars);
+  free_hash_table(pool->index);
+}
+
+static uint32_t pool_string(StringPool *pool, const wchar_t *string) {
+  size_t length;
+  void **stored;
+  uint32_t offset;
+  if (string == NULL) return MORPHOLOGY_IMAGE_NONE;
+  length = wcslen(string);
+  stored = hash_table_get_always(pool->index, string, length*sizeof(wchar_t));
+  if (*stored == NULL) {
+    offset = (uint32_t)array_list_size(pool->chars);
+    while (*string != L'\0') {
+      array_list_append(pool->chars, string++);
+    }
+    array_list_append(pool->chars, string);
+    *stored = (void *)((uintptr_t)offset + 1);
+  }
+  return (uint32_t)((uintptr_t)*stored - 1);
+}
+
+/* Контрольная сумма содержимого файла: по 8 байт за шаг, так что на
+   morphs.mrd в несколько мегабайт уходит около миллисекунды */
+static uint64_t data_checksum(const uint8_t *data, size_t size) {
+  uint64_t hash = UINT64_C(0xcbf29ce484222325) ^ size, word;
+  size_t i;
+  for (i = 0; i + sizeof(word) <= size; i += sizeof(word)) {
+    memcpy(&word, data + i, sizeof(word));
+    hash = (hash ^ word)*UINT64_C(0x9E3779B97F4A7C15);
+    hash ^= hash >> 29;
+  }
+  for (; i < size; i++) {
+    hash = (hash ^ data[i])*UINT64_C(0x100000001b3);
+  }
+  return hash ^ (hash >> 32);
+}
+
+/* Размер и контрольная сумма содержимого файла file_name */
+static int file_signature(const char *file_name, uint64_t *size, uint64_t *checksum) {
+  struct stat file_stat;
+  void *data;
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) return -1;
+  if (fstat(fd, &file_stat) != 0) {
+    close(fd);
+    return -1;
+  }
+  *size = (uint64_t)file_stat.st_size;
+  if (file_stat.st_size == 0) {
+    close(fd);
+    *checksum = data_checksum(NULL, 0);
+    return 0;
+  }
+  data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return -1;
+  *checksum = data_checksum(data, (size_t)file_stat.st_size);
+  munmap(data, (size_t)file_stat.st_size);
+  return 0;
+}
+
+/* Помещается ли в образ блок из count элементов по item_size байт,
+   начинающийся со смещения offset */
+static int image_block_fits(const MorphologyImageHeader *header, uint64_t offset,
+                            uint64_t count, size_t item_size) {
+  return offset >= sizeof(*header) && offset <= header->size && offset % sizeof(uint32_t) == 0 &&
+      count <= (header->size - offset)/item_size;
+}
+
+/* Проверяет, что все блоки образа лежат в его пределах */
+static int check_image_layout(const MorphologyImageHeader *header, size_t image_size) {
+  return image_size >= sizeof(*header) &&
+      memcmp(header->signature, MORPHOLOGY_IMAGE_SIGNATURE, sizeof(MORPHOLOGY_IMAGE_SIGNATURE)) == 0 &&
+      header->version == MORPHOLOGY_IMAGE_FORMAT_VERSION &&
+      header->char_size == sizeof(wchar_t) &&
+      header->size == image_size &&
+      image_block_fits(header, header->grammars_offset, header->grammars_count, sizeof(ImageGrammar)) &&
+      image_block_fits(header, header->flex_models_offset, (uint64_t)header->flex_models_count + 1, sizeof(uint32_t)) &&
+      image_block_fits(header, header->variances_offset, header->variances_count, sizeof(ImageFlexVariance)) &&
+      image_block_fits(header, header->prefix_models_offset, (uint64_t)header->prefix_models_count + 1, sizeof(uint32_t)) &&
+      image_block_fits(header, header->prefixes_offset, header->prefixes_count, sizeof(uint32_t)) &&
+      image_block_fits(header, header->sorted_prefixes_offset, header->prefixes_count, sizeof(uint32_t)) &&
+      image_block_fits(header, header->strings_offset, header->strings_size, sizeof(wchar_t));
+}
+
+/* Строка образа: MORPHOLOGY_IMAGE_NONE или начало строки в пуле (пул
+   заканчивается '\0', так что любая строка в нём завершена) */
+static inline int image_string_valid(const MorphologyImageHeader *header, uint32_t offset) {
+  return offset == MORPHOLOGY_IMAGE_NONE || offset < header->strings_size;
+}
+
+/* Границы моделей bounds[0..count] не убывают и кончаются на items_count */
+static int image_bounds_valid(const uint32_t *bounds, uint32_t count, uint32_t items_count) {
+  uint32_t i;
+  if (bounds[0] != 0 || bounds[count] != items_count) return 0;
+  for (i = 0; i < count; i++) {
+    if (bounds[i] > bounds[i + 1]) return 0;
+  }
+  return 1;
+}
+
+/* Проверяет ссылки внутри образа: строки, номера грамматик и границы
+   моделей. Образ, испорченный на месте, не должен приводить к чтению за
+   его пределами. */
+static int check_image_contents(const MorphologyImageHeader *header, const int8_t *data) {
+  const ImageGrammar *grammars = (const ImageGrammar *)(data + header->grammars_offset);
+  const ImageFlexVariance *variances = (const ImageFlexVariance *)(data + header->variances_offset);
+  const uint32_t *prefixes = (const uint32_t *)(data + header->prefixes_offset),
+      *sorted_prefixes = (const uint32_t *)(data + header->sorted_prefixes_offset);
+  const wchar_t *strings = (const wchar_t *)(data + header->strings_offset);
+  size_t i;
+  if (header->strings_size == 0 || strings[header->strings_size - 1] != L'\0') return 0;
+  for (i = 0; i < header->grammars_count; i++) {
+    if (grammars[i].ancode == MORPHOLOGY_IMAGE_NONE ||
+        !image_string_valid(header, grammars[i].ancode) ||
+        !image_string_valid(header, grammars[i].part_of_speech) ||
+        !image_string_valid(header, grammars[i].grammems)) {
+      return 0;
+    }
+  }
+  for (i = 0; i < header->variances_count; i++) {
+    if (!image_string_valid(header, variances[i].flexion) ||
+        !image_string_valid(header, variances[i].ancode) ||
+        !image_string_valid(header, variances[i].prefix) ||
+        (variances[i].grammar != MORPHOLOGY_IMAGE_NONE && variances[i].grammar >= header->grammars_count)) {
+      return 0;
+    }
+  }
+  for (i = 0; i < header->prefixes_count; i++) {
+    if (!image_string_valid(header, prefixes[i]) || !image_string_valid(header, sorted_prefixes[i])) return 0;
+  }
+  return image_bounds_valid((const uint32_t *)(data + header->flex_models_offset),
+                            header->flex_models_count, header->variances_count) &&
+      image_bounds_valid((const uint32_t *)(data + header->prefix_models_offset),
+                         header->prefix_models_count, header->prefixes_count);
+}
+
+/* Проверяет, что образ собран из текущих версий файлов словаря */
+static int check_image_sources(const MorphologyImageHeader *header,
+                               const char *mrd_file_name, const char *grammar_file_name) {
+  uint64_t mrd_size, grammar_size, mrd_checksum, grammar_checksum;
+  struct stat file_stat;
+  /* Размеры сверяются до того, как читать файлы целиком */
+  if (stat(mrd_file_name, &file_stat) != 0 || (uint64_t)file_stat.st_size != header->mrd_file_size ||
+      stat(grammar_file_name, &file_stat) != 0 || (uint64_t)file_stat.st_size != header->grammar_file_size) {
+    return 0;
+  }
+  if (file_signature(mrd_file_name, &mrd_size, &mrd_checksum) != 0 ||
+      file_signature(grammar_file_name, &grammar_size, &grammar_checksum) != 0) {
+    return 0;
+  }
+  return header->mrd_file_size == mrd_size && header->mrd_file_checksum == mrd_checksum &&
+      header->grammar_file_size == grammar_size && header->grammar_file_checksum == grammar_checksum;
+}
+
+
+/* Сохраняет модели словообразования, префиксов и грамматики базы base в
+ * двоичный образ image_file_name. mrd_file_name и grammar_file_name - файлы,
+ * из которых была загружена база: их размер и контрольная сумма запоминаются,
+ * чтобы не использовать образ, если словарь потом обновят.
+ * Возвращает 0 при успехе. */
+int save_morphology_image(MorphologyBase *base, const char *image_file_name,
+                          const char *mrd_file_name, const char *grammar_file_name) {
+  MorphologyImageHeader header;
+  StringPool pool;
+  HashTable *grammar_indexes = make_hash_table(12);
+  ImageGrammar *grammars;
+  ImageFlexVariance *variances, *image_variance;
+  uint32_t *flex_model_bounds, *prefix_model_bounds, *prefixes, *sorted_prefixes;
+  void *iter_state = NULL, *key, **stored_index;
+  size_t key_size, i, k, count;
+  Grammar *grammar;
+  FlexVariance *variance;
+  int8_t *image;
+  int result;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, MORPHOLOGY_IMAGE_SIGNATURE, sizeof(MORPHOLOGY_IMAGE_SIGNATURE));
+  header.version = MORPHOLOGY_IMAGE_FORMAT_VERSION;
+  header.char_size = sizeof(wchar_t);
+  if (file_signature(mrd_file_name, &header.mrd_file_size, &header.mrd_file_checksum) != 0 ||
+      file_signature(grammar_file_name, &header.grammar_file_size, &header.grammar_file_checksum) != 0) {
+    free_hash_table(grammar_indexes);
+    return -1;
+  }
+  make_string_pool(&pool);
+  /* Грамматики */
+  header.grammars_count = (uint32_t)hash_table_stored(base->grammars);
+  grammars = strict_malloc(sizeof(*grammars)*(header.grammars_count + 1));
+  count = 0;
+  while ((grammar = hash_table_chain_iter_items(base->grammars, &key, &key_size, &iter_state)) != NULL) {
+    grammars[count].ancode = pool_string(&pool, grammar->ancode);
+    grammars[count].part_of_speech = pool_string(&pool, grammar->part_of_speech);
+    grammars[count].grammems = pool_string(&pool, grammar->grammems);
+    hash_table_chain_put(grammar_indexes, &grammar, sizeof(grammar), (void *)(count + 1));
+    count++;
+  }
+  /* Модели словообразования */
+  header.flex_models_count = (uint32_t)base->flex_models->length;
+  flex_model_bounds = strict_malloc(sizeof(*flex_model_bounds)*(header.flex_models_count + 1));
+  for (i = 0, count = 0; i < base->flex_models->length; i++) {
+    flex_model_bounds[i] = (uint32_t)count;
+    count += flex_model_size(base->flex_models->model_list[i]);
+  }
+  flex_model_bounds[i] = (uint32_t)count;
+  header.variances_count = (uint32_t)count;
+  image_variance = variances = strict_malloc(sizeof(*variances)*(count + 1));
+  for (i = 0; i < base->flex_models->length; i++) {
+    FlexModel *model = base->flex_models->model_list[i];
+    for (k = 0; k < flex_model_size(model); k++, image_variance++) {
+      variance = flex_model_variance(model, k);
+      image_variance->form_no = variance->form_no;
+      image_variance->flexion = pool_string(&pool, variance->flexion);
+      image_variance->ancode = pool_string(&pool, variance->ancode);
+      image_variance->prefix = pool_string(&pool, variance->prefix);
+      stored_index = (variance->grammar != NULL) ?
+          hash_table_chain_get(grammar_indexes, &variance->grammar, sizeof(variance->grammar)) : NULL;
+      image_variance->grammar = (stored_index != NULL) ?
+          (uint32_t)((uintptr_t)stored_index - 1) : MORPHOLOGY_IMAGE_NONE;
+    }
+  }
+  /* Модели префиксов */
+  header.prefix_models_count = (uint32_t)base->prefix_models->length;
+  header.prefixes_count = (uint32_t)base->prefix_models->all_prefixes_count;
+  prefix_model_bounds = strict_malloc(sizeof(*prefix_model_bounds)*(header.prefix_models_count + 1));
+  prefixes = strict_malloc(sizeof(*prefixes)*(header.prefixes_count + 1));
+  sorted_prefixes = strict_malloc(sizeof(*sorted_prefixes)*(header.prefixes_count + 1));
+  for (i = 0, count = 0; i < base->prefix_models->length; i++) {
+    PrefixModel *model = base->prefix_models->prefix_list[i];
+    prefix_model_bounds[i] = (uint32_t)count;
+    for (k = 0; k < prefix_model_size(model); k++) {
+      prefixes[count++] = pool_string(&pool, prefix_model_item(model, k));
+    }
+  }
+  prefix_model_bounds[i] = (uint32_t)count;
+  for (i = 0; i < header.prefixes_count; i++) {
+    sorted_prefixes[i] = pool_string(&pool, base->prefix_models->all_prefixes[i]);
+  }
+  header.strings_size = (uint32_t)array_list_size(pool.chars);
+  /* Раскладка блоков */
+  header.grammars_offset = align_offset(sizeof(header));
+  header.flex_models_offset = align_offset(header.grammars_offset + sizeof(*grammars)*header.grammars_count);
+  header.variances_offset = align_offset(header.flex_models_offset + sizeof(*flex_model_bounds)*(header.flex_models_count + 1));
+  header.prefix_models_offset = align_offset(header.variances_offset + sizeof(*variances)*header.variances_count);
+  header.prefixes_offset = align_offset(header.prefix_models_offset + sizeof(*prefix_model_bounds)*(header.prefix_models_count + 1));
+  header.sorted_prefixes_offset = align_offset(header.prefixes_offset + sizeof(*prefixes)*header.prefixes_count);
+  header.strings_offset = align_offset(header.sorted_prefixes_offset + sizeof(*sorted_prefixes)*header.prefixes_count);
+  header.size = header.strings_offset + sizeof(wchar_t)*header.strings_size;
+  image = strict_calloc(1, header.size);
+  memcpy(image, &header, sizeof(header));
+  memcpy(image + header.grammars_offset, grammars, sizeof(*grammars)*header.grammars_count);
+  memcpy(image + header.flex_models_offset, flex_model_bounds, sizeof(*flex_model_bounds)*(header.flex_models_count + 1));
+  memcpy(image + header.variances_offset, variances, sizeof(*variances)*header.variances_count);
+  memcpy(image + header.prefix_models_offset, prefix_model_bounds, sizeof(*prefix_model_bounds)*(header.prefix_models_count + 1));
+  memcpy(image + header.prefixes_offset, prefixes, sizeof(*prefixes)*header.prefixes_count);
+  memcpy(image + header.sorted_prefixes_offset, sorted_prefixes, sizeof(*sorted_prefixes)*header.prefixes_count);
+  memcpy(image + header.strings_offset, array_list_data(pool.chars), sizeof(wchar_t)*header.strings_size);
+  result = save_file_image(image, header.size, image_file_name);
+  strict_free(image);
+  strict_free(grammars);
+  strict_free(flex_model_bounds);
+  strict_free(variances);
+  strict_free(prefix_model_bounds);
+  strict_free(prefixes);
+  strict_free(sorted_prefixes);
+  free_string_pool(&pool);
+  free_hash_table(grammar_indexes);
+  return result;
+}
+
+static inline wchar_t *image_string(wchar_t *strings, uint32_t offset) {
+  return offset == MORPHOLOGY_IMAGE_NONE ? NULL : strings + offset;
+}
+
+/* Загружает морфологическую базу (без лемм) из двоичного образа,
+ * созданного save_morphology_image. Образ отображается в память только для
+ * чтения и не копируется. Возвращает NULL, если образа нет, он повреждён или
+ * устарел относительно mrd_file_name и grammar_file_name. */
+MorphologyBase *map_morphology_image(const char *image_file_name,
+                                     const char *mrd_file_name, const char *grammar_file_name) {
+  const MorphologyImageHeader *header;
+  const ImageGrammar *image_grammar;
+  const ImageFlexVariance *image_variance;
+  const uint32_t *bounds, *prefix_offsets;
+  MorphologyImage *image;
+  MorphologyBase *base;
+  wchar_t *strings;
+  size_t i, data_size;
+  void *data = map_file_image(image_file_name, 0, &data_size);
+  if (data == NULL) return NULL;
+  header = data;
+  if (data_size < sizeof(*header) ||
+      !check_image_layout(header, data_size) || !check_image_contents(header, data)) {
+    fprintf(stderr, "Morphology image %s is damaged or of another format version, ignored\n", image_file_name);
+    unmap_file_image(data, data_size);
+    return NULL;
+  }
+  if (!check_image_sources(header, mrd_file_name, grammar_file_name)) {
+    fprintf(stderr, "Morphology image %s does not match %s and %s, ignored\n",
+            image_file_name, mrd_file_name, grammar_file_name);
+    unmap_file_image(data, data_size);
+    return NULL;
+  }
+  strings = (wchar_t *)((int8_t *)data + header->strings_offset);
+  image = strict_malloc(sizeof(*image));
+  image->data = data;
+  image->size = data_size;
+  base = strict_malloc(sizeof(*base));
+  base->automat = NULL;
+  base->lemmas = NULL;
+  base->image = image;
+  /* Грамматики */
+  image->grammars = strict_malloc(sizeof(Grammar)*(header->grammars_count + 1));
+  base->grammars = make_hash_table(10);
+  image_grammar = (const ImageGrammar *)((int8_t *)data + header->grammars_offset);
+  for (i = 0; i < header->grammars_count; i++, image_grammar++) {
+    Grammar *grammar = image->grammars + i;
+    grammar->ancode = image_string(strings, image_grammar->ancode);
+    grammar->part_of_speech = image_string(strings, image_grammar->part_of_speech);
+    grammar->grammems = image_string(strings, image_grammar->grammems);
+    parse_grammar_tags(grammar->part_of_speech, grammar->grammems, &grammar->pos, &grammar->grammeme_bits);
+    hash_table_chain_put(base->grammars, grammar->ancode, wcslen(grammar->ancode)*sizeof(wchar_t), grammar);
+  }
+  /* Флективные правила и модели словообразования */
+  image->variances = strict_malloc(sizeof(FlexVariance)*(header->variances_count + 1));
+  image_variance = (const ImageFlexVariance *)((int8_t *)data + header->variances_offset);
+  for (i = 0; i < header->variances_count; i++, image_variance++) {
+    FlexVariance *variance = image->variances + i;
+    variance->form_no = image_variance->form_no;
+    variance->flexion = image_string(strings, image_variance->flexion);
+    variance->ancode = image_string(strings, image_variance->ancode);
+    variance->prefix = image_string(strings, image_variance->prefix);
+    variance->grammar = (image_variance->grammar == MORPHOLOGY_IMAGE_NONE) ?
+        NULL : image->grammars + image_variance->grammar;
+  }
+  base->flex_models = strict_malloc(sizeof(FlexModelList));
+  base->flex_models->length = header->flex_models_count;
+  base->flex_models->model_list = strict_malloc(sizeof(FlexModel *)*(header->flex_models_count + 1));
+  image->flex_models = strict_malloc(sizeof(FlexModel)*(header->flex_models_count + 1));
+  bounds = (const uint32_t *)((int8_t *)data + header->flex_models_offset);
+  for (i = 0; i < header->flex_models_count; i++) {
+    FlexModel *model = image->flex_models + i;
+    model->data = (int8_t *)(image->variances + bounds[i]);
+    model->block_size = sizeof(FlexVariance);
+    model->size = model->capacity = model->initial_capacity = bounds[i + 1] - bounds[i];
+    base->flex_models->model_list[i] = model;
+  }
+  /* Модели префиксов */
+  image->prefixes = strict_malloc(sizeof(wchar_t *)*(header->prefixes_count + 1));
+  prefix_offsets = (const uint32_t *)((int8_t *)data + header->prefixes_offset);
+  for (i = 0; i < header->prefixes_count; i++) {
+    image->prefixes[i] = image_string(strings, prefix_offsets[i]);
+  }
+  base->prefix_models = strict_malloc(sizeof(PrefixModelList));
+  base->prefix_models->length = header->prefix_models_count;
+  base->prefix_models->prefix_list = strict_malloc(sizeof(PrefixModel *)*(header->prefix_models_count + 1));
+  image->prefix_models = strict_malloc(sizeof(PrefixModel)*(header->prefix_models_count + 1));
+  bounds = (const uint32_t *)((int8_t *)data + header->prefix_models_offset);
+  for (i = 0; i < header->prefix_models_count; i++) {
+    PrefixModel *model = image->prefix_models + i;
+    model->data = (int8_t *)(image->prefixes + bounds[i]);
+    model->block_size = sizeof(wchar_t *);
+    model->size = model->capacity = model->initial_capacity = bounds[i + 1] - bounds[i];
+    base->prefix_models->prefix_list[i] = model;
+  }
+  base->prefix_models->all_prefixes_count = header->prefixes_count;
+  base->prefix_models->all_prefixes = strict_malloc(sizeof(wchar_t *)*(header->prefixes_count + 1));
+  prefix_offsets = (const uint32_t *)((int8_t *)data + header->sorted_prefixes_offset);
+  for (i = 0; i < header->prefixes_count; i++) {
+    base->prefix_models->all_prefixes[i] = image_string(strings, prefix_offsets[i]);
+  }
+  prepare_lemma_rules(base);
+  return base;
+}
+
+/* Освобождает базу, загруженную map_morphology_image */
+void free_mapped_morphology_base(MorphologyBase *base) {
+  MorphologyImage *image = base->image;
+  free_hash_table(base->grammars);
+  strict_free(base->lemma_rules);
+  strict_free(base->flex_models->model_list);
+  strict_free(base->flex_models);
+  strict_free(base->prefix_models->prefix_list);
+  strict_free(base->prefix_models->all_prefixes);
+  strict_free(base->prefix_models);
+  strict_free(image->grammars);
+  strict_free(image->variances);
+  strict_free(image->flex_models);
+  strict_free(image->prefixes);
+  strict_free(image->prefix_models);
+  unmap_file_image(image->data, image->size);
+  strict_free(image);
+  strict_free(base);
+}
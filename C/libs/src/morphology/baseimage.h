@@ -0,0 +1,69 @@
+/* Скомпилированный двоичный образ морфологической базы (модели
+   словообразования, модели префиксов и грамматики) - чтобы не разбирать
+   текстовый morphs.mrd при каждом запуске.
+*/
+
+#ifndef __MORPHOLOGY_BASEIMAGE_H__
+#define __MORPHOLOGY_BASEIMAGE_H__
+
+#include <stdint.h>
+
+#include "wordforms.h"
+
+#define MORPHOLOGY_IMAGE_SIGNATURE "MORPHBI"
+#define MORPHOLOGY_IMAGE_FORMAT_VERSION 2
+/* Отсутствующая строка или грамматика */
+#define MORPHOLOGY_IMAGE_NONE UINT32_MAX
+
+/* Заголовок образа. Все смещения отсчитываются от начала образа, строки
+   хранятся в общем пуле и адресуются номером первого символа в нём. */
+typedef struct {
+  char signature[8];
+  uint32_t version;
+  uint8_t char_size;
+  uint8_t reserved[3];
+  /* Размер и контрольная сумма содержимого morphs.mrd и gramtab.tab, по
+     которым собран образ. Если исходники поменялись, образ считается
+     устаревшим. Время изменения для этого не годится: при копировании
+     словарей (make install) оно меняется, а содержимое - нет. */
+  uint64_t mrd_file_size;
+  uint64_t mrd_file_checksum;
+  uint64_t grammar_file_size;
+  uint64_t grammar_file_checksum;
+  uint32_t grammars_count;
+  uint32_t flex_models_count;
+  uint32_t variances_count;
+  uint32_t prefix_models_count;
+  uint32_t prefixes_count;
+  uint32_t strings_size;
+  uint64_t grammars_offset; /* ImageGrammar[grammars_count] */
+  uint64_t flex_models_offset; /* uint32_t[flex_models_count + 1] - первое правило модели */
+  uint64_t variances_offset; /* ImageFlexVariance[variances_count] */
+  uint64_t prefix_models_offset; /* uint32_t[prefix_models_count + 1] - первый префикс модели */
+  uint64_t prefixes_offset; /* uint32_t[prefixes_count] - префиксы по моделям */
+  uint64_t sorted_prefixes_offset; /* uint32_t[prefixes_count] - все префиксы по алфавиту */
+  uint64_t strings_offset; /* wchar_t[strings_size] */
+  uint64_t size;
+} MorphologyImageHeader;
+
+typedef struct {
+  uint32_t ancode;
+  uint32_t part_of_speech;
+  uint32_t grammems;
+} ImageGrammar;
+
+typedef struct {
+  uint32_t form_no;
+  uint32_t flexion;
+  uint32_t ancode;
+  uint32_t prefix;
+  uint32_t grammar;
+} ImageFlexVariance;
+
+int save_morphology_image(MorphologyBase *base, const char *image_file_name,
+                          const char *mrd_file_name, const char *grammar_file_name);
+MorphologyBase *map_morphology_image(const char *image_file_name,
+                                     const char *mrd_file_name, const char *grammar_file_name);
+void free_mapped_morphology_base(MorphologyBase *base);
+
+#endif /* __MORPHOLOGY_BASEIMAGE_H__ */
@@ -0,0 +1,378 @@
+/* Компилятор словарей. Построение автомата по morphs.mrd занимает минуты
+ * (генерация всех словоформ, сортировка, алгоритм Дацюк), поэтому оно не
+ * выполняется при загрузке морфологии, а делается заранее: утилитой
+ * morph-compile или функцией morph_compile. Словари разных языков
+ * независимы и собираются параллельно.
+ *
+ * Если задан образец текстов (compilation->profile_corpus), слова образца
+ * проводятся по плоскому автомату, и его состояния раскладываются в
+ * automat.flat по частоте посещений (см. reorder_mini_automat).
+ *
+ * Словоформы сортируются внешней сортировкой (см. wordsorter.h): в памяти
+ * их лежит не больше, чем на compilation->memory_budget байт, остальные
+ * сбрасываются во временные файлы в каталоге словаря.
+ *
+ * Все файлы пишутся во временный файл и потом переименовываются, так что
+ * прерванная сборка не оставляет в словаре полузаписанных файлов. */
+
+#include "morphology/compiler.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <wctype.h>
+
+#include "morphology/dictinfo.h"
+#include "morphology/miniautomat.h"
+#include "morphology/succinctautomat.h"
+#include "morphology/wordhash.h"
+#include "morphology/baseimage.h"
+#include "morphology/wordsorter.h"
+#include "common/strict_alloc.h"
+#include "common/fileimage.h"
+#include "common/strtools.h"
+#include "common/timer.h"
+#include "common/parallel.h"
+
+static const char *phase_names[COMPILE_PHASES_COUNT] = {
+  "load", "generate", "sort", "automat", "save", "flat", "succinct", "profile", "hash", "filter", "image"
+};
+
+const char *compile_phase_name(CompilePhase phase) {
+  return (phase < COMPILE_PHASES_COUNT) ? phase_names[phase] : "unknown";
+}
+
+/* Сохраняет автомат вместе с таблицей аннотаций annotations через
+   временный файл (см. save_file_image) */
+static int save_automat_atomic(Automat *automat, const AnnotationTable *annotations, const char *automat_file_name) {
+  char *temp_file_name = make_temp_file_name(automat_file_name);
+  int result = 0;
+  if (save_automat(automat, temp_file_name) < 0 ||
+      append_annotation_table(temp_file_name, annotations) != 0 ||
+      rename(temp_file_name, automat_file_name) != 0) {
+    unlink(temp_file_name);
+    result = -1;
+  }
+  strict_free(temp_file_name);
+  return result;
+}
+
+/* Слово образца может состоять из тех же знаков, что и слово словаря (см.
+   is_garbage_word) */
+static int is_corpus_word_char(wchar_t c) {
+  return iswalpha((wint_t)c) || c == L'-' || c == L'\'' || c == L'`';
+}
+
+/* Собирает профиль автомата automat по образцу текстов corpus_file_name
+   (UTF-8): каждое слово образца проходит автомат так же, как при разборе, и
+   в visits отмечаются посещённые состояния. Повторяющиеся слова считаются
+   столько раз, сколько встретились, так что образец должен повторять
+   распределение слов настоящих текстов. Возвращает 0 при успехе. */
+static int profile_mini_automat(const MiniAutomat *automat, const char *corpus_file_name, uint32_t visits[]) {
+  AutomatOutputLimits limits = { AUTOMAT_MAX_OUTPUTS, AUTOMAT_MAX_VISITED_STATES };
+  FILE *corpus = fopen(corpus_file_name, "r");
+  char *line = NULL;
+  size_t line_capacity = 0, wide_length;
+  wchar_t *wide_line = NULL, *word, *cursor;
+  locale_t old_locale;
+  if (corpus == NULL) return -1;
+  old_locale = use_morphology_locale();
+  while (getline(&line, &line_capacity, corpus) != -1) {
+    wide_line = to_wide_string(line, wide_line, &wide_length);
+    wcslower(wide_line);
+    for (cursor = wide_line; *cursor != L'\0'; ) {
+      while (*cursor != L'\0' && !is_corpus_word_char(*cursor)) cursor++;
+      word = cursor;
+      while (*cursor != L'\0' && is_corpus_word_char(*cursor)) cursor++;
+      if (cursor > word) {
+        wcssubreverse(word, cursor);
+        mini_profile_word(automat, word, (size_t)(cursor - word), MIN_MATCH_FOR_PREDICTION, &limits, visits);
+      }
+    }
+  }
+  uselocale(old_locale);
+  strict_free(line);
+  strict_free(wide_line);
+  return fclose(corpus) != 0 ? -1 : 0;
+}
+
+/* Перекладывает automat.flat по профилю, собранному на образце текстов
+   corpus_file_name. Возвращает 0 при успехе. */
+static int reorder_mini_automat_file(const char *mini_automat_file_name, const char *corpus_file_name) {
+  MiniAutomat *automat = map_mini_automat(mini_automat_file_name), *reordered = NULL;
+  uint32_t *visits;
+  int result = -1;
+  if (automat == NULL) return -1;
+  visits = strict_calloc(automat->states_count, sizeof(*visits));
+  if (profile_mini_automat(automat, corpus_file_name, visits) == 0) {
+    reordered = reorder_mini_automat(automat, visits);
+  }
+  if (reordered != NULL) {
+    result = save_mini_automat(reordered, mini_automat_file_name);
+    free_mini_automat(reordered);
+  }
+  strict_free(visits);
+  free_mini_automat(automat);
+  return result;
+}
+
+/* Собирает словарь из каталога dictionary_dir: automat.save, automat.flat,
+ * morphs.base и, если в compilation->flags есть COMPILE_SUCCINCT,
+ * automat.louds, а если есть COMPILE_WORD_HASH - wordforms.hash (с
+ * COMPILE_WORD_FILTER - ещё и wordforms.bloom, сама таблица при этом
+ * тоже собирается). Иначе старые automat.louds, wordforms.hash и
+ * wordforms.bloom удаляются - они собраны по прежнему автомату. Время каждого этапа и место ошибки записываются в
+ * compilation. Возвращает COMPILE_OK, COMPILE_FAILED или COMPILE_SKIPPED. */
+int compile_dictionary(const char *dictionary_dir, DictionaryCompilation *compilation) {
+  char *mrd_file_name = join_path(2, dictionary_dir, DICTIONARY_MRD_FILE),
+      *grammar_file_name = join_path(2, dictionary_dir, DICTIONARY_GRAMMAR_FILE),
+      *automat_file_name = join_path(2, dictionary_dir, DICTIONARY_AUTOMAT_FILE),
+      *mini_automat_file_name = join_path(2, dictionary_dir, DICTIONARY_MINI_AUTOMAT_FILE),
+      *succinct_automat_file_name = join_path(2, dictionary_dir, DICTIONARY_SUCCINCT_AUTOMAT_FILE),
+      *base_image_file_name = join_path(2, dictionary_dir, DICTIONARY_BASE_IMAGE_FILE),
+      *word_hash_file_name = join_path(2, dictionary_dir, DICTIONARY_WORD_HASH_FILE),
+      *word_filter_file_name = join_path(2, dictionary_dir, DICTIONARY_WORD_FILTER_FILE);
+  MorphologyBase *base = NULL;
+  WordSorter *sorter = NULL;
+  Automat *automat = NULL;
+  AnnotationTable annotations = {NULL, 0};
+  CompilePhase phase = COMPILE_PHASE_LOAD;
+  void *timer;
+  memset(compilation->phase_times, 0, sizeof(compilation->phase_times));
+  compilation->status = COMPILE_OK;
+  compilation->error_number = 0;
+  compilation->error_message = NULL;
+  compilation->runs_count = 0;
+  if (access(mrd_file_name, F_OK) != 0) {
+    compilation->status = COMPILE_SKIPPED;
+  } else {
+    errno = 0;
+    timer = start_timer();
+    base = init_morphology_base(mrd_file_name, grammar_file_name, 0);
+    compilation->phase_times[phase] = stop_timer(timer);
+    if (base == NULL) {
+      compilation->status = COMPILE_FAILED;
+    } else if (base->flex_models->length == 0) {
+      compilation->status = COMPILE_FAILED;
+      compilation->error_message = "no flexion models in " DICTIONARY_MRD_FILE;
+    }
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_GENERATE;
+    errno = 0;
+    timer = start_timer();
+    sorter = make_word_sorter(compilation->memory_budget > 0 ? compilation->memory_budget : WORD_SORTER_DEFAULT_BUDGET,
+                              dictionary_dir);
+    if (generate_word_forms(base, 0, &annotations, word_sorter_add, sorter) != 0) {
+      compilation->status = COMPILE_FAILED;
+    } else if (word_sorter_size(sorter) == 0) {
+      /* Из пустого автомата нечего сохранять, а разбор по нему невозможен */
+      compilation->status = COMPILE_FAILED;
+      compilation->error_message = "no word forms in " DICTIONARY_MRD_FILE;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_SORT;
+    errno = 0;
+    timer = start_timer();
+    if (word_sorter_finish(sorter) != 0) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_AUTOMAT;
+    errno = 0;
+    timer = start_timer();
+    automat = make_morphology_automat_sorted(sorter);
+    if (automat == NULL) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->runs_count = word_sorter_runs(sorter);
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (sorter != NULL) {
+    free_word_sorter(sorter);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_SAVE;
+    errno = 0;
+    timer = start_timer();
+    if (save_automat_atomic(automat, &annotations, automat_file_name) != 0) {
+      compilation->status = COMPILE_FAILED;
+    }
+    free_automat(automat);
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  free_annotation_table(&annotations);
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_FLAT;
+    errno = 0;
+    timer = start_timer();
+    if (convert_mini_automat(automat_file_name, mini_automat_file_name) != 0) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  /* Сжатый автомат собирается до раскладки: в нём рёбрами дерева
+   * хранятся только переходы в состояния со следующими номерами обхода в
+   * ширину, а раскладка по образцу эту нумерацию ломает */
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_SUCCINCT;
+    errno = 0;
+    timer = start_timer();
+    if (compilation->flags & COMPILE_SUCCINCT) {
+      if (convert_succinct_automat(mini_automat_file_name, succinct_automat_file_name) != 0) {
+        compilation->status = COMPILE_FAILED;
+      }
+    } else if (unlink(succinct_automat_file_name) != 0 && errno != ENOENT) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK && compilation->profile_corpus != NULL) {
+    phase = COMPILE_PHASE_PROFILE;
+    errno = 0;
+    timer = start_timer();
+    if (reorder_mini_automat_file(mini_automat_file_name, compilation->profile_corpus) != 0) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_HASH;
+    errno = 0;
+    timer = start_timer();
+    if (compilation->flags & (COMPILE_WORD_HASH | COMPILE_WORD_FILTER)) {
+      if (convert_word_form_hash(mini_automat_file_name, word_hash_file_name) != 0) {
+        compilation->status = COMPILE_FAILED;
+      }
+    } else if (unlink(word_hash_file_name) != 0 && errno != ENOENT) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_FILTER;
+    errno = 0;
+    timer = start_timer();
+    if (compilation->flags & COMPILE_WORD_FILTER) {
+      if (convert_word_form_filter(word_hash_file_name, word_filter_file_name) != 0) {
+        compilation->status = COMPILE_FAILED;
+      }
+    } else if (unlink(word_filter_file_name) != 0 && errno != ENOENT) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_OK) {
+    phase = COMPILE_PHASE_IMAGE;
+    errno = 0;
+    timer = start_timer();
+    if (save_morphology_image(base, base_image_file_name, mrd_file_name, grammar_file_name) != 0) {
+      compilation->status = COMPILE_FAILED;
+    }
+    compilation->phase_times[phase] = stop_timer(timer);
+  }
+  if (compilation->status == COMPILE_FAILED) {
+    compilation->failed_phase = phase;
+    compilation->error_number = compilation->error_message == NULL ? errno : 0;
+  }
+  if (base != NULL) {
+    free_morphology_base(base);
+  }
+  strict_free(mrd_file_name);
+  strict_free(grammar_file_name);
+  strict_free(automat_file_name);
+  strict_free(mini_automat_file_name);
+  strict_free(succinct_automat_file_name);
+  strict_free(base_image_file_name);
+  strict_free(word_hash_file_name);
+  strict_free(word_filter_file_name);
+  return compilation->status;
+}
+
+static void compile_job(size_t index, void *data) {
+  DictionaryCompilation *compilation = (DictionaryCompilation *)data + index;
+  fprintf(stderr, "Compiling dictionary %s...\n", compilation->path);
+  compile_dictionary(compilation->path, compilation);
+}
+
+static void report_compilation(DictionaryCompilation *compilation) {
+  long int total = 0;
+  int i;
+  switch (compilation->status) {
+    case COMPILE_SKIPPED:
+      fprintf(stderr, "%s: skipped, no %s\n", compilation->folder_name, DICTIONARY_MRD_FILE);
+      return;
+    case COMPILE_FAILED:
+      fprintf(stderr, "%s: FAILED at phase '%s'", compilation->folder_name,
+              compile_phase_name(compilation->failed_phase));
+      if (compilation->error_message != NULL) {
+        fprintf(stderr, ": %s", compilation->error_message);
+      } else if (compilation->error_number != 0) {
+        fprintf(stderr, ": %s", strerror(compilation->error_number));
+      }
+      fprintf(stderr, "\n");
+      return;
+    default:
+      fprintf(stderr, "%s: OK (", compilation->folder_name);
+      for (i = 0; i < COMPILE_PHASES_COUNT; i++) {
+        fprintf(stderr, "%s %ld ms, ", phase_names[i], compilation->phase_times[i]);
+        total += compilation->phase_times[i];
+      }
+      fprintf(stderr, "total %ld ms", total);
+      if (compilation->runs_count > 0) {
+        fprintf(stderr, ", %lu sorted runs", (unsigned long)compilation->runs_count);
+      }
+      fprintf(stderr, ")\n");
+  }
+}
+
+/* Собирает все словари в каталоге all_dicts_root не более чем в
+ * threads_count потоков (0 - по числу процессоров) с флагами flags. На
+ * словоформы каждого словаря отводится memory_budget байт (0 - по
+ * умолчанию). Автоматы раскладываются по образцу текстов profile_corpus,
+ * если он не NULL. Итоги по каждому словарю
+ * печатаются в stderr в порядке словарей. Возвращает число словарей, которые
+ * собрать не удалось, или -1, если в каталоге нет ни одного словаря. */
+int compile_dictionaries(const char *all_dicts_root, size_t threads_count, int flags, size_t memory_budget,
+                         const char *profile_corpus) {
+  struct dirent **folder_names;
+  DictionaryCompilation *compilations;
+  size_t i, count;
+  int folders_count, failed = 0, compiled = 0;
+  folders_count = scan_dictionary_folders(all_dicts_root, &folder_names);
+  if (folders_count <= 0) {
+    fprintf(stderr, "No dictionaries found in %s\n", all_dicts_root);
+    if (folders_count == 0) strict_free(folder_names);
+    return -1;
+  }
+  count = (size_t)folders_count;
+  compilations = strict_calloc(count, sizeof(*compilations));
+  for (i = 0; i < count; i++) {
+    compilations[i].folder_name = strict_strndup(folder_names[i]->d_name, strlen(folder_names[i]->d_name));
+    compilations[i].path = join_path(2, all_dicts_root, folder_names[i]->d_name);
+    compilations[i].flags = flags;
+    compilations[i].memory_budget = memory_budget;
+    compilations[i].profile_corpus = profile_corpus;
+    strict_free(folder_names[i]);
+  }
+  strict_free(folder_names);
+  run_parallel(count, threads_count, compile_job, compilations);
+  for (i = 0; i < count; i++) {
+    report_compilation(compilations + i);
+    if (compilations[i].status == COMPILE_FAILED) failed++;
+    if (compilations[i].status == COMPILE_OK) compiled++;
+    strict_free(compilations[i].folder_name);
+    strict_free(compilations[i].path);
+  }
+  strict_free(compilations);
+  if (failed == 0 && compiled == 0) {
+    fprintf(stderr, "No dictionaries to compile in %s\n", all_dicts_root);
+    return -1;
+  }
+  return failed;
+}
@@ -0,0 +1,55 @@
+/* Заблаговременная сборка словарей: автомат разбора и все двоичные образы,
+   которые потом только отображаются в память при загрузке.
+*/
+
+#ifndef __MORPHOLOGY_COMPILER_H__
+#define __MORPHOLOGY_COMPILER_H__
+
+#include <stdlib.h>
+
+/* Этапы сборки словаря */
+typedef enum {
+  COMPILE_PHASE_LOAD,     /* Разбор morphs.mrd и gramtab.tab */
+  COMPILE_PHASE_GENERATE, /* Генерация всех словоформ со сбросом отсортированных порций */
+  COMPILE_PHASE_SORT,     /* Сортировка последней порции словоформ */
+  COMPILE_PHASE_AUTOMAT,  /* Построение минимального автомата */
+  COMPILE_PHASE_SAVE,     /* Запись automat.save */
+  COMPILE_PHASE_FLAT,     /* Запись automat.flat */
+  COMPILE_PHASE_SUCCINCT, /* Запись automat.louds (только с COMPILE_SUCCINCT) */
+  COMPILE_PHASE_PROFILE,  /* Раскладка automat.flat по образцу текстов (только с profile_corpus) */
+  COMPILE_PHASE_HASH,     /* Запись wordforms.hash (только с COMPILE_WORD_HASH) */
+  COMPILE_PHASE_FILTER,   /* Запись wordforms.bloom (только с COMPILE_WORD_FILTER) */
+  COMPILE_PHASE_IMAGE,    /* Запись morphs.base */
+  COMPILE_PHASES_COUNT
+} CompilePhase;
+
+#define COMPILE_OK 0
+#define COMPILE_FAILED -1
+#define COMPILE_SKIPPED 1 /* В каталоге нет morphs.mrd - собирать нечего */
+
+/* Флаги сборки */
+#define COMPILE_SUCCINCT 0x01 /* Собирать ещё и сжатый автомат automat.louds */
+#define COMPILE_WORD_HASH 0x02 /* Собирать хэш-таблицу словоформ wordforms.hash */
+#define COMPILE_WORD_FILTER 0x04 /* Собирать ещё и фильтр Блума словоформ wordforms.bloom (с хэш-таблицей) */
+
+/* Результат сборки одного словаря */
+typedef struct {
+  char *folder_name;
+  char *path;
+  int flags; /* Флаги сборки COMPILE_... */
+  size_t memory_budget; /* Байт на словоформы в памяти, 0 - по умолчанию */
+  const char *profile_corpus; /* Образец текстов для раскладки автомата, NULL - нет */
+  int status;
+  CompilePhase failed_phase;
+  int error_number; /* errno на момент ошибки, если он известен */
+  const char *error_message; /* Что не так со словарём, если ошибка не системная */
+  size_t runs_count; /* Порций словоформ, сброшенных во временные файлы */
+  long int phase_times[COMPILE_PHASES_COUNT]; /* мс */
+} DictionaryCompilation;
+
+const char *compile_phase_name(CompilePhase phase);
+int compile_dictionary(const char *dictionary_dir, DictionaryCompilation *compilation);
+int compile_dictionaries(const char *all_dicts_root, size_t threads_count, int flags, size_t memory_budget,
+                         const char *profile_corpus);
+
+#endif /* __MORPHOLOGY_COMPILER_H__ */
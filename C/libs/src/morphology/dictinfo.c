@@ -17,6 +17,7 @@
 #include "common/strict_alloc.h"
 #include "common/errors.h"
 #include "common/strtools.h"
+#include "common/parallel.h"
 
 /* Полагая, что folder_name - имя каталога словаря, извлекает из имени название
  * самого словаря. Например, "01ru" преобразуется в "ru". В случае ошибки (не
@@ -71,6 +72,13 @@ static int filter_dictionary_folder(const struct dirent *folder) {
   return 1;
 }
 
+/* Находит в каталоге all_dicts_root подкаталоги словарей и записывает их,
+ * упорядоченные по имени, в folder_names (освобождаются вызывающим через
+ * free). Возвращает число найденных каталогов или -1 при ошибке. */
+int scan_dictionary_folders(const char *all_dicts_root, struct dirent ***folder_names) {
+  return scandir(all_dicts_root, folder_names, filter_dictionary_folder, alphasort);
+}
+
 /* Освобождает ресурсы, занятые make_dictionary */
 void free_dictionary(Dictionary *dictionary) {
   strict_free(dictionary->name);
@@ -81,16 +89,23 @@ void free_dictionary(Dictionary *dictionary) {
   if (dictionary->morphology != NULL) {
     unload_morphology_bases(dictionary->morphology);
   }
+  pthread_mutex_destroy(&dictionary->load_mutex);
   strict_free(dictionary);
 }
 
 /* Загружает словарь одного языка, находящегося в папке folder_name,
  * расположенной внутри базового каталога словарей all_dicts_root.
  * description_cache_size - размер кэша, используемого функцией для кэширования
- * лемм слов (подробнее см. функцию init_morphology_bases). */
-Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root, size_t description_cache_size) {
+ * лемм слов (подробнее см. функцию init_morphology_bases).
+ * Если lazy_load не 0, проверяется только наличие файлов словаря, а сама
+ * морфология загрузится при первом обращении к ней (dictionary_morphology). */
+Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root, size_t description_cache_size,
+                            char lazy_load) {
   Dictionary *result = strict_calloc(1, sizeof(*result));
   int files_is_ready = 0;
+  pthread_mutex_init(&result->load_mutex, NULL);
+  result->description_cache_size = description_cache_size;
+  result->load_state = DICTIONARY_NOT_LOADED;
   result->name = extract_dictionary_name(folder_name);
   result->mrd_file_path = join_path(3, all_dicts_root, folder_name, DICTIONARY_MRD_FILE);
   result->path = join_path(2, all_dicts_root, folder_name);
@@ -102,18 +117,12 @@ Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root,
         /* Можно загружать морфологию */
         files_is_ready = 1;
       } else {
-        if (access(result->path, W_OK) == 0) {
-          /* Создаём новый автомат */
-          fprintf(stderr,
-                  "Generating new automat file: %s\n", result->automat_file_path);
-          build_automat(result->mrd_file_path, result->grammar_file_path, result->automat_file_path);
-          files_is_ready = 1;
-        } else {
-          fprintf(stderr,
-                  "Automat file %s does not exists. And I"
-                  " have no write permissions on %s to create one.\n",
-                  result->automat_file_path, result->path);
-        }
+        /* Построение автомата занимает минуты, поэтому при загрузке его не
+         * делаем: словари заранее собираются утилитой morph-compile */
+        fprintf(stderr,
+                "Automat file %s does not exists. Compile dictionaries"
+                " first: morph-compile %s\n",
+                result->automat_file_path, all_dicts_root);
       }
     } else {
       fprintf(stderr, "Can't read grammar file %s.\n", result->grammar_file_path);
@@ -122,9 +131,7 @@ Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root,
     fprintf(stderr, "Can't read morphology file %s.\n", result->mrd_file_path);
   }
   if (files_is_ready) {
-    result->morphology = init_morphology_bases(result->path, description_cache_size);
-    if (result->morphology == NULL) {
-      fprintf(stderr, "Can't load dictionary %s. Possible one or more files are corrupted.\n", result->path);
+    if (!lazy_load && dictionary_morphology(result) == NULL) {
       free_dictionary(result);
       result = NULL;
     }
@@ -135,30 +142,66 @@ Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root,
   return result;
 }
 
+/* Параметры загрузки словарей, общие для всех потоков load_dictionaries */
+typedef struct {
+  struct dirent **folder_names;
+  const char *all_dicts_root;
+  size_t description_cache_size;
+  char lazy_load;
+  Dictionary **dictionaries;
+} DictionariesLoading;
+
+static void load_dictionary_job(size_t index, void *data) {
+  DictionariesLoading *loading = data;
+  loading->dictionaries[index] = make_dictionary(loading->folder_names[index]->d_name,
+                                                 loading->all_dicts_root,
+                                                 loading->description_cache_size,
+                                                 loading->lazy_load);
+}
+
 /* Загружает все словари, расположенные в общем каталоге all_dicts_root, и
  * возвращает массив загруженных словарей. В переменную, на которую ссылается
  * length, записывается размер этого массива. description_cache_size - размер
  * кэша *каждого словаря*, используемого функцией для кэширования лемм слов
- * (подробнее см. функцию init_morphology_bases). */
-Dictionary **load_dictionaries(const char *all_dicts_root, size_t *length, size_t description_cache_size) {
+ * (подробнее см. функцию init_morphology_bases).
+ * Словари независимы и загружаются параллельно (не более чем в
+ * DICTIONARY_LOAD_THREADS потоков), но порядок в массиве всегда совпадает с
+ * порядком имён каталогов.
+ * Если lazy_load не 0, сразу загружается только первый (основной) словарь, а
+ * остальные - при первом обращении к ним. */
+Dictionary **load_dictionaries(const char *all_dicts_root, size_t *length, size_t description_cache_size,
+                               char lazy_load) {
   struct dirent **dict_folder_names;
+  DictionariesLoading loading;
   size_t valid_dicts;
   int folders_count, i;
-  Dictionary *dictionary, **result;
-  folders_count = scandir(all_dicts_root, &dict_folder_names, filter_dictionary_folder, alphasort);
+  Dictionary **result;
+  folders_count = scan_dictionary_folders(all_dicts_root, &dict_folder_names);
   
   errno_assert(folders_count >= 0);
   
   result = strict_malloc(sizeof(*result)*(size_t)folders_count);
+  loading.folder_names = dict_folder_names;
+  loading.all_dicts_root = all_dicts_root;
+  loading.description_cache_size = description_cache_size;
+  loading.lazy_load = lazy_load;
+  loading.dictionaries = result;
+  run_parallel((size_t)folders_count, DICTIONARY_LOAD_THREADS, load_dictionary_job, &loading);
   valid_dicts = 0;
   for (i = 0; i < folders_count; i++) {
-    dictionary = make_dictionary(dict_folder_names[i]->d_name, all_dicts_root, description_cache_size);
     strict_free(dict_folder_names[i]);
-    if (dictionary != NULL) {
-      result[valid_dicts++] = dictionary;
+    if (result[i] != NULL) {
+      result[valid_dicts++] = result[i];
     }
   }
   strict_free(dict_folder_names);
+  if (lazy_load) {
+    /* Основной язык нужен почти всегда, и без него словари бесполезны */
+    while (valid_dicts > 0 && dictionary_morphology(result[0]) == NULL) {
+      free_dictionary(result[0]);
+      memmove(result, result + 1, sizeof(*result)*(--valid_dicts));
+    }
+  }
   result = strict_realloc(result, sizeof(*result)*valid_dicts);
   *length = valid_dicts;
   return result;
@@ -173,10 +216,34 @@ void free_dictionaries(Dictionary **dictionaries, size_t count) {
   strict_free(dictionaries);
 }
 
+static void load_dictionary_morphology(Dictionary *dictionary) {
+  pthread_mutex_lock(&dictionary->load_mutex);
+  if (dictionary->load_state == DICTIONARY_NOT_LOADED) {
+    dictionary->morphology = init_morphology_bases(dictionary->path, dictionary->description_cache_size);
+    if (dictionary->morphology == NULL) {
+      fprintf(stderr, "Can't load dictionary %s. Possible one or more files are corrupted.\n", dictionary->path);
+    }
+    __atomic_store_n(&dictionary->load_state,
+                     dictionary->morphology != NULL ? DICTIONARY_LOADED : DICTIONARY_LOAD_FAILED,
+                     __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&dictionary->load_mutex);
+}
+
+/* Возвращает морфологию словаря, при отложенной загрузке загружая её при
+ * первом обращении. Возвращает NULL, если загрузить её не удалось. */
 Morphology *dictionary_morphology(Dictionary *dictionary) {
+  if (__atomic_load_n(&dictionary->load_state, __ATOMIC_ACQUIRE) == DICTIONARY_NOT_LOADED) {
+    load_dictionary_morphology(dictionary);
+  }
   return dictionary->morphology;
 }
 
+/* Состояние загрузки морфологии словаря (DICTIONARY_...), без загрузки */
+int8_t dictionary_load_state(Dictionary *dictionary) {
+  return __atomic_load_n(&dictionary->load_state, __ATOMIC_ACQUIRE);
+}
+
 char *dictionary_name(Dictionary *dictionary) {
   return dictionary->name;
 }
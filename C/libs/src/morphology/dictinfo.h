@@ -1,8 +1,21 @@
 #ifndef __MORPHOLOGY_DICTINFO_H
 #define __MORPHOLOGY_DICTINFO_H
 
+#include <dirent.h>
+#include <pthread.h>
+
 #include "helpers.h"
 
+/* Максимальное число потоков загрузки словарей, 0 - по числу процессоров */
+#ifndef DICTIONARY_LOAD_THREADS
+#define DICTIONARY_LOAD_THREADS 0
+#endif
+
+/* Состояние загрузки морфологии словаря */
+#define DICTIONARY_NOT_LOADED 0
+#define DICTIONARY_LOADED 1
+#define DICTIONARY_LOAD_FAILED 2
+
 typedef struct {
   char *name;
   Morphology *morphology;
@@ -10,14 +23,24 @@ typedef struct {
   char *mrd_file_path;
   char *grammar_file_path;
   char *automat_file_path;
+  /* При отложенной загрузке морфология загружается при первом обращении
+   * к dictionary_morphology. load_state читается без блокировки, а сама
+   * загрузка идёт под load_mutex. */
+  size_t description_cache_size;
+  int8_t load_state;
+  pthread_mutex_t load_mutex;
 } Dictionary;
 
 char *extract_dictionary_name(const char *folder_name);
 void free_dictionary(Dictionary *dictionary);
-Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root, size_t description_cache_size);
-Dictionary **load_dictionaries(const char *all_dicts_root, size_t *length, size_t description_cache_size);
+int scan_dictionary_folders(const char *all_dicts_root, struct dirent ***folder_names);
+Dictionary *make_dictionary(const char *folder_name, const char *all_dicts_root, size_t description_cache_size,
+                            char lazy_load);
+Dictionary **load_dictionaries(const char *all_dicts_root, size_t *length, size_t description_cache_size,
+                               char lazy_load);
 void free_dictionaries(Dictionary **dictionaries, size_t count);
 Morphology *dictionary_morphology(Dictionary *dictionary);
+int8_t dictionary_load_state(Dictionary *dictionary);
 char *dictionary_name(Dictionary *dictionary);
 
 #endif
@@ -0,0 +1,199 @@
+/* Перевод обозначений gramtab.tab в числа (см. grammemes.h) */
+
+#include "morphology/grammemes.h"
+
+#include <string.h>
+
+#include "common/strtools.h"
+
+/* Обозначение части речи или граммемы и его значение. Часть речи может
+   сама нести граммемы ("ИНФИНИТИВ" - глагол в инфинитиве). */
+typedef struct {
+  const wchar_t *name;
+  uint8_t pos;
+  uint64_t bits;
+} GrammarTag;
+
+static const GrammarTag cyrillic_parts_of_speech[] = {
+  {L"С", MORPH_POS_NOUN, 0},
+  {L"П", MORPH_POS_ADJECTIVE, 0},
+  {L"КР_ПРИЛ", MORPH_POS_ADJECTIVE, MORPH_GRAM_SHORT},
+  {L"Г", MORPH_POS_VERB, 0},
+  {L"ИНФИНИТИВ", MORPH_POS_VERB, MORPH_GRAM_INFINITIVE},
+  {L"ПРИЧАСТИЕ", MORPH_POS_VERB, MORPH_GRAM_PARTICIPLE},
+  {L"КР_ПРИЧАСТИЕ", MORPH_POS_VERB, MORPH_GRAM_PARTICIPLE | MORPH_GRAM_SHORT},
+  {L"ДЕЕПРИЧАСТИЕ", MORPH_POS_VERB, MORPH_GRAM_GERUND},
+  {L"Н", MORPH_POS_ADVERB, 0},
+  {L"МС", MORPH_POS_PRONOUN, 0},
+  {L"МС-П", MORPH_POS_PRONOUN_ADJECTIVE, 0},
+  {L"МС-ПРЕДК", MORPH_POS_PRONOUN_PREDICATIVE, 0},
+  {L"ПРЕДК", MORPH_POS_PREDICATIVE, 0},
+  {L"ЧИСЛ", MORPH_POS_NUMERAL, 0},
+  {L"ЧИСЛ-П", MORPH_POS_ORDINAL_NUMERAL, 0},
+  {L"ПРЕДЛ", MORPH_POS_PREPOSITION, 0},
+  {L"ПОСЛ", MORPH_POS_POSTPOSITION, 0},
+  {L"СОЮЗ", MORPH_POS_CONJUNCTION, 0},
+  {L"ЧАСТ", MORPH_POS_PARTICLE, 0},
+  {L"МЕЖД", MORPH_POS_INTERJECTION, 0},
+  {L"ВВОДН", MORPH_POS_PARENTHESIS, 0},
+  {L"ФРАЗ", MORPH_POS_PHRASE, 0},
+  {NULL, 0, 0}
+};
+
+static const GrammarTag cyrillic_grammemes[] = {
+  {L"им", 0, MORPH_GRAM_NOMINATIVE},
+  {L"рд", 0, MORPH_GRAM_GENITIVE},
+  {L"дт", 0, MORPH_GRAM_DATIVE},
+  {L"вн", 0, MORPH_GRAM_ACCUSATIVE},
+  {L"тв", 0, MORPH_GRAM_INSTRUMENTAL},
+  {L"пр", 0, MORPH_GRAM_PREPOSITIONAL},
+  {L"зв", 0, MORPH_GRAM_VOCATIVE},
+  {L"ед", 0, MORPH_GRAM_SINGULAR},
+  {L"мн", 0, MORPH_GRAM_PLURAL},
+  {L"мр", 0, MORPH_GRAM_MASCULINE},
+  {L"жр", 0, MORPH_GRAM_FEMININE},
+  {L"ср", 0, MORPH_GRAM_NEUTER},
+  {L"мр-жр", 0, MORPH_GRAM_MASCULINE | MORPH_GRAM_FEMININE},
+  {L"1л", 0, MORPH_GRAM_FIRST_PERSON},
+  {L"2л", 0, MORPH_GRAM_SECOND_PERSON},
+  {L"3л", 0, MORPH_GRAM_THIRD_PERSON},
+  {L"нст", 0, MORPH_GRAM_PRESENT},
+  {L"прш", 0, MORPH_GRAM_PAST},
+  {L"буд", 0, MORPH_GRAM_FUTURE},
+  {L"инф", 0, MORPH_GRAM_INFINITIVE},
+  {L"прч", 0, MORPH_GRAM_PARTICIPLE},
+  {L"дпр", 0, MORPH_GRAM_GERUND},
+  {L"пвл", 0, MORPH_GRAM_IMPERATIVE},
+  {L"дст", 0, MORPH_GRAM_ACTIVE},
+  {L"стр", 0, MORPH_GRAM_PASSIVE},
+  {L"св", 0, MORPH_GRAM_PERFECTIVE},
+  {L"нс", 0, MORPH_GRAM_IMPERFECTIVE},
+  {L"пе", 0, MORPH_GRAM_TRANSITIVE},
+  {L"нп", 0, MORPH_GRAM_INTRANSITIVE},
+  {L"безл", 0, MORPH_GRAM_IMPERSONAL},
+  {L"од", 0, MORPH_GRAM_ANIMATE},
+  {L"но", 0, MORPH_GRAM_INANIMATE},
+  {L"кр", 0, MORPH_GRAM_SHORT},
+  {L"сравн", 0, MORPH_GRAM_COMPARATIVE},
+  {L"прев", 0, MORPH_GRAM_SUPERLATIVE},
+  {L"кач", 0, MORPH_GRAM_QUALITATIVE},
+  {L"притяж", 0, MORPH_GRAM_POSSESSIVE},
+  {L"указат", 0, MORPH_GRAM_DEMONSTRATIVE},
+  {L"вопр", 0, MORPH_GRAM_INTERROGATIVE},
+  {L"имя", 0, MORPH_GRAM_FIRST_NAME},
+  {L"фам", 0, MORPH_GRAM_SURNAME},
+  {L"отч", 0, MORPH_GRAM_PATRONYMIC},
+  {L"лок", 0, MORPH_GRAM_LOCATION},
+  {L"орг", 0, MORPH_GRAM_ORGANIZATION},
+  {L"аббр", 0, MORPH_GRAM_ABBREVIATION},
+  {L"0", 0, MORPH_GRAM_INVARIABLE},
+  {L"2", 0, MORPH_GRAM_SECOND_FORM},
+  {L"разг", 0, MORPH_GRAM_COLLOQUIAL},
+  {L"арх", 0, MORPH_GRAM_ARCHAIC},
+  {L"жарг", 0, MORPH_GRAM_SLANG},
+  {L"опч", 0, MORPH_GRAM_MISPRINT},
+  {NULL, 0, 0}
+};
+
+static const GrammarTag latin_parts_of_speech[] = {
+  {L"NOUN", MORPH_POS_NOUN, 0},
+  {L"ADJECTIVE", MORPH_POS_ADJECTIVE, 0},
+  {L"VERB", MORPH_POS_VERB, 0},
+  {L"MOD", MORPH_POS_VERB, 0},
+  {L"VBE", MORPH_POS_VERB, 0},
+  {L"ADVERB", MORPH_POS_ADVERB, 0},
+  {L"PN", MORPH_POS_PRONOUN, 0},
+  {L"PRON", MORPH_POS_PRONOUN, 0},
+  {L"PN_ADJ", MORPH_POS_PRONOUN_ADJECTIVE, 0},
+  {L"POSS", MORPH_POS_PRONOUN_ADJECTIVE, MORPH_GRAM_POSSESSIVE},
+  {L"NUMERAL", MORPH_POS_NUMERAL, 0},
+  {L"ORDNUM", MORPH_POS_ORDINAL_NUMERAL, 0},
+  {L"PREP", MORPH_POS_PREPOSITION, 0},
+  {L"CONJ", MORPH_POS_CONJUNCTION, 0},
+  {L"PART", MORPH_POS_PARTICLE, 0},
+  {L"INT", MORPH_POS_INTERJECTION, 0},
+  {L"ARTICLE", MORPH_POS_ARTICLE, 0},
+  {NULL, 0, 0}
+};
+
+static const GrammarTag latin_grammemes[] = {
+  {L"nom", 0, MORPH_GRAM_NOMINATIVE},
+  {L"obj", 0, MORPH_GRAM_OBJECTIVE},
+  {L"sg", 0, MORPH_GRAM_SINGULAR},
+  {L"pl", 0, MORPH_GRAM_PLURAL},
+  {L"m", 0, MORPH_GRAM_MASCULINE},
+  {L"f", 0, MORPH_GRAM_FEMININE},
+  {L"1", 0, MORPH_GRAM_FIRST_PERSON},
+  {L"2", 0, MORPH_GRAM_SECOND_PERSON},
+  {L"3", 0, MORPH_GRAM_THIRD_PERSON},
+  {L"prsa", 0, MORPH_GRAM_PRESENT},
+  {L"pasa", 0, MORPH_GRAM_PAST},
+  {L"fut", 0, MORPH_GRAM_FUTURE},
+  {L"inf", 0, MORPH_GRAM_INFINITIVE},
+  {L"pp", 0, MORPH_GRAM_PARTICIPLE | MORPH_GRAM_PAST},
+  {L"ing", 0, MORPH_GRAM_PARTICIPLE | MORPH_GRAM_PRESENT},
+  {L"comp", 0, MORPH_GRAM_COMPARATIVE},
+  {L"sup", 0, MORPH_GRAM_SUPERLATIVE},
+  {L"pers", 0, MORPH_GRAM_PERSONAL},
+  {L"poss", 0, MORPH_GRAM_POSSESSIVE},
+  {L"dem", 0, MORPH_GRAM_DEMONSTRATIVE},
+  {L"ref", 0, MORPH_GRAM_REFLEXIVE},
+  {L"prop", 0, MORPH_GRAM_PROPER},
+  {L"name", 0, MORPH_GRAM_FIRST_NAME},
+  {L"geo", 0, MORPH_GRAM_LOCATION},
+  {L"org", 0, MORPH_GRAM_ORGANIZATION},
+  {L"uncount", 0, MORPH_GRAM_UNCOUNTABLE},
+  {L"mass", 0, MORPH_GRAM_UNCOUNTABLE},
+  {NULL, 0, 0}
+};
+
+static const GrammarTag *find_grammar_tag(const GrammarTag *tags, const wchar_t *name, size_t name_length) {
+  for (; tags->name != NULL; tags++) {
+    if (wcslen(tags->name) == name_length && wmemcmp(tags->name, name, name_length) == 0) return tags;
+  }
+  return NULL;
+}
+
+/* Письменность обозначений грамматики - по первой букве части речи, а
+   если там букв нет ("*"), то граммем */
+static unsigned int grammar_tags_script(const wchar_t *part_of_speech, const wchar_t *grammems) {
+  const wchar_t *strings[2], *c;
+  unsigned int script;
+  size_t i;
+  strings[0] = part_of_speech;
+  strings[1] = grammems;
+  for (i = 0; i < 2; i++) {
+    for (c = strings[i]; c != NULL && *c != L'\0'; c++) {
+      script = char_script(*c);
+      if (script != SCRIPT_OTHER) return script;
+    }
+  }
+  return SCRIPT_CYRILLIC;
+}
+
+/* Переводит часть речи part_of_speech и граммемы grammems ("мр,ед,рд")
+   одной грамматики в номер части речи pos и биты граммем grammeme_bits.
+   Любая из строк может быть NULL. */
+void parse_grammar_tags(const wchar_t *part_of_speech, const wchar_t *grammems,
+                        uint8_t *pos, uint64_t *grammeme_bits) {
+  unsigned int script = grammar_tags_script(part_of_speech, grammems);
+  const GrammarTag *parts_of_speech = script == SCRIPT_LATIN ? latin_parts_of_speech : cyrillic_parts_of_speech;
+  const GrammarTag *grammemes = script == SCRIPT_LATIN ? latin_grammemes : cyrillic_grammemes;
+  const GrammarTag *tag;
+  const wchar_t *end;
+  *pos = MORPH_POS_UNKNOWN;
+  *grammeme_bits = 0;
+  if (part_of_speech != NULL &&
+      (tag = find_grammar_tag(parts_of_speech, part_of_speech, wcslen(part_of_speech))) != NULL) {
+    *pos = tag->pos;
+    *grammeme_bits = tag->bits;
+  }
+  while (grammems != NULL && *grammems != L'\0') {
+    end = wcschr(grammems, L',');
+    if (end == NULL) end = grammems + wcslen(grammems);
+    if ((tag = find_grammar_tag(grammemes, grammems, (size_t)(end - grammems))) != NULL) {
+      *grammeme_bits |= tag->bits;
+    }
+    grammems = *end == L',' ? end + 1 : end;
+  }
+}
@@ -0,0 +1,110 @@
+/* Часть речи и граммемы формы в виде чисел.
+
+   В gramtab.tab часть речи и граммемы записаны строками ("С", "мр,ед,рд";
+   "NOUN", "sg"), и чтобы отобрать, например, существительные в
+   родительном падеже, пришлось бы разбирать эти строки для каждого слова.
+   Поэтому при загрузке словаря строки каждой грамматики переводятся в
+   номер части речи MORPH_POS_... и набор бит MORPH_GRAM_..., общие для всех
+   языков, и отбор сводится к сравнению чисел и проверке масок.
+
+   Обозначения в gramtab.tab у русского и украинского словарей - кириллицей,
+   у английского - латиницей, и одно и то же обозначение у них может значить
+   разное ("2" - второй родительный или предложный падеж у русских
+   существительных и второе лицо у английских местоимений). Таблица
+   обозначений выбирается по письменности самой грамматики. Обозначения,
+   которых нет в таблицах, пропускаются.
+*/
+
+#ifndef __MORPHOLOGY_GRAMMEMES_H__
+#define __MORPHOLOGY_GRAMMEMES_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <wchar.h>
+
+/* Части речи */
+#define MORPH_POS_UNKNOWN 0 /* "*" и неизвестные обозначения */
+#define MORPH_POS_NOUN 1
+#define MORPH_POS_ADJECTIVE 2
+#define MORPH_POS_VERB 3 /* В том числе причастия, деепричастия и инфинитивы */
+#define MORPH_POS_ADVERB 4
+#define MORPH_POS_PRONOUN 5
+#define MORPH_POS_PRONOUN_ADJECTIVE 6
+#define MORPH_POS_PRONOUN_PREDICATIVE 7
+#define MORPH_POS_PREDICATIVE 8
+#define MORPH_POS_NUMERAL 9
+#define MORPH_POS_ORDINAL_NUMERAL 10
+#define MORPH_POS_PREPOSITION 11
+#define MORPH_POS_POSTPOSITION 12
+#define MORPH_POS_CONJUNCTION 13
+#define MORPH_POS_PARTICLE 14
+#define MORPH_POS_INTERJECTION 15
+#define MORPH_POS_PARENTHESIS 16
+#define MORPH_POS_PHRASE 17
+#define MORPH_POS_ARTICLE 18
+#define MORPH_POS_COUNT 19
+
+/* Бит части речи pos в маске частей речи */
+#define MORPH_POS_MASK(pos) (UINT32_C(1) << (pos))
+
+/* Граммемы */
+#define MORPH_GRAM_NOMINATIVE (UINT64_C(1) << 0)
+#define MORPH_GRAM_GENITIVE (UINT64_C(1) << 1)
+#define MORPH_GRAM_DATIVE (UINT64_C(1) << 2)
+#define MORPH_GRAM_ACCUSATIVE (UINT64_C(1) << 3)
+#define MORPH_GRAM_INSTRUMENTAL (UINT64_C(1) << 4)
+#define MORPH_GRAM_PREPOSITIONAL (UINT64_C(1) << 5)
+#define MORPH_GRAM_VOCATIVE (UINT64_C(1) << 6)
+#define MORPH_GRAM_OBJECTIVE (UINT64_C(1) << 7) /* Объектный падеж английских местоимений */
+#define MORPH_GRAM_SINGULAR (UINT64_C(1) << 8)
+#define MORPH_GRAM_PLURAL (UINT64_C(1) << 9)
+#define MORPH_GRAM_MASCULINE (UINT64_C(1) << 10)
+#define MORPH_GRAM_FEMININE (UINT64_C(1) << 11)
+#define MORPH_GRAM_NEUTER (UINT64_C(1) << 12)
+#define MORPH_GRAM_FIRST_PERSON (UINT64_C(1) << 13)
+#define MORPH_GRAM_SECOND_PERSON (UINT64_C(1) << 14)
+#define MORPH_GRAM_THIRD_PERSON (UINT64_C(1) << 15)
+#define MORPH_GRAM_PRESENT (UINT64_C(1) << 16)
+#define MORPH_GRAM_PAST (UINT64_C(1) << 17)
+#define MORPH_GRAM_FUTURE (UINT64_C(1) << 18)
+#define MORPH_GRAM_INFINITIVE (UINT64_C(1) << 19)
+#define MORPH_GRAM_PARTICIPLE (UINT64_C(1) << 20)
+#define MORPH_GRAM_GERUND (UINT64_C(1) << 21)
+#define MORPH_GRAM_IMPERATIVE (UINT64_C(1) << 22)
+#define MORPH_GRAM_ACTIVE (UINT64_C(1) << 23)
+#define MORPH_GRAM_PASSIVE (UINT64_C(1) << 24)
+#define MORPH_GRAM_PERFECTIVE (UINT64_C(1) << 25)
+#define MORPH_GRAM_IMPERFECTIVE (UINT64_C(1) << 26)
+#define MORPH_GRAM_TRANSITIVE (UINT64_C(1) << 27)
+#define MORPH_GRAM_INTRANSITIVE (UINT64_C(1) << 28)
+#define MORPH_GRAM_IMPERSONAL (UINT64_C(1) << 29)
+#define MORPH_GRAM_ANIMATE (UINT64_C(1) << 30)
+#define MORPH_GRAM_INANIMATE (UINT64_C(1) << 31)
+#define MORPH_GRAM_SHORT (UINT64_C(1) << 32)
+#define MORPH_GRAM_COMPARATIVE (UINT64_C(1) << 33)
+#define MORPH_GRAM_SUPERLATIVE (UINT64_C(1) << 34)
+#define MORPH_GRAM_QUALITATIVE (UINT64_C(1) << 35)
+#define MORPH_GRAM_POSSESSIVE (UINT64_C(1) << 36)
+#define MORPH_GRAM_DEMONSTRATIVE (UINT64_C(1) << 37)
+#define MORPH_GRAM_INTERROGATIVE (UINT64_C(1) << 38)
+#define MORPH_GRAM_PERSONAL (UINT64_C(1) << 39)
+#define MORPH_GRAM_REFLEXIVE (UINT64_C(1) << 40)
+#define MORPH_GRAM_PROPER (UINT64_C(1) << 41)
+#define MORPH_GRAM_FIRST_NAME (UINT64_C(1) << 42)
+#define MORPH_GRAM_SURNAME (UINT64_C(1) << 43)
+#define MORPH_GRAM_PATRONYMIC (UINT64_C(1) << 44)
+#define MORPH_GRAM_LOCATION (UINT64_C(1) << 45)
+#define MORPH_GRAM_ORGANIZATION (UINT64_C(1) << 46)
+#define MORPH_GRAM_ABBREVIATION (UINT64_C(1) << 47)
+#define MORPH_GRAM_INVARIABLE (UINT64_C(1) << 48)
+#define MORPH_GRAM_UNCOUNTABLE (UINT64_C(1) << 49)
+#define MORPH_GRAM_SECOND_FORM (UINT64_C(1) << 50) /* Второй родительный или предложный ("чаю", "в лесу") */
+#define MORPH_GRAM_COLLOQUIAL (UINT64_C(1) << 51)
+#define MORPH_GRAM_ARCHAIC (UINT64_C(1) << 52)
+#define MORPH_GRAM_SLANG (UINT64_C(1) << 53)
+#define MORPH_GRAM_MISPRINT (UINT64_C(1) << 54)
+
+void parse_grammar_tags(const wchar_t *part_of_speech, const wchar_t *grammems,
+                        uint8_t *pos, uint64_t *grammeme_bits);
+
+#endif /* __MORPHOLOGY_GRAMMEMES_H__ */
@@ -5,6 +5,7 @@
 
 #include "morphology/helpers.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <syslog.h>
 
@@ -53,10 +54,36 @@ static void free_description_cache(HashTable *cache) {
   free_hash_table(cache);
 }
 
+static void free_mini_automat_object(void *automat) {
+  free_mini_automat(automat);
+}
+
+static void free_succinct_automat_object(void *automat) {
+  free_succinct_automat(automat);
+}
+
+/* Письменности меток алфавита автомата (символ 0 - не метка) */
+static unsigned int alphabet_scripts(const MiniAlphabet *alphabet, uint16_t alphabet_size) {
+  unsigned int result = 0;
+  uint16_t i;
+  for (i = 1; i < alphabet_size; i++) {
+    result |= char_script(alphabet->labels[i]);
+  }
+  return result;
+}
+
 /* Загружает базы морфологии и автомат для анализа слов, объединяя всё в одном
  * объекте, для удобства.
  * dictionary_dir - путь до каталога, содержащего файлы morphs.mrd, gramtab.tab
- *   и automat.save
+ *   и automat.save. Если рядом лежит плоский образ автомата automat.flat, он
+ *   отображается в память напрямую, а automat.save не читается вовсе. Точно
+ *   так же вместо разбора morphs.mrd используется его образ morphs.base, если
+ *   он есть и не устарел. Если же в каталоге есть сжатый образ automat.louds
+ *   (morph-compile -s), то используется он: поиск по нему медленнее, но
+ *   памяти нужно в 2-3 раза меньше. Хэш-таблица словоформ wordforms.hash
+ *   (morph-compile -w), если она есть и собрана по тому же автомату,
+ *   ускоряет разбор словарных слов, а приложенный к ней фильтр
+ *   wordforms.bloom (morph-compile -b) - отсев незнакомых.
  * description_cache_size - размер кэша, используемого функцией
  *   make_word_description для кэширование лемм слов. Если число кэшированных лемм
  *   превысит указанное количество, самые старые из них начнут вытесняться.
@@ -65,29 +92,107 @@ static void free_description_cache(HashTable *cache) {
 Morphology *init_morphology_bases(const char *dictionary_dir, size_t description_cache_size) {
   char *mrd_file_name = join_path(2, dictionary_dir, DICTIONARY_MRD_FILE),
       *grammar_file_name = join_path(2, dictionary_dir, DICTIONARY_GRAMMAR_FILE),
-      *automat_file_name = join_path(2, dictionary_dir, DICTIONARY_AUTOMAT_FILE);
+      *automat_file_name = join_path(2, dictionary_dir, DICTIONARY_AUTOMAT_FILE),
+      *mini_automat_file_name = join_path(2, dictionary_dir, DICTIONARY_MINI_AUTOMAT_FILE),
+      *succinct_automat_file_name = join_path(2, dictionary_dir, DICTIONARY_SUCCINCT_AUTOMAT_FILE),
+      *base_image_file_name = join_path(2, dictionary_dir, DICTIONARY_BASE_IMAGE_FILE),
+      *word_hash_file_name = join_path(2, dictionary_dir, DICTIONARY_WORD_HASH_FILE),
+      *word_filter_file_name = join_path(2, dictionary_dir, DICTIONARY_WORD_FILTER_FILE);
   void *automat, *base;
+  uint32_t states_count = 0;
+  const MiniAlphabet *alphabet = NULL;
+  uint16_t alphabet_size = 0;
+  WordFormHash *word_hash = NULL;
+  WordFormFilter *word_filter;
+  AutomatOutputsGenerator output_generator = mini_possible_outputs;
+  AutomatCommonPrefixSize common_prefix_size = mini_common_prefix_size;
+  AutomatTransition transition = mini_transition;
+  AutomatCommonPrefixBatch common_prefix_batch = mini_common_prefix_batch;
+  AutomatPrefixOutputsGenerator prefix_output_generator = mini_prefix_outputs;
+  AutomatDestructor destructor = free_mini_automat_object;
+  AnnotationTable annotations;
   Morphology *morphology;
-  base = init_morphology_base(mrd_file_name, grammar_file_name, 1);
-  automat = load_mini_automat(automat_file_name);
+  base = map_morphology_image(base_image_file_name, mrd_file_name, grammar_file_name);
+  if (base == NULL) {
+    base = init_morphology_base(mrd_file_name, grammar_file_name, 1);
+  }
+  automat = map_succinct_automat(succinct_automat_file_name);
+  if (automat != NULL) {
+    output_generator = succinct_possible_outputs;
+    common_prefix_size = succinct_common_prefix_size;
+    transition = succinct_transition;
+    common_prefix_batch = succinct_common_prefix_batch;
+    prefix_output_generator = succinct_prefix_outputs;
+    destructor = free_succinct_automat_object;
+    annotations = ((SuccinctAutomat *)automat)->annotations;
+    states_count = ((SuccinctAutomat *)automat)->states_count;
+    alphabet = ((SuccinctAutomat *)automat)->alphabet;
+    alphabet_size = ((SuccinctAutomat *)automat)->alphabet_size;
+  } else {
+    automat = map_mini_automat(mini_automat_file_name);
+    if (automat == NULL) {
+      automat = load_mini_automat(automat_file_name);
+    }
+    if (automat != NULL) {
+      annotations = ((MiniAutomat *)automat)->annotations;
+      states_count = ((MiniAutomat *)automat)->states_count;
+      alphabet = ((MiniAutomat *)automat)->alphabet;
+      alphabet_size = ((MiniAutomat *)automat)->alphabet_size;
+    }
+  }
+  if (automat != NULL) {
+    word_hash = map_word_form_hash(word_hash_file_name);
+    if (word_hash != NULL && !word_form_hash_matches(word_hash, states_count, &annotations)) {
+      fprintf(stderr, "Word form hash %s does not match the automat, ignored\n", word_hash_file_name);
+      free_word_form_hash(word_hash);
+      word_hash = NULL;
+    }
+  }
+  if (word_hash != NULL) {
+    word_filter = map_word_form_filter(word_filter_file_name);
+    if (word_filter != NULL && word_form_hash_attach_filter(word_hash, word_filter) != 0) {
+      fprintf(stderr, "Word form filter %s does not match the word form hash, ignored\n", word_filter_file_name);
+      free_word_form_filter(word_filter);
+    }
+  }
   strict_free(mrd_file_name);
   strict_free(grammar_file_name);
   strict_free(automat_file_name);
-  if (automat == NULL) {
-    /* fprintf(stderr, "Automat loading failed.\n"); */
-    return NULL;
-  }
-  if (base == NULL) {
-    /* fprintf(stderr, "Morphology base loading failed.\n"); */
+  strict_free(mini_automat_file_name);
+  strict_free(succinct_automat_file_name);
+  strict_free(base_image_file_name);
+  strict_free(word_hash_file_name);
+  strict_free(word_filter_file_name);
+  if (automat == NULL || base == NULL) {
+    /* fprintf(stderr, "Automat or morphology base loading failed.\n"); */
+    /* То, что всё же загрузилось, освобождается: при перезагрузке словарей
+       (morph_reload) неудачные попытки не должны копить память */
+    if (base != NULL) free_morphology_base(base);
+    if (automat != NULL) destructor(automat);
+    if (word_hash != NULL) free_word_form_hash(word_hash);
     return NULL;
   }
   morphology = strict_malloc(sizeof(*morphology));
   morphology->base = base;
   morphology->automat = automat;
-  morphology->automat_output_generator = mini_possible_outputs;
-  morphology->automat_common_prefix_size = mini_common_prefix_size;
+  morphology->automat_output_generator = output_generator;
+  morphology->automat_common_prefix_size = common_prefix_size;
+  morphology->automat_transition = transition;
+  morphology->automat_common_prefix_batch = common_prefix_batch;
+  morphology->automat_prefix_outputs_generator = prefix_output_generator;
+  morphology->automat_destructor = destructor;
+  morphology->output_limits.max_outputs = AUTOMAT_MAX_OUTPUTS;
+  morphology->output_limits.max_states = AUTOMAT_MAX_VISITED_STATES;
+  morphology->annotations = annotations;
+  morphology->word_hash = word_hash;
+  morphology->scripts = alphabet_scripts(alphabet, alphabet_size);
   morphology->description_cache = make_description_cache(description_cache_size);
   if (pthread_mutex_init(&morphology->mutex, NULL) != 0) {
+    free_description_cache(morphology->description_cache);
+    free_morphology_base(base);
+    destructor(automat);
+    if (word_hash != NULL) free_word_form_hash(word_hash);
+    strict_free(morphology);
     return NULL;
   }
   return morphology;
@@ -116,7 +221,10 @@ static void unlock_morphology(Morphology *morphology) {
 /* Выгружает базы морфологии и автомат разбора слов из памяти */
 void unload_morphology_bases(Morphology *morphology) {
     free_morphology_base(morphology->base);
-    free_mini_automat(morphology->automat);
+    morphology->automat_destructor(morphology->automat);
+    if (morphology->word_hash != NULL) {
+      free_word_form_hash(morphology->word_hash);
+    }
     free_description_cache(morphology->description_cache);
     pthread_mutex_destroy(&morphology->mutex);
     strict_free(morphology);
@@ -127,57 +235,95 @@ void unload_morphology_bases(Morphology *morphology) {
 ArrayList *get_word_lemmas(const wchar_t *word, size_t word_size, Morphology *morphology) {
   return analyze_word(word, word_size, morphology->automat,
                       morphology->automat_output_generator,
+                      &morphology->output_limits,
+                      &morphology->annotations,
+                      morphology->word_hash,
                       morphology->base, 1, 0);
 }
 
 /* Освобождает память из под найденных get_word_lemmas лемм */
 inline void free_word_lemmas(ArrayList *lemmas) { free_analyze_word_results(lemmas); }
 
+/* Ищет все леммы указанного слова в рабочей памяти scratch */
+ArrayList *get_word_lemmas_scratch(const wchar_t *word, size_t word_size, Morphology *morphology,
+                                   AnalysisScratch *scratch) {
+  return analyze_word_scratch(word, word_size, morphology->automat,
+                              morphology->automat_output_generator,
+                              &morphology->output_limits,
+                              &morphology->annotations,
+                              morphology->word_hash,
+                              morphology->base, 1, 0, scratch);
+}
+
+/* Ищет леммы указанного слова с грамматикой его форм в рабочей памяти scratch */
+ArrayList *get_word_tags_scratch(const wchar_t *word, size_t word_size, Morphology *morphology,
+                                 AnalysisScratch *scratch) {
+  return analyze_word_scratch(word, word_size, morphology->automat,
+                              morphology->automat_output_generator,
+                              &morphology->output_limits,
+                              &morphology->annotations,
+                              morphology->word_hash,
+                              morphology->base, ANALYZE_LEMMA_TAGS, 1, scratch);
+}
+
+/* Проводит по автомату сразу count слов для их лемматизации */
+void walk_words_lemmas(const wchar_t *const words[], const size_t word_sizes[], size_t count,
+                       WordSelector select, void *data,
+                       Morphology *morphology, AnalysisScratch *scratch) {
+  walk_words_scratch(words, word_sizes, count, select, data, morphology->automat,
+                     morphology->automat_common_prefix_batch,
+                     morphology->automat_prefix_outputs_generator,
+                     &morphology->output_limits,
+                     morphology->word_hash,
+                     morphology->base, scratch);
+}
+
+/* Леммы index-го слова, пройденного по автомату walk_words_lemmas */
+ArrayList *get_walked_word_lemmas(size_t index, const wchar_t *word, size_t word_size,
+                                  Morphology *morphology, AnalysisScratch *scratch) {
+  return analyze_walked_word_scratch(index, word, word_size,
+                                     &morphology->annotations,
+                                     morphology->base, 1, 0, scratch);
+}
+
 /* Ищет все формы указанного слова, возвращая их в виде массива */
 inline ArrayList *get_word_forms(const wchar_t *word, size_t word_size, Morphology *morphology) {
   return analyze_word(word, word_size, morphology->automat,
                       morphology->automat_output_generator,
+                      &morphology->output_limits,
+                      &morphology->annotations,
+                      morphology->word_hash,
                       morphology->base, 0, 0);
 }
 
 /* Освобождает память из под найденных get_word_lemmas лемм */
 inline void free_word_forms(ArrayList *lemmas) { free_analyze_word_results(lemmas); }
 
-/* Создаёт "описание слова" - строку, содержащую исходное слово, плюс все его
- * леммы, разделённые точками. Причём исходное слово всегда идёт последним.
- * Такое представление удобно для построения суффиксного массива, в котором
- * можно искать сразу все формы слова. Если слово не имеет лемм, в результат
- * попадает только исходный вариант. Результат работы кэшируется для повторного
- * использования.
- * 1. word и mb_word должны содержать одно и то же слово в "широкой строке" и в
- *    UTF-8 соответственно.
- * 2. Вместо word можно передать NULL, тогда преобразование будет выполнено внутри
- *    функции. mb_word - обязателен.
- * 3. mb_word может не завершаться терминатором '\0'. Размер строки берётся только
- *    из mb_word_length.
- * 4. Параметр dont_imitate задаёт поведение функции в случаях, если слово не
- *    лемматизируется, или вообще представляет собой мусор. В этом случае, можно
- *    потребовать не создавать описание, и вернуть NULL. Кэш при этом также не
- *    занимается.
- * 5. Через аргумент is_garbage возвращается флаг мусорности слова (т.е. оно
- *     вообще ни в один словарь точно не входит).
- *
- * Память, занимаемую возвращаемым значением, надо освобождать.
- */
-char *make_word_description(const wchar_t *word, size_t word_length,
-                            const char *mb_word, size_t mb_word_length,
-                            Morphology *morphology,
-                            int dont_imitate,
-                            int *is_garbage,
-                            size_t *result_length) {
+/* Собственно make_word_description. Если лемматизация слова уже сделана,
+ * её результат (в рабочей памяти потока) передаётся в lemmas, иначе - NULL.
+ * Леммы ищутся в рабочей памяти потока (thread_analysis_scratch), так что
+ * сама лемматизация памяти не выделяет. */
+static char *describe_word(const wchar_t *word, size_t word_length,
+                           const char *mb_word, size_t mb_word_length,
+                           Morphology *morphology,
+                           int dont_imitate,
+                           int *is_garbage,
+                           size_t *result_length,
+                           ArrayList *lemmas) {
   const char terminator[2] = {WORD_DESCRIPTION_TERMINATOR, '\0'};
-  ArrayList *lemmas;
   char *mb_form, *result;
   size_t i, lemmas_count, mb_form_length;
   WordForm *form;
   StringBuffer *result_buffer;
   int8_t is_imitation;
+  lock_morphology(morphology);
   result = get_description_from_cache(mb_word, mb_word_length, result_length, &is_imitation, morphology->description_cache);
+  if (result != NULL && !dont_imitate) {
+    /* Копируем под блокировкой: иначе другой поток может вытеснить эту
+     * запись из кэша раньше, чем мы её прочитаем */
+    result = strict_strndup(result, *result_length);
+  }
+  unlock_morphology(morphology);
   if (result == NULL) {
     wchar_t *converted_word;
     if (word == NULL) {
@@ -188,7 +334,9 @@ char *make_word_description(const wchar_t *word, size_t word_length,
     *is_garbage = is_garbage_word(word, word_length);
     if (!*is_garbage) {
       /* Если слово - не мусор, можно провести лемматизацию. */
-      lemmas = get_word_lemmas(word, word_length, morphology);
+      if (lemmas == NULL) {
+        lemmas = get_word_lemmas_scratch(word, word_length, morphology, thread_analysis_scratch());
+      }
       lemmas_count = array_list_size(lemmas);
       is_imitation = (lemmas_count == 0);
       if (is_imitation && dont_imitate) {
@@ -216,7 +364,6 @@ char *make_word_description(const wchar_t *word, size_t word_length,
                                  morphology->description_cache);
         unlock_morphology(morphology);
       }
-      free_word_lemmas(lemmas);
     } else {
       /* Слово - мусорное.
          Бесполезно лемматизировать всё что не похоже на на нормальное слово
@@ -241,13 +388,91 @@ char *make_word_description(const wchar_t *word, size_t word_length,
     result_length = 0;
     result = NULL;
   } else {
-    /* Результат взят из кэша */
-    result = strict_strndup(result, *result_length);
+    /* Результат взят из кэша (и уже скопирован) */
     *is_garbage = 0;
   }
   return result;
 }
 
+/* Создаёт "описание слова" - строку, содержащую исходное слово, плюс все его
+ * леммы, разделённые точками. Причём исходное слово всегда идёт последним.
+ * Такое представление удобно для построения суффиксного массива, в котором
+ * можно искать сразу все формы слова. Если слово не имеет лемм, в результат
+ * попадает только исходный вариант. Результат работы кэшируется для повторного
+ * использования.
+ * 1. word и mb_word должны содержать одно и то же слово в "широкой строке" и в
+ *    UTF-8 соответственно.
+ * 2. Вместо word можно передать NULL, тогда преобразование будет выполнено внутри
+ *    функции. mb_word - обязателен.
+ * 3. mb_word может не завершаться терминатором '\0'. Размер строки берётся только
+ *    из mb_word_length.
+ * 4. Параметр dont_imitate задаёт поведение функции в случаях, если слово не
+ *    лемматизируется, или вообще представляет собой мусор. В этом случае, можно
+ *    потребовать не создавать описание, и вернуть NULL. Кэш при этом также не
+ *    занимается.
+ * 5. Через аргумент is_garbage возвращается флаг мусорности слова (т.е. оно
+ *     вообще ни в один словарь точно не входит).
+ *
+ * Память, занимаемую возвращаемым значением, надо освобождать.
+ */
+char *make_word_description(const wchar_t *word, size_t word_length,
+                            const char *mb_word, size_t mb_word_length,
+                            Morphology *morphology,
+                            int dont_imitate,
+                            int *is_garbage,
+                            size_t *result_length) {
+  return describe_word(word, word_length, mb_word, mb_word_length, morphology,
+                       dont_imitate, is_garbage, result_length, NULL);
+}
+
+/* Слова make_words_descriptions, для выбора лемматизируемых */
+typedef struct {
+  const wchar_t *const *words;
+  const size_t *word_lengths;
+  const char *const *mb_words;
+  const size_t *mb_word_lengths;
+  Morphology *morphology;
+} DescribedWords;
+
+/* Нужна ли index-му слову лемматизация: его нет в кэше, и оно не мусор */
+static int is_undescribed_word(size_t index, void *data) {
+  DescribedWords *described = data;
+  size_t cached_length;
+  int8_t is_imitation;
+  char *cached;
+  lock_morphology(described->morphology);
+  cached = get_description_from_cache(described->mb_words[index], described->mb_word_lengths[index],
+                                      &cached_length, &is_imitation, described->morphology->description_cache);
+  unlock_morphology(described->morphology);
+  return cached == NULL && !is_garbage_word(described->words[index], described->word_lengths[index]);
+}
+
+/* То же, что make_word_description, но сразу для count слов. Слова, которых
+ * нет в кэше, лемматизируются вместе (walk_words_lemmas), в рабочей памяти
+ * потока. */
+void make_words_descriptions(const wchar_t *const words[], const size_t word_lengths[],
+                             const char *const mb_words[], const size_t mb_word_lengths[],
+                             size_t count,
+                             Morphology *morphology,
+                             int dont_imitate,
+                             int is_garbage[],
+                             char *results[],
+                             size_t result_lengths[]) {
+  AnalysisScratch *scratch = thread_analysis_scratch();
+  DescribedWords described = {words, word_lengths, mb_words, mb_word_lengths, morphology};
+  ArrayList *lemmas;
+  size_t i;
+  walk_words_lemmas(words, word_lengths, count, is_undescribed_word, &described, morphology, scratch);
+  /* Описания собираются по порядку, как при вызовах make_word_description
+   * одного слова за другим: кэш мог измениться, поэтому он проверяется
+   * снова, а готовые леммы лишь избавляют от повторной лемматизации */
+  for (i = 0; i < count; i++) {
+    lemmas = get_walked_word_lemmas(i, words[i], word_lengths[i], morphology, scratch);
+    results[i] = describe_word(words[i], word_lengths[i], mb_words[i], mb_word_lengths[i], morphology,
+                               dont_imitate, &is_garbage[i], &result_lengths[i], lemmas);
+  }
+}
+
 /* Возвращает длину часть слова (с конца), на которую его узнаёт автомат анализа
  * данной  морфологии без использования предсказания. Применяется для
  * детектирования языка отдельных слов.  */
@@ -4,7 +4,10 @@
 #include <pthread.h>
 
 #include "miniautomat.h"
+#include "succinctautomat.h"
+#include "baseimage.h"
 #include "wordforms.h"
+#include "wordhash.h"
 #include "../common/hashtable.h"
 
 #define WORD_DESCRIPTION_TERMINATOR '.'
@@ -17,12 +20,25 @@ extern "C" {
 #define DICTIONARY_MRD_FILE "morphs.mrd" /* Основы слов и правила словообразования */
 #define DICTIONARY_GRAMMAR_FILE "gramtab.tab" /* Части речи */
 #define DICTIONARY_AUTOMAT_FILE "automat.save" /* Автомат разбора и предсказания */
+#define DICTIONARY_MINI_AUTOMAT_FILE "automat.flat" /* Он же, в виде плоского образа для mmap */
+#define DICTIONARY_SUCCINCT_AUTOMAT_FILE "automat.louds" /* Он же, в сжатом виде (необязателен) */
+#define DICTIONARY_BASE_IMAGE_FILE "morphs.base" /* Скомпилированный образ правил из morphs.mrd */
+#define DICTIONARY_WORD_HASH_FILE "wordforms.hash" /* Хэш-таблица словоформ автомата (необязательна) */
+#define DICTIONARY_WORD_FILTER_FILE "wordforms.bloom" /* Фильтр Блума словоформ хэш-таблицы (необязателен) */
   
 typedef struct {
-  MiniAutomat *automat;
+  void *automat; /* MiniAutomat или SuccinctAutomat */
   MorphologyBase *base;
   AutomatOutputsGenerator automat_output_generator;
   AutomatCommonPrefixSize automat_common_prefix_size;
+  AutomatTransition automat_transition;
+  AutomatCommonPrefixBatch automat_common_prefix_batch;
+  AutomatPrefixOutputsGenerator automat_prefix_outputs_generator;
+  AutomatDestructor automat_destructor;
+  AutomatOutputLimits output_limits; /* Ограничения разбора и предсказания */
+  AnnotationTable annotations; /* Таблица аннотаций из образа автомата */
+  WordFormHash *word_hash; /* Быстрый путь для словарных слов, NULL - нет */
+  unsigned int scripts; /* Письменности букв автомата (SCRIPT_...) */
   HashTable *description_cache;
   pthread_mutex_t mutex;
 } Morphology;
@@ -30,7 +46,7 @@ typedef struct {
 /* Загружает базы морфологии и автомат для анализа слов, объединяя всё в одном
  * объекте, для удобства.
  * dictionary_dir - путь до каталога, содержащего файлы morphs.mrd, rgramtab.tab
- *   и automat.save
+ *   и automat.save (или его образ automat.flat либо automat.louds)
  * description_cache_size - размер кэша, используемого функцией
  *   make_word_description для кэширование лемм слов. Если число кэшированных лемм
  *   превысит указанное количество, самые старые из них начнут вытесняться.
@@ -47,6 +63,32 @@ ArrayList *get_word_lemmas(const wchar_t *word, size_t word_size, Morphology *mo
 /* Освобождает память из под найденных get_word_lemmas лемм */
 void free_word_lemmas(ArrayList *lemmas);
 
+/* То же, что get_word_lemmas, но без выделения памяти: леммы собираются в
+ * рабочей памяти scratch (make_analysis_scratch) и действительны до
+ * следующего вызова с ней же; освобождать их не нужно. Рабочую память
+ * стоит завести одну на поток и передавать в каждый вызов. */
+ArrayList *get_word_lemmas_scratch(const wchar_t *word, size_t word_size, Morphology *morphology,
+                                   AnalysisScratch *scratch);
+
+/* Леммы слова вместе с грамматикой самого слова (ANALYZE_LEMMA_TAGS): по
+ * словоформе на каждое сочетание леммы и возможной формы слова, в grammar
+ * - грамматика этой формы (часть речи и граммемы - в grammar->pos и
+ * grammar->grammeme_bits), в base_grammar - начальной формы. Результат,
+ * как у get_word_lemmas_scratch, живёт в scratch. */
+ArrayList *get_word_tags_scratch(const wchar_t *word, size_t word_size, Morphology *morphology,
+                                 AnalysisScratch *scratch);
+
+/* Пакетный вариант get_word_lemmas_scratch: проводит по автомату сразу
+ * count слов (кроме тех, для которых select вернул 0), что быстрее, чем
+ * по одному (см. walk_words_scratch). Леммы index-го слова затем выдаёт
+ * get_walked_word_lemmas - с тем же временем жизни, что у
+ * get_word_lemmas_scratch, или NULL, если слово было пропущено. */
+void walk_words_lemmas(const wchar_t *const words[], const size_t word_sizes[], size_t count,
+                       WordSelector select, void *data,
+                       Morphology *morphology, AnalysisScratch *scratch);
+ArrayList *get_walked_word_lemmas(size_t index, const wchar_t *word, size_t word_size,
+                                  Morphology *morphology, AnalysisScratch *scratch);
+
 /* Ищет все леммы указанного слова, возвращая их в виде массива. */
 ArrayList *get_word_forms(const wchar_t *word, size_t word_size, Morphology *morphology);
 
@@ -67,6 +109,18 @@ char *make_word_description(const wchar_t *word, size_t word_length,
                                   int *is_garbage,
                                   size_t *result_length);
 
+/* То же, что make_word_description, но сразу для count слов. Слова words
+ * обязательны (NULL нельзя), результат и флаг мусорности i-го слова
+ * записываются в results[i], result_lengths[i] и is_garbage[i]. */
+void make_words_descriptions(const wchar_t *const words[], const size_t word_lengths[],
+                             const char *const mb_words[], const size_t mb_word_lengths[],
+                             size_t count,
+                             Morphology *morphology,
+                             int dont_imitate,
+                             int is_garbage[],
+                             char *results[],
+                             size_t result_lengths[]);
+
 size_t known_part_of_word(Morphology *morphology, const wchar_t *word, size_t word_length);
   
 #ifdef __cplusplus
@@ -10,34 +10,92 @@
 #include "morphology/miniautomat.h"
 
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "morphology/automat.h"
+#include "morphology/automatwalk.h"
 #include "morphology/wordforms.h"
 #include "common/strict_alloc.h"
+#include "common/fileimage.h"
 
-#define MAX_AUTOMAT_OUTPUT_SIZE 255
+/* Векторный поиск переходов. Отключается флагом сборки MINI_AUTOMAT_NO_SIMD */
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(MINI_AUTOMAT_NO_SIMD)
+#define MINI_SIMD_LOOKUP
+#include <immintrin.h>
+#endif
+
+/* Способ поиска перехода, выбирается один раз по возможностям процессора */
+enum {
+  MINI_LOOKUP_BINARY,
+  MINI_LOOKUP_SSE2,
+  MINI_LOOKUP_AVX2
+};
+
+static int mini_lookup = MINI_LOOKUP_BINARY;
+static pthread_once_t mini_lookup_once = PTHREAD_ONCE_INIT;
+
+static void init_mini_lookup(void) {
+#ifdef MINI_SIMD_LOOKUP
+  __builtin_cpu_init();
+  mini_lookup = __builtin_cpu_supports("avx2") ? MINI_LOOKUP_AVX2 : MINI_LOOKUP_SSE2;
+#endif
+}
+
+/* Переход состояния, восстановленного из файла полного автомата */
+typedef struct {
+  Label label;
+  uint32_t target;
+} DecodedTransition;
+
+/* Состояние, восстановленное из файла полного автомата (automat.save).
+   Используется только как промежуточное звено при сборке плоского образа:
+   здесь target перехода - ещё номер состояния из файла, до перенумерации. */
+typedef struct {
+  int8_t is_final;
+  uint32_t transitions_count;
+  DecodedTransition transitions[];
+} DecodedState;
 
 static int transitions_comparer(const void *t1, const void *t2) {
-  if (((MiniTransition *)t1)->label == ((MiniTransition *)t2)->label) return 0;
-  return ((MiniTransition *)t1)->label < ((MiniTransition *)t2)->label ? -1 : 1;
+  if (((DecodedTransition *)t1)->label == ((DecodedTransition *)t2)->label) return 0;
+  return ((DecodedTransition *)t1)->label < ((DecodedTransition *)t2)->label ? -1 : 1;
+}
+
+/* Добавляет метку в упорядоченный алфавит, если её там ещё нет.
+   Возвращает -1, если алфавит переполнен. */
+static int add_alphabet_label(Label labels[], size_t *size, Label label) {
+  size_t left = 1, right = *size, middle;
+  while (left < right) {
+    middle = (left + right) >> 1;
+    if (labels[middle] == label) return 0;
+    if (labels[middle] < label) left = middle + 1;
+    else right = middle;
+  }
+  if (left < *size && labels[left] == label) return 0;
+  if (*size >= MINI_ALPHABET_SIZE) return -1;
+  memmove(labels + left + 1, labels + left, sizeof(Label)*(*size - left));
+  labels[left] = label;
+  (*size)++;
+  return 0;
 }
 
 static void *decode_state(void *data, void *prev_state) {
   uint32_t state_id;
   int8_t is_final, *description = (int8_t *)data;
-  MiniStateHeader *state;
+  DecodedState *state;
   int8_t *cursor = description;
   uint32_t i, transitions_count;
   struct class_transition_descriptor transition_descriptor;
-  MiniTransition *transition, *transitions_start;
+  DecodedTransition *transition;
   state_id = *(uint32_t *)cursor; cursor += sizeof(state_id);
   is_final = *(int8_t *)cursor; cursor += sizeof(is_final);
   transitions_count = *(uint32_t *)cursor; cursor += sizeof(transitions_count);
-  state = (MiniStateHeader *) malloc(sizeof(MiniStateHeader) + sizeof(MiniTransition)*transitions_count);
-  transitions_start = transition = (MiniTransition *)(state + 1);
+  state = (DecodedState *) strict_malloc(sizeof(DecodedState) + sizeof(DecodedTransition)*transitions_count);
+  transition = state->transitions;
   state->is_final = is_final;
-  state->transitions_count = (uint8_t) transitions_count;
+  state->transitions_count = transitions_count;
   for (i = 0; i < transitions_count; i++) {
     memcpy(&transition_descriptor, cursor, sizeof(transition_descriptor));
     cursor += sizeof(transition_descriptor);
@@ -45,45 +103,358 @@ static void *decode_state(void *data, void *prev_state) {
     transition->label = transition_descriptor.label;
     transition++;
   }
-  qsort(transitions_start, transitions_count, sizeof(MiniTransition), transitions_comparer);
+  qsort(state->transitions, transitions_count, sizeof(DecodedTransition), transitions_comparer);
   return state;
 }
 
 static void decode_transition(void *state, void *data, void **states_map) {}
 
-static void *prepare_mini_automat(void **states_map, size_t states_count) {
-  MiniAutomat *automat = malloc(sizeof(MiniAutomat));
-  automat->states = (MiniStateHeader **) malloc(sizeof(MiniStateHeader *)*states_count);
-  memcpy(automat->states, states_map, sizeof(MiniStateHeader *)*states_count);
-  automat->states_count = (uint32_t) states_count;
+/* Нумерует состояния обходом в ширину от начального: order[новый номер] =
+   старый номер, numbers[старый номер] = новый номер */
+static void number_states_breadth_first(void **states_map, size_t states_count, uint32_t *order, uint32_t *numbers) {
+  DecodedState *decoded;
+  uint32_t target, k;
+  size_t i, head, tail = 0;
+  for (i = 0; i < states_count; i++) numbers[i] = MINI_NO_STATE;
+  if (states_count > 0) {
+    numbers[0] = 0;
+    order[tail++] = 0;
+  }
+  for (head = 0; head < tail; head++) {
+    decoded = states_map[order[head]];
+    for (k = 0; k < decoded->transitions_count; k++) {
+      target = decoded->transitions[k].target;
+      if (numbers[target] == MINI_NO_STATE) {
+        numbers[target] = (uint32_t)tail;
+        order[tail++] = target;
+      }
+    }
+  }
+  /* Недостижимые состояния (в собранном automat.c автомате их не бывает) */
+  for (i = 0; i < states_count; i++) {
+    if (numbers[i] == MINI_NO_STATE) {
+      numbers[i] = (uint32_t)tail;
+      order[tail++] = (uint32_t)i;
+    }
+  }
+}
+
+static int keys_comparer(const void *k1, const void *k2) {
+  uint64_t key1 = *(const uint64_t *)k1, key2 = *(const uint64_t *)k2;
+  return key1 < key2 ? -1 : (key1 > key2);
+}
+
+/* Размещает цепочку горячих состояний от state: за состоянием идёт его
+   самый посещаемый ещё не размещённый потомок, если через него проходит
+   хотя бы половина посещений предка, и так далее */
+static void place_hot_chain(void **states_map, const uint32_t *visits, uint32_t state,
+                            uint32_t *order, uint32_t *numbers, size_t *tail) {
+  DecodedState *decoded;
+  uint32_t next, target, k;
+  for (; state != MINI_NO_STATE; state = next) {
+    numbers[state] = (uint32_t)*tail;
+    order[(*tail)++] = state;
+    decoded = states_map[state];
+    next = MINI_NO_STATE;
+    for (k = 0; k < decoded->transitions_count; k++) {
+      target = decoded->transitions[k].target;
+      if (numbers[target] == MINI_NO_STATE && visits[target] > 0 && visits[target] >= visits[state]/2 &&
+          (next == MINI_NO_STATE || visits[target] > visits[next])) {
+        next = target;
+      }
+    }
+  }
+}
+
+/* Нумерует состояния по профилю visits (число посещений каждого состояния
+   на образцовых текстах, см. mini_profile_word). Сначала идут посещённые
+   состояния, цепочками (см. place_hot_chain) от начального и дальше от
+   самого горячего из ещё не размещённых. Так горячие пути слов
+   лежат в образе подряд, а все посещённые состояния и их переходы - в
+   начале образа, в наименьшем числе строк кэша и страниц. Остальные
+   состояния идут за ними в порядке обхода в ширину. Начальное состояние
+   всегда остаётся нулевым. */
+static void number_states_by_visits(void **states_map, size_t states_count, const uint32_t *visits,
+                                    uint32_t *order, uint32_t *numbers) {
+  uint32_t *breadth_order, state;
+  uint64_t *hot;
+  size_t i, hot_count = 0, tail = 0;
+  if (states_count == 0) return;
+  breadth_order = strict_malloc(sizeof(*breadth_order)*states_count);
+  number_states_breadth_first(states_map, states_count, breadth_order, numbers);
+  /* Ключ сортировки: сначала более посещаемые, при равенстве - в порядке
+     обхода в ширину */
+  hot = strict_malloc(sizeof(*hot)*states_count);
+  for (i = 0; i < states_count; i++) {
+    numbers[i] = MINI_NO_STATE;
+    if (visits[breadth_order[i]] > 0) hot[hot_count++] = ((uint64_t)(UINT32_MAX - visits[breadth_order[i]]) << 32) | i;
+  }
+  qsort(hot, hot_count, sizeof(*hot), keys_comparer);
+  place_hot_chain(states_map, visits, 0, order, numbers, &tail);
+  for (i = 0; i < hot_count; i++) {
+    state = breadth_order[(uint32_t)hot[i]];
+    if (numbers[state] == MINI_NO_STATE) place_hot_chain(states_map, visits, state, order, numbers, &tail);
+  }
+  for (i = 0; i < states_count; i++) {
+    state = breadth_order[i];
+    if (numbers[state] == MINI_NO_STATE) {
+      numbers[state] = (uint32_t)tail;
+      order[tail++] = state;
+    }
+  }
+  strict_free(breadth_order);
+  strict_free(hot);
+}
+
+/* Собирает из отдельных состояний единый плоский образ автомата: заголовок,
+   алфавит, массив состояний и общий массив переходов (см. MiniState). Без
+   профиля (visits == NULL) состояния перенумеровываются обходом в ширину от
+   начального, так что переходы первых уровней автомата, через которые
+   проходит каждое слово, оказываются в нескольких соседних строках кэша, а
+   с профилем - по числу посещений (см. number_states_by_visits). Дальше
+   образ можно использовать как есть - и в памяти, и после отображения из
+   файла. Состояния states_map освобождаются. */
+static MiniAutomat *build_mini_automat(void **states_map, size_t states_count, const uint32_t *visits) {
+  MiniAutomat *automat;
+  MiniAutomatHeader *header;
+  DecodedState *decoded;
+  MiniAlphabet *alphabet;
+  MiniState *states;
+  MiniTransition *transitions;
+  Label labels[MINI_ALPHABET_SIZE] = {0};
+  MiniTransition *row, transition;
+  uint32_t *order, *numbers, first, k;
+  uint64_t transitions_count = 0;
+  size_t i, alphabet_size = 1, dense_count = 0;
+  int error = 0;
+  for (i = 0; i < states_count && !error; i++) {
+    decoded = states_map[i];
+    transitions_count += decoded->transitions_count;
+    if (decoded->transitions_count > MINI_DENSE_FANOUT) dense_count++;
+    for (k = 0; k < decoded->transitions_count && !error; k++) {
+      error = add_alphabet_label(labels, &alphabet_size, decoded->transitions[k].label);
+    }
+  }
+  /* Таблицы прямого доступа и выравнивание хранятся в том же массиве */
+  transitions_count += dense_count*alphabet_size + MINI_TRANSITIONS_PADDING;
+  if (error || states_count > MINI_MAX_STATES_COUNT || transitions_count > MINI_FIRST_TRANSITION_MASK) {
+    fprintf(stderr, "Automat is too large for the flat format.\n");
+    for (i = 0; i < states_count; i++) strict_free(states_map[i]);
+    return NULL;
+  }
+  /* order[новый номер] = старый номер, numbers[старый номер] = новый номер */
+  order = strict_malloc(sizeof(*order)*states_count);
+  numbers = strict_malloc(sizeof(*numbers)*states_count);
+  if (visits != NULL) {
+    number_states_by_visits(states_map, states_count, visits, order, numbers);
+  } else {
+    number_states_breadth_first(states_map, states_count, order, numbers);
+  }
+  pthread_once(&mini_lookup_once, init_mini_lookup);
+  automat = strict_malloc(sizeof(*automat));
+  automat->image_size = sizeof(MiniAutomatHeader) + sizeof(MiniAlphabet) +
+    sizeof(MiniState)*(states_count + 1) + sizeof(MiniTransition)*transitions_count;
+  automat->image = strict_calloc(1, automat->image_size);
+  automat->is_mapped = 0;
+  automat->states_count = (uint32_t)states_count;
+  header = automat->image;
+  memcpy(header->signature, MINI_AUTOMAT_SIGNATURE, sizeof(MINI_AUTOMAT_SIGNATURE));
+  header->version = MINI_AUTOMAT_FORMAT_VERSION;
+  header->label_size = sizeof(Label);
+  header->alphabet_size = (uint16_t)alphabet_size;
+  header->states_count = (uint32_t)states_count;
+  header->transitions_count = (uint32_t)transitions_count;
+  header->alphabet_offset = sizeof(MiniAutomatHeader);
+  header->states_offset = header->alphabet_offset + sizeof(MiniAlphabet);
+  header->transitions_offset = header->states_offset + sizeof(MiniState)*(states_count + 1);
+  header->annotations_offset = automat->image_size;
+  header->size = automat->image_size;
+  states = (MiniState *)((int8_t *)automat->image + header->states_offset);
+  transitions = (MiniTransition *)((int8_t *)automat->image + header->transitions_offset);
+  alphabet = (MiniAlphabet *)((int8_t *)automat->image + header->alphabet_offset);
+  memcpy(alphabet->labels, labels, sizeof(labels));
+  for (i = 1; i < alphabet_size; i++) {
+    if ((uint32_t)labels[i] < MINI_SYMBOLS_TABLE_SIZE) alphabet->symbols[labels[i]] = (uint8_t)i;
+  }
+  automat->alphabet = alphabet;
+  automat->alphabet_size = (uint16_t)alphabet_size;
+  automat->delimiter_symbol = mini_symbol(automat->alphabet, automat->alphabet_size, ANNOTATION_DELIMITER);
+  automat->states = states;
+  automat->transitions = transitions;
+  automat->annotations.codes = NULL;
+  automat->annotations.count = 0;
+  first = 0;
+  for (i = 0; i < states_count; i++) {
+    decoded = states_map[order[i]];
+    row = NULL;
+    if (decoded->transitions_count > MINI_DENSE_FANOUT) {
+      row = transitions + first;
+      first += (uint32_t)alphabet_size;
+    }
+    states[i] = first | (decoded->is_final ? MINI_FINAL_STATE : 0) | (row != NULL ? MINI_DENSE_STATE : 0);
+    for (k = 0; k < decoded->transitions_count; k++, first++) {
+      transition = ((uint32_t)mini_symbol(automat->alphabet, automat->alphabet_size, decoded->transitions[k].label) << 24) |
+        numbers[decoded->transitions[k].target];
+      transitions[first] = transition;
+      if (row != NULL) row[MINI_TRANSITION_SYMBOL(transition)] = transition;
+    }
+  }
+  states[states_count] = first;
+  for (i = 0; i < states_count; i++) strict_free(states_map[i]);
+  strict_free(order);
+  strict_free(numbers);
   return automat;
 }
 
+static void *prepare_mini_automat(void **states_map, size_t states_count) {
+  return build_mini_automat(states_map, states_count, NULL);
+}
+
+/* Расставляет указатели автомата на части образа по его заголовку */
+static void bind_mini_automat(MiniAutomat *automat) {
+  const MiniAutomatHeader *header = automat->image;
+  automat->states_count = header->states_count;
+  automat->alphabet = (const MiniAlphabet *)((int8_t *)automat->image + header->alphabet_offset);
+  automat->alphabet_size = header->alphabet_size;
+  automat->delimiter_symbol = mini_symbol(automat->alphabet, automat->alphabet_size, ANNOTATION_DELIMITER);
+  automat->states = (const MiniState *)((int8_t *)automat->image + header->states_offset);
+  automat->transitions = (const MiniTransition *)((int8_t *)automat->image + header->transitions_offset);
+  automat->annotations.codes = (const uint32_t *)((int8_t *)automat->image + header->annotations_offset);
+  automat->annotations.count = header->annotations_count;
+}
+
+/* Дописывает таблицу аннотаций annotations в конец собранного в памяти образа */
+static void attach_mini_annotations(MiniAutomat *automat, const AnnotationTable *annotations) {
+  MiniAutomatHeader *header;
+  if (annotations->count == 0) return;
+  automat->image = strict_realloc(automat->image, automat->image_size + sizeof(uint32_t)*annotations->count);
+  header = automat->image;
+  header->annotations_offset = automat->image_size;
+  header->annotations_count = annotations->count;
+  memcpy((int8_t *)automat->image + automat->image_size, annotations->codes, sizeof(uint32_t)*annotations->count);
+  automat->image_size += sizeof(uint32_t)*annotations->count;
+  header->size = automat->image_size;
+  bind_mini_automat(automat);
+}
+
+/* Загружает автомат из файла полного автомата (automat.save), собирая
+   плоский образ в памяти процесса. Медленный путь - используется, если
+   готового плоского образа (см. map_mini_automat) нет. Таблица аннотаций
+   из конца файла переносится в конец образа. */
 void *load_mini_automat(char *automat_file_name) {
-  return load_automat_process(automat_file_name, 0, decode_state, decode_transition, prepare_mini_automat);
+  MiniAutomat *automat;
+  AnnotationTable annotations;
+  if (read_annotation_table(automat_file_name, &annotations) != 0) return NULL;
+  automat = (MiniAutomat *)load_automat_process(automat_file_name, 0, decode_state, decode_transition, prepare_mini_automat);
+  if (automat != NULL) attach_mini_annotations(automat, &annotations);
+  free_annotation_table(&annotations);
+  return automat;
+}
+
+/* Отображает в память готовый плоский образ автомата, созданный
+   save_mini_automat. Никакого разбора и выделения памяти под состояния не
+   делается - образ используется прямо на месте, только для чтения, а его
+   страницы разделяются между всеми процессами, открывшими тот же файл.
+   Возвращает NULL, если файла нет или он повреждён. */
+void *map_mini_automat(const char *mini_automat_file_name) {
+  MiniAutomat *automat;
+  const MiniAutomatHeader *header;
+  size_t image_size;
+  void *image = map_file_image(mini_automat_file_name, sizeof(MiniAutomatHeader), &image_size);
+  if (image == NULL) return NULL;
+  header = image;
+  if (memcmp(header->signature, MINI_AUTOMAT_SIGNATURE, sizeof(MINI_AUTOMAT_SIGNATURE)) != 0 ||
+      header->version != MINI_AUTOMAT_FORMAT_VERSION ||
+      header->label_size != sizeof(Label) ||
+      header->size != (uint64_t)image_size ||
+      header->states_count == 0 ||
+      header->states_count > MINI_MAX_STATES_COUNT ||
+      header->alphabet_size == 0 || header->alphabet_size > MINI_ALPHABET_SIZE ||
+      header->alphabet_offset + sizeof(MiniAlphabet) > header->size ||
+      header->states_offset + sizeof(MiniState)*((uint64_t)header->states_count + 1) > header->size ||
+      header->transitions_offset + sizeof(MiniTransition)*(uint64_t)header->transitions_count > header->size ||
+      header->annotations_offset + sizeof(uint32_t)*(uint64_t)header->annotations_count > header->size ||
+      (((const MiniState *)((int8_t *)image + header->states_offset))[header->states_count] &
+       MINI_FIRST_TRANSITION_MASK) + (uint64_t)MINI_TRANSITIONS_PADDING > header->transitions_count) {
+    unmap_file_image(image, image_size);
+    return NULL;
+  }
+  pthread_once(&mini_lookup_once, init_mini_lookup);
+  automat = strict_malloc(sizeof(*automat));
+  automat->image = image;
+  automat->image_size = image_size;
+  automat->is_mapped = 1;
+  bind_mini_automat(automat);
+  return automat;
+}
+
+/* Сохраняет плоский образ автомата в файл. Запись идёт во временный файл,
+   который затем атомарно подменяет старый - процессы, уже отобразившие
+   прежнюю версию, продолжают спокойно с ней работать.
+   Возвращает 0 при успехе. */
+int save_mini_automat(MiniAutomat *automat, const char *mini_automat_file_name) {
+  return save_file_image(automat->image, automat->image_size, mini_automat_file_name);
+}
+
+/* Преобразует сохранённый полный автомат в плоский образ для
+   map_mini_automat. Возвращает 0 при успехе. */
+int convert_mini_automat(char *automat_file_name, const char *mini_automat_file_name) {
+  int result;
+  MiniAutomat *automat = load_mini_automat(automat_file_name);
+  if (automat == NULL) return -1;
+  result = save_mini_automat(automat, mini_automat_file_name);
+  free_mini_automat(automat);
+  return result;
+}
+
+/* Перестраивает плоский образ automat по профилю visits - числу посещений
+   каждого его состояния на образцовых текстах (см. mini_profile_word).
+   Слова и выводы нового образа те же, меняются только номера состояний и
+   их порядок в образе (см. number_states_by_visits). Возвращает новый
+   образ в памяти или NULL. */
+MiniAutomat *reorder_mini_automat(const MiniAutomat *automat, const uint32_t visits[]) {
+  void **states_map = strict_malloc(sizeof(void *)*automat->states_count);
+  DecodedState *decoded;
+  MiniAutomat *result;
+  MiniTransition transition;
+  uint32_t state, first, last, k;
+  for (state = 0; state < automat->states_count; state++) {
+    mini_transitions_range(automat, state, &first, &last);
+    decoded = strict_malloc(sizeof(DecodedState) + sizeof(DecodedTransition)*(last - first));
+    decoded->is_final = (automat->states[state] & MINI_FINAL_STATE) != 0;
+    decoded->transitions_count = last - first;
+    for (k = 0; k < decoded->transitions_count; k++) {
+      transition = automat->transitions[first + k];
+      decoded->transitions[k].label = automat->alphabet->labels[MINI_TRANSITION_SYMBOL(transition)];
+      decoded->transitions[k].target = MINI_TRANSITION_TARGET(transition);
+    }
+    states_map[state] = decoded;
+  }
+  result = build_mini_automat(states_map, automat->states_count, visits);
+  strict_free(states_map);
+  if (result != NULL) attach_mini_annotations(result, &automat->annotations);
+  return result;
 }
 
 void free_mini_automat(MiniAutomat *automat) {
-  MiniStateHeader **state;
-  uint32_t i;
-  for (state = automat->states, i = 0; i < automat->states_count; i++, state++) {
-    strict_free(*state);
+  if (automat->is_mapped) {
+    unmap_file_image(automat->image, automat->image_size);
+  } else {
+    strict_free(automat->image);
   }
-  strict_free(automat->states);
   strict_free(automat);
 }
 
-inline MiniStateHeader *mini_find_transition(MiniAutomat *automat, MiniStateHeader *state, Label label) {
-  MiniTransition *transitions = (MiniTransition *)(state + 1);
-  MiniTransition *transition, *left, *right;
+static inline uint32_t mini_find_binary(const MiniTransition *transitions, uint32_t count, uint8_t symbol) {
+  const MiniTransition *transition, *left, *right;
   /* Двоичный поиск */
-  if (state->transitions_count > 0) {
-    left = transitions; right = transitions + state->transitions_count - 1;
+  if (count > 0) {
+    left = transitions; right = transitions + count - 1;
     do {
       transition = left + ((right - left) >> 1);
-      if (transition->label == label) return automat->states[transition->target];
+      if (MINI_TRANSITION_SYMBOL(*transition) == symbol) return MINI_TRANSITION_TARGET(*transition);
       else {
-        if (transition->label < label) {
+        if (MINI_TRANSITION_SYMBOL(*transition) < symbol) {
           left = transition + 1;
         } else {
           right = transition - 1;
@@ -91,57 +462,156 @@ inline MiniStateHeader *mini_find_transition(MiniAutomat *automat, MiniStateHead
       }
     } while (left <= right);
   }
-  return NULL;
-}
-
-void mini_collect_output(MiniAutomat *automat,
-			 MiniStateHeader *state,
-			 char is_prediction,
-			 size_t prefix_size,
-			 int depth,
-			 Label buffer[], 
-			 int buffer_size, 
-			 AutomatOutputProcessor on_complete,
-			 void *data) {
-
-  MiniStateHeader *target;
-  if (state->is_final) {
-    on_complete(is_prediction, prefix_size, buffer, data);
-    if (!is_prediction) return;
-  }
-  if (depth + 1 < buffer_size) {
-    if (depth == 0 && !is_prediction) {
-      target = mini_find_transition(automat, state, ANNOTATION_DELIMITER);
-      buffer[depth] = ANNOTATION_DELIMITER;
-      buffer[depth + 1] = L'\0';
-      mini_collect_output(automat, target, is_prediction, prefix_size, depth + 1, buffer, buffer_size, on_complete, data);
-    } else {
-      MiniTransition *transition = (MiniTransition *)(state + 1);
-      uint8_t i = 0;
-      for (i = 0; i < state->transitions_count; i++, transition++) {
-	buffer[depth] = (*transition).label;
-	buffer[depth + 1] = L'\0';
-	mini_collect_output(automat, automat->states[(*transition).target], is_prediction, prefix_size, depth + 1, buffer, buffer_size, on_complete, data);
-      }
-    }
+  return MINI_NO_STATE;
+}
+
+#ifdef MINI_SIMD_LOOKUP
+/* Векторный поиск среди не более чем MINI_DENSE_FANOUT переходов: символы
+   всех переходов сравниваются с искомым разом, лишние (за count) отсекаются
+   маской. Читать за концом переходов состояния безопасно благодаря
+   MINI_TRANSITIONS_PADDING. */
+static inline uint32_t mini_find_sse2(const MiniTransition *transitions, uint32_t count, uint8_t symbol) {
+  __m128i key = _mm_set1_epi32(symbol), block;
+  uint32_t mask = 0, i;
+  for (i = 0; i < count; i += 4) {
+    block = _mm_srli_epi32(_mm_loadu_si128((const __m128i *)(transitions + i)), 24);
+    mask |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(block, key))) << i;
+  }
+  mask &= (1u << count) - 1;
+  return mask ? MINI_TRANSITION_TARGET(transitions[__builtin_ctz(mask)]) : MINI_NO_STATE;
+}
+
+__attribute__((target("avx2")))
+static uint32_t mini_find_avx2(const MiniTransition *transitions, uint32_t count, uint8_t symbol) {
+  __m256i key = _mm256_set1_epi32(symbol), block;
+  uint32_t mask;
+  block = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)transitions), 24);
+  mask = (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, key)));
+  if (count > 8) {
+    block = _mm256_srli_epi32(_mm256_loadu_si256((const __m256i *)(transitions + 8)), 24);
+    mask |= (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(block, key))) << 8;
   }
+  mask &= (1u << count) - 1;
+  return mask ? MINI_TRANSITION_TARGET(transitions[__builtin_ctz(mask)]) : MINI_NO_STATE;
+}
+#endif
+
+/* Ищет переход из состояния state по символу symbol. Возвращает номер
+   целевого состояния или MINI_NO_STATE. */
+static inline uint32_t mini_find_transition(const MiniAutomat *automat, uint32_t state, uint8_t symbol) {
+  MiniState description = automat->states[state];
+  const MiniTransition *transitions = automat->transitions + (description & MINI_FIRST_TRANSITION_MASK);
+  MiniTransition transition;
+  uint32_t first, last;
+  if (symbol == 0) return MINI_NO_STATE;
+  if (description & MINI_DENSE_STATE) {
+    /* Таблица прямого доступа лежит перед обычными переходами */
+    transition = transitions[(int32_t)symbol - automat->alphabet_size];
+    return transition != 0 ? MINI_TRANSITION_TARGET(transition) : MINI_NO_STATE;
+  }
+  mini_transitions_range(automat, state, &first, &last);
+#ifdef MINI_SIMD_LOOKUP
+  if (mini_lookup == MINI_LOOKUP_AVX2) return mini_find_avx2(transitions, last - first, symbol);
+  if (mini_lookup == MINI_LOOKUP_SSE2) return mini_find_sse2(transitions, last - first, symbol);
+#endif
+  return mini_find_binary(transitions, last - first, symbol);
+}
+
+static int mini_is_final(const void *automat, uint32_t state) {
+  return (((const MiniAutomat *)automat)->states[state] & MINI_FINAL_STATE) != 0;
+}
+
+static uint32_t mini_transitions(const void *automat, uint32_t state, Label labels[], uint32_t targets[]) {
+  const MiniAutomat *mini = automat;
+  uint32_t i, last, count = 0;
+  mini_transitions_range(mini, state, &i, &last);
+  for (; i < last; i++, count++) {
+    labels[count] = mini->alphabet->labels[MINI_TRANSITION_SYMBOL(mini->transitions[i])];
+    targets[count] = MINI_TRANSITION_TARGET(mini->transitions[i]);
+  }
+  return count;
+}
+
+static const AutomatWalkOps mini_walk_ops = { mini_is_final, mini_transitions };
+
+/* Переход из состояния state по метке label (см. AutomatTransition) */
+uint32_t mini_transition(void *automat, uint32_t state, Label label) {
+  const MiniAutomat *mini = automat;
+  return mini_find_transition(mini, state, mini_symbol(mini->alphabet, mini->alphabet_size, label));
 }
 
-void mini_common_prefix(MiniAutomat *automat, Label word[], size_t word_length, size_t *prefix_size, MiniStateHeader **last_state) {
-  MiniStateHeader *match_transition;
-  MiniStateHeader *initial = automat->states[0];
+void mini_common_prefix(MiniAutomat *automat, Label word[], size_t word_length, size_t *prefix_size, uint32_t *last_state) {
+  uint32_t match_transition;
   size_t i;
-  *last_state = initial;
+  *last_state = 0;
   *prefix_size = 0;
   for (i = 0; i < word_length; i++) {
-    match_transition = mini_find_transition(automat, *last_state, word[i]);
-    if (match_transition != NULL) {
+    match_transition = mini_find_transition(automat, *last_state, mini_symbol(automat->alphabet, automat->alphabet_size, word[i]));
+    if (match_transition != MINI_NO_STATE) {
       (*prefix_size)++;
       *last_state = match_transition;
     } else break;
   }
 }
 
+/* Пакетный вариант mini_common_prefix: проводит по автомату сразу count
+   слов words (длины word_lengths) и для каждого записывает в prefixes длину
+   узнанного префикса и последнее состояние.
+
+   Шаг по автомату - это два зависимых чтения: описание состояния, а по нему
+   его переходы; на большом словаре оба обычно промахиваются мимо кэша. Здесь
+   до MINI_BATCH_WIDTH слов идут по автомату вперемешку, по кругу: пока для
+   одного слова подгружаются описание состояния и его переходы (prefetch),
+   делаются шаги других слов, так что промахи разных слов перекрываются.
+   Результат тот же, что и у mini_common_prefix для каждого слова. */
+void mini_common_prefix_batch(void *automat,
+                              Label *const words[], const size_t word_lengths[], size_t count,
+                              AutomatPrefix prefixes[]) {
+  const MiniAutomat *mini = automat;
+  size_t lanes[MINI_BATCH_WIDTH], lanes_count = 0, next_word = 0, word, i;
+  uint32_t states[MINI_BATCH_WIDTH], target;
+  uint8_t symbols[MINI_BATCH_WIDTH];
+  while (next_word < count || lanes_count > 0) {
+    /* Освободившиеся дорожки занимают следующие слова */
+    while (lanes_count < MINI_BATCH_WIDTH && next_word < count) {
+      prefixes[next_word].prefix_size = 0;
+      prefixes[next_word].last_state = 0;
+      if (word_lengths[next_word] > 0) {
+        lanes[lanes_count] = next_word;
+        states[lanes_count] = 0;
+        lanes_count++;
+      }
+      next_word++;
+    }
+    /* Описания состояний уже загружены (или загружаются) - заказываем их
+       переходы и заодно находим символы */
+    for (i = 0; i < lanes_count; i++) {
+      word = lanes[i];
+      symbols[i] = mini_symbol(mini->alphabet, mini->alphabet_size, words[word][prefixes[word].prefix_size]);
+      __builtin_prefetch(mini->transitions + (mini->states[states[i]] & MINI_FIRST_TRANSITION_MASK));
+    }
+    /* Шаг каждого слова; следующее состояние заказывается заранее */
+    for (i = 0; i < lanes_count; ) {
+      word = lanes[i];
+      target = mini_find_transition(mini, states[i], symbols[i]);
+      if (target != MINI_NO_STATE) {
+        states[i] = target;
+        if (++prefixes[word].prefix_size < word_lengths[word]) {
+          __builtin_prefetch(mini->states + target);
+          i++;
+          continue;
+        }
+      }
+      /* Слово пройдено или дальше не узнаётся - дорожка освобождается */
+      prefixes[word].last_state = states[i];
+      lanes_count--;
+      lanes[i] = lanes[lanes_count];
+      states[i] = states[lanes_count];
+      symbols[i] = symbols[lanes_count];
+    }
+  }
+}
+
 /* Определяет максимальную длину куска инвертированного слова word, которую
  * автомат ещё может "узнать". Если точно такое слово уже есть в автомате,
  * возвращаемая длина будет точно совпадать со значением word_length.
@@ -150,7 +620,7 @@ void mini_common_prefix(MiniAutomat *automat, Label word[], size_t word_length,
  * слово полнее всего. */
 size_t mini_common_prefix_size(void *automat, Label word[], size_t word_length) {
     size_t prefix_size;
-    MiniStateHeader *last_state;
+    uint32_t last_state;
     mini_common_prefix(automat, word, word_length, &prefix_size, &last_state);
     return prefix_size;
 }
@@ -162,19 +632,85 @@ size_t mini_common_prefix_size(void *automat, Label word[], size_t word_length)
    предсказание производиться не будет.
    В результате работы делаются вызовы функции on_complete, в которую передаётся
    очередной вывод, данные data и флаг, указывающий на то идёт ли сейчас предсказание.
+   Перебор ограничен limits (см. walk_automat_outputs).
  */
 void mini_possible_outputs(void *automat,
 			   Label word[], size_t word_length, 
 			   size_t min_prediction_prefix,
+			   const AutomatOutputLimits *limits,
 			   AutomatOutputProcessor on_complete,
 			   void *data) {
-  size_t prefix_size;
-  MiniStateHeader *last_state;
-  wchar_t buffer[MAX_AUTOMAT_OUTPUT_SIZE];
-  mini_common_prefix(automat, word, word_length, &prefix_size, &last_state);
-  if (prefix_size == word_length && mini_find_transition(automat, last_state, ANNOTATION_DELIMITER)) {
-    mini_collect_output(automat, last_state, 0, prefix_size, 0, buffer, MAX_AUTOMAT_OUTPUT_SIZE, on_complete, data);
+  AutomatPrefix prefix;
+  mini_common_prefix(automat, word, word_length, &prefix.prefix_size, &prefix.last_state);
+  mini_prefix_outputs(automat, &prefix, word_length, min_prediction_prefix, limits, on_complete, data);
+}
+
+/* Выводы слова длиной word_length, уже пройденного до prefix (например,
+   mini_common_prefix_batch) - вторая половина mini_possible_outputs */
+void mini_prefix_outputs(void *automat,
+                         const AutomatPrefix *prefix, size_t word_length,
+                         size_t min_prediction_prefix,
+                         const AutomatOutputLimits *limits,
+                         AutomatOutputProcessor on_complete,
+                         void *data) {
+  if (prefix->prefix_size == word_length &&
+      mini_find_transition(automat, prefix->last_state, ((MiniAutomat *)automat)->delimiter_symbol) != MINI_NO_STATE) {
+    walk_automat_outputs(automat, &mini_walk_ops, prefix->last_state, 0, prefix->prefix_size, limits, on_complete, data);
+  } else if (prefix->prefix_size >= min_prediction_prefix) {
+    walk_automat_outputs(automat, &mini_walk_ops, prefix->last_state, 1, prefix->prefix_size, limits, on_complete, data);
+  }
+}
+
+/* Профиль: автомат и счётчики посещений его состояний */
+typedef struct {
+  const MiniAutomat *automat;
+  uint32_t *visits;
+} MiniProfile;
+
+static inline void count_visit(uint32_t visits[], uint32_t state) {
+  if (visits[state] < UINT32_MAX) visits[state]++;
+}
+
+static int profile_is_final(const void *profile, uint32_t state) {
+  return mini_is_final(((const MiniProfile *)profile)->automat, state);
+}
+
+static uint32_t profile_transitions(const void *profile, uint32_t state, Label labels[], uint32_t targets[]) {
+  const MiniProfile *mini_profile = profile;
+  count_visit(mini_profile->visits, state);
+  return mini_transitions(mini_profile->automat, state, labels, targets);
+}
+
+static const AutomatWalkOps mini_profile_walk_ops = { profile_is_final, profile_transitions };
+
+static void skip_output(char is_prediction, size_t prefix_size, size_t prediction_size, uint32_t annotation, void *data) {}
+
+/* Проходит инвертированное слово word по автомату так же, как
+   mini_possible_outputs (с теми же min_prediction_prefix и limits), но
+   вместо выдачи выводов прибавляет в visits по единице каждому посещённому
+   состоянию. Используется для сбора профиля, по которому
+   reorder_mini_automat раскладывает состояния. */
+void mini_profile_word(const MiniAutomat *automat,
+                       Label word[], size_t word_length,
+                       size_t min_prediction_prefix,
+                       const AutomatOutputLimits *limits,
+                       uint32_t visits[]) {
+  MiniProfile profile;
+  uint32_t state = 0, target;
+  size_t prefix_size = 0;
+  profile.automat = automat;
+  profile.visits = visits;
+  count_visit(visits, state);
+  for (; prefix_size < word_length; prefix_size++) {
+    target = mini_find_transition(automat, state, mini_symbol(automat->alphabet, automat->alphabet_size, word[prefix_size]));
+    if (target == MINI_NO_STATE) break;
+    state = target;
+    count_visit(visits, state);
+  }
+  if (prefix_size == word_length &&
+      mini_find_transition(automat, state, automat->delimiter_symbol) != MINI_NO_STATE) {
+    walk_automat_outputs(&profile, &mini_profile_walk_ops, state, 0, prefix_size, limits, skip_output, NULL);
   } else if (prefix_size >= min_prediction_prefix) {
-    mini_collect_output(automat, last_state, 1, prefix_size, 0, buffer, MAX_AUTOMAT_OUTPUT_SIZE, on_complete, data);
+    walk_automat_outputs(&profile, &mini_profile_walk_ops, state, 1, prefix_size, limits, skip_output, NULL);
   }
 }
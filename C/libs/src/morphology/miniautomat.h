@@ -13,30 +13,147 @@
 #include <stdlib.h>
 
 #include "automat.h"
+#include "annotations.h"
 #include "wordforms.h"
 
+#define MINI_AUTOMAT_SIGNATURE "MORPHFA"
+#define MINI_AUTOMAT_FORMAT_VERSION 5
+
+/* Заголовок "плоского" образа автомата. Образ целиком, без изменений,
+   пишется в файл и потом отображается в память через mmap. */
 typedef struct {
-  int8_t is_final;
-  uint8_t transitions_count;
-} MiniStateHeader;
+  char signature[8];
+  uint32_t version;
+  uint8_t label_size;
+  uint8_t reserved;
+  uint16_t alphabet_size;
+  uint32_t states_count;
+  uint32_t transitions_count; /* Длина массива переходов, см. MiniTransition */
+  uint64_t alphabet_offset; /* Смещение алфавита (см. MiniAlphabet) от начала образа */
+  uint64_t states_offset; /* Смещение массива состояний */
+  uint64_t transitions_offset; /* Смещение массива переходов */
+  uint64_t annotations_offset; /* Смещение таблицы аннотаций (см. annotations.h) */
+  uint32_t annotations_count; /* 0 - таблицы нет */
+  uint32_t reserved2;
+  uint64_t size; /* Полный размер образа */
+} MiniAutomatHeader;
+
+/* Автомат хранится в виде CSR (compressed sparse row): состояние - это
+   индекс первого из его переходов в общем массиве переходов, а число
+   переходов - разность с индексом следующего состояния (в конце массива
+   состояний есть ещё один, замыкающий элемент). Старший бит - признак
+   конечного состояния. Состояния пронумерованы обходом в ширину от
+   начального, поэтому близкие к корню (самые горячие) состояния и их
+   переходы лежат рядом и делят одни и те же строки кэша. Если словарь
+   собран с образцом текстов (morph-compile -p), порядок другой: первыми
+   идут состояния, через которые чаще всего проходили слова образца (см.
+   reorder_mini_automat). Начальное состояние всегда нулевое.
 
-typedef struct mini_transition {
-  Label label;
-  uint32_t target;
-} MiniTransition;
+   У состояний с числом переходов больше MINI_DENSE_FANOUT (корень и его
+   ближайшие соседи) перед обычными переходами лежит ещё таблица прямого
+   доступа: по переходу (или 0) на каждый символ алфавита. Такие состояния
+   помечены битом MINI_DENSE_STATE. */
+typedef uint32_t MiniState;
+
+#define MINI_FINAL_STATE 0x80000000u
+#define MINI_DENSE_STATE 0x40000000u
+#define MINI_FIRST_TRANSITION_MASK 0x3fffffffu
+#define MINI_DENSE_FANOUT 16
+#define MINI_NO_STATE UINT32_MAX
+/* Сколько слов mini_common_prefix_batch ведёт по автомату одновременно */
+#define MINI_BATCH_WIDTH 16
+
+/* Алфавит языка. Автомат одного языка использует меньше сотни различных
+   меток, поэтому в переходах хранится не сама метка, а её номер в алфавите -
+   символ, умещающийся в байт. Символы раздаются в порядке возрастания
+   меток, так что порядок переходов по символам совпадает с порядком по
+   меткам. Символ 0 означает метку, которой в автомате нет. */
+#define MINI_ALPHABET_SIZE 256
+/* Для меток меньше этой границы (латиница, кириллица, греческий...) символ
+   берётся из таблицы прямым индексом, для остальных - двоичным поиском */
+#define MINI_SYMBOLS_TABLE_SIZE 2048
+
+typedef struct {
+  Label labels[MINI_ALPHABET_SIZE]; /* Символ -> метка, по возрастанию */
+  uint8_t symbols[MINI_SYMBOLS_TABLE_SIZE]; /* Метка -> символ */
+} MiniAlphabet;
+
+/* Переход упакован в 32 бита: старший байт - символ, остальные 24 бита -
+   номер целевого состояния. Переходы одного состояния отсортированы по
+   символу. Массив переходов дополнен в конце MINI_TRANSITIONS_PADDING
+   нулями, чтобы векторное сравнение могло читать переходы блоками по 16, не
+   выходя за границу образа. */
+typedef uint32_t MiniTransition;
+
+#define MINI_TRANSITION_SYMBOL(transition) ((uint8_t)((transition) >> 24))
+#define MINI_TRANSITION_TARGET(transition) ((transition) & 0x00ffffffu)
+#define MINI_MAX_STATES_COUNT 0x01000000u
+#define MINI_TRANSITIONS_PADDING 16
 
 typedef struct {
   uint32_t states_count;
-  MiniStateHeader **states;
+  const MiniAlphabet *alphabet;
+  uint16_t alphabet_size;
+  uint8_t delimiter_symbol; /* Символ ANNOTATION_DELIMITER */
+  const MiniState *states;
+  const MiniTransition *transitions;
+  AnnotationTable annotations;
+  void *image;
+  size_t image_size;
+  int8_t is_mapped;
 } MiniAutomat;
 
+/* Возвращает символ алфавита для метки label или 0, если такой метки в
+   автомате нет */
+static inline uint8_t mini_symbol(const MiniAlphabet *alphabet, uint16_t alphabet_size, Label label) {
+  const Label *left, *right, *middle;
+  if ((uint32_t)label < MINI_SYMBOLS_TABLE_SIZE) return alphabet->symbols[label];
+  left = alphabet->labels + 1;
+  right = alphabet->labels + alphabet_size - 1;
+  while (left <= right) {
+    middle = left + ((right - left) >> 1);
+    if (*middle == label) return (uint8_t)(middle - alphabet->labels);
+    if (*middle < label) left = middle + 1;
+    else right = middle - 1;
+  }
+  return 0;
+}
+
+/* Границы обычных (не табличных) переходов состояния state в массиве
+   переходов: [first, last) */
+static inline void mini_transitions_range(const MiniAutomat *automat, uint32_t state, uint32_t *first, uint32_t *last) {
+  MiniState next = automat->states[state + 1];
+  *first = automat->states[state] & MINI_FIRST_TRANSITION_MASK;
+  *last = (next & MINI_FIRST_TRANSITION_MASK) - ((next & MINI_DENSE_STATE) ? automat->alphabet_size : 0);
+}
+
 void *load_mini_automat(char *automat_file_name);
+void *map_mini_automat(const char *mini_automat_file_name);
+int save_mini_automat(MiniAutomat *automat, const char *mini_automat_file_name);
+int convert_mini_automat(char *automat_file_name, const char *mini_automat_file_name);
+MiniAutomat *reorder_mini_automat(const MiniAutomat *automat, const uint32_t visits[]);
 void free_mini_automat(MiniAutomat *automat);
-void mini_possible_outputs(void *automat, 
-			   Label word[], size_t word_length, 
+void mini_possible_outputs(void *automat,
+			   Label word[], size_t word_length,
 			   size_t min_prediction_prefix,
+			   const AutomatOutputLimits *limits,
 			   AutomatOutputProcessor on_complete,
 			   void *data);
 size_t mini_common_prefix_size(void *automat, Label word[], size_t word_length);
+uint32_t mini_transition(void *automat, uint32_t state, Label label);
+void mini_common_prefix_batch(void *automat,
+                              Label *const words[], const size_t word_lengths[], size_t count,
+                              AutomatPrefix prefixes[]);
+void mini_prefix_outputs(void *automat,
+                         const AutomatPrefix *prefix, size_t word_length,
+                         size_t min_prediction_prefix,
+                         const AutomatOutputLimits *limits,
+                         AutomatOutputProcessor on_complete,
+                         void *data);
+void mini_profile_word(const MiniAutomat *automat,
+                       Label word[], size_t word_length,
+                       size_t min_prediction_prefix,
+                       const AutomatOutputLimits *limits,
+                       uint32_t visits[]);
 
 #endif /* __MORPHOLOGY_MINIAUTOMAT_H__ */
@@ -33,9 +33,22 @@
 #include "common/strtools.h"
 #include "morphology/dictinfo.h"
 
-MultiMorphology *init_multi_morphology(const char *all_dicts_root, size_t description_cache_size) {
+/* Больше стольких языков detect_language проверяет по очереди */
+#define DETECT_LANGUAGE_MAX_LANES 32
+
+/* get_word_lemmas_scratch или get_word_tags_scratch */
+typedef ArrayList *(*ScratchWordAnalyzer)(const wchar_t *word, size_t word_size, Morphology *morphology,
+                                          AnalysisScratch *scratch);
+
+/* Загружает словари всех языков из каталога all_dicts_root. Если lazy_load
+ * не 0, сразу загружается только основной (первый) язык, а остальные - когда
+ * они впервые понадобятся detect_language или get_dictionary. */
+MultiMorphology *init_multi_morphology(const char *all_dicts_root, size_t description_cache_size,
+                                       char lazy_load) {
   MultiMorphology *result = strict_malloc(sizeof(*result));
-  result->languages = load_dictionaries(all_dicts_root, &result->languages_count, description_cache_size);
+  result->languages = load_dictionaries(all_dicts_root, &result->languages_count, description_cache_size,
+                                        lazy_load);
+  result->references = 1;
   return result;
 }
 
@@ -44,6 +57,20 @@ void free_multi_morphology(MultiMorphology *instance) {
   strict_free(instance);
 }
 
+/* Подсчёт ссылок нужен при горячей перезагрузке словарей: старая версия
+ * морфологии освобождается, только когда её отпустит последний читатель.
+ * Только что созданный объект уже имеет одного владельца. */
+MultiMorphology *acquire_multi_morphology(MultiMorphology *instance) {
+  __atomic_add_fetch(&instance->references, 1, __ATOMIC_RELAXED);
+  return instance;
+}
+
+void release_multi_morphology(MultiMorphology *instance) {
+  if (__atomic_sub_fetch(&instance->references, 1, __ATOMIC_ACQ_REL) == 0) {
+    free_multi_morphology(instance);
+  }
+}
+
 /* Возвращает словарь конкретного языка, если он был загружен, или
  * NULL. Используется в тестах, когда надо работать со словарём конкретного языка */
 Dictionary *get_dictionary(MultiMorphology *multi_morpher, const char *language_name,
@@ -52,32 +79,115 @@ Dictionary *get_dictionary(MultiMorphology *multi_morpher, const char *language_
   Dictionary **language;
   for (i = 0, language = multi_morpher->languages; i < multi_morpher->languages_count; ++i, ++language) {
     if (strncmp(dictionary_name(*language), language_name, language_name_length) == 0) {
-      return *language;
+      return (dictionary_morphology(*language) != NULL) ? *language : NULL;
     }
   }
   return NULL;
 }
 
-/* Определяет язык слова word, возвращая ссылку на соответствующий ему
- * словарь. Если слово совершенно непохоже ни на один язык, возвращается NULL. */
-Dictionary *detect_language(MultiMorphology *multi_morpher, const wchar_t *word, size_t word_length) {
+/* Определяет язык слова word по очереди, язык за языком: первый язык,
+ * автомат которого узнаёт слово целиком, или язык, узнающий самую длинную
+ * его часть. Ещё не загруженные словари при этом загружаются. */
+static Dictionary *detect_language_sequential(MultiMorphology *multi_morpher, const wchar_t *word,
+                                              size_t word_length) {
   size_t i, known_length, max_known = 0;
   Dictionary **language, *result = NULL;
-  if (!is_garbage_word(word, word_length)) {
-    for (i = 0, language = multi_morpher->languages; i < multi_morpher->languages_count; ++i, ++language) {
-      known_length = known_part_of_word(dictionary_morphology(multi_morpher->languages[i]), word, word_length);
-      if (known_length == word_length) {
-        return *language;
-      }
-      if (known_length > max_known) {
-        result = *language;
-        max_known = known_length;
-      }
+  Morphology *morphology;
+  for (i = 0, language = multi_morpher->languages; i < multi_morpher->languages_count; ++i, ++language) {
+    morphology = dictionary_morphology(*language);
+    if (morphology == NULL) continue;
+    known_length = known_part_of_word(morphology, word, word_length);
+    if (known_length == word_length) {
+      return *language;
+    }
+    if (known_length > max_known) {
+      result = *language;
+      max_known = known_length;
     }
   }
   return result;
 }
 
+/* Определяет язык слова word, возвращая ссылку на соответствующий ему
+ * словарь. Если слово совершенно непохоже ни на один язык, возвращается NULL.
+ *
+ * Результат тот же, что у detect_language_sequential, но слово не
+ * копируется и проходится один раз: буква за буквой с конца, автоматы всех
+ * загруженных языков делают шаг вместе, и язык выбывает на первой
+ * незнакомой ему букве. Как только язык остаётся один, он и есть ответ -
+ * остаток слова можно не проходить.
+ *
+ * Языки, в автомате которых нет ни одной буквы письменности "чистого"
+ * (только латиница или только кириллица) слова, не узнают в нём ни буквы и
+ * не проверяются вовсе - так слово одной письменности сразу попадает к
+ * языкам с этой письменностью. Если же какие-то словари ещё не загружены
+ * (отложенная загрузка) и ответ может зависеть от них, язык определяется
+ * по очереди, с их загрузкой. */
+Dictionary *detect_language(MultiMorphology *multi_morpher, const wchar_t *word, size_t word_length) {
+  Morphology *morphologies[DETECT_LANGUAGE_MAX_LANES];
+  uint32_t states[DETECT_LANGUAGE_MAX_LANES], target;
+  size_t languages[DETECT_LANGUAGE_MAX_LANES], lanes_count = 0, alive, lane, i, known_length = 0;
+  size_t first_pending = multi_morpher->languages_count, winner;
+  unsigned int scripts;
+  int8_t load_state;
+  if (is_garbage_word(word, word_length)) return NULL;
+  scripts = word_scripts(word, word_length);
+  if (scripts != SCRIPT_LATIN && scripts != SCRIPT_CYRILLIC) {
+    scripts = 0;
+  }
+  if (multi_morpher->languages_count > DETECT_LANGUAGE_MAX_LANES) {
+    return detect_language_sequential(multi_morpher, word, word_length);
+  }
+  for (i = 0; i < multi_morpher->languages_count; i++) {
+    load_state = dictionary_load_state(multi_morpher->languages[i]);
+    if (load_state == DICTIONARY_LOADED) {
+      morphologies[lanes_count] = dictionary_morphology(multi_morpher->languages[i]);
+      if (scripts != 0 && (morphologies[lanes_count]->scripts & scripts) == 0) continue;
+      states[lanes_count] = 0;
+      languages[lanes_count] = i;
+      lanes_count++;
+    } else if (load_state == DICTIONARY_NOT_LOADED && first_pending == multi_morpher->languages_count) {
+      first_pending = i;
+    }
+  }
+  if (lanes_count == 0) {
+    return first_pending < multi_morpher->languages_count ?
+      detect_language_sequential(multi_morpher, word, word_length) : NULL;
+  }
+  /* Дорожки остаются упорядоченными по номеру языка, так что при равной
+   * узнанной длине выигрывает первый язык */
+  winner = languages[0];
+  for (; known_length < word_length; known_length++) {
+    for (lane = 0, alive = 0; lane < lanes_count; lane++) {
+      target = morphologies[lane]->automat_transition(morphologies[lane]->automat, states[lane],
+                                                      word[word_length - 1 - known_length]);
+      if (target != MINI_NO_STATE) {
+        morphologies[alive] = morphologies[lane];
+        states[alive] = target;
+        languages[alive] = languages[lane];
+        alive++;
+      }
+    }
+    lanes_count = alive;
+    if (alive == 0) break;
+    winner = languages[0];
+    if (alive == 1 && first_pending == multi_morpher->languages_count) {
+      /* Остальные языки узнают меньше */
+      return multi_morpher->languages[winner];
+    }
+  }
+  if (known_length == word_length) {
+    /* Слово целиком узнали языки на оставшихся дорожках. Не загруженные
+     * словари важны, только если идут раньше первого из них. */
+    if (first_pending < winner) return detect_language_sequential(multi_morpher, word, word_length);
+  } else if (first_pending < multi_morpher->languages_count) {
+    return detect_language_sequential(multi_morpher, word, word_length);
+  } else if (known_length == 0) {
+    return NULL;
+  }
+  return multi_morpher->languages[winner];
+}
+
 static Dictionary *main_language(MultiMorphology *multi_morpher) {
   return (multi_morpher->languages_count > 0 ? multi_morpher->languages[0] : NULL);
 }
@@ -128,6 +238,90 @@ ArrayList *multilang_word_forms(MultiMorphology *multi_morpher,
   return result;
 }
 
+/* Разбор слова функцией analyzer (get_word_lemmas_scratch или
+ * get_word_tags_scratch) на предпочтительном языке, а если слова в нём нет -
+ * на определённом (см. multilang_word_forms) */
+static ArrayList *multilang_analyze_scratch(MultiMorphology *multi_morpher,
+                                            Dictionary *suggested_language,
+                                            const wchar_t *word, size_t word_length,
+                                            ScratchWordAnalyzer analyzer,
+                                            AnalysisScratch *scratch,
+                                            Dictionary **detected_language) {
+  ArrayList *result;
+  if (suggested_language != NULL) {
+    result = analyzer(word, word_length, dictionary_morphology(suggested_language), scratch);
+    if (array_list_size(result) > 0) {
+      *detected_language = suggested_language;
+      return result;
+    }
+  }
+  *detected_language = detect_language(multi_morpher, word, word_length);
+  result = analyzer(word, word_length,
+                    dictionary_morphology((*detected_language != NULL) ?
+                                          *detected_language
+                                          : main_language(multi_morpher)),
+                    scratch);
+  if (array_list_size(result) == 0) {
+    *detected_language = NULL;
+  }
+  return result;
+}
+
+/* То же, что multilang_word_forms, но для лемм и в рабочей памяти scratch
+ * (get_word_lemmas_scratch): леммы действительны до следующего разбора с
+ * тем же scratch. */
+ArrayList *multilang_word_lemmas_scratch(MultiMorphology *multi_morpher,
+                                         Dictionary *suggested_language,
+                                         const wchar_t *word, size_t word_length,
+                                         AnalysisScratch *scratch,
+                                         Dictionary **detected_language) {
+  return multilang_analyze_scratch(multi_morpher, suggested_language, word, word_length,
+                                   get_word_lemmas_scratch, scratch, detected_language);
+}
+
+/* То же, что multilang_word_lemmas_scratch, но леммы - с грамматикой самого
+ * слова (get_word_tags_scratch) */
+ArrayList *multilang_word_tags_scratch(MultiMorphology *multi_morpher,
+                                       Dictionary *suggested_language,
+                                       const wchar_t *word, size_t word_length,
+                                       AnalysisScratch *scratch,
+                                       Dictionary **detected_language) {
+  return multilang_analyze_scratch(multi_morpher, suggested_language, word, word_length,
+                                   get_word_tags_scratch, scratch, detected_language);
+}
+
+/* Описание слова, которого не оказалось в словаре предпочтительного языка
+ * suggested_language (см. multilang_word_description): язык определяется
+ * заново, а если не определился - слово описывается основным языком. */
+static char *describe_unsuggested_word(MultiMorphology *multi_morpher,
+                                       Dictionary *suggested_language,
+                                       const wchar_t *word, size_t word_length,
+                                       const char *mb_word, size_t mb_word_length,
+                                       int is_garbage_word,
+                                       size_t *result_length, Dictionary **detected_language) {
+  char *result;
+  if (!is_garbage_word) {
+    *detected_language = detect_language(multi_morpher, word, word_length);
+  }
+  result = make_word_description(word, word_length, mb_word, mb_word_length,
+                                 dictionary_morphology(
+                                     is_garbage_word || *detected_language == NULL ?
+                                     main_language(multi_morpher)
+                                     : *detected_language),
+                                 0,
+                                 &is_garbage_word,
+                                 result_length);
+  if (!is_garbage_word) {
+    if (*detected_language == suggested_language) {
+      /* предсказание выдало уже рекомендованный язык, но слова в словаре
+       * не было, и даже предсказание не сработало. Значит, формально, язык
+       * остался неизвестным. */
+      *detected_language = NULL;
+    }
+  }
+  return result;
+}
+
 /* Полный аналог функции make_word_description (из helpers.c), но умеющий сам
  * определять язык передаваемого слова и искать начальные формы в его
  * контексте.
@@ -173,25 +367,9 @@ char *multilang_word_description(MultiMorphology *multi_morpher,
                                    &is_garbage_word,
                                    result_length);
     if (result == NULL) {
-      if (!is_garbage_word) {
-        *detected_language = detect_language(multi_morpher, word, word_length);
-      }
-      result = make_word_description(word, word_length, mb_word, mb_word_length,
-                                     dictionary_morphology(
-                                         is_garbage_word || *detected_language == NULL ?
-                                         main_language(multi_morpher)
-                                         : *detected_language),
-                                     0,
-                                     &is_garbage_word,
-                                     result_length);
-      if (!is_garbage_word) {
-        if (*detected_language == suggested_language) {
-          /* предсказание выдало уже рекомендованный язык, но слова в словаре
-           * не было, и даже предсказание не сработало. Значит, формально, язык
-           * остался неизвестным. */
-          *detected_language = NULL;
-        }
-      }
+      result = describe_unsuggested_word(multi_morpher, suggested_language,
+                                         word, word_length, mb_word, mb_word_length,
+                                         is_garbage_word, result_length, detected_language);
     } else {
       *detected_language = suggested_language;
     }
@@ -199,3 +377,69 @@ char *multilang_word_description(MultiMorphology *multi_morpher,
   strict_free(converted_word);
   return (char *) result;
 }
+
+/* То же, что multilang_word_description, но сразу для count слов с одним
+ * предпочтительным языком: результат для i-го слова записывается в
+ * results[i], result_lengths[i] и detected_languages[i]. Слова words
+ * обязательны. Слова, которые есть в словаре предпочтительного языка (а
+ * это почти все слова текста на этом языке), анализируются вместе
+ * (make_words_descriptions), остальные - по одному.
+ * Описание останавливается на первом слове, язык которого определился и
+ * отличается от suggested_language: для следующих слов предпочтительным был
+ * бы уже его язык. Возвращает число описанных слов, results остальных не
+ * заполняются.
+ * Если pin_language не 0, язык suggested_language закреплён: слова, которых
+ * нет в его словаре, описываются (предсказываются) им же, без определения
+ * языка. */
+size_t multilang_words_descriptions(MultiMorphology *multi_morpher,
+                                    Dictionary *suggested_language, int pin_language,
+                                    const wchar_t *const words[], const size_t word_lengths[],
+                                    const char *const mb_words[], const size_t mb_word_lengths[],
+                                    size_t count,
+                                    char *results[], size_t result_lengths[],
+                                    Dictionary *detected_languages[]) {
+  int *is_garbage;
+  size_t i, j;
+  if (suggested_language == NULL) {
+    for (i = 0; i < count; i++) {
+      results[i] = multilang_word_description(multi_morpher, NULL, words[i], word_lengths[i],
+                                              mb_words[i], mb_word_lengths[i],
+                                              &result_lengths[i], &detected_languages[i]);
+      if (detected_languages[i] != NULL) return i + 1;
+    }
+    return count;
+  }
+  is_garbage = strict_malloc(sizeof(int)*count);
+  if (pin_language) {
+    make_words_descriptions(words, word_lengths, mb_words, mb_word_lengths, count,
+                            dictionary_morphology(suggested_language), 0,
+                            is_garbage, results, result_lengths);
+    for (i = 0; i < count; i++) {
+      detected_languages[i] = is_garbage[i] ? NULL : suggested_language;
+    }
+    strict_free(is_garbage);
+    return count;
+  }
+  make_words_descriptions(words, word_lengths, mb_words, mb_word_lengths, count,
+                          dictionary_morphology(suggested_language), 1,
+                          is_garbage, results, result_lengths);
+  for (i = 0; i < count; i++) {
+    if (results[i] == NULL) {
+      detected_languages[i] = NULL; /* Так и останется для мусорных слов */
+      results[i] = describe_unsuggested_word(multi_morpher, suggested_language,
+                                             words[i], word_lengths[i], mb_words[i], mb_word_lengths[i],
+                                             is_garbage[i], &result_lengths[i], &detected_languages[i]);
+      if (detected_languages[i] != NULL) {
+        for (j = i + 1; j < count; j++) {
+          if (results[j] != NULL) strict_free(results[j]);
+        }
+        strict_free(is_garbage);
+        return i + 1;
+      }
+    } else {
+      detected_languages[i] = suggested_language;
+    }
+  }
+  strict_free(is_garbage);
+  return count;
+}
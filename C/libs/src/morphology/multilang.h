@@ -7,10 +7,14 @@
 typedef struct {
   Dictionary **languages;
   size_t languages_count;
+  int references; /* Число владельцев (см. acquire_multi_morphology) */
 } MultiMorphology;
 
-MultiMorphology *init_multi_morphology(const char *all_dicts_root, size_t description_cache_size);
+MultiMorphology *init_multi_morphology(const char *all_dicts_root, size_t description_cache_size,
+                                       char lazy_load);
 void free_multi_morphology(MultiMorphology *instance);
+MultiMorphology *acquire_multi_morphology(MultiMorphology *instance);
+void release_multi_morphology(MultiMorphology *instance);
 Dictionary *get_dictionary(MultiMorphology *multi_morpher, const char *language_name, size_t language_name_length);
 Dictionary *detect_language(MultiMorphology *multi_morpher, const wchar_t *word, size_t word_length);
 char *multilang_word_description(MultiMorphology *multi_morpher,
@@ -18,8 +22,25 @@ char *multilang_word_description(MultiMorphology *multi_morpher,
                                        const wchar_t *word, size_t word_length,
                                        const char *mb_word, size_t mb_word_length,
                                        size_t *result_length, Dictionary **detected_language);
+size_t multilang_words_descriptions(MultiMorphology *multi_morpher,
+                                    Dictionary *suggested_language, int pin_language,
+                                    const wchar_t *const words[], const size_t word_lengths[],
+                                    const char *const mb_words[], const size_t mb_word_lengths[],
+                                    size_t count,
+                                    char *results[], size_t result_lengths[],
+                                    Dictionary *detected_languages[]);
 ArrayList *multilang_word_forms(MultiMorphology *multi_morpher,
                                 Dictionary *suggested_language,
                                 const wchar_t *word, size_t word_length,
                                 Dictionary **detected_language);
+ArrayList *multilang_word_lemmas_scratch(MultiMorphology *multi_morpher,
+                                         Dictionary *suggested_language,
+                                         const wchar_t *word, size_t word_length,
+                                         AnalysisScratch *scratch,
+                                         Dictionary **detected_language);
+ArrayList *multilang_word_tags_scratch(MultiMorphology *multi_morpher,
+                                       Dictionary *suggested_language,
+                                       const wchar_t *word, size_t word_length,
+                                       AnalysisScratch *scratch,
+                                       Dictionary **detected_language);
 #endif
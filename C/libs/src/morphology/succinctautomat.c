@@ -0,0 +1,422 @@
+/* Сжатое (succinct) представление автомата морфологии, см. succinctautomat.h */
+
+#include "morphology/succinctautomat.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "morphology/wordforms.h"
+#include "morphology/automatwalk.h"
+#include "common/strict_alloc.h"
+#include "common/fileimage.h"
+
+/* Размер блока битового вектора, для которого хранится rank, и шаг выборки
+   нулей для select */
+#define SUCCINCT_BLOCK_BITS 512
+#define SUCCINCT_BLOCK_WORDS (SUCCINCT_BLOCK_BITS / 64)
+
+/* Работа с битовыми векторами */
+
+static uint64_t reserve_image_space(uint64_t *size, uint64_t bytes) {
+  uint64_t offset = (*size + 7) & ~(uint64_t)7;
+  *size = offset + bytes;
+  return offset;
+}
+
+static inline uint64_t bits_blocks_count(const SuccinctBitsHeader *header) {
+  return header->bits_count / SUCCINCT_BLOCK_BITS + 1;
+}
+
+static void layout_bits(SuccinctBitsHeader *header, uint64_t *size, int with_selects) {
+  uint64_t blocks_count = bits_blocks_count(header);
+  header->words_offset = reserve_image_space(size, blocks_count*SUCCINCT_BLOCK_WORDS*sizeof(uint64_t));
+  header->ranks_offset = reserve_image_space(size, (blocks_count + 1)*sizeof(uint32_t));
+  header->selects_offset = with_selects ?
+    reserve_image_space(size, ((blocks_count*SUCCINCT_BLOCK_BITS - header->ones_count) / SUCCINCT_BLOCK_BITS + 1)*sizeof(uint32_t)) : 0;
+}
+
+/* Строит справочники rank и select по уже заполненным битам */
+static void index_bits(const SuccinctBitsHeader *header, int8_t *image) {
+  const uint64_t *words = (const uint64_t *)(image + header->words_offset);
+  uint32_t *ranks = (uint32_t *)(image + header->ranks_offset),
+    *selects = header->selects_offset ? (uint32_t *)(image + header->selects_offset) : NULL;
+  uint64_t blocks_count = bits_blocks_count(header), block, ones = 0, zeros_end, sample = 0;
+  int i;
+  for (block = 0; block < blocks_count; block++) {
+    ranks[block] = (uint32_t)ones;
+    for (i = 0; i < SUCCINCT_BLOCK_WORDS; i++) {
+      ones += (uint64_t)__builtin_popcountll(words[block*SUCCINCT_BLOCK_WORDS + i]);
+    }
+    if (selects != NULL) {
+      zeros_end = (block + 1)*SUCCINCT_BLOCK_BITS - ones;
+      for (; sample*SUCCINCT_BLOCK_BITS < zeros_end; sample++) selects[sample] = (uint32_t)block;
+    }
+  }
+  ranks[blocks_count] = (uint32_t)ones;
+}
+
+static inline void set_bit(int8_t *image, uint64_t words_offset, uint64_t position) {
+  ((uint64_t *)(image + words_offset))[position >> 6] |= (uint64_t)1 << (position & 63);
+}
+
+static inline int test_bit(const uint64_t *words, uint64_t position) {
+  return (int)((words[position >> 6] >> (position & 63)) & 1);
+}
+
+/* Число единиц в битах [0, position) */
+static inline uint64_t bits_rank1(const SuccinctBits *bits, uint64_t position) {
+  uint64_t word = (position / SUCCINCT_BLOCK_BITS)*SUCCINCT_BLOCK_WORDS, last = position >> 6,
+    rank = bits->ranks[position / SUCCINCT_BLOCK_BITS];
+  for (; word < last; word++) rank += (uint64_t)__builtin_popcountll(bits->words[word]);
+  if (position & 63) {
+    rank += (uint64_t)__builtin_popcountll(bits->words[last] & (((uint64_t)1 << (position & 63)) - 1));
+  }
+  return rank;
+}
+
+/* Позиция нуля номер k (с нуля) */
+static inline uint64_t bits_select0(const SuccinctBits *bits, uint64_t k) {
+  uint64_t block = bits->selects[k / SUCCINCT_BLOCK_BITS], word, zeros, value;
+  while ((block + 1)*SUCCINCT_BLOCK_BITS - bits->ranks[block + 1] <= k) block++;
+  k -= block*SUCCINCT_BLOCK_BITS - bits->ranks[block];
+  for (word = block*SUCCINCT_BLOCK_WORDS; ; word++) {
+    zeros = 64 - (uint64_t)__builtin_popcountll(bits->words[word]);
+    if (k < zeros) break;
+    k -= zeros;
+  }
+  value = ~bits->words[word];
+  while (k-- > 0) value &= value - 1;
+  return (word << 6) + (uint64_t)__builtin_ctzll(value);
+}
+
+/* Массивы чисел по bits бит на число. В конце каждого массива есть 8 байт
+   запаса, так что читать можно всегда целым словом. */
+
+static inline uint64_t packed_size(uint64_t count, unsigned int bits) {
+  return (count*bits + 7) / 8 + sizeof(uint64_t);
+}
+
+static inline uint32_t packed_get(const uint8_t *data, uint64_t index, unsigned int bits) {
+  uint64_t position = index*bits, word;
+  memcpy(&word, data + (position >> 3), sizeof(word));
+  return (uint32_t)((word >> (position & 7)) & (((uint64_t)1 << bits) - 1));
+}
+
+static inline void packed_set(uint8_t *data, uint64_t index, unsigned int bits, uint32_t value) {
+  uint64_t position = index*bits, word;
+  memcpy(&word, data + (position >> 3), sizeof(word));
+  word |= (uint64_t)value << (position & 7);
+  memcpy(data + (position >> 3), &word, sizeof(word));
+}
+
+static unsigned int bits_for(uint32_t max_value) {
+  unsigned int bits = 1;
+  while (bits < 32 && (max_value >> bits) != 0) bits++;
+  return bits;
+}
+
+/* Раскладка образа: по числу состояний, переходов, рёбер дерева и ширине
+   полей вычисляет все смещения и полный размер. Используется и при сборке,
+   и для проверки загружаемого образа. */
+static void layout_succinct_automat(SuccinctAutomatHeader *header) {
+  uint64_t size = sizeof(SuccinctAutomatHeader);
+  header->alphabet_offset = reserve_image_space(&size, sizeof(MiniAlphabet));
+  header->finals_offset = reserve_image_space(&size, ((uint64_t)header->states_count / 64 + 1)*sizeof(uint64_t));
+  header->degrees.bits_count = (uint64_t)header->states_count + header->transitions_count;
+  header->degrees.ones_count = header->transitions_count;
+  layout_bits(&header->degrees, &size, 1);
+  header->tree_edges.bits_count = header->transitions_count;
+  layout_bits(&header->tree_edges, &size, 0);
+  header->labels_offset = reserve_image_space(&size, packed_size(header->transitions_count, header->label_bits));
+  header->targets_offset = reserve_image_space(&size, packed_size(header->transitions_count - header->tree_edges.ones_count,
+                                                                  header->target_bits));
+  header->annotations_offset = reserve_image_space(&size, sizeof(uint32_t)*(uint64_t)header->annotations_count);
+  header->size = size;
+}
+
+static void attach_image(SuccinctAutomat *automat, void *image) {
+  const SuccinctAutomatHeader *header = image;
+  int8_t *data = image;
+  automat->image = image;
+  automat->states_count = header->states_count;
+  automat->alphabet = (const MiniAlphabet *)(data + header->alphabet_offset);
+  automat->alphabet_size = header->alphabet_size;
+  automat->delimiter_symbol = header->delimiter_symbol;
+  automat->label_bits = header->label_bits;
+  automat->target_bits = header->target_bits;
+  automat->finals = (const uint64_t *)(data + header->finals_offset);
+  automat->degrees.words = (const uint64_t *)(data + header->degrees.words_offset);
+  automat->degrees.ranks = (const uint32_t *)(data + header->degrees.ranks_offset);
+  automat->degrees.selects = (const uint32_t *)(data + header->degrees.selects_offset);
+  automat->tree_edges.words = (const uint64_t *)(data + header->tree_edges.words_offset);
+  automat->tree_edges.ranks = (const uint32_t *)(data + header->tree_edges.ranks_offset);
+  automat->tree_edges.selects = NULL;
+  automat->labels = (const uint8_t *)(data + header->labels_offset);
+  automat->targets = (const uint8_t *)(data + header->targets_offset);
+  automat->annotations.codes = (const uint32_t *)(data + header->annotations_offset);
+  automat->annotations.count = header->annotations_count;
+}
+
+/* Обходит переходы плоского автомата в порядке номеров и отмечает рёбра
+   остовного дерева обхода в ширину: переход в ещё не встреченное состояние
+   с очередным номером. Возвращает число таких рёбер. */
+static uint32_t mark_tree_edges(MiniAutomat *mini, int8_t *image, const SuccinctAutomatHeader *header) {
+  uint8_t *discovered = strict_calloc(mini->states_count, sizeof(*discovered));
+  uint32_t state, first, last, target, next_state = 1, edge = 0;
+  discovered[0] = 1;
+  for (state = 0; state < mini->states_count; state++) {
+    mini_transitions_range(mini, state, &first, &last);
+    for (; first < last; first++, edge++) {
+      target = MINI_TRANSITION_TARGET(mini->transitions[first]);
+      if (!discovered[target] && target == next_state) {
+        discovered[target] = 1;
+        next_state++;
+        if (image != NULL) set_bit(image, header->tree_edges.words_offset, edge);
+      }
+    }
+  }
+  strict_free(discovered);
+  return next_state - 1;
+}
+
+/* Строит сжатый автомат по плоскому. Плоский автомат при этом не
+   меняется. */
+SuccinctAutomat *make_succinct_automat(MiniAutomat *mini) {
+  SuccinctAutomat *automat;
+  SuccinctAutomatHeader *header;
+  int8_t *image;
+  uint32_t state, first, last, edge = 0, explicit_edge = 0;
+  uint64_t position = 0, transitions_count = 0;
+  for (state = 0; state < mini->states_count; state++) {
+    mini_transitions_range(mini, state, &first, &last);
+    transitions_count += last - first;
+  }
+  header = strict_calloc(1, sizeof(*header));
+  header->states_count = mini->states_count;
+  header->transitions_count = (uint32_t)transitions_count;
+  header->tree_edges.ones_count = mark_tree_edges(mini, NULL, NULL);
+  header->label_bits = (uint8_t)bits_for(mini->alphabet_size - 1);
+  header->target_bits = (uint8_t)bits_for(mini->states_count - 1);
+  header->annotations_count = mini->annotations.count;
+  layout_succinct_automat(header);
+  image = strict_calloc(1, header->size);
+  memcpy(header->signature, SUCCINCT_AUTOMAT_SIGNATURE, sizeof(SUCCINCT_AUTOMAT_SIGNATURE));
+  header->version = SUCCINCT_AUTOMAT_FORMAT_VERSION;
+  header->label_size = sizeof(Label);
+  header->alphabet_size = mini->alphabet_size;
+  header->delimiter_symbol = mini->delimiter_symbol;
+  memcpy(image, header, sizeof(*header));
+  strict_free(header);
+  header = (SuccinctAutomatHeader *)image;
+  memcpy(image + header->alphabet_offset, mini->alphabet, sizeof(MiniAlphabet));
+  if (mini->annotations.count > 0) {
+    memcpy(image + header->annotations_offset, mini->annotations.codes, sizeof(uint32_t)*mini->annotations.count);
+  }
+  mark_tree_edges(mini, image, header);
+  for (state = 0; state < mini->states_count; state++) {
+    if (mini->states[state] & MINI_FINAL_STATE) set_bit(image, header->finals_offset, state);
+    mini_transitions_range(mini, state, &first, &last);
+    for (; first < last; first++, edge++, position++) {
+      set_bit(image, header->degrees.words_offset, position);
+      packed_set((uint8_t *)image + header->labels_offset, edge, header->label_bits,
+                 MINI_TRANSITION_SYMBOL(mini->transitions[first]));
+      if (!test_bit((const uint64_t *)(image + header->tree_edges.words_offset), edge)) {
+        packed_set((uint8_t *)image + header->targets_offset, explicit_edge++, header->target_bits,
+                   MINI_TRANSITION_TARGET(mini->transitions[first]));
+      }
+    }
+    position++; /* Ноль - конец состояния */
+  }
+  index_bits(&header->degrees, image);
+  index_bits(&header->tree_edges, image);
+  automat = strict_malloc(sizeof(*automat));
+  attach_image(automat, image);
+  automat->image_size = header->size;
+  automat->is_mapped = 0;
+  return automat;
+}
+
+/* Отображает в память готовый образ, созданный save_succinct_automat.
+   Возвращает NULL, если файла нет или он повреждён. */
+void *map_succinct_automat(const char *succinct_automat_file_name) {
+  SuccinctAutomat *automat;
+  const SuccinctAutomatHeader *header;
+  SuccinctAutomatHeader expected;
+  size_t image_size;
+  void *image = map_file_image(succinct_automat_file_name, sizeof(SuccinctAutomatHeader), &image_size);
+  if (image == NULL) return NULL;
+  header = image;
+  memcpy(&expected, header, sizeof(expected));
+  if (header->tree_edges.ones_count <= header->transitions_count &&
+      header->label_bits >= 1 && header->label_bits <= 8 &&
+      header->target_bits >= 1 && header->target_bits <= 32) {
+    layout_succinct_automat(&expected);
+  }
+  if (memcmp(header->signature, SUCCINCT_AUTOMAT_SIGNATURE, sizeof(SUCCINCT_AUTOMAT_SIGNATURE)) != 0 ||
+      header->version != SUCCINCT_AUTOMAT_FORMAT_VERSION ||
+      header->label_size != sizeof(Label) ||
+      header->states_count == 0 ||
+      header->alphabet_size == 0 || header->alphabet_size > MINI_ALPHABET_SIZE ||
+      memcmp(&expected, header, sizeof(expected)) != 0 ||
+      header->size != (uint64_t)image_size) {
+    unmap_file_image(image, image_size);
+    return NULL;
+  }
+  automat = strict_malloc(sizeof(*automat));
+  attach_image(automat, image);
+  automat->image_size = image_size;
+  automat->is_mapped = 1;
+  return automat;
+}
+
+/* Сохраняет образ в файл через временный файл, как и save_mini_automat.
+   Возвращает 0 при успехе. */
+int save_succinct_automat(SuccinctAutomat *automat, const char *succinct_automat_file_name) {
+  return save_file_image(automat->image, automat->image_size, succinct_automat_file_name);
+}
+
+/* Собирает сжатый образ по плоскому образу mini_automat_file_name.
+   Возвращает 0 при успехе. */
+int convert_succinct_automat(const char *mini_automat_file_name, const char *succinct_automat_file_name) {
+  int result;
+  SuccinctAutomat *automat;
+  MiniAutomat *mini = map_mini_automat(mini_automat_file_name);
+  if (mini == NULL) return -1;
+  automat = make_succinct_automat(mini);
+  free_mini_automat(mini);
+  result = save_succinct_automat(automat, succinct_automat_file_name);
+  free_succinct_automat(automat);
+  return result;
+}
+
+void free_succinct_automat(SuccinctAutomat *automat) {
+  if (automat->is_mapped) {
+    unmap_file_image(automat->image, automat->image_size);
+  } else {
+    strict_free(automat->image);
+  }
+  strict_free(automat);
+}
+
+/* Переходы состояния state: номер первого из них и их число */
+static inline void succinct_transitions_range(const SuccinctAutomat *automat, uint32_t state,
+                                              uint64_t *first, uint64_t *count) {
+  uint64_t position = state == 0 ? 0 : bits_select0(&automat->degrees, state - 1) + 1, word;
+  unsigned int shift, length;
+  *first = position - state;
+  *count = 0;
+  for (;;) {
+    shift = (unsigned int)(position & 63);
+    word = ~(automat->degrees.words[position >> 6] >> shift);
+    length = word == 0 ? 64 : (unsigned int)__builtin_ctzll(word);
+    *count += length;
+    if (length < 64 - shift) break;
+    position += length;
+  }
+}
+
+static inline uint32_t succinct_target(const SuccinctAutomat *automat, uint64_t transition) {
+  uint64_t rank = bits_rank1(&automat->tree_edges, transition);
+  if (test_bit(automat->tree_edges.words, transition)) return (uint32_t)rank + 1;
+  return packed_get(automat->targets, transition - rank, automat->target_bits);
+}
+
+static inline uint32_t succinct_find_transition(const SuccinctAutomat *automat, uint32_t state, uint8_t symbol) {
+  uint64_t first, count, i;
+  uint32_t label;
+  if (symbol == 0) return MINI_NO_STATE;
+  succinct_transitions_range(automat, state, &first, &count);
+  for (i = 0; i < count; i++) {
+    label = packed_get(automat->labels, first + i, automat->label_bits);
+    if (label == symbol) return succinct_target(automat, first + i);
+    if (label > symbol) break;
+  }
+  return MINI_NO_STATE;
+}
+
+static int succinct_is_final(const void *automat, uint32_t state) {
+  return test_bit(((const SuccinctAutomat *)automat)->finals, state);
+}
+
+static uint32_t succinct_transitions(const void *automat, uint32_t state, Label labels[], uint32_t targets[]) {
+  const SuccinctAutomat *succinct = automat;
+  uint64_t first, count, i;
+  succinct_transitions_range(succinct, state, &first, &count);
+  for (i = 0; i < count; i++) {
+    labels[i] = succinct->alphabet->labels[packed_get(succinct->labels, first + i, succinct->label_bits)];
+    targets[i] = succinct_target(succinct, first + i);
+  }
+  return (uint32_t)count;
+}
+
+static const AutomatWalkOps succinct_walk_ops = { succinct_is_final, succinct_transitions };
+
+static void succinct_common_prefix(const SuccinctAutomat *automat, Label word[], size_t word_length,
+                                   size_t *prefix_size, uint32_t *last_state) {
+  uint32_t match_transition;
+  size_t i;
+  *last_state = 0;
+  *prefix_size = 0;
+  for (i = 0; i < word_length; i++) {
+    match_transition = succinct_find_transition(automat, *last_state,
+                                                mini_symbol(automat->alphabet, automat->alphabet_size, word[i]));
+    if (match_transition != MINI_NO_STATE) {
+      (*prefix_size)++;
+      *last_state = match_transition;
+    } else break;
+  }
+}
+
+/* То же, что mini_transition */
+uint32_t succinct_transition(void *automat, uint32_t state, Label label) {
+  const SuccinctAutomat *succinct = automat;
+  return succinct_find_transition(succinct, state, mini_symbol(succinct->alphabet, succinct->alphabet_size, label));
+}
+
+/* То же, что mini_common_prefix_size */
+size_t succinct_common_prefix_size(void *automat, Label word[], size_t word_length) {
+  size_t prefix_size;
+  uint32_t last_state;
+  succinct_common_prefix(automat, word, word_length, &prefix_size, &last_state);
+  return prefix_size;
+}
+
+/* То же, что mini_possible_outputs */
+void succinct_possible_outputs(void *automat,
+                               Label word[], size_t word_length,
+                               size_t min_prediction_prefix,
+                               const AutomatOutputLimits *limits,
+                               AutomatOutputProcessor on_complete,
+                               void *data) {
+  AutomatPrefix prefix;
+  succinct_common_prefix(automat, word, word_length, &prefix.prefix_size, &prefix.last_state);
+  succinct_prefix_outputs(automat, &prefix, word_length, min_prediction_prefix, limits, on_complete, data);
+}
+
+/* То же, что mini_common_prefix_batch. Шаг по сжатому автомату - это
+   цепочка rank/select по нескольким битовым векторам, поэтому слова здесь
+   проходятся по очереди, без чередования. */
+void succinct_common_prefix_batch(void *automat,
+                                  Label *const words[], const size_t word_lengths[], size_t count,
+                                  AutomatPrefix prefixes[]) {
+  size_t i;
+  for (i = 0; i < count; i++) {
+    succinct_common_prefix(automat, words[i], word_lengths[i], &prefixes[i].prefix_size, &prefixes[i].last_state);
+  }
+}
+
+/* То же, что mini_prefix_outputs */
+void succinct_prefix_outputs(void *automat,
+                             const AutomatPrefix *prefix, size_t word_length,
+                             size_t min_prediction_prefix,
+                             const AutomatOutputLimits *limits,
+                             AutomatOutputProcessor on_complete,
+                             void *data) {
+  SuccinctAutomat *succinct = automat;
+  if (prefix->prefix_size == word_length &&
+      succinct_find_transition(succinct, prefix->last_state, succinct->delimiter_symbol) != MINI_NO_STATE) {
+    walk_automat_outputs(succinct, &succinct_walk_ops, prefix->last_state, 0, prefix->prefix_size, limits, on_complete, data);
+  } else if (prefix->prefix_size >= min_prediction_prefix) {
+    walk_automat_outputs(succinct, &succinct_walk_ops, prefix->last_state, 1, prefix->prefix_size, limits, on_complete, data);
+  }
+}
@@ -0,0 +1,111 @@
+/* Сжатое (succinct) представление автомата морфологии - для случаев, когда
+   память важнее скорости. Строится из плоского автомата (miniautomat.c) и
+   так же отображается в память из файла без разбора.
+
+   Состояния пронумерованы обходом в ширину, и автомат хранится по схеме
+   LOUDS: число переходов каждого состояния записано в битовый вектор
+   степеней в унарном виде (единица на переход, ноль в конце состояния), а
+   метки - в массив символов алфавита по несколько бит на символ. Переходы
+   из одного состояния в другое, впервые встреченное при обходе (рёбра
+   остовного дерева), своего номера цели не хранят: k-е такое ребро ведёт в
+   состояние k + 1. Номера целей хранятся только для остальных переходов,
+   по минимуму бит на номер. Переход по вектору степеней - это select и
+   rank по небольшим справочникам, так что поиск медленнее плоского
+   автомата, зато памяти нужно в 2-3 раза меньше.
+*/
+
+#ifndef __MORPHOLOGY_SUCCINCTAUTOMAT_H__
+#define __MORPHOLOGY_SUCCINCTAUTOMAT_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "automat.h"
+#include "miniautomat.h"
+#include "wordforms.h"
+
+#define SUCCINCT_AUTOMAT_SIGNATURE "MORPHSA"
+#define SUCCINCT_AUTOMAT_FORMAT_VERSION 2
+
+/* Битовый вектор со справочниками для rank и select. Все смещения
+   отсчитываются от начала образа. */
+typedef struct {
+  uint64_t bits_count;
+  uint64_t words_offset; /* uint64_t[] - сами биты */
+  uint64_t ranks_offset; /* uint32_t[] - число единиц перед каждым блоком по 512 бит */
+  uint64_t selects_offset; /* uint32_t[] - блок, содержащий каждый 512-й ноль (или 0) */
+  uint64_t ones_count;
+} SuccinctBitsHeader;
+
+typedef struct {
+  char signature[8];
+  uint32_t version;
+  uint8_t label_size;
+  uint8_t label_bits; /* Бит на символ метки */
+  uint8_t target_bits; /* Бит на явно хранимый номер цели */
+  uint8_t reserved;
+  uint16_t alphabet_size;
+  uint8_t delimiter_symbol;
+  uint8_t reserved2;
+  uint32_t states_count;
+  uint32_t transitions_count;
+  uint64_t alphabet_offset; /* MiniAlphabet */
+  uint64_t finals_offset; /* uint64_t[] - биты конечных состояний */
+  SuccinctBitsHeader degrees; /* Вектор степеней состояний */
+  SuccinctBitsHeader tree_edges; /* Единица - ребро остовного дерева */
+  uint64_t labels_offset; /* Символы переходов, по label_bits бит */
+  uint64_t targets_offset; /* Цели прочих переходов, по target_bits бит */
+  uint64_t annotations_offset; /* uint32_t[] - таблица аннотаций (см. annotations.h) */
+  uint32_t annotations_count;
+  uint32_t reserved3;
+  uint64_t size;
+} SuccinctAutomatHeader;
+
+typedef struct {
+  const uint64_t *words;
+  const uint32_t *ranks;
+  const uint32_t *selects;
+} SuccinctBits;
+
+typedef struct {
+  uint32_t states_count;
+  const MiniAlphabet *alphabet;
+  uint16_t alphabet_size;
+  uint8_t delimiter_symbol;
+  uint8_t label_bits;
+  uint8_t target_bits;
+  const uint64_t *finals;
+  SuccinctBits degrees;
+  SuccinctBits tree_edges;
+  const uint8_t *labels;
+  const uint8_t *targets;
+  AnnotationTable annotations;
+  void *image;
+  size_t image_size;
+  int8_t is_mapped;
+} SuccinctAutomat;
+
+SuccinctAutomat *make_succinct_automat(MiniAutomat *automat);
+void *map_succinct_automat(const char *succinct_automat_file_name);
+int save_succinct_automat(SuccinctAutomat *automat, const char *succinct_automat_file_name);
+int convert_succinct_automat(const char *mini_automat_file_name, const char *succinct_automat_file_name);
+void free_succinct_automat(SuccinctAutomat *automat);
+void succinct_possible_outputs(void *automat,
+                               Label word[], size_t word_length,
+                               size_t min_prediction_prefix,
+                               const AutomatOutputLimits *limits,
+                               AutomatOutputProcessor on_complete,
+                               void *data);
+size_t succinct_common_prefix_size(void *automat, Label word[], size_t word_length);
+uint32_t succinct_transition(void *automat, uint32_t state, Label label);
+void succinct_common_prefix_batch(void *automat,
+                                  Label *const words[], const size_t word_lengths[], size_t count,
+                                  AutomatPrefix prefixes[]);
+void succinct_prefix_outputs(void *automat,
+                             const AutomatPrefix *prefix, size_t word_length,
+                             size_t min_prediction_prefix,
+                             const AutomatOutputLimits *limits,
+                             AutomatOutputProcessor on_complete,
+                             void *data);
+
+#endif /* __MORPHOLOGY_SUCCINCTAUTOMAT_H__ */
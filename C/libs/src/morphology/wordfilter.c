@@ -0,0 +1,112 @@
+/* Блочный фильтр Блума словоформ (см. wordfilter.h).
+
+   Схема - "split block" фильтр: блок из восьми 32-битных слов, и ключ
+   ставит ровно по одному биту в каждое слово блока. Номер бита в i-м
+   слове - старшие 5 бит произведения младшей половины отпечатка на i-ю
+   нечётную "соль". Проверка ключа - одна строка кэша и восемь
+   независимых проверок бита без ветвлений между ними. */
+
+#include "morphology/wordfilter.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common/strict_alloc.h"
+#include "common/fileimage.h"
+
+static const uint32_t word_filter_salts[WORD_FORM_FILTER_BLOCK_WORDS] = {
+  0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+  0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u
+};
+
+static inline uint32_t fingerprint_block(uint64_t fingerprint, uint32_t blocks_count) {
+  return (uint32_t)(((fingerprint >> 32)*blocks_count) >> 32);
+}
+
+/* Маска бита ключа в i-м слове блока */
+static inline uint32_t fingerprint_bit(uint64_t fingerprint, size_t i) {
+  return 1u << (((uint32_t)fingerprint*word_filter_salts[i]) >> 27);
+}
+
+/* Сборка */
+
+/* Собирает фильтр по count отпечаткам fingerprints (посчитанным с зерном
+   seed по автомату с automat_states_count состояниями) и сохраняет его в
+   filter_file_name через временный файл. Возвращает 0 при успехе. */
+int save_word_form_filter(const uint64_t fingerprints[], size_t count, uint64_t seed,
+                          uint32_t automat_states_count, const char *filter_file_name) {
+  WordFormFilterHeader header;
+  size_t i, j;
+  uint32_t *block;
+  void *image;
+  int result;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, WORD_FORM_FILTER_SIGNATURE, sizeof(WORD_FORM_FILTER_SIGNATURE));
+  header.version = WORD_FORM_FILTER_FORMAT_VERSION;
+  header.blocks_count = (uint32_t)(((uint64_t)count*WORD_FORM_FILTER_BITS_PER_KEY +
+                                    32*WORD_FORM_FILTER_BLOCK_WORDS - 1)/(32*WORD_FORM_FILTER_BLOCK_WORDS));
+  if (header.blocks_count == 0) header.blocks_count = 1;
+  header.seed = seed;
+  header.keys_count = (uint32_t)count;
+  header.automat_states_count = automat_states_count;
+  header.blocks_offset = sizeof(header);
+  header.size = header.blocks_offset + sizeof(uint32_t)*WORD_FORM_FILTER_BLOCK_WORDS*(uint64_t)header.blocks_count;
+  image = strict_calloc(1, header.size);
+  memcpy(image, &header, sizeof(header));
+  for (i = 0; i < count; i++) {
+    block = (uint32_t *)((int8_t *)image + header.blocks_offset) +
+      (size_t)fingerprint_block(fingerprints[i], header.blocks_count)*WORD_FORM_FILTER_BLOCK_WORDS;
+    for (j = 0; j < WORD_FORM_FILTER_BLOCK_WORDS; j++) {
+      block[j] |= fingerprint_bit(fingerprints[i], j);
+    }
+  }
+  result = save_file_image(image, header.size, filter_file_name);
+  strict_free(image);
+  return result;
+}
+
+/* Загрузка и поиск */
+
+/* Отображает в память фильтр словоформ. Возвращает NULL, если файла нет
+   или он повреждён. */
+WordFormFilter *map_word_form_filter(const char *filter_file_name) {
+  WordFormFilter *filter;
+  const WordFormFilterHeader *header;
+  size_t image_size;
+  void *image = map_file_image(filter_file_name, sizeof(WordFormFilterHeader), &image_size);
+  if (image == NULL) return NULL;
+  header = image;
+  if (memcmp(header->signature, WORD_FORM_FILTER_SIGNATURE, sizeof(WORD_FORM_FILTER_SIGNATURE)) != 0 ||
+      header->version != WORD_FORM_FILTER_FORMAT_VERSION ||
+      header->size != (uint64_t)image_size ||
+      header->blocks_count == 0 ||
+      header->blocks_offset % sizeof(uint32_t) != 0 ||
+      header->blocks_offset + sizeof(uint32_t)*WORD_FORM_FILTER_BLOCK_WORDS*(uint64_t)header->blocks_count > header->size) {
+    unmap_file_image(image, image_size);
+    return NULL;
+  }
+  filter = strict_malloc(sizeof(*filter));
+  filter->header = header;
+  filter->blocks = (const uint32_t *)((int8_t *)image + header->blocks_offset);
+  filter->image = image;
+  filter->image_size = image_size;
+  return filter;
+}
+
+void free_word_form_filter(WordFormFilter *filter) {
+  unmap_file_image(filter->image, filter->image_size);
+  strict_free(filter);
+}
+
+/* Возвращает 0, если слова с отпечатком fingerprint в словаре точно нет,
+   и 1, если оно там может быть */
+int word_form_filter_may_contain(const WordFormFilter *filter, uint64_t fingerprint) {
+  const uint32_t *block = filter->blocks +
+    (size_t)fingerprint_block(fingerprint, filter->header->blocks_count)*WORD_FORM_FILTER_BLOCK_WORDS;
+  uint32_t missing = 0;
+  size_t i;
+  for (i = 0; i < WORD_FORM_FILTER_BLOCK_WORDS; i++) {
+    missing |= fingerprint_bit(fingerprint, i) & ~block[i];
+  }
+  return missing == 0;
+}
@@ -0,0 +1,60 @@
+/* Блочный фильтр Блума словоформ словаря - быстрый ответ "этого слова в
+   словаре точно нет".
+
+   Хэш-таблица словоформ (wordhash.h) находит словарное слово одним
+   обращением, но для незнакомого слова тоже делает два-три обращения в
+   разные места большой таблицы, прежде чем выяснится, что слова там нет.
+   Фильтр отвечает на этот вопрос одним обращением к блоку в 32 байта (в
+   одной строке кэша), а сам в 8-9 раз меньше таблицы. Слова, которых
+   фильтр не знает, сразу идут к автомату (и предсказанию); для остальных
+   таблица проверяется как обычно, так что результаты разбора от фильтра
+   не меняются.
+
+   Ключи фильтра - те же 64-битные отпечатки слов, что и в таблице, с тем
+   же зерном: отпечаток считается один раз. По старшей половине отпечатка
+   выбирается блок из восьми 32-битных слов, по младшей - по одному биту в
+   каждом слове блока. При 12 битах на словоформу ложных "может быть"
+   около 1%.
+
+   Фильтр собирается по готовой таблице (morph-compile -b) и лежит рядом с
+   ней в файле, который отображается в память без разбора.
+*/
+
+#ifndef __MORPHOLOGY_WORDFILTER_H__
+#define __MORPHOLOGY_WORDFILTER_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#define WORD_FORM_FILTER_SIGNATURE "MORPHWF"
+#define WORD_FORM_FILTER_FORMAT_VERSION 1
+/* Бит фильтра на словоформу */
+#define WORD_FORM_FILTER_BITS_PER_KEY 12
+/* 32-битных слов в блоке */
+#define WORD_FORM_FILTER_BLOCK_WORDS 8
+
+typedef struct {
+  char signature[8];
+  uint32_t version;
+  uint32_t blocks_count;
+  uint64_t seed; /* Зерно отпечатков - то же, что у хэш-таблицы */
+  uint32_t keys_count; /* Число словоформ хэш-таблицы, по которой собран фильтр */
+  uint32_t automat_states_count; /* И число состояний её автомата */
+  uint64_t blocks_offset; /* uint32_t[blocks_count][WORD_FORM_FILTER_BLOCK_WORDS] */
+  uint64_t size;
+} WordFormFilterHeader;
+
+typedef struct word_form_filter {
+  const WordFormFilterHeader *header;
+  const uint32_t *blocks;
+  void *image;
+  size_t image_size;
+} WordFormFilter;
+
+int save_word_form_filter(const uint64_t fingerprints[], size_t count, uint64_t seed,
+                          uint32_t automat_states_count, const char *filter_file_name);
+WordFormFilter *map_word_form_filter(const char *filter_file_name);
+void free_word_form_filter(WordFormFilter *filter);
+int word_form_filter_may_contain(const WordFormFilter *filter, uint64_t fingerprint);
+
+#endif /* __MORPHOLOGY_WORDFILTER_H__ */
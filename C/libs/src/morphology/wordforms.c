@@ -13,25 +13,23 @@
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "common/strict_alloc.h"
 #include "common/datastruct.h"
 #include "common/strtools.h"
 #include "common/hashtable.h"
+#include "morphology/baseimage.h"
+#include "morphology/annotations.h"
+#include "morphology/wordhash.h"
 
 #define MRD_LINE_BUFFER_SIZE 10240
 /* Максимальная длина одного вывода автомата */
 #define MAX_AUTOMAT_OUTPUT_SIZE 255
-/* Максимальная длина одной словоформы, которая может быть составлена по
- * морфологическому словарю для обучения автомата */
-#define MAX_WORD_FORM_SIZE 240
 /* Максимальная длина приставки во флективном правиле FlexVariance */
 #define MAX_FLEX_PREFIX_SIZE 15
 /* Максимальная длина окончания во флективном правиле FlexVariance */
 #define MAX_FLEX_FLEXION_SIZE 30
-/* Минимальная длина части всего слова, которая должна совпасть с автоматом,
-   чтобы можно было делать предсказание словоформ */
-#define MIN_MATCH_FOR_PREDICTION 4
 /* Минимальная длина части леммы слова, которая должна совпасть с автоматом,
    чтобы можно было делать предсказание словоформ */
 #define MIN_BASE_LENGTH 3
@@ -121,6 +119,7 @@ static Grammar *make_grammar(wchar_t *line) {
   grammar->grammems = wcstok(NULL, L" ", &memo);
   if (grammar->grammems != NULL) 
     grammar->grammems = wcsdup(grammar->grammems);
+  parse_grammar_tags(grammar->part_of_speech, grammar->grammems, &grammar->pos, &grammar->grammeme_bits);
   return grammar;
 }
 
@@ -391,15 +390,43 @@ void free_lemmas(LemmaList *list) {
   strict_free(list);
 }
 
+/* Заполняет base->lemma_rules по первым правилам флективных моделей. У
+   пустой модели (их в словарях не бывает) правило без приставки и
+   окончания. */
+void prepare_lemma_rules(MorphologyBase *base) {
+  size_t i;
+  FlexVariance *variance;
+  LemmaRule *rule;
+  base->lemma_rules = strict_calloc(base->flex_models->length + 1, sizeof(LemmaRule));
+  for (i = 0; i < base->flex_models->length; i++) {
+    if (flex_model_size(base->flex_models->model_list[i]) == 0) continue;
+    variance = flex_model_variance(base->flex_models->model_list[i], 0);
+    rule = base->lemma_rules + i;
+    rule->prefix = variance->prefix;
+    rule->flexion = variance->flexion;
+    rule->prefix_length = variance->prefix != NULL ? wcslen(variance->prefix) : 0;
+    rule->flexion_length = variance->flexion != NULL ? wcslen(variance->flexion) : 0;
+    rule->grammar = variance->grammar;
+  }
+}
+
 MorphologyBase *init_morphology_base(char *mrd_file_name, const char *grammar_file_name, char no_load_lemmas) {
   MorphologyBase *base = strict_malloc(sizeof(MorphologyBase));
   FILE *mrd_file;
   char line_buffer[MRD_LINE_BUFFER_SIZE];
   base->automat = NULL;
+  base->image = NULL;
   base->grammars = load_grammars(grammar_file_name, line_buffer, MRD_LINE_BUFFER_SIZE);
-  if (base->grammars == NULL) return NULL;
+  if (base->grammars == NULL) {
+    strict_free(base);
+    return NULL;
+  }
   mrd_file = fopen(mrd_file_name, "rt");
-  if (mrd_file == NULL) return NULL;
+  if (mrd_file == NULL) {
+    free_grammars(base->grammars);
+    strict_free(base);
+    return NULL;
+  }
   base->flex_models = load_flex_models(mrd_file, line_buffer, MRD_LINE_BUFFER_SIZE, base->grammars); /* Модели словообразования */
   mrd_file_skip_section(mrd_file, line_buffer, MRD_LINE_BUFFER_SIZE); /* Пропускаем ударения */
   mrd_file_skip_section(mrd_file, line_buffer, MRD_LINE_BUFFER_SIZE); /* Пропускаем пользовательские сессии */
@@ -411,11 +438,17 @@ MorphologyBase *init_morphology_base(char *mrd_file_name, const char *grammar_fi
     base->lemmas = load_lemmas(mrd_file, line_buffer, MRD_LINE_BUFFER_SIZE, base->flex_models, base->prefix_models); /* Основы слов */
   }
   fclose(mrd_file);
+  prepare_lemma_rules(base);
   return base;
 }
 
 void free_morphology_base(MorphologyBase *base) {
+  if (base->image != NULL) {
+    free_mapped_morphology_base(base);
+    return;
+  }
   free_grammars(base->grammars);
+  strict_free(base->lemma_rules);
   free_flex_models(base->flex_models);
   free_prefix_models(base->prefix_models);
   if (base->lemmas != NULL) 
@@ -441,65 +474,136 @@ static wchar_t *build_word(Lemma *lemma, FlexVariance *variance, wchar_t *result
   return word_tail;
 }
 
-/* Превращает морфологическую аннотацию в обычную строку, кодируя её в 36-ичной
- системе счисления, для укорачивания. Например число №1234567 будет 
- преобразовано в строку "QJLJ" */
-static wchar_t *build_morphology_annotation(uint16_t flex_model_index, uint8_t flexion_size, uint8_t base_size, wchar_t *result) {
-  wchar_t number_code[128];
-  uint32_t code = 0;
-  /* Используя допущения, что число флективных моделей 
-     не больше 65536 (в русском словаре их всего ~2600),
-     а окончания и приставки не могут быть длиннее 255 символов,
-     можно упаковать эту информацию в 4-байтовое целое. Это упрощает
-     и ускоряет последующий разбор*/
-  code = (uint32_t)flex_model_index << 16;
-  code |= (uint32_t)flexion_size << 8;
-  code |= (uint32_t)base_size;
-  return wcpcpy(result, ultowcs(code, 36, number_code));
-}
-
-void parse_morphology_annotation(wchar_t *annotation, WordForm *form) {
-  wchar_t *end_of_number = NULL;
-  uint32_t flex_code_num;
-  flex_code_num = (uint32_t)wcstoul(annotation, &end_of_number, 36);
-  form->base_size = flex_code_num & 255;
-  form->flexion_size = (flex_code_num >> 8) & 255;
-  form->flex_model_index = (uint16_t)(flex_code_num >> 16);
-  /*fprintf(stderr, "%ls -> %d %d %d %d\n", annotation, flex_code_num, form->base_size, form->flexion_size, form->flex_model_index);*/
-}
-
-/* Генерирует все возможные словоформы из по базе base.
+static uint32_t variance_annotation(Lemma *lemma, FlexVariance *variance) {
+  wchar_t *word_base = lemma_base(lemma);
+  return pack_annotation((uint16_t) lemma_flex_model_no(lemma),
+                         (uint8_t)(variance->flexion == NULL ? 0 : wcslen(variance->flexion)),
+                         (uint8_t)(word_base == NULL ? 0 : wcslen(word_base)));
+}
+
+/* Порядок аннотаций в таблице - тот же, в котором шли их прежние
+   36-ичные записи в автомате, чтобы порядок выводов автомата не изменился */
+static int annotation_comparer(const void *code1, const void *code2) {
+  wchar_t number1[16], number2[16];
+  return wcscmp(ultowcs(*(uint32_t *)code1, ANNOTATION_RADIX, number1),
+                ultowcs(*(uint32_t *)code2, ANNOTATION_RADIX, number2));
+}
+
+/* Собирает таблицу всех аннотаций словоформ базы base (не более max_count
+   словоформ, если max_count > 0). В index для каждой аннотации
+   записывается её номер в таблице плюс единица. */
+static void make_annotation_table(MorphologyBase *base, size_t max_count, HashTable *index, AnnotationTable *annotations) {
+  LemmaList *lemmas = morphology_lemmas(base);
+  ArrayList *codes = make_array_list(sizeof(uint32_t), 4096);
+  unsigned int lemma_index, variances_count, variance_index;
+  size_t i, counter = 0;
+  uint32_t code, *table;
+  Lemma **lemma;
+  FlexModel *flex_model;
+  void **stored;
+  for (lemma=lemmas->lemmas, lemma_index = 0; lemma_index < lemmas->length; lemma_index++, lemma++) {
+    flex_model = lemma_flex_model(*lemma);
+    variances_count = (unsigned int) flex_model_size(flex_model);
+    for (variance_index = 0; variance_index < variances_count; variance_index++) {
+      code = variance_annotation(*lemma, flex_model_variance(flex_model, variance_index));
+      stored = hash_table_get_always(index, &code, sizeof(code));
+      if (*stored == NULL) {
+        *stored = (void *)(uintptr_t)1;
+        array_list_append(codes, &code);
+      }
+      if (max_count > 0 && ++counter >= max_count) break;
+    }
+    if (max_count > 0 && counter >= max_count) break;
+  }
+  table = strict_malloc(sizeof(uint32_t)*(array_list_size(codes) + 1));
+  memcpy(table, array_list_data(codes), sizeof(uint32_t)*array_list_size(codes));
+  qsort(table, array_list_size(codes), sizeof(uint32_t), annotation_comparer);
+  for (i = 0; i < array_list_size(codes); i++) {
+    *hash_table_get_always(index, table + i, sizeof(uint32_t)) = (void *)(uintptr_t)(i + 1);
+  }
+  annotations->codes = table;
+  annotations->count = (uint32_t)array_list_size(codes);
+  free_array_list(codes);
+}
+
+/* Записывает в result номер аннотации number 36-ичными цифрами, дополняя
+   его нулями слева до width цифр. Возвращает указатель на конец записи. */
+static wchar_t *build_morphology_annotation(uint32_t number, size_t width, wchar_t *result) {
+  wchar_t number_code[16];
+  size_t length = wcslen(ultowcs(number, ANNOTATION_RADIX, number_code));
+  for (; length < width; width--) *result++ = L'0';
+  return wcpcpy(result, number_code);
+}
+
+/* Генерирует все возможные словоформы по базе base и передаёт их по
+ одной on_word_form, не сохраняя.
  Если указать max_count > 0, число словоформ будет ограничено 
  указанным количеством (для нужд тестирования).
- Возвращается массив словоформ, содержащий записи WordForm.
+ В annotations собирается таблица аннотаций словоформ, а в самих
+ словоформах после разделителя пишется номер аннотации в ней. Если
+ annotations == NULL, пишется сама аннотация - так собирались автоматы
+ до появления таблицы.
+ Возвращает 0, или -1, если on_word_form прервал генерацию.
 */
-ArrayList *generate_all_words(MorphologyBase *base, size_t max_count) {
-  ArrayList *result = make_array_list(sizeof(wchar_t *), 1000000);
+int generate_word_forms(MorphologyBase *base, size_t max_count, AnnotationTable *annotations,
+                        WordFormProcessor on_word_form, void *data) {
   LemmaList *lemmas = morphology_lemmas(base);
+  HashTable *index = NULL;
   unsigned int lemma_index, variances_count, variance_index, counter = 0;
+  size_t width = 0;
+  uint32_t code, limit;
+  int status = 0;
   Lemma **lemma;
   FlexVariance *variance;
   FlexModel *flex_model;
-  wchar_t word[MAX_WORD_FORM_SIZE], *word_base, *word_tail, *result_word;
+  wchar_t word[MAX_WORD_FORM_SIZE], *word_tail;
+  if (annotations != NULL) {
+    index = make_hash_table(12);
+    make_annotation_table(base, max_count, index, annotations);
+    for (limit = 1; limit < annotations->count && width < 6; limit *= ANNOTATION_RADIX) width++;
+    if (width == 0) width = 1;
+  }
   for (lemma=lemmas->lemmas, lemma_index = 0; lemma_index < lemmas->length; lemma_index++, lemma++) {
     flex_model = lemma_flex_model(*lemma);
-    word_base = lemma_base(*lemma);
     variances_count = (unsigned int) flex_model_size(flex_model);
     for (variance_index = 0; variance_index < variances_count; variance_index++) {
       variance = flex_model_variance(flex_model, variance_index);
       word_tail = build_word(*lemma, variance, word);
       wcssubreverse(word, word_tail);
       word_tail = wcpcpy(word_tail, ANNOTATION_DELIMITER_STRING);
-      word_tail = build_morphology_annotation((uint16_t) lemma_flex_model_no(*lemma),
-					      (uint8_t)(variance->flexion == NULL ? 0 : wcslen(variance->flexion)),
-					      (uint8_t)(word_base == NULL ? 0 : wcslen(word_base)), word_tail);
+      code = variance_annotation(*lemma, variance);
+      if (index != NULL) {
+        word_tail = build_morphology_annotation((uint32_t)((uintptr_t)hash_table_chain_get(index, &code, sizeof(code)) - 1),
+                                                width, word_tail);
+      } else {
+        word_tail = build_morphology_annotation(code, 0, word_tail);
+      }
       *word_tail = L'\0';
-      result_word = wcsdup(word);
-      array_list_append(result, &result_word);
+      if (on_word_form(word, (size_t)(word_tail - word), data) != 0) {
+        status = -1;
+        break;
+      }
       counter++;
-      if (max_count > 0 && counter >= max_count) return result;
+      if (max_count > 0 && counter >= max_count) break;
     }
+    if (status != 0 || (max_count > 0 && counter >= max_count)) break;
   }
+  if (index != NULL) free_hash_table(index);
+  return status;
+}
+
+static int append_word_form(const wchar_t *word_form, size_t length, void *data) {
+  wchar_t *result_word = wcsdup(word_form);
+  array_list_append((ArrayList *)data, &result_word);
+  return 0;
+}
+
+/* Генерирует все словоформы по базе base (см. generate_word_forms) и
+ возвращает их массивом строк. Держит в памяти все словоформы сразу, так
+ что для сборки словаря используется build_morphology_automat. */
+ArrayList *generate_all_words(MorphologyBase *base, size_t max_count, AnnotationTable *annotations) {
+  ArrayList *result = make_array_list(sizeof(wchar_t *), 1000000);
+  generate_word_forms(base, max_count, annotations, append_word_form, result);
   array_list_minimize(result);
   return result;
 }
@@ -525,24 +629,69 @@ void prepare_words_for_automat(ArrayList *all_forms) {
   qsort(array_list_data(all_forms), array_list_size(all_forms), sizeof(wchar_t *), word_form_comparer);
 }
 
+/* Автомат, в который словоформы добавляются по одной, с выводом хода
+   построения */
+typedef struct {
+  Automat *automat;
+  size_t count;
+  size_t total_count;
+  size_t last_percent;
+} AutomatBuilder;
+
+static int add_word_form_to_automat(const wchar_t *word_form, size_t length, void *data) {
+  AutomatBuilder *builder = (AutomatBuilder *)data;
+  Automat *automat = builder->automat;
+  size_t percent = 100 * builder->count / builder->total_count;
+  if (percent != builder->last_percent) {
+    builder->last_percent = percent;
+    fprintf(stderr, "%ld%% words processed. ", percent);
+    fprintf(stderr, "States registered %ld. Fill rate:%f\n", 
+	    (long int)automat->state_register->count,
+	    (double)automat->state_register->count / automat->state_register->capacity);
+  }
+  automat_add_word(automat, (Label *)word_form, length);
+  builder->count++;
+  return 0;
+}
+
 /* Строит автомат морфологического разбора на основе словоформ word_forms */
 Automat *make_morphology_automat(ArrayList *word_forms) {
-  Automat *automat = (Automat *) make_automat();
+  AutomatBuilder builder = {make_automat(), 0, array_list_size(word_forms), 0};
   wchar_t *sample;
   size_t i;
-  size_t percent, last_percent = 0;
   for (i = 0; i < array_list_size(word_forms); i++) {
     sample = *(wchar_t **) array_list_get(word_forms, i);
-    percent = 100 * i / array_list_size(word_forms);
-    if (percent != last_percent) {
-      last_percent = percent;
-      fprintf(stderr, "%ld%% words processed. ", percent);
-      fprintf(stderr, "Equivalence classes stored %ld. Fill rate:%f\n", 
-	      automat->class_list->total_stored, hash_table_fill_rate(automat->class_list));
-    }
-    automat_add_word(automat, sample, wcslen(sample));
+    add_word_form_to_automat(sample, wcslen(sample), &builder);
+  }
+  complete_automat(builder.automat);
+  return builder.automat;
+}
+
+/* Строит автомат морфологического разбора по словоформам, собранным и
+   отсортированным сортировщиком sorter (после word_sorter_finish).
+   Возвращает NULL, если не удалось прочитать временные файлы. */
+Automat *make_morphology_automat_sorted(WordSorter *sorter) {
+  AutomatBuilder builder = {make_automat(), 0, word_sorter_size(sorter), 0};
+  if (word_sorter_merge(sorter, add_word_form_to_automat, &builder) != 0) {
+    free_automat(builder.automat);
+    return NULL;
   }
-  complete_automat(automat);
+  complete_automat(builder.automat);
+  return builder.automat;
+}
+
+/* Строит автомат морфологического разбора по базе base, держа в памяти
+   словоформ не больше чем на memory_budget байт: остальные уходят во
+   временные файлы в каталоге temp_dir (NULL - каталог по умолчанию). В
+   annotations собирается таблица аннотаций. Возвращает NULL при ошибке. */
+Automat *build_morphology_automat(MorphologyBase *base, size_t memory_budget, const char *temp_dir, AnnotationTable *annotations) {
+  WordSorter *sorter = make_word_sorter(memory_budget, temp_dir);
+  Automat *automat = NULL;
+  if (generate_word_forms(base, 0, annotations, word_sorter_add, sorter) == 0 &&
+      word_sorter_finish(sorter) == 0) {
+    automat = make_morphology_automat_sorted(sorter);
+  }
+  free_word_sorter(sorter);
   return automat;
 }
 
@@ -554,6 +703,21 @@ Automat *make_morphology_automat(ArrayList *word_forms) {
    состояния и некие дополнительные данные data. 
    Используется для морфологического анализа слов.
 */
+/* Передаёт on_complete вывод автомата из буфера buffer: длину части до
+   разделителя и номер аннотации после него */
+static void complete_output(char is_prediction, size_t prefix_size, Label buffer[],
+                            AutomatOutputProcessor on_complete, void *data) {
+  Label *annotation = wcschr(buffer, ANNOTATION_DELIMITER);
+  uint32_t number = 0;
+  int digit;
+  if (annotation == NULL) return;
+  while (*++annotation != L'\0') {
+    if ((digit = annotation_digit(*annotation)) < 0) return;
+    number = number*ANNOTATION_RADIX + (uint32_t)digit;
+  }
+  on_complete(is_prediction, prefix_size, (size_t)(wcschr(buffer, ANNOTATION_DELIMITER) - buffer), number, data);
+}
+
 static void collect_output(State *state,
 			   char is_prediction,
 			   size_t prefix_size,
@@ -566,7 +730,7 @@ static void collect_output(State *state,
   Transition *transition;
   void *loop_memo = NULL;
   if (is_final_state(state)) {
-    on_complete(is_prediction, prefix_size, buffer, data);
+    complete_output(is_prediction, prefix_size, buffer, on_complete, data);
     if (!is_prediction) return;
   }
   if (depth + 1 < buffer_size) {
@@ -610,62 +774,6 @@ void possible_outputs(void *automat,
   }
 }
 
-/* Возвращает массив всех возможных словоформ слова word, допустимых
-   для флективной модели flex_model_no. Параметры flexion_size и base_size
-   определяют ту часть слова word, которую надо использовать как основу при
-   добавлении приставок и окончаний флективной модели. */
-WordForm *all_word_variations(const wchar_t *word,
-                              size_t word_length,
-			      int8_t only_lemma,
-			      uint8_t flexion_size, 
-			      uint8_t base_size, 
-			      uint16_t flex_model_no, 
-			      MorphologyBase *base, 
-			      size_t *variances_count) {
-  FlexModel *model = base->flex_models->model_list[flex_model_no];
-  size_t i, part_length;
-  WordForm *result, *result_cursor;
-  FlexVariance *variance;
-  wchar_t *buffer = strict_malloc(sizeof(*buffer) *
-                                  (word_length +
-                                   MAX_FLEX_PREFIX_SIZE +
-                                   MAX_FLEX_FLEXION_SIZE + 1));
-  wchar_t *word_base = buffer + MAX_FLEX_PREFIX_SIZE, *word_start;
-  size_t result_length = 0;
-  *variances_count = only_lemma ? 1 : flex_model_size(model);
-  result_cursor = result = strict_malloc(*variances_count * sizeof(WordForm));
-  wcsncpy(word_base, word + (word_length - flexion_size - base_size), base_size);
-  word_base[base_size] = L'\0';
-  for (i = 0; i < *variances_count; i++, result_cursor++) {
-    result_length = base_size;
-    variance = flex_model_variance(model, i);
-    if (variance->prefix != NULL) {
-      part_length = wcslen(variance->prefix);
-      word_start = word_base - part_length;
-      wmemcpy(word_start, variance->prefix, part_length);
-      result_length += part_length;
-    } else {
-      word_start = word_base;
-    }
-    if (variance->flexion != NULL) {
-      wcpcpy(word_base + base_size, variance->flexion);
-      (*result_cursor).flexion_size = (uint8_t) wcslen(variance->flexion);
-      result_length += (*result_cursor).flexion_size;
-    } else {
-      *(word_base + base_size) = L'\0';
-      (*result_cursor).flexion_size = 0;
-    }
-    (*result_cursor).word = wcsdup(word_start);
-    (*result_cursor).flex_model_index = flex_model_no;
-    (*result_cursor).base_size = base_size;
-    (*result_cursor).grammar = variance->grammar;
-    (*result_cursor).frequency = 0;
-    (*result_cursor).word_length = result_length;
-  }
-  strict_free(buffer);
-  return result;
-}
-
 /* Проверяет, что часть слова word, размером prefix_size
  состоит из одной или нескольких известных приставок known_prefixes. Так,
 даже если автомат не распознал слово полностью, мы можем
@@ -697,66 +805,66 @@ char word_has_known_prefix(const wchar_t *word, size_t prefix_size,
   return 0;
 }
 
-void init_automat_output(AutomatOutput *output, wchar_t *text, uint8_t automat_prefix_size, int8_t is_prediction) {
-  output->text = wcsdup(text);
-  output->annotation = wcschr(output->text, ANNOTATION_DELIMITER);
-  *(output->annotation) = L'\0';
-  wcssubreverse(output->text, output->annotation);
-  output->annotation++;
+void init_automat_output(AutomatOutput *output, uint32_t annotation, uint8_t automat_prefix_size,
+                         uint8_t prediction_size, int8_t is_prediction) {
+  output->annotation = annotation;
   output->known_prefix_size = 0;
   output->is_prediction = is_prediction;
   output->automat_prefix_size = automat_prefix_size;
+  output->prediction_size = prediction_size;
 }
 
-void free_automat_output(void *output) {
-  strict_free(((AutomatOutput *)output)->text);
+/* Проверяет, что предсказательный вывод output на самом деле точный:
+   автомат упёрся в аннотацию, а нераспознанная часть слова - приставка.
+   Такой вывод превращается в законченный. */
+static char complete_prefixed_output(AutomatOutput *output, const wchar_t *word, size_t word_length,
+                                     MorphologyBase *morphology) {
+  if (output->prediction_size != 0 ||
+      !word_has_known_prefix(word,
+                             word_length - output->automat_prefix_size,
+                             morphology->prefix_models->all_prefixes,
+                             morphology->prefix_models->all_prefixes_count)) {
+    return 0;
+  }
+  output->is_prediction = 0;
+  output->known_prefix_size = (uint8_t)(word_length - output->automat_prefix_size);
+  return 1;
 }
 
 /* Удаляет выводы автомата, могущие давать неправильные предсказания.
    Иногда слово распозналость полностью, а помешала только какая-то
    приставка. Тогда вывод можно считать не предсказательным, а законченным,
-   и предсказательные выводы совсем отбросить. */
+   и предсказательные выводы совсем отбросить: те, что стоят до последнего
+   такого вывода, и те, что остались в хвосте списка. Список уплотняется
+   за один проход, без сдвигов на каждое удаление. */
 void filter_productive_output(ArrayList *outputs, const wchar_t *word, size_t word_length, MorphologyBase *morphology) {
-  size_t outputs_count = array_list_size(outputs), output_text_length;
-  ssize_t i;
-  char drop_prediction_outputs = 0;
-  for (i = (ssize_t)outputs_count - 1; i >= 0; i--) {
-    AutomatOutput *output = array_list_get(outputs, (size_t)i);
-    if (output->is_prediction) {
-      output_text_length = wcslen(output->text);
-      /* Если автомат упёрся в аннотацию, а нераспознанная часть - приставка, 
-       такой вывод можно считать точным, а не предсказательным */
-      if (output_text_length == 0 &&
-	  word_has_known_prefix(word, 
-				word_length - output->automat_prefix_size,
-				morphology->prefix_models->all_prefixes,
-				morphology->prefix_models->all_prefixes_count)) {
-	output->is_prediction = 0;
-	output->known_prefix_size = (uint8_t)(word_length - output->automat_prefix_size);
-	drop_prediction_outputs = 1;
-      } else if (drop_prediction_outputs) {
-	free_automat_output(output);
-	array_list_delete(outputs, (size_t)i);
-      }
-    }
+  size_t outputs_count = array_list_size(outputs), last_completed, last_kept, kept, i;
+  AutomatOutput *output;
+  for (i = outputs_count; i > 0; i--) {
+    output = array_list_get(outputs, i - 1);
+    if (output->is_prediction && complete_prefixed_output(output, word, word_length, morphology)) break;
   }
-  if (drop_prediction_outputs) {
-    outputs_count = array_list_size(outputs);
-    for (i = (ssize_t)outputs_count - 1; i >= 0; i--) {
-      AutomatOutput *output = array_list_get(outputs, (size_t)i);
-      if (output->is_prediction) {
-	free_automat_output(output);
-	array_list_delete(outputs, (size_t)i);
-      } else {
-	break;
-      }
+  if (i == 0) return;
+  last_completed = i - 1;
+  for (last_kept = outputs_count - 1; last_kept > last_completed; last_kept--) {
+    if (!((AutomatOutput *)array_list_get(outputs, last_kept))->is_prediction) break;
+  }
+  for (i = 0, kept = 0; i <= last_kept; i++) {
+    output = array_list_get(outputs, i);
+    if (i < last_completed && output->is_prediction &&
+        !complete_prefixed_output(output, word, word_length, morphology)) {
+      continue;
     }
+    if (kept != i) array_list_put(outputs, kept, output);
+    kept++;
   }
+  array_list_truncate(outputs, kept);
 }
 
-static void collect_automat_output(char is_prediction, size_t prefix_size, Label buffer[], void *data) {
+static void collect_automat_output(char is_prediction, size_t prefix_size, size_t prediction_size,
+                                   uint32_t annotation, void *data) {
   AutomatOutput *output = array_list_append((ArrayList *)data, NULL);
-  init_automat_output(output, buffer, (uint8_t) prefix_size, is_prediction);
+  init_automat_output(output, annotation, (uint8_t) prefix_size, (uint8_t) prediction_size, is_prediction);
 }
 
 /* Мелкая вспомогательная функция для analyze_word */
@@ -768,91 +876,539 @@ static char is_analyzed_model(uint16_t model, int *models, int count) {
   return 0;
 }
 
-static int is_same_word_form(const void *form1, const void *form2) {
-  return wcscmp(((WordForm *)form1)->word, ((WordForm *)form2)->word) == 0;
+static int word_form_frequency_comparer(const void *form1, const void *form2) {
+  if (((WordForm *)form1)->frequency == ((WordForm *)form2)->frequency) return 0;
+  return (((WordForm *)form1)->frequency > ((WordForm *)form2)->frequency) ? -1 : 1; 
 }
 
-static int is_same_word_form_with_ancode(const void *form1, const void *form2) {
-  return wcscmp(((WordForm *)form1)->word, ((WordForm *)form2)->word) == 0 
-    && ((WordForm *)form1)->grammar == ((WordForm *)form2)->grammar;
+/* Рабочая память разбора слов (см. analyze_word_scratch). Всё, что разбор
+   слова выделял бы заново, - выводы автомата, инвертированное слово,
+   найденные словоформы и их тексты - хранится здесь и переиспользуется от
+   слова к слову.
+   Повторы словоформ ищутся по открытой хэш-таблице form_slots на тексте
+   словоформы (и грамматике, если различаются анкоды). Место таблицы
+   занято, только если его поколение совпадает с поколением текущего
+   слова, так что для нового слова таблицу не надо чистить. */
+typedef struct {
+  uint32_t generation;
+  uint32_t form; /* Номер словоформы в forms */
+} FormSlot;
+
+struct analysis_scratch {
+  ArrayList *outputs; /* AutomatOutput - выводы автомата для текущего слова */
+  ArrayList *forms; /* WordForm - словоформы последнего разобранного слова */
+  wchar_t *words; /* Тексты словоформ forms подряд, каждый с '\0' */
+  size_t words_size;
+  size_t words_capacity;
+  Label *reversed_word;
+  size_t reversed_word_capacity;
+  int *checked_models;
+  size_t checked_models_capacity;
+  FormSlot *form_slots;
+  size_t form_slots_capacity; /* Степень двойки */
+  uint32_t generation;
+  /* Пакет слов (см. walk_words_scratch): выводы автомата i-го слова, было
+     ли оно выбрано, а для слов, проходимых по автомату, - их
+     инвертированные тексты (подряд в batch_buffer), длины и узнанные
+     части, в порядке прохода */
+  ArrayList **batch_outputs;
+  int8_t *batch_selected;
+  size_t *batch_walked;
+  Label **batch_reversed;
+  size_t *batch_lengths;
+  AutomatPrefix *batch_prefixes;
+  size_t batch_capacity;
+  Label *batch_buffer;
+  size_t batch_buffer_capacity;
+};
+
+AnalysisScratch *make_analysis_scratch(void) {
+  AnalysisScratch *scratch = strict_calloc(1, sizeof(*scratch));
+  scratch->outputs = make_array_list(sizeof(AutomatOutput), 10);
+  return scratch;
 }
 
-static int word_form_frequency_comparer(const void *form1, const void *form2) {
-  if (((WordForm *)form1)->frequency == ((WordForm *)form2)->frequency) return 0;
-  return (((WordForm *)form1)->frequency > ((WordForm *)form2)->frequency) ? -1 : 1; 
+void free_analysis_scratch(AnalysisScratch *scratch) {
+  size_t i;
+  for (i = 0; i < scratch->batch_capacity; i++) {
+    free_array_list(scratch->batch_outputs[i]);
+  }
+  strict_free(scratch->batch_outputs);
+  strict_free(scratch->batch_selected);
+  strict_free(scratch->batch_walked);
+  strict_free(scratch->batch_reversed);
+  strict_free(scratch->batch_lengths);
+  strict_free(scratch->batch_prefixes);
+  strict_free(scratch->batch_buffer);
+  free_array_list(scratch->outputs);
+  if (scratch->forms != NULL) free_array_list(scratch->forms);
+  strict_free(scratch->words);
+  strict_free(scratch->reversed_word);
+  strict_free(scratch->checked_models);
+  strict_free(scratch->form_slots);
+  strict_free(scratch);
 }
 
-static void unique_variations_to_result(WordForm *variations, size_t variations_count, ArrayList *result, EqFunction eq_function) {
-  size_t j;
-  ssize_t variation_index;
-  WordForm *variation;
-  for (variation = variations, j = 0; j < variations_count; j++, variation++) {
-    variation_index = array_list_index(result, variation, eq_function);
-    if (variation_index == -1) {
-      array_list_append(result, variation);
-    } else {
-      ((WordForm *)array_list_get(result, (size_t)variation_index))->frequency++;
-      strict_free(variation->word);
+static pthread_key_t thread_scratch_key;
+static pthread_once_t thread_scratch_once = PTHREAD_ONCE_INIT;
+
+static void free_thread_analysis_scratch(void *scratch) {
+  free_analysis_scratch(scratch);
+}
+
+static void init_thread_scratch_key(void) {
+  pthread_key_create(&thread_scratch_key, free_thread_analysis_scratch);
+}
+
+/* Рабочая память разбора текущего потока. Заводится при первом обращении
+   и освобождается при завершении потока. */
+AnalysisScratch *thread_analysis_scratch(void) {
+  AnalysisScratch *scratch;
+  pthread_once(&thread_scratch_once, init_thread_scratch_key);
+  scratch = pthread_getspecific(thread_scratch_key);
+  if (scratch == NULL) {
+    scratch = make_analysis_scratch();
+    pthread_setspecific(thread_scratch_key, scratch);
+  }
+  return scratch;
+}
+
+/* Гарантирует место ещё для length букв текстов словоформ. Тексты лежат
+   подряд в порядке словоформ, так что если буфер переехал, указатели
+   словоформ восстанавливаются по их длинам. */
+static void reserve_scratch_words(AnalysisScratch *scratch, size_t length) {
+  size_t i, count, offset = 0;
+  WordForm *form;
+  if (scratch->words_size + length <= scratch->words_capacity) return;
+  while (scratch->words_size + length > scratch->words_capacity) {
+    scratch->words_capacity = scratch->words_capacity == 0 ? 256 : scratch->words_capacity*2;
+  }
+  scratch->words = strict_realloc(scratch->words, sizeof(wchar_t)*scratch->words_capacity);
+  count = array_list_size(scratch->forms);
+  for (i = 0; i < count; i++) {
+    form = array_list_get(scratch->forms, i);
+    form->word = scratch->words + offset;
+    offset += form->word_length + 1;
+  }
+}
+
+/* Начинает сбор словоформ нового слова в scratch */
+static void reset_scratch_forms(AnalysisScratch *scratch) {
+  array_list_clear(scratch->forms);
+  scratch->words_size = 0;
+  if (++scratch->generation == 0) {
+    if (scratch->form_slots != NULL) {
+      memset(scratch->form_slots, 0, sizeof(FormSlot)*scratch->form_slots_capacity);
     }
+    scratch->generation = 1;
   }
-  free(variations);
 }
 
-/* Анализирует слово, используя морфологическую базу, и 
-   выдаёт словоформы этого слова - все, или только начальные 
-   флаг only_lemmas указывает, выдавать ли только начальные формы слов или все возможные
-   флаг distinct_ancodes указывает, учитывать ли различия в аношкинском коде 
-      (фактически - часть речи, падеж и т.п.) при удалении дубликатов.
-*/
+static uint32_t word_form_hash_code(const WordForm *form, int8_t distinct_ancodes) {
+  uint32_t code = 2166136261u;
+  size_t i;
+  for (i = 0; i < form->word_length; i++) {
+    code = (code ^ (uint32_t) form->word[i])*16777619u;
+  }
+  if (distinct_ancodes) {
+    code = (code ^ (uint32_t)((uintptr_t) form->grammar >> 3))*16777619u;
+  }
+  return code ^ (code >> 16);
+}
 
-ArrayList *analyze_word(const wchar_t *word, size_t word_length,
-                        void *automat, AutomatOutputsGenerator outputs_generator,
-                        MorphologyBase *morphology,
-                        int8_t only_lemmas, int8_t distinct_ancodes) {
-  ArrayList *outputs = make_array_list(sizeof(AutomatOutput), 10);
-  ArrayList *result = make_array_list(sizeof(WordForm), 15);
-  size_t i, variations_count, outputs_count, result_size;
+/* Место словоформы form в form_slots: занятое такой же словоформой или
+   первое свободное */
+static FormSlot *find_form_slot(AnalysisScratch *scratch, const WordForm *form, int8_t distinct_ancodes) {
+  size_t mask = scratch->form_slots_capacity - 1;
+  size_t i = word_form_hash_code(form, distinct_ancodes) & mask;
+  FormSlot *slot;
+  WordForm *other;
+  for (;; i = (i + 1) & mask) {
+    slot = scratch->form_slots + i;
+    if (slot->generation != scratch->generation) return slot;
+    other = array_list_get(scratch->forms, slot->form);
+    if (other->word_length == form->word_length &&
+        wmemcmp(other->word, form->word, form->word_length) == 0 &&
+        (!distinct_ancodes || other->grammar == form->grammar)) {
+      return slot;
+    }
+  }
+}
+
+/* Добавляет словоформу form, текст которой уже записан в конец
+   scratch->words, в scratch->forms. Если такая словоформа уже есть, её
+   частота увеличивается, а текст form отбрасывается. */
+static void add_scratch_form(AnalysisScratch *scratch, const WordForm *form, int8_t distinct_ancodes) {
+  size_t i, count = array_list_size(scratch->forms), capacity;
+  FormSlot *slot;
+  if (2*(count + 1) > scratch->form_slots_capacity) {
+    capacity = scratch->form_slots_capacity == 0 ? 64 : 2*scratch->form_slots_capacity;
+    strict_free(scratch->form_slots);
+    scratch->form_slots = strict_calloc(capacity, sizeof(FormSlot));
+    scratch->form_slots_capacity = capacity;
+    scratch->generation = 1;
+    for (i = 0; i < count; i++) {
+      slot = find_form_slot(scratch, array_list_get(scratch->forms, i), distinct_ancodes);
+      slot->generation = scratch->generation;
+      slot->form = (uint32_t) i;
+    }
+  }
+  slot = find_form_slot(scratch, form, distinct_ancodes);
+  if (slot->generation == scratch->generation) {
+    ((WordForm *)array_list_get(scratch->forms, slot->form))->frequency++;
+    return;
+  }
+  slot->generation = scratch->generation;
+  slot->form = (uint32_t) count;
+  array_list_append(scratch->forms, form);
+  scratch->words_size += form->word_length + 1;
+}
+
+/* Добавляет в scratch->forms все словоформы слова word, допустимые для
+   флективной модели flex_model_no.
+   Параметры flexion_size и base_size определяют ту часть слова word,
+   которую надо использовать как основу при добавлении приставок и
+   окончаний флективной модели. Текст словоформы пишется прямо в
+   scratch->words; повтор уже найденной словоформы (с той же грамматикой,
+   если distinct_ancodes) места не занимает, а только увеличивает её
+   частоту. */
+static void add_word_variations(AnalysisScratch *scratch,
+                                const wchar_t *word, size_t word_length,
+                                uint8_t flexion_size,
+                                uint8_t base_size,
+                                uint16_t flex_model_no,
+                                MorphologyBase *base,
+                                int8_t distinct_ancodes) {
+  FlexModel *model = base->flex_models->model_list[flex_model_no];
+  size_t i, variances_count = flex_model_size(model), prefix_length, flexion_length;
+  const wchar_t *word_base = word + (word_length - flexion_size - base_size);
+  FlexVariance *variance;
+  WordForm form;
+  for (i = 0; i < variances_count; i++) {
+    variance = flex_model_variance(model, i);
+    prefix_length = variance->prefix != NULL ? wcslen(variance->prefix) : 0;
+    flexion_length = variance->flexion != NULL ? wcslen(variance->flexion) : 0;
+    reserve_scratch_words(scratch, prefix_length + base_size + flexion_length + 1);
+    form.word = scratch->words + scratch->words_size;
+    if (prefix_length > 0) wmemcpy(form.word, variance->prefix, prefix_length);
+    wmemcpy(form.word + prefix_length, word_base, base_size);
+    if (flexion_length > 0) wmemcpy(form.word + prefix_length + base_size, variance->flexion, flexion_length);
+    form.word[prefix_length + base_size + flexion_length] = L'\0';
+    form.flexion_size = (uint8_t) flexion_length;
+    form.word_length = prefix_length + base_size + form.flexion_size;
+    form.flex_model_index = flex_model_no;
+    form.base_size = base_size;
+    form.grammar = variance->grammar;
+    form.base_grammar = NULL;
+    form.frequency = 0;
+    add_scratch_form(scratch, &form, distinct_ancodes);
+  }
+}
+
+/* Добавляет в scratch->forms лемму слова word по флективной модели
+   flex_model_no - так же, как add_word_variations добавила бы первую
+   словоформу модели, но сразу по правилу base->lemma_rules. Повтор леммы
+   (с той же грамматикой, если distinct_ancodes) только увеличивает её
+   частоту. */
+static void add_word_lemma(AnalysisScratch *scratch,
+                           const wchar_t *word, size_t word_length,
+                           uint8_t flexion_size,
+                           uint8_t base_size,
+                           uint16_t flex_model_no,
+                           MorphologyBase *base,
+                           int8_t distinct_ancodes) {
+  const LemmaRule *rule = base->lemma_rules + flex_model_no;
+  wchar_t *lemma;
+  WordForm form;
+  reserve_scratch_words(scratch, rule->prefix_length + base_size + rule->flexion_length + 1);
+  lemma = scratch->words + scratch->words_size;
+  if (rule->prefix_length > 0) wmemcpy(lemma, rule->prefix, rule->prefix_length);
+  wmemcpy(lemma + rule->prefix_length, word + (word_length - flexion_size - base_size), base_size);
+  if (rule->flexion_length > 0) wmemcpy(lemma + rule->prefix_length + base_size, rule->flexion, rule->flexion_length);
+  lemma[rule->prefix_length + base_size + rule->flexion_length] = L'\0';
+  form.word = lemma;
+  form.word_length = rule->prefix_length + base_size + (uint8_t) rule->flexion_length;
+  form.flex_model_index = flex_model_no;
+  form.flexion_size = (uint8_t) rule->flexion_length;
+  form.base_size = base_size;
+  form.frequency = 0;
+  form.base_grammar = NULL;
+  form.grammar = rule->grammar;
+  add_scratch_form(scratch, &form, distinct_ancodes);
+}
+
+/* Добавляет в scratch->forms лемму с основой base (длиной base_size) по
+   правилу rule и грамматикой формы grammar (см. add_word_tags) */
+static void add_tagged_lemma(AnalysisScratch *scratch, const wchar_t *base, uint8_t base_size,
+                             uint16_t flex_model_no, const LemmaRule *rule, Grammar *grammar) {
+  WordForm form;
+  form.word_length = rule->prefix_length + base_size + (uint8_t) rule->flexion_length;
+  reserve_scratch_words(scratch, form.word_length + 1);
+  form.word = scratch->words + scratch->words_size;
+  if (rule->prefix_length > 0) wmemcpy(form.word, rule->prefix, rule->prefix_length);
+  wmemcpy(form.word + rule->prefix_length, base, base_size);
+  if (rule->flexion_length > 0) wmemcpy(form.word + rule->prefix_length + base_size, rule->flexion, rule->flexion_length);
+  form.word[form.word_length] = L'\0';
+  form.flex_model_index = flex_model_no;
+  form.flexion_size = (uint8_t) rule->flexion_length;
+  form.base_size = base_size;
+  form.frequency = 0;
+  form.base_grammar = rule->grammar;
+  form.grammar = grammar;
+  add_scratch_form(scratch, &form, 1);
+}
+
+/* Добавляет в scratch->forms лемму слова word по флективной модели
+   flex_model_no (как add_word_lemma) - по разу на каждое правило модели,
+   которым могло быть образовано само слово word, то есть с его окончанием
+   и приставкой. Грамматика такого правила (формы слова word) пишется в
+   grammar словоформы, грамматика начальной формы - в base_grammar. Если
+   ни одно правило не подошло, лемма добавляется без грамматики. */
+static void add_word_tags(AnalysisScratch *scratch,
+                          const wchar_t *word, size_t word_length,
+                          uint8_t flexion_size,
+                          uint8_t base_size,
+                          uint16_t flex_model_no,
+                          MorphologyBase *base) {
+  FlexModel *model = base->flex_models->model_list[flex_model_no];
+  const LemmaRule *rule = base->lemma_rules + flex_model_no;
+  size_t i, variances_count = flex_model_size(model), prefix_length;
+  size_t before_base_size = word_length - flexion_size - base_size;
+  const wchar_t *flexion = word + (word_length - flexion_size);
+  FlexVariance *variance;
+  int matched = 0;
+  for (i = 0; i < variances_count; i++) {
+    variance = flex_model_variance(model, i);
+    if ((variance->flexion != NULL ? wcslen(variance->flexion) : 0) != flexion_size ||
+        (flexion_size > 0 && wmemcmp(variance->flexion, flexion, flexion_size) != 0)) {
+      continue;
+    }
+    prefix_length = variance->prefix != NULL ? wcslen(variance->prefix) : 0;
+    if (prefix_length > before_base_size ||
+        (prefix_length > 0 && wmemcmp(word + before_base_size - prefix_length, variance->prefix, prefix_length) != 0)) {
+      continue;
+    }
+    add_tagged_lemma(scratch, word + before_base_size, base_size, flex_model_no, rule, variance->grammar);
+    matched = 1;
+  }
+  if (!matched) {
+    add_tagged_lemma(scratch, word + before_base_size, base_size, flex_model_no, rule, NULL);
+  }
+}
+
+/* Строит по выводам автомата outputs словоформы слова word (см.
+   analyze_word) в scratch->forms, заменяя прежние. При only_lemmas ==
+   ANALYZE_LEMMA_TAGS это леммы с грамматикой самого слова (см.
+   add_word_tags). */
+static void analyze_automat_outputs(ArrayList *outputs,
+                                    const wchar_t *word, size_t word_length,
+                                    const AnnotationTable *annotations,
+                                    MorphologyBase *morphology,
+                                    int8_t only_lemmas, int8_t distinct_ancodes,
+                                    AnalysisScratch *scratch) {
+  size_t i, outputs_count, result_size;
+  uint32_t code;
   WordForm form;
-  int *checked_models, checked_models_count;
-  EqFunction eq_func = distinct_ancodes ? is_same_word_form_with_ancode : is_same_word_form;
-  wchar_t *reversed_word = strict_malloc(sizeof(wchar_t)*(word_length + 1));
-  wmemcpy(reversed_word, word, word_length);
-  wcssubreverse(reversed_word, reversed_word + word_length);
-  outputs_generator(automat, reversed_word, word_length, MIN_MATCH_FOR_PREDICTION, collect_automat_output, outputs);
-  strict_free(reversed_word);
-  filter_productive_output(outputs, word, word_length, morphology);
+  int checked_models_count = 0;
+  ssize_t base_part_size;
+  AutomatOutput *output;
+  if (scratch->forms == NULL) {
+    scratch->forms = make_array_list(sizeof(WordForm), 15);
+  }
+  reset_scratch_forms(scratch);
   outputs_count = array_list_size(outputs);
-  checked_models = strict_malloc(sizeof(int)*outputs_count);
-  checked_models_count = 0;
+  if (outputs_count > scratch->checked_models_capacity) {
+    scratch->checked_models_capacity = outputs_count;
+    scratch->checked_models = strict_realloc(scratch->checked_models, sizeof(int)*outputs_count);
+  }
   for (i=0; i < outputs_count; i++) {
-    WordForm *variations;
-    AutomatOutput *output = array_list_get(outputs, i);
-    ssize_t base_part_size;
-    parse_morphology_annotation(output->annotation, &form);
-    if (!is_analyzed_model(form.flex_model_index, checked_models, checked_models_count)) {
+    output = array_list_get(outputs, i);
+    if ((code = annotation_code(annotations, output->annotation)) == ANNOTATION_NONE) continue;
+    form.base_size = (uint8_t)(code & 255);
+    form.flexion_size = (uint8_t)((code >> 8) & 255);
+    form.flex_model_index = (uint16_t)(code >> 16);
+    if (!is_analyzed_model(form.flex_model_index, scratch->checked_models, checked_models_count)) {
       if (output->is_prediction) { /* Нужно предсказание */
 	base_part_size = (ssize_t) word_length - form.flexion_size;
-	if (base_part_size >= MIN_BASE_LENGTH) {
-	  variations = all_word_variations(word, word_length, only_lemmas, form.flexion_size, (uint8_t) base_part_size, form.flex_model_index, morphology, &variations_count);
-	  unique_variations_to_result(variations, variations_count, result, eq_func);
-	}
       } else {
-	variations = all_word_variations(word, word_length, only_lemmas, form.flexion_size, (uint8_t)(output->known_prefix_size + form.base_size), form.flex_model_index, morphology, &variations_count);
-	unique_variations_to_result(variations, variations_count, result, eq_func);
+	base_part_size = output->known_prefix_size + form.base_size;
       }
-      checked_models[checked_models_count++] = form.flex_model_index;
+      if (!output->is_prediction || base_part_size >= MIN_BASE_LENGTH) {
+	if (only_lemmas == ANALYZE_LEMMA_TAGS) {
+	  add_word_tags(scratch, word, word_length, form.flexion_size, (uint8_t) base_part_size, form.flex_model_index, morphology);
+	} else if (only_lemmas) {
+	  add_word_lemma(scratch, word, word_length, form.flexion_size, (uint8_t) base_part_size, form.flex_model_index, morphology, distinct_ancodes);
+	} else {
+	  add_word_variations(scratch, word, word_length, form.flexion_size, (uint8_t) base_part_size, form.flex_model_index, morphology, distinct_ancodes);
+	}
+      }
+      scratch->checked_models[checked_models_count++] = form.flex_model_index;
     }
   }
-  free(checked_models);
-  array_list_foreach(outputs, free_automat_output);
-  free_array_list(outputs);
-  result_size = array_list_size(result);
+  result_size = array_list_size(scratch->forms);
   if (result_size > 1) {
-    qsort(array_list_data(result), result_size, sizeof(WordForm), word_form_frequency_comparer);
+    qsort(array_list_data(scratch->forms), result_size, sizeof(WordForm), word_form_frequency_comparer);
+  }
+}
+
+/* Забирает у scratch список словоформ последнего разобранного слова,
+   копируя их тексты, - так, как его возвращает analyze_word. */
+static ArrayList *take_analysis_result(AnalysisScratch *scratch) {
+  ArrayList *result = scratch->forms;
+  size_t i, count = array_list_size(result);
+  WordForm *form;
+  wchar_t *word;
+  for (i = 0; i < count; i++) {
+    form = array_list_get(result, i);
+    word = strict_malloc(sizeof(wchar_t)*(form->word_length + 1));
+    wmemcpy(word, form->word, form->word_length + 1);
+    form->word = word;
   }
+  scratch->forms = NULL;
   return result;
 }
 
+/* То же, что analyze_word, но в рабочей памяти scratch: результат - список
+   словоформ внутри scratch, он действителен до следующего разбора с тем
+   же scratch и не освобождается. Когда буферы scratch доросли до нужных
+   размеров, разбор слова не выделяет памяти вовсе (кроме редких
+   предсказаний, перебирающих больше AUTOMAT_WALK_INLINE_NODES
+   состояний). Одной рабочей памятью может пользоваться только один
+   поток.
+*/
+ArrayList *analyze_word_scratch(const wchar_t *word, size_t word_length,
+                                void *automat, AutomatOutputsGenerator outputs_generator,
+                                const AutomatOutputLimits *limits,
+                                const AnnotationTable *annotations,
+                                const struct word_form_hash *word_hash,
+                                MorphologyBase *morphology,
+                                int8_t only_lemmas, int8_t distinct_ancodes,
+                                AnalysisScratch *scratch) {
+  ArrayList *outputs = scratch->outputs;
+  array_list_clear(outputs);
+  if (word_hash == NULL || !word_form_hash_outputs(word_hash, word, word_length, limits, collect_automat_output, outputs)) {
+    if (word_length + 1 > scratch->reversed_word_capacity) {
+      scratch->reversed_word_capacity = word_length + 1;
+      scratch->reversed_word = strict_realloc(scratch->reversed_word, sizeof(Label)*scratch->reversed_word_capacity);
+    }
+    wmemcpy(scratch->reversed_word, word, word_length);
+    wcssubreverse(scratch->reversed_word, scratch->reversed_word + word_length);
+    outputs_generator(automat, scratch->reversed_word, word_length, MIN_MATCH_FOR_PREDICTION, limits, collect_automat_output, outputs);
+    filter_productive_output(outputs, word, word_length, morphology);
+  }
+  analyze_automat_outputs(outputs, word, word_length, annotations, morphology, only_lemmas, distinct_ancodes, scratch);
+  return scratch->forms;
+}
+
+/* Анализирует слово, используя морфологическую базу, и
+   выдаёт словоформы этого слова - все, или только начальные
+   флаг only_lemmas указывает, выдавать ли только начальные формы слов или все возможные
+   флаг distinct_ancodes указывает, учитывать ли различия в аношкинском коде
+      (фактически - часть речи, падеж и т.п.) при удалении дубликатов.
+   Если есть таблица словоформ word_hash (может быть NULL) и слово в ней
+   нашлось, автомат не используется вовсе.
+   Разбор идёт в рабочей памяти потока (thread_analysis_scratch), так что
+   выделяется только сам результат.
+*/
+
+ArrayList *analyze_word(const wchar_t *word, size_t word_length,
+                        void *automat, AutomatOutputsGenerator outputs_generator,
+                        const AutomatOutputLimits *limits,
+                        const AnnotationTable *annotations,
+                        const struct word_form_hash *word_hash,
+                        MorphologyBase *morphology,
+                        int8_t only_lemmas, int8_t distinct_ancodes) {
+  AnalysisScratch *scratch = thread_analysis_scratch();
+  analyze_word_scratch(word, word_length, automat, outputs_generator, limits, annotations, word_hash,
+                       morphology, only_lemmas, distinct_ancodes, scratch);
+  return take_analysis_result(scratch);
+}
+
+/* Гарантирует в scratch место для пакета из count слов */
+static void reserve_scratch_batch(AnalysisScratch *scratch, size_t count) {
+  size_t i, capacity = scratch->batch_capacity;
+  if (count <= capacity) return;
+  while (count > capacity) {
+    capacity = capacity == 0 ? 64 : capacity*2;
+  }
+  scratch->batch_outputs = strict_realloc(scratch->batch_outputs, sizeof(ArrayList *)*capacity);
+  for (i = scratch->batch_capacity; i < capacity; i++) {
+    scratch->batch_outputs[i] = make_array_list(sizeof(AutomatOutput), 10);
+  }
+  scratch->batch_selected = strict_realloc(scratch->batch_selected, sizeof(int8_t)*capacity);
+  scratch->batch_walked = strict_realloc(scratch->batch_walked, sizeof(size_t)*capacity);
+  scratch->batch_reversed = strict_realloc(scratch->batch_reversed, sizeof(Label *)*capacity);
+  scratch->batch_lengths = strict_realloc(scratch->batch_lengths, sizeof(size_t)*capacity);
+  scratch->batch_prefixes = strict_realloc(scratch->batch_prefixes, sizeof(AutomatPrefix)*capacity);
+  scratch->batch_capacity = capacity;
+}
+
+/* Пакетный вариант analyze_word_scratch, первая половина: находит выводы
+   автомата сразу для count слов words и оставляет их в scratch. Слова,
+   для которых select (если не NULL) вернул 0, пропускаются. Слова,
+   которых нет в word_hash, проходятся по автомату не по одному, а все
+   вместе (prefix_batch), так что промахи кэша разных слов перекрываются.
+   Выгодно при анализе документа, где все слова известны заранее.
+   Словоформы каждого слова затем строит analyze_walked_word_scratch.
+*/
+void walk_words_scratch(const wchar_t *const words[], const size_t word_lengths[], size_t count,
+                        WordSelector select, void *data,
+                        void *automat, AutomatCommonPrefixBatch prefix_batch,
+                        AutomatPrefixOutputsGenerator prefix_outputs_generator,
+                        const AutomatOutputLimits *limits,
+                        const struct word_form_hash *word_hash, MorphologyBase *morphology,
+                        AnalysisScratch *scratch) {
+  size_t i, word, walked_count = 0, buffer_size = 0;
+  Label *cursor;
+  reserve_scratch_batch(scratch, count);
+  for (i = 0; i < count; i++) {
+    array_list_clear(scratch->batch_outputs[i]);
+    scratch->batch_selected[i] = (int8_t)(select == NULL || select(i, data));
+    if (!scratch->batch_selected[i]) continue;
+    if (word_hash == NULL || !word_form_hash_outputs(word_hash, words[i], word_lengths[i], limits, collect_automat_output, scratch->batch_outputs[i])) {
+      scratch->batch_walked[walked_count++] = i;
+      buffer_size += word_lengths[i];
+    }
+  }
+  if (buffer_size > scratch->batch_buffer_capacity) {
+    scratch->batch_buffer_capacity = buffer_size;
+    scratch->batch_buffer = strict_realloc(scratch->batch_buffer, sizeof(Label)*buffer_size);
+  }
+  /* Инвертированные слова - в одном общем буфере */
+  cursor = scratch->batch_buffer;
+  for (i = 0; i < walked_count; i++) {
+    word = scratch->batch_walked[i];
+    wmemcpy(cursor, words[word], word_lengths[word]);
+    wcssubreverse(cursor, cursor + word_lengths[word]);
+    scratch->batch_reversed[i] = cursor;
+    scratch->batch_lengths[i] = word_lengths[word];
+    cursor += word_lengths[word];
+  }
+  prefix_batch(automat, scratch->batch_reversed, scratch->batch_lengths, walked_count, scratch->batch_prefixes);
+  for (i = 0; i < walked_count; i++) {
+    word = scratch->batch_walked[i];
+    prefix_outputs_generator(automat, &scratch->batch_prefixes[i], word_lengths[word], MIN_MATCH_FOR_PREDICTION, limits, collect_automat_output, scratch->batch_outputs[word]);
+    filter_productive_output(scratch->batch_outputs[word], words[word], word_lengths[word], morphology);
+  }
+}
+
+/* Вторая половина пакетного разбора: строит словоформы index-го слова
+   word последнего пакета walk_words_scratch - так же, как
+   analyze_word_scratch, и с тем же временем жизни результата. Для слова,
+   не выбранного в пакет, возвращает NULL. Выводы автомата остальных
+   слов пакета сохраняются, так что между вызовами можно разбирать и
+   отдельные слова (analyze_word_scratch) с той же рабочей памятью.
+*/
+ArrayList *analyze_walked_word_scratch(size_t index, const wchar_t *word, size_t word_length,
+                                       const AnnotationTable *annotations, MorphologyBase *morphology,
+                                       int8_t only_lemmas, int8_t distinct_ancodes,
+                                       AnalysisScratch *scratch) {
+  if (!scratch->batch_selected[index]) return NULL;
+  analyze_automat_outputs(scratch->batch_outputs[index], word, word_length, annotations, morphology,
+                          only_lemmas, distinct_ancodes, scratch);
+  return scratch->forms;
+}
+
 static void free_analyze_variation(void *form) {
   strict_free(((WordForm *)form)->word);
 }
@@ -863,22 +1419,32 @@ void free_analyze_word_results(ArrayList *list) {
 }
 
 /* Генерирует новый автомат морфологического разбора, на основе файлов словаря
- * mrd_file_name и grammar_file_name. Результат работы сохраняется в файл automat_file_name. */
-void build_automat(char *mrd_file_name, char *grammar_file_name, char *automat_file_name) {
+ * mrd_file_name и grammar_file_name. Результат работы сохраняется в файл automat_file_name.
+ * Возвращает 0 при успехе и -1 при ошибке. Словари целиком, с замером
+ * времени каждого этапа, собирает compile_dictionaries (см. compiler.c). */
+int build_automat(char *mrd_file_name, char *grammar_file_name, char *automat_file_name) {
   MorphologyBase *base;
-  ArrayList *words;
   Automat *automat;
+  AnnotationTable annotations = {NULL, 0};
+  long int saved_states;
   base = init_morphology_base(mrd_file_name, grammar_file_name, 0);
-  fprintf(stderr, "Generating word forms...");
-  words = generate_all_words(base, 0);
-  fprintf(stderr, "OK\nSorting word forms...");
-  prepare_words_for_automat(words);
-  fprintf(stderr, "OK\nBuilding automat...");
-  automat = make_morphology_automat(words);
+  if (base == NULL) return -1;
+  fprintf(stderr, "Building automat...");
+  automat = build_morphology_automat(base, WORD_SORTER_DEFAULT_BUDGET, NULL, &annotations);
+  if (automat == NULL) {
+    fprintf(stderr, "FAILED\n");
+    free_annotation_table(&annotations);
+    free_morphology_base(base);
+    return -1;
+  }
   fprintf(stderr, "OK\nSaving automat...");
-  save_automat(automat, automat_file_name);
-  fprintf(stderr, "OK\n");
-  free_generated_words(words);
+  saved_states = save_automat(automat, automat_file_name);
+  if (saved_states >= 0 && append_annotation_table(automat_file_name, &annotations) != 0) {
+    saved_states = -1;
+  }
+  fprintf(stderr, saved_states < 0 ? "FAILED\n" : "OK\n");
+  free_annotation_table(&annotations);
   free_morphology_base(base);
   free_automat(automat);
+  return saved_states < 0 ? -1 : 0;
 }
@@ -2,6 +2,10 @@
 #define __MORPH_WORDFORMS_H_
 
 #include "automat.h"
+#include "annotations.h"
+#include "wordsorter.h"
+#include "grammemes.h"
+#include "../common/hashtable.h"
 #include "../common/datastruct.h"
 
 #define ANNOTATION_DELIMITER L'|'
@@ -13,6 +17,8 @@ typedef struct {
   wchar_t *ancode;
   wchar_t *part_of_speech;
   wchar_t *grammems;
+  uint8_t pos; /* Часть речи и граммемы в числах (см. grammemes.h) */
+  uint64_t grammeme_bits;
 } Grammar;
 
 typedef HashTable GrammarList;
@@ -65,6 +71,30 @@ typedef struct {
   size_t length;
 } LemmaList;
 
+/* Правило начальной формы флективной модели - её первое правило с
+   заранее посчитанными длинами. По нему лемма слова строится сразу, без
+   обхода остальных правил модели. */
+typedef struct {
+  const wchar_t *prefix; /* NULL, если приставки нет */
+  const wchar_t *flexion; /* NULL, если окончания нет */
+  size_t prefix_length;
+  size_t flexion_length;
+  Grammar *grammar;
+} LemmaRule;
+
+/* Память базы, загруженной из двоичного образа (см. baseimage.c). Строки
+   всех правил указывают прямо внутрь отображённого в память образа, а
+   сами правила и модели лежат в нескольких общих массивах. */
+typedef struct {
+  void *data;
+  size_t size;
+  Grammar *grammars;
+  FlexModel *flex_models;
+  FlexVariance *variances;
+  PrefixModel *prefix_models;
+  wchar_t **prefixes;
+} MorphologyImage;
+
 /* Морфологическая база - набор всех правил, лемм и т.п. 
    необходимый для анализа и генерации */
 typedef struct {
@@ -73,6 +103,8 @@ typedef struct {
   PrefixModelList *prefix_models;
   LemmaList *lemmas;
   GrammarList *grammars;
+  MorphologyImage *image; /* NULL, если база разобрана из morphs.mrd */
+  LemmaRule *lemma_rules; /* По правилу на флективную модель */
 } MorphologyBase;
 
 /* Словоформа - слово, образованное по определённому
@@ -92,16 +124,40 @@ typedef struct {
 /* Вывод автомата на основе некоторого слова.
  Используется в морфологическом анализе. */
 typedef struct {
-  wchar_t *text;
+  /* Номер морфологической аннотации в таблице аннотаций (см. annotations.h) */
+  uint32_t annotation;
   /* Размер части слова, являющейся приставкой вида "квази", "мульти" и т.п.*/
   uint8_t known_prefix_size;
-  /* Морфологическая аннотация, является указателем на часть text */
-  wchar_t *annotation;
   int8_t is_prediction;
   uint8_t automat_prefix_size;
+  /* Число меток, которые автомат достроил к слову при предсказании */
+  uint8_t prediction_size;
 } AutomatOutput;
 
-typedef void (*AutomatOutputProcessor) (char is_prediction, size_t prefix_size, Label buffer[], void *data);
+/* Получает очередной вывод автомата: prefix_size - длина разобранной части
+   слова, prediction_size - длина достроенной при предсказании части,
+   annotation - номер аннотации после разделителя */
+typedef void (*AutomatOutputProcessor) (char is_prediction, size_t prefix_size, size_t prediction_size,
+                                        uint32_t annotation, void *data);
+
+/* Ограничения перебора выводов автомата. У коротких незнакомых слов
+   предсказание может дойти до десятков тысяч состояний и выводов, а
+   полезны из них только первые (см. walk_automat_outputs).
+   Ноль - без ограничения. */
+typedef struct {
+  size_t max_outputs; /* Число выводов */
+  size_t max_states; /* Число пройденных состояний */
+} AutomatOutputLimits;
+
+#ifndef AUTOMAT_MAX_OUTPUTS
+#define AUTOMAT_MAX_OUTPUTS 256
+#endif
+#ifndef AUTOMAT_MAX_VISITED_STATES
+#define AUTOMAT_MAX_VISITED_STATES 8192
+#endif
+/* Минимальная длина части всего слова, которая должна совпасть с автоматом,
+   чтобы можно было делать предсказание словоформ */
+#define MIN_MATCH_FOR_PREDICTION 4
 
 wchar_t *variance_flexion(FlexVariance *variance);
 wchar_t *variance_ancode(FlexVariance *variance);
@@ -129,12 +185,17 @@ void free_prefix_model(PrefixModel *model);
 size_t prefix_model_size(PrefixModel *model);
 wchar_t *prefix_model_item(PrefixModel *model, size_t index);
 
+void prepare_lemma_rules(MorphologyBase *base);
 MorphologyBase *init_morphology_base(char *mrd_file_name, const char *grammar_file_name, char no_load_lemmas);
 void free_morphology_base(MorphologyBase *base);
-ArrayList *generate_all_words(MorphologyBase *base, size_t max_count);
+int generate_word_forms(MorphologyBase *base, size_t max_count, AnnotationTable *annotations,
+                        WordFormProcessor on_word_form, void *data);
+ArrayList *generate_all_words(MorphologyBase *base, size_t max_count, AnnotationTable *annotations);
 void free_generated_words(ArrayList *words);
 void prepare_words_for_automat(ArrayList *all_forms);
 Automat *make_morphology_automat(ArrayList *word_forms);
+Automat *make_morphology_automat_sorted(WordSorter *sorter);
+Automat *build_morphology_automat(MorphologyBase *base, size_t memory_budget, const char *temp_dir, AnnotationTable *annotations);
 void possible_outputs(void *automat, 
 		      Label word[], size_t word_length, 
 		      size_t min_prediction_prefix,
@@ -146,16 +207,81 @@ void possible_outputs(void *automat,
 typedef void (*AutomatOutputsGenerator)(void *automat,
 					Label word[], size_t word_length, 
 					size_t min_prediction_prefix,
+					const AutomatOutputLimits *limits,
 					AutomatOutputProcessor on_complete,
 					void *data);
 /* Возвращает длину последовательности символов в инвертированном слове word,
  * которую автомат способен узнать  */
 typedef size_t (*AutomatCommonPrefixSize)(void *automat,
                                        Label word[], size_t word_length);
+/* Переход из состояния state по метке label: номер целевого состояния или
+ * UINT32_MAX, если перехода нет. Начальное состояние - 0 */
+typedef uint32_t (*AutomatTransition)(void *automat, uint32_t state, Label label);
+/* Освобождает автомат */
+typedef void (*AutomatDestructor)(void *automat);
+
+/* Узнанная автоматом часть инвертированного слова: её длина и состояние,
+   в котором она кончается */
+typedef struct {
+  size_t prefix_size;
+  uint32_t last_state;
+} AutomatPrefix;
+
+/* Проводит по автомату сразу count инвертированных слов words, записывая
+ * для каждого узнанную часть в prefixes */
+typedef void (*AutomatCommonPrefixBatch)(void *automat,
+                                         Label *const words[], const size_t word_lengths[], size_t count,
+                                         AutomatPrefix prefixes[]);
+/* То же, что AutomatOutputsGenerator, но для слова длиной word_length, уже
+ * пройденного по автомату до prefix */
+typedef void (*AutomatPrefixOutputsGenerator)(void *automat,
+                                              const AutomatPrefix *prefix, size_t word_length,
+                                              size_t min_prediction_prefix,
+                                              const AutomatOutputLimits *limits,
+                                              AutomatOutputProcessor on_complete,
+                                              void *data);
+
+/* Таблица словоформ для точных совпадений (см. wordhash.h) */
+struct word_form_hash;
+
+/* Рабочая память разбора слов, переиспользуемая от слова к слову (см.
+   analyze_word_scratch). Одна рабочая память - на один поток. */
+typedef struct analysis_scratch AnalysisScratch;
+
+/* Значение only_lemmas функций анализа: выдавать леммы, но с грамматикой
+   самого слова (WordForm.grammar), а не начальной формы (base_grammar) -
+   по лемме на каждую возможную форму слова */
+#define ANALYZE_LEMMA_TAGS 2
+
+/* Выбирает слова пакета для разбора: 0 - index-е слово пропустить */
+typedef int (*WordSelector)(size_t index, void *data);
+
+AnalysisScratch *make_analysis_scratch(void);
+void free_analysis_scratch(AnalysisScratch *scratch);
+AnalysisScratch *thread_analysis_scratch(void);
 
-ArrayList *analyze_word(const wchar_t *word, size_t word_length, void *automat, AutomatOutputsGenerator outputs_generator, MorphologyBase *morphology, int8_t only_lemmas, int8_t distinct_ancodes);
+ArrayList *analyze_word(const wchar_t *word, size_t word_length, void *automat, AutomatOutputsGenerator outputs_generator, const AutomatOutputLimits *limits, const AnnotationTable *annotations, const struct word_form_hash *word_hash, MorphologyBase *morphology, int8_t only_lemmas, int8_t distinct_ancodes);
+ArrayList *analyze_word_scratch(const wchar_t *word, size_t word_length,
+                                void *automat, AutomatOutputsGenerator outputs_generator,
+                                const AutomatOutputLimits *limits,
+                                const AnnotationTable *annotations,
+                                const struct word_form_hash *word_hash,
+                                MorphologyBase *morphology,
+                                int8_t only_lemmas, int8_t distinct_ancodes,
+                                AnalysisScratch *scratch);
+void walk_words_scratch(const wchar_t *const words[], const size_t word_lengths[], size_t count,
+                        WordSelector select, void *data,
+                        void *automat, AutomatCommonPrefixBatch prefix_batch,
+                        AutomatPrefixOutputsGenerator prefix_outputs_generator,
+                        const AutomatOutputLimits *limits,
+                        const struct word_form_hash *word_hash, MorphologyBase *morphology,
+                        AnalysisScratch *scratch);
+ArrayList *analyze_walked_word_scratch(size_t index, const wchar_t *word, size_t word_length,
+                                       const AnnotationTable *annotations, MorphologyBase *morphology,
+                                       int8_t only_lemmas, int8_t distinct_ancodes,
+                                       AnalysisScratch *scratch);
 void free_analyze_word_results(ArrayList *list);
-void build_automat(char *mrd_file_name, char *grammar_file_name, char *automat_file_name);
+int build_automat(char *mrd_file_name, char *grammar_file_name, char *automat_file_name);
 char word_has_known_prefix(const wchar_t *word, size_t prefix_size, 
 			   wchar_t **known_prefixes, size_t known_prefixes_count);
 
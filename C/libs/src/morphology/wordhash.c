@@ -0,0 +1,475 @@
+/* Минимальная совершенная хэш-таблица словоформ (см. wordhash.h).
+
+   Сборка: обходом плоского автомата перечисляются все словоформы, у
+   которых за последней буквой есть разделитель аннотаций. Для каждой
+   словоформы её аннотации берутся тем же обходом, что и при разборе
+   (mini_possible_outputs), так что порядок выводов совпадает. Одинаковые
+   списки аннотаций хранятся один раз.
+
+   Раскладка по местам: корзин около 5n/log2(n); 60% отпечатков попадают в
+   первые 30% корзин, так что крупные корзины раскладываются первыми, пока
+   таблица почти пуста. Корзины перебираются по убыванию размера, и для
+   каждой подбирается наименьший пилот, при котором все её слова ложатся
+   на свободные и разные места. Мест чуть больше, чем слов (заполнение
+   0.99); занятые места за пределами числа слов потом переотображаются на
+   оставшиеся свободные. */
+
+#include "morphology/wordhash.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "morphology/automatwalk.h"
+#include "common/strict_alloc.h"
+#include "common/fileimage.h"
+#include "common/hashtable.h"
+
+/* Первые 60% отпечатков (по старшим 32 битам) - в плотные корзины */
+#define WORD_HASH_DENSE_KEYS 2576980378u
+#define WORD_HASH_DENSE_BUCKETS 0.3
+#define WORD_HASH_BUCKET_FACTOR 5.0
+#define WORD_HASH_LOAD_FACTOR 0.99
+/* Пилоты больше этого не перебираются - сборка повторяется с другим зерном */
+#define WORD_HASH_MAX_PILOT (1u << 24)
+#define WORD_HASH_SEEDS_COUNT 4
+#define WORD_HASH_INITIAL_SEED 0x6d6f727068776831ULL
+
+static inline uint64_t word_hash_mix(uint64_t value) {
+  value ^= value >> 30;
+  value *= 0xbf58476d1ce4e5b9ULL;
+  value ^= value >> 27;
+  value *= 0x94d049bb133111ebULL;
+  value ^= value >> 31;
+  return value;
+}
+
+/* 64-битный отпечаток слова word длиной length */
+static inline uint64_t word_fingerprint(const wchar_t *word, size_t length, uint64_t seed) {
+  uint64_t hash = seed ^ ((uint64_t)length * 0x9e3779b97f4a7c15ULL);
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash = (hash ^ (uint32_t)word[i]) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 29;
+  }
+  return word_hash_mix(hash);
+}
+
+static inline uint32_t fingerprint_bucket(uint64_t fingerprint, uint32_t buckets_count, uint32_t dense_buckets_count) {
+  uint64_t low = fingerprint & 0xffffffffu;
+  if ((uint32_t)(fingerprint >> 32) < WORD_HASH_DENSE_KEYS) {
+    return (uint32_t)((low*dense_buckets_count) >> 32);
+  }
+  return dense_buckets_count + (uint32_t)((low*(buckets_count - dense_buckets_count)) >> 32);
+}
+
+static inline uint32_t fingerprint_slot(uint64_t fingerprint, uint32_t pilot, uint32_t slots_count) {
+  uint64_t mixed = word_hash_mix(fingerprint ^ word_hash_mix((uint64_t)pilot + 1));
+  return (uint32_t)(((mixed >> 32)*slots_count) >> 32);
+}
+
+/* Сборка */
+
+typedef struct {
+  MiniAutomat *automat;
+  uint64_t seed;
+  uint64_t *fingerprints;
+  uint32_t *values;
+  size_t count;
+  size_t capacity;
+  uint32_t *lists;
+  size_t lists_size;
+  size_t lists_capacity;
+  HashTable *lists_index;
+  uint32_t *annotations; /* Аннотации текущей словоформы */
+  size_t annotations_count;
+  size_t annotations_capacity;
+} WordHashBuilder;
+
+static void collect_annotation(char is_prediction, size_t prefix_size, size_t prediction_size,
+                               uint32_t annotation, void *data) {
+  WordHashBuilder *builder = data;
+  if (builder->annotations_count == builder->annotations_capacity) {
+    builder->annotations_capacity = builder->annotations_capacity == 0 ? 16 : builder->annotations_capacity*2;
+    builder->annotations = strict_realloc(builder->annotations, builder->annotations_capacity*sizeof(uint32_t));
+  }
+  builder->annotations[builder->annotations_count++] = annotation;
+}
+
+/* Возвращает смещение списка аннотаций текущей словоформы, добавляя его,
+   если такого списка ещё не было */
+static uint32_t intern_annotations(WordHashBuilder *builder) {
+  size_t list_size = builder->annotations_count + 1;
+  void **stored = hash_table_get_always(builder->lists_index, builder->annotations,
+                                        builder->annotations_count*sizeof(uint32_t));
+  if (*stored != NULL) return (uint32_t)((uintptr_t)*stored - 1);
+  while (builder->lists_size + list_size > builder->lists_capacity) {
+    builder->lists_capacity = builder->lists_capacity == 0 ? 4096 : builder->lists_capacity*2;
+    builder->lists = strict_realloc(builder->lists, builder->lists_capacity*sizeof(uint32_t));
+  }
+  builder->lists[builder->lists_size] = (uint32_t)builder->annotations_count;
+  memcpy(builder->lists + builder->lists_size + 1, builder->annotations, builder->annotations_count*sizeof(uint32_t));
+  *stored = (void *)(uintptr_t)(builder->lists_size + 1);
+  builder->lists_size += list_size;
+  return (uint32_t)(builder->lists_size - list_size);
+}
+
+/* Добавляет словоформу, путь до которой в автомате - reversed_word */
+static void add_word_form(WordHashBuilder *builder, Label reversed_word[], size_t length) {
+  AutomatOutputLimits no_limits = {0, 0};
+  wchar_t word[MAX_AUTOMAT_OUTPUT_SIZE];
+  size_t i;
+  builder->annotations_count = 0;
+  mini_possible_outputs(builder->automat, reversed_word, length, length + 1, &no_limits, collect_annotation, builder);
+  if (builder->annotations_count == 0) return;
+  for (i = 0; i < length; i++) word[i] = reversed_word[length - 1 - i];
+  if (builder->count == builder->capacity) {
+    builder->capacity = builder->capacity == 0 ? 65536 : builder->capacity*2;
+    builder->fingerprints = strict_realloc(builder->fingerprints, builder->capacity*sizeof(uint64_t));
+    builder->values = strict_realloc(builder->values, builder->capacity*sizeof(uint32_t));
+  }
+  builder->fingerprints[builder->count] = word_fingerprint(word, length, builder->seed);
+  builder->values[builder->count] = intern_annotations(builder);
+  builder->count++;
+}
+
+/* Перебирает обходом в глубину все пути автомата, за которыми следует
+   разделитель аннотаций */
+static void collect_word_forms(WordHashBuilder *builder) {
+  MiniAutomat *automat = builder->automat;
+  uint32_t next[MAX_AUTOMAT_OUTPUT_SIZE], last[MAX_AUTOMAT_OUTPUT_SIZE], target;
+  Label path[MAX_AUTOMAT_OUTPUT_SIZE];
+  MiniTransition transition;
+  size_t depth = 0;
+  mini_transitions_range(automat, 0, next, last);
+  for (;;) {
+    if (next[depth] == last[depth]) {
+      if (depth == 0) break;
+      depth--;
+      continue;
+    }
+    transition = automat->transitions[next[depth]++];
+    target = MINI_TRANSITION_TARGET(transition);
+    if (MINI_TRANSITION_SYMBOL(transition) == automat->delimiter_symbol) {
+      if (depth > 0) add_word_form(builder, path, depth);
+    } else if (depth + 2 < MAX_AUTOMAT_OUTPUT_SIZE) {
+      path[depth++] = automat->alphabet->labels[MINI_TRANSITION_SYMBOL(transition)];
+      mini_transitions_range(automat, target, next + depth, last + depth);
+    }
+  }
+}
+
+/* Раскладывает отпечатки fingerprints по местам. В slots для каждого
+   отпечатка записывается его место (до переотображения). Возвращает -1,
+   если для какой-то корзины пилот не нашёлся (или отпечатки совпали). */
+static int place_fingerprints(const uint64_t *fingerprints, uint32_t count, WordFormHashHeader *header,
+                              uint32_t *pilots, uint32_t *slots) {
+  uint32_t buckets_count = header->buckets_count, dense = header->dense_buckets_count, slots_count = header->slots_count;
+  uint32_t *bucket_starts = strict_calloc((size_t)buckets_count + 1, sizeof(uint32_t));
+  uint32_t *bucket_keys = strict_malloc(sizeof(uint32_t)*((size_t)count + 1));
+  uint32_t *order = strict_malloc(sizeof(uint32_t)*buckets_count);
+  uint32_t *fill = strict_malloc(sizeof(uint32_t)*buckets_count);
+  uint8_t *taken = strict_calloc(slots_count, sizeof(uint8_t));
+  uint32_t i, j, k, bucket, size, max_size = 0, pilot, *size_starts, positions[256];
+  int result = 0;
+  for (i = 0; i < count; i++) {
+    bucket_starts[fingerprint_bucket(fingerprints[i], buckets_count, dense) + 1]++;
+  }
+  for (i = 0; i < buckets_count; i++) {
+    if (bucket_starts[i + 1] > max_size) max_size = bucket_starts[i + 1];
+    bucket_starts[i + 1] += bucket_starts[i];
+  }
+  if (max_size > sizeof(positions)/sizeof(positions[0])) result = -1;
+  for (i = 0; i < buckets_count; i++) fill[i] = bucket_starts[i];
+  for (i = 0; i < count; i++) {
+    bucket = fingerprint_bucket(fingerprints[i], buckets_count, dense);
+    bucket_keys[fill[bucket]++] = i;
+  }
+  /* Корзины по убыванию размера - подсчётом */
+  size_starts = strict_calloc((size_t)max_size + 2, sizeof(uint32_t));
+  for (i = 0; i < buckets_count; i++) size_starts[max_size - (bucket_starts[i + 1] - bucket_starts[i]) + 1]++;
+  for (i = 0; i <= max_size; i++) size_starts[i + 1] += size_starts[i];
+  for (i = 0; i < buckets_count; i++) order[size_starts[max_size - (bucket_starts[i + 1] - bucket_starts[i])]++] = i;
+  memset(pilots, 0, sizeof(uint32_t)*buckets_count);
+  for (i = 0; i < buckets_count && result == 0; i++) {
+    bucket = order[i];
+    size = bucket_starts[bucket + 1] - bucket_starts[bucket];
+    if (size == 0) break;
+    for (pilot = 0; pilot < WORD_HASH_MAX_PILOT; pilot++) {
+      for (j = 0; j < size; j++) {
+        positions[j] = fingerprint_slot(fingerprints[bucket_keys[bucket_starts[bucket] + j]], pilot, slots_count);
+        if (taken[positions[j]]) break;
+        for (k = 0; k < j && positions[k] != positions[j]; k++);
+        if (k < j) break;
+      }
+      if (j == size) break;
+    }
+    if (pilot == WORD_HASH_MAX_PILOT) {
+      result = -1;
+      break;
+    }
+    pilots[bucket] = pilot;
+    for (j = 0; j < size; j++) {
+      taken[positions[j]] = 1;
+      slots[bucket_keys[bucket_starts[bucket] + j]] = positions[j];
+    }
+  }
+  strict_free(size_starts);
+  strict_free(taken);
+  strict_free(fill);
+  strict_free(order);
+  strict_free(bucket_keys);
+  strict_free(bucket_starts);
+  return result;
+}
+
+/* Собирает образ таблицы по собранным словоформам. Возвращает NULL, если
+   разложить отпечатки с зерном builder->seed не удалось. */
+static void *make_word_form_hash_image(WordHashBuilder *builder, size_t *image_size) {
+  WordFormHashHeader header;
+  uint32_t count = (uint32_t)builder->count, i, free_slot = 0, limit, *pilots, *slots, *remap, *values;
+  uint64_t *fingerprints;
+  uint8_t *used;
+  void *image;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.signature, WORD_FORM_HASH_SIGNATURE, sizeof(WORD_FORM_HASH_SIGNATURE));
+  header.version = WORD_FORM_HASH_FORMAT_VERSION;
+  header.label_size = sizeof(Label);
+  header.seed = builder->seed;
+  header.keys_count = count;
+  header.slots_count = (uint32_t)((double)count / WORD_HASH_LOAD_FACTOR) + 1;
+  /* c*n/log2(n) корзин - оценка PTHash, log2 с точностью до целого */
+  for (limit = 0; ((uint64_t)count + 2) >> (limit + 1) != 0; limit++);
+  header.buckets_count = (uint32_t)(WORD_HASH_BUCKET_FACTOR*count/(limit + 1)) + 1;
+  header.dense_buckets_count = (uint32_t)(WORD_HASH_DENSE_BUCKETS*header.buckets_count) + 1;
+  if (header.dense_buckets_count >= header.buckets_count) header.buckets_count = header.dense_buckets_count + 1;
+  header.automat_states_count = builder->automat->states_count;
+  header.annotations_count = builder->automat->annotations.count;
+  for (limit = 1; limit < header.annotations_count && header.annotation_width < 6; limit *= ANNOTATION_RADIX) {
+    header.annotation_width++;
+  }
+  if (header.annotation_width == 0) header.annotation_width = 1;
+  header.pilots_offset = sizeof(header);
+  header.remap_offset = header.pilots_offset + sizeof(uint32_t)*(uint64_t)header.buckets_count;
+  header.fingerprints_offset = (header.remap_offset + sizeof(uint32_t)*(uint64_t)(header.slots_count - count) + 7) & ~(uint64_t)7;
+  header.values_offset = header.fingerprints_offset + sizeof(uint64_t)*(uint64_t)count;
+  header.lists_offset = header.values_offset + sizeof(uint32_t)*(uint64_t)count;
+  header.lists_size = builder->lists_size;
+  header.size = header.lists_offset + sizeof(uint32_t)*header.lists_size;
+  image = strict_calloc(1, header.size);
+  memcpy(image, &header, sizeof(header));
+  pilots = (uint32_t *)((int8_t *)image + header.pilots_offset);
+  remap = (uint32_t *)((int8_t *)image + header.remap_offset);
+  fingerprints = (uint64_t *)((int8_t *)image + header.fingerprints_offset);
+  values = (uint32_t *)((int8_t *)image + header.values_offset);
+  slots = strict_malloc(sizeof(uint32_t)*((size_t)count + 1));
+  if (place_fingerprints(builder->fingerprints, count, &header, pilots, slots) != 0) {
+    strict_free(slots);
+    strict_free(image);
+    return NULL;
+  }
+  /* Переотображение мест за пределами count на свободные */
+  used = strict_calloc(header.slots_count, sizeof(uint8_t));
+  for (i = 0; i < count; i++) used[slots[i]] = 1;
+  for (i = count; i < header.slots_count; i++) {
+    if (!used[i]) continue;
+    while (used[free_slot]) free_slot++;
+    remap[i - count] = free_slot++;
+  }
+  for (i = 0; i < count; i++) {
+    if (slots[i] >= count) slots[i] = remap[slots[i] - count];
+    fingerprints[slots[i]] = builder->fingerprints[i];
+    values[slots[i]] = builder->values[i];
+  }
+  memcpy((int8_t *)image + header.lists_offset, builder->lists, sizeof(uint32_t)*header.lists_size);
+  strict_free(used);
+  strict_free(slots);
+  *image_size = header.size;
+  return image;
+}
+
+static void reset_word_hash_builder(WordHashBuilder *builder) {
+  if (builder->lists_index != NULL) free_hash_table(builder->lists_index);
+  builder->lists_index = make_hash_table(16);
+  builder->count = 0;
+  builder->lists_size = 0;
+}
+
+static void free_word_hash_builder(WordHashBuilder *builder) {
+  if (builder->lists_index != NULL) free_hash_table(builder->lists_index);
+  strict_free(builder->fingerprints);
+  strict_free(builder->values);
+  strict_free(builder->lists);
+  strict_free(builder->annotations);
+}
+
+static int fingerprint_comparer(const void *fingerprint1, const void *fingerprint2) {
+  uint64_t value1 = *(const uint64_t *)fingerprint1, value2 = *(const uint64_t *)fingerprint2;
+  return value1 < value2 ? -1 : (value1 > value2 ? 1 : 0);
+}
+
+/* Отпечатки должны быть различны - иначе двух слов не различить */
+static int has_duplicate_fingerprints(const uint64_t *fingerprints, size_t count) {
+  uint64_t *sorted = strict_malloc(sizeof(uint64_t)*(count + 1));
+  size_t i;
+  int result = 0;
+  memcpy(sorted, fingerprints, sizeof(uint64_t)*count);
+  qsort(sorted, count, sizeof(uint64_t), fingerprint_comparer);
+  for (i = 1; i < count && !result; i++) {
+    if (sorted[i] == sorted[i - 1]) result = 1;
+  }
+  strict_free(sorted);
+  return result;
+}
+
+/* Собирает таблицу словоформ по плоскому образу автомата
+   mini_automat_file_name и сохраняет её в hash_file_name (через временный
+   файл, как и образы автомата). Возвращает 0 при успехе. */
+int convert_word_form_hash(const char *mini_automat_file_name, const char *hash_file_name) {
+  WordHashBuilder builder;
+  void *image = NULL;
+  size_t image_size = 0;
+  int attempt, result;
+  memset(&builder, 0, sizeof(builder));
+  builder.automat = map_mini_automat(mini_automat_file_name);
+  if (builder.automat == NULL) return -1;
+  if (builder.automat->annotations.count == 0) {
+    fprintf(stderr, "Automat %s has no annotation table\n", mini_automat_file_name);
+    free_mini_automat(builder.automat);
+    return -1;
+  }
+  for (attempt = 0; attempt < WORD_HASH_SEEDS_COUNT && image == NULL; attempt++) {
+    builder.seed = word_hash_mix(WORD_HASH_INITIAL_SEED + (uint64_t)attempt);
+    reset_word_hash_builder(&builder);
+    collect_word_forms(&builder);
+    if (!has_duplicate_fingerprints(builder.fingerprints, builder.count)) {
+      image = make_word_form_hash_image(&builder, &image_size);
+    }
+  }
+  free_word_hash_builder(&builder);
+  free_mini_automat(builder.automat);
+  if (image == NULL) {
+    fprintf(stderr, "Can't build word forms hash for %s\n", mini_automat_file_name);
+    return -1;
+  }
+  result = save_file_image(image, image_size, hash_file_name);
+  strict_free(image);
+  return result;
+}
+
+/* Собирает фильтр Блума словоформ таблицы hash_file_name (см.
+   wordfilter.h) и сохраняет его в filter_file_name. Возвращает 0 при
+   успехе. */
+int convert_word_form_filter(const char *hash_file_name, const char *filter_file_name) {
+  WordFormHash *hash = map_word_form_hash(hash_file_name);
+  int result;
+  if (hash == NULL) {
+    fprintf(stderr, "Can't map word forms hash %s\n", hash_file_name);
+    return -1;
+  }
+  result = save_word_form_filter(hash->fingerprints, hash->header->keys_count, hash->header->seed,
+                                 hash->header->automat_states_count, filter_file_name);
+  free_word_form_hash(hash);
+  return result;
+}
+
+/* Загрузка и поиск */
+
+/* Отображает в память таблицу словоформ. Возвращает NULL, если файла нет
+   или он повреждён. */
+WordFormHash *map_word_form_hash(const char *hash_file_name) {
+  WordFormHash *hash;
+  const WordFormHashHeader *header;
+  size_t image_size;
+  void *image = map_file_image(hash_file_name, sizeof(WordFormHashHeader), &image_size);
+  if (image == NULL) return NULL;
+  header = image;
+  if (memcmp(header->signature, WORD_FORM_HASH_SIGNATURE, sizeof(WORD_FORM_HASH_SIGNATURE)) != 0 ||
+      header->version != WORD_FORM_HASH_FORMAT_VERSION ||
+      header->label_size != sizeof(Label) ||
+      header->size != (uint64_t)image_size ||
+      header->slots_count < header->keys_count ||
+      header->dense_buckets_count == 0 || header->dense_buckets_count >= header->buckets_count ||
+      header->pilots_offset + sizeof(uint32_t)*(uint64_t)header->buckets_count > header->size ||
+      header->remap_offset + sizeof(uint32_t)*(uint64_t)(header->slots_count - header->keys_count) > header->size ||
+      header->fingerprints_offset % sizeof(uint64_t) != 0 ||
+      header->fingerprints_offset + sizeof(uint64_t)*(uint64_t)header->keys_count > header->size ||
+      header->values_offset + sizeof(uint32_t)*(uint64_t)header->keys_count > header->size ||
+      header->lists_offset + sizeof(uint32_t)*header->lists_size > header->size) {
+    unmap_file_image(image, image_size);
+    return NULL;
+  }
+  hash = strict_malloc(sizeof(*hash));
+  hash->header = header;
+  hash->pilots = (const uint32_t *)((int8_t *)image + header->pilots_offset);
+  hash->remap = (const uint32_t *)((int8_t *)image + header->remap_offset);
+  hash->fingerprints = (const uint64_t *)((int8_t *)image + header->fingerprints_offset);
+  hash->values = (const uint32_t *)((int8_t *)image + header->values_offset);
+  hash->lists = (const uint32_t *)((int8_t *)image + header->lists_offset);
+  hash->filter = NULL;
+  hash->image = image;
+  hash->image_size = image_size;
+  return hash;
+}
+
+void free_word_form_hash(WordFormHash *hash) {
+  if (hash->filter != NULL) free_word_form_filter(hash->filter);
+  unmap_file_image(hash->image, hash->image_size);
+  strict_free(hash);
+}
+
+/* Проверяет, что таблица собрана по автомату с states_count состояниями и
+   таблицей аннотаций annotations. Таблица от другого автомата (например,
+   оставшаяся от прежней сборки) использоваться не должна. */
+int word_form_hash_matches(const WordFormHash *hash, uint32_t states_count, const AnnotationTable *annotations) {
+  return hash->header->automat_states_count == states_count &&
+    hash->header->annotations_count == annotations->count;
+}
+
+/* Прикладывает к таблице фильтр filter, если он собран по ней, и
+   возвращает 0 - дальше фильтр принадлежит таблице. Чужой фильтр
+   (например, оставшийся от прежней сборки) не прикладывается: -1. */
+int word_form_hash_attach_filter(WordFormHash *hash, WordFormFilter *filter) {
+  if (filter->header->seed != hash->header->seed ||
+      filter->header->keys_count != hash->header->keys_count ||
+      filter->header->automat_states_count != hash->header->automat_states_count) {
+    return -1;
+  }
+  hash->filter = filter;
+  return 0;
+}
+
+/* Если слово word есть в таблице, передаёт on_complete его аннотации -
+   так же, как их передал бы точный разбор автоматом, - и возвращает 1.
+   Иначе (а также если разбор автоматом упёрся бы в ограничения limits)
+   возвращает 0, и слово нужно разбирать автоматом. */
+int word_form_hash_outputs(const WordFormHash *hash,
+                           const wchar_t *word, size_t word_length,
+                           const AutomatOutputLimits *limits,
+                           AutomatOutputProcessor on_complete,
+                           void *data) {
+  const WordFormHashHeader *header = hash->header;
+  const uint32_t *list;
+  uint64_t fingerprint;
+  uint32_t slot, i;
+  if (header->keys_count == 0 || word_length == 0) return 0;
+  fingerprint = word_fingerprint(word, word_length, header->seed);
+  if (hash->filter != NULL && !word_form_filter_may_contain(hash->filter, fingerprint)) return 0;
+  slot = fingerprint_slot(fingerprint,
+                          hash->pilots[fingerprint_bucket(fingerprint, header->buckets_count, header->dense_buckets_count)],
+                          header->slots_count);
+  if (slot >= header->keys_count) slot = hash->remap[slot - header->keys_count];
+  if (slot >= header->keys_count || hash->fingerprints[slot] != fingerprint ||
+      hash->values[slot] >= header->lists_size) {
+    return 0;
+  }
+  list = hash->lists + hash->values[slot];
+  if (hash->values[slot] + 1 + (uint64_t)list[0] > header->lists_size ||
+      (limits->max_outputs > 0 && list[0] > limits->max_outputs) ||
+      (limits->max_states > 0 && 1 + (size_t)list[0]*header->annotation_width >= limits->max_states)) {
+    return 0;
+  }
+  for (i = 1; i <= list[0]; i++) {
+    on_complete(0, word_length, 0, list[i], data);
+  }
+  return 1;
+}
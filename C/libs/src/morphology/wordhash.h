@@ -0,0 +1,85 @@
+/* Минимальная совершенная хэш-таблица словоформ словаря - быстрый путь
+   для слов, которые автомат знает точно.
+
+   Большинство слов текста - словарные, и для каждого из них разбор
+   обращает слово, проходит его по автомату и обходит аннотации за
+   разделителем. Таблица отвечает на тот же вопрос одним обращением: по
+   64-битному отпечатку слова (в прямом порядке букв) находится его место
+   в таблице, а там - список номеров аннотаций в том же порядке, в котором
+   их выдал бы автомат. Слова, которых в таблице нет, разбираются
+   автоматом, как и раньше (в том числе с предсказанием).
+
+   Таблица строится по плоскому автомату (morph-compile -w) и лежит рядом
+   с ним в файле, который отображается в память без разбора. Место слова
+   вычисляется по схеме PTHash: слово попадает в корзину, а номер
+   "пилота" корзины подобран при сборке так, чтобы все слова корзины
+   легли в свободные места. Места за пределами числа слов переотображаются
+   на свободные, так что таблица минимальна - ровно по месту на слово.
+   Сами слова не хранятся, только их отпечатки: вероятность принять
+   незнакомое слово за словарное - порядка 2^-64.
+
+   К таблице можно приложить фильтр Блума тех же словоформ (wordfilter.h):
+   тогда слова, которых в словаре точно нет, отсеиваются им, не обращаясь
+   к самой таблице.
+*/
+
+#ifndef __MORPHOLOGY_WORDHASH_H__
+#define __MORPHOLOGY_WORDHASH_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "miniautomat.h"
+#include "wordforms.h"
+#include "wordfilter.h"
+
+#define WORD_FORM_HASH_SIGNATURE "MORPHWH"
+#define WORD_FORM_HASH_FORMAT_VERSION 1
+
+typedef struct {
+  char signature[8];
+  uint32_t version;
+  uint32_t label_size;
+  uint64_t seed;
+  uint32_t keys_count; /* Число словоформ (и мест в таблице) */
+  uint32_t slots_count; /* Мест до переотображения, не меньше keys_count */
+  uint32_t buckets_count;
+  uint32_t dense_buckets_count; /* Корзин для первых 60% отпечатков */
+  uint32_t automat_states_count; /* Число состояний автомата, по которому собрана таблица */
+  uint32_t annotations_count; /* И размер его таблицы аннотаций */
+  uint32_t annotation_width; /* Цифр в номере аннотации */
+  uint32_t reserved;
+  uint64_t pilots_offset; /* uint32_t[buckets_count] */
+  uint64_t remap_offset; /* uint32_t[slots_count - keys_count] */
+  uint64_t fingerprints_offset; /* uint64_t[keys_count] */
+  uint64_t values_offset; /* uint32_t[keys_count] - смещения списков */
+  uint64_t lists_offset; /* uint32_t[] - списки: число, затем номера аннотаций */
+  uint64_t lists_size;
+  uint64_t size;
+} WordFormHashHeader;
+
+typedef struct word_form_hash {
+  const WordFormHashHeader *header;
+  const uint32_t *pilots;
+  const uint32_t *remap;
+  const uint64_t *fingerprints;
+  const uint32_t *values;
+  const uint32_t *lists;
+  WordFormFilter *filter; /* Фильтр Блума словоформ или NULL */
+  void *image;
+  size_t image_size;
+} WordFormHash;
+
+WordFormHash *map_word_form_hash(const char *hash_file_name);
+void free_word_form_hash(WordFormHash *hash);
+int convert_word_form_hash(const char *mini_automat_file_name, const char *hash_file_name);
+int convert_word_form_filter(const char *hash_file_name, const char *filter_file_name);
+int word_form_hash_attach_filter(WordFormHash *hash, WordFormFilter *filter);
+int word_form_hash_matches(const WordFormHash *hash, uint32_t states_count, const AnnotationTable *annotations);
+int word_form_hash_outputs(const WordFormHash *hash,
+                           const wchar_t *word, size_t word_length,
+                           const AutomatOutputLimits *limits,
+                           AutomatOutputProcessor on_complete,
+                           void *data);
+
+#endif /* __MORPHOLOGY_WORDHASH_H__ */
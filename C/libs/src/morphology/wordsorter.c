@@ -0,0 +1,296 @@
+/* Внешняя сортировка словоформ (см. wordsorter.h).
+
+   Порция - это блоки текста по WORD_SORTER_BLOCK_SIZE символов, в
+   которые подряд пишутся словоформы, и массив указателей на них. Память
+   под порцию (блоки плюс массив) не превышает бюджета; когда очередная
+   словоформа в него уже не влезает, порция сортируется и сбрасывается в
+   безымянный временный файл (серия), а блоки используются заново.
+
+   Серия - это записи uint16_t длина | wchar_t символы[длина]. Слияние
+   держит по одной текущей словоформе на серию в двоичной куче, так что
+   память слияния от числа словоформ не зависит. */
+
+#include "morphology/wordsorter.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "common/strict_alloc.h"
+#include "common/strtools.h"
+
+/* Символов в блоке текста порции */
+#define WORD_SORTER_BLOCK_SIZE (64*1024)
+#define WORD_SORTER_RUN_TEMPLATE ".wordforms-XXXXXX"
+
+/* Серия, текущая словоформа которой ждёт слияния */
+typedef struct {
+  FILE *file;
+  size_t length;
+  wchar_t word[MAX_WORD_FORM_SIZE];
+} SortedRun;
+
+struct word_sorter {
+  size_t memory_budget;
+  char *temp_dir; /* NULL - каталог временных файлов по умолчанию */
+  wchar_t **blocks;
+  size_t blocks_count; /* Выделено блоков */
+  size_t block_index; /* Заполняемый блок */
+  size_t block_used; /* Занято символов в заполняемом блоке */
+  wchar_t **words; /* Словоформы порции */
+  size_t words_count;
+  size_t words_capacity;
+  size_t total_count; /* Всего словоформ */
+  SortedRun *runs;
+  size_t runs_count;
+  size_t runs_capacity;
+  int8_t is_finished;
+  int8_t is_failed;
+};
+
+/* Создаёт сортировщик, которому на порцию словоформ отводится не больше
+   memory_budget байт (но не меньше WORD_SORTER_MIN_BUDGET). Серии пишутся
+   в каталог temp_dir, а если он NULL - туда, куда пишет tmpfile. */
+WordSorter *make_word_sorter(size_t memory_budget, const char *temp_dir) {
+  WordSorter *sorter = strict_calloc(1, sizeof(WordSorter));
+  sorter->memory_budget = memory_budget < WORD_SORTER_MIN_BUDGET ? WORD_SORTER_MIN_BUDGET : memory_budget;
+  if (temp_dir != NULL) sorter->temp_dir = strict_strndup(temp_dir, strlen(temp_dir));
+  return sorter;
+}
+
+static void free_chunk(WordSorter *sorter) {
+  size_t i;
+  for (i = 0; i < sorter->blocks_count; i++) {
+    strict_free(sorter->blocks[i]);
+  }
+  strict_free(sorter->blocks);
+  strict_free(sorter->words);
+  sorter->blocks = NULL;
+  sorter->words = NULL;
+  sorter->blocks_count = sorter->block_index = sorter->block_used = 0;
+  sorter->words_count = sorter->words_capacity = 0;
+}
+
+void free_word_sorter(WordSorter *sorter) {
+  size_t i;
+  free_chunk(sorter);
+  for (i = 0; i < sorter->runs_count; i++) {
+    if (sorter->runs[i].file != NULL) fclose(sorter->runs[i].file);
+  }
+  strict_free(sorter->runs);
+  strict_free(sorter->temp_dir);
+  strict_free(sorter);
+}
+
+/* Число словоформ, переданных сортировщику */
+size_t word_sorter_size(WordSorter *sorter) {
+  return sorter->total_count;
+}
+
+/* Число серий, сброшенных во временные файлы */
+size_t word_sorter_runs(WordSorter *sorter) {
+  return sorter->runs_count;
+}
+
+static size_t chunk_memory(size_t blocks_count, size_t words_capacity) {
+  return blocks_count*WORD_SORTER_BLOCK_SIZE*sizeof(wchar_t) + words_capacity*sizeof(wchar_t *);
+}
+
+static int word_form_comparer(const void *form1, const void *form2) {
+  return wcscmp(*(wchar_t **)form1, *(wchar_t **)form2);
+}
+
+/* Открывает безымянный временный файл для серии */
+static FILE *open_run_file(WordSorter *sorter) {
+  char *file_name;
+  FILE *file;
+  int descriptor;
+  if (sorter->temp_dir == NULL) return tmpfile();
+  file_name = join_path(2, sorter->temp_dir, WORD_SORTER_RUN_TEMPLATE);
+  descriptor = mkstemp(file_name);
+  if (descriptor < 0) {
+    strict_free(file_name);
+    return NULL;
+  }
+  unlink(file_name);
+  strict_free(file_name);
+  file = fdopen(descriptor, "w+b");
+  if (file == NULL) close(descriptor);
+  return file;
+}
+
+/* Сортирует порцию и сбрасывает её в новую серию. Блоки остаются
+   выделенными и заполняются заново. */
+static int spill_chunk(WordSorter *sorter) {
+  FILE *file;
+  uint16_t length;
+  size_t i;
+  qsort(sorter->words, sorter->words_count, sizeof(wchar_t *), word_form_comparer);
+  file = open_run_file(sorter);
+  if (file == NULL) {
+    fprintf(stderr, "Can't create temporary file for word forms\n");
+    return -1;
+  }
+  for (i = 0; i < sorter->words_count; i++) {
+    length = (uint16_t)wcslen(sorter->words[i]);
+    if (fwrite(&length, sizeof(length), 1, file) != 1 ||
+        fwrite(sorter->words[i], sizeof(wchar_t), length, file) != length) {
+      fprintf(stderr, "Can't write word forms to temporary file\n");
+      fclose(file);
+      return -1;
+    }
+  }
+  if (sorter->runs_count == sorter->runs_capacity) {
+    sorter->runs_capacity = sorter->runs_capacity == 0 ? 8 : sorter->runs_capacity*2;
+    sorter->runs = strict_realloc(sorter->runs, sorter->runs_capacity*sizeof(SortedRun));
+  }
+  sorter->runs[sorter->runs_count].file = file;
+  sorter->runs[sorter->runs_count].length = 0;
+  sorter->runs_count++;
+  sorter->words_count = 0;
+  sorter->block_index = sorter->block_used = 0;
+  return 0;
+}
+
+/* Передаёт сортировщику sorter словоформу word_form длиной length
+   (сигнатура - как у WordFormProcessor, чтобы сортировщик можно было
+   прямо отдать генератору словоформ). Возвращает 0 или -1 при ошибке
+   записи временного файла. */
+int word_sorter_add(const wchar_t *word_form, size_t length, void *data) {
+  WordSorter *sorter = (WordSorter *)data;
+  size_t blocks_count = sorter->blocks_count, words_capacity = sorter->words_capacity;
+  int8_t needs_block;
+  wchar_t *word;
+  if (sorter->is_failed || sorter->is_finished) return -1;
+  if (length >= MAX_WORD_FORM_SIZE) length = MAX_WORD_FORM_SIZE - 1;
+  needs_block = sorter->block_used + length + 1 > WORD_SORTER_BLOCK_SIZE || sorter->blocks_count == 0;
+  if (needs_block && sorter->block_index + 1 >= sorter->blocks_count) blocks_count++;
+  if (sorter->words_count == sorter->words_capacity) words_capacity = words_capacity == 0 ? 1024 : words_capacity*2;
+  if ((blocks_count != sorter->blocks_count || words_capacity != sorter->words_capacity) &&
+      sorter->words_count > 0 &&
+      chunk_memory(blocks_count, words_capacity) > sorter->memory_budget) {
+    if (spill_chunk(sorter) != 0) {
+      sorter->is_failed = 1;
+      return -1;
+    }
+    return word_sorter_add(word_form, length, data);
+  }
+  if (words_capacity != sorter->words_capacity) {
+    sorter->words_capacity = words_capacity;
+    sorter->words = strict_realloc(sorter->words, words_capacity*sizeof(wchar_t *));
+  }
+  if (needs_block) {
+    if (sorter->blocks_count > 0) sorter->block_index++;
+    if (sorter->block_index >= sorter->blocks_count) {
+      sorter->blocks = strict_realloc(sorter->blocks, (sorter->blocks_count + 1)*sizeof(wchar_t *));
+      sorter->blocks[sorter->blocks_count++] = strict_malloc(WORD_SORTER_BLOCK_SIZE*sizeof(wchar_t));
+    }
+    sorter->block_used = 0;
+  }
+  word = sorter->blocks[sorter->block_index] + sorter->block_used;
+  wmemcpy(word, word_form, length);
+  word[length] = L'\0';
+  sorter->block_used += length + 1;
+  sorter->words[sorter->words_count++] = word;
+  sorter->total_count++;
+  return 0;
+}
+
+/* Читает из серии run следующую словоформу. Возвращает 1, если она
+   прочитана, 0 в конце серии и -1 при ошибке. */
+static int read_run_word(SortedRun *run) {
+  uint16_t length;
+  if (fread(&length, sizeof(length), 1, run->file) != 1) {
+    return ferror(run->file) ? -1 : 0;
+  }
+  if (length >= MAX_WORD_FORM_SIZE ||
+      fread(run->word, sizeof(wchar_t), length, run->file) != length) {
+    return -1;
+  }
+  run->word[length] = L'\0';
+  run->length = length;
+  return 1;
+}
+
+/* Заканчивает приём словоформ. Если серий ещё не было, порция просто
+   сортируется в памяти, иначе она тоже сбрасывается в серию, а память
+   порции освобождается до слияния. Возвращает 0 или -1 при ошибке. */
+int word_sorter_finish(WordSorter *sorter) {
+  if (sorter->is_failed) return -1;
+  if (sorter->is_finished) return 0;
+  sorter->is_finished = 1;
+  if (sorter->runs_count == 0) {
+    qsort(sorter->words, sorter->words_count, sizeof(wchar_t *), word_form_comparer);
+    return 0;
+  }
+  if (sorter->words_count > 0 && spill_chunk(sorter) != 0) {
+    sorter->is_failed = 1;
+    return -1;
+  }
+  free_chunk(sorter);
+  return 0;
+}
+
+static inline int run_is_less(SortedRun *runs, size_t index1, size_t index2) {
+  int order = wcscmp(runs[index1].word, runs[index2].word);
+  return order < 0 || (order == 0 && index1 < index2);
+}
+
+static void sift_down(SortedRun *runs, size_t *heap, size_t heap_size, size_t position) {
+  size_t child, top = heap[position];
+  while ((child = 2*position + 1) < heap_size) {
+    if (child + 1 < heap_size && run_is_less(runs, heap[child + 1], heap[child])) child++;
+    if (!run_is_less(runs, heap[child], top)) break;
+    heap[position] = heap[child];
+    position = child;
+  }
+  heap[position] = top;
+}
+
+/* Сливает серии, передавая словоформы on_word_form по возрастанию */
+static int merge_runs(WordSorter *sorter, WordFormProcessor on_word_form, void *data) {
+  SortedRun *runs = sorter->runs;
+  size_t *heap = strict_malloc(sorter->runs_count*sizeof(size_t));
+  size_t i, heap_size = 0;
+  int read_status = 1, is_stopped = 0;
+  for (i = 0; i < sorter->runs_count && read_status >= 0; i++) {
+    if (fflush(runs[i].file) != 0 || fseek(runs[i].file, 0, SEEK_SET) != 0) {
+      read_status = -1;
+    } else if ((read_status = read_run_word(runs + i)) > 0) {
+      heap[heap_size++] = i;
+    }
+  }
+  for (i = heap_size/2; i > 0; i--) {
+    sift_down(runs, heap, heap_size, i - 1);
+  }
+  while (heap_size > 0 && read_status >= 0) {
+    i = heap[0];
+    if (on_word_form(runs[i].word, runs[i].length, data) != 0) {
+      is_stopped = 1;
+      break;
+    }
+    read_status = read_run_word(runs + i);
+    if (read_status == 0) heap[0] = heap[--heap_size];
+    if (heap_size > 0) sift_down(runs, heap, heap_size, 0);
+  }
+  strict_free(heap);
+  if (read_status < 0) {
+    fprintf(stderr, "Can't read word forms from temporary file\n");
+    return -1;
+  }
+  return is_stopped ? -1 : 0;
+}
+
+/* Передаёт on_word_form все словоформы по возрастанию (в порядке wcscmp).
+   Вызывается после word_sorter_finish. Возвращает 0, или -1 при ошибке
+   чтения серий или если on_word_form прервал перебор. */
+int word_sorter_merge(WordSorter *sorter, WordFormProcessor on_word_form, void *data) {
+  size_t i;
+  if (!sorter->is_finished || sorter->is_failed) return -1;
+  if (sorter->runs_count > 0) return merge_runs(sorter, on_word_form, data);
+  for (i = 0; i < sorter->words_count; i++) {
+    if (on_word_form(sorter->words[i], wcslen(sorter->words[i]), data) != 0) return -1;
+  }
+  return 0;
+}
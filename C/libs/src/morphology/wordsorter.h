@@ -0,0 +1,40 @@
+/* Внешняя сортировка словоформ для построения автомата.
+
+   Все словоформы словаря в памяти сразу не держатся: они копятся в
+   порциях не больше заданного бюджета памяти, каждая заполненная порция
+   сортируется и сбрасывается во временный файл, а в конце отсортированные
+   файлы сливаются и словоформы по одной, по возрастанию, передаются
+   построителю автомата. Если все словоформы уместились в одну порцию,
+   файлов нет вовсе и сортировка идёт в памяти.
+*/
+
+#ifndef __MORPHOLOGY_WORDSORTER_H__
+#define __MORPHOLOGY_WORDSORTER_H__
+
+#include <stdlib.h>
+#include <wchar.h>
+
+/* Максимальная длина одной словоформы, которая может быть составлена по
+ * морфологическому словарю для обучения автомата */
+#define MAX_WORD_FORM_SIZE 240
+/* Бюджет памяти на порцию словоформ по умолчанию, байт. Словарь на
+   миллионы словоформ в него укладывается целиком. */
+#define WORD_SORTER_DEFAULT_BUDGET ((size_t)256 << 20)
+/* Меньше этого бюджет памяти сортировки не бывает */
+#define WORD_SORTER_MIN_BUDGET ((size_t)1 << 20)
+
+/* Обработчик очередной словоформы word_form длиной length. Возвращает 0,
+   или -1, чтобы прервать перебор. */
+typedef int (*WordFormProcessor)(const wchar_t *word_form, size_t length, void *data);
+
+typedef struct word_sorter WordSorter;
+
+WordSorter *make_word_sorter(size_t memory_budget, const char *temp_dir);
+void free_word_sorter(WordSorter *sorter);
+int word_sorter_add(const wchar_t *word_form, size_t length, void *sorter);
+int word_sorter_finish(WordSorter *sorter);
+int word_sorter_merge(WordSorter *sorter, WordFormProcessor on_word_form, void *data);
+size_t word_sorter_size(WordSorter *sorter);
+size_t word_sorter_runs(WordSorter *sorter);
+
+#endif /* __MORPHOLOGY_WORDSORTER_H__ */
@@ -39,6 +39,14 @@
 #include "textprocessor/suffix.h"
 #include "morphology/helpers.h"
 
+/* Сколько слов документа разбирается за раз (см. build_text_with_ranges) */
+#define DOCUMENT_WORDS_BATCH 64
+/* Закрепление языка документа (DOC_PIN_LANGUAGE): по скольким первым словам
+ * с определённым языком оно решается и какая доля (%) из них должна быть на
+ * одном языке */
+#define DOCUMENT_PIN_MIN_WORDS 32
+#define DOCUMENT_PIN_SHARE 90
+
 /* Делает "нормализацию текста" в  UTF-8, приводя его к нижнему регистру, в той
  * же кодировке. Именно так он и будет потом обрабатываться и храниться, для
  * экономии памяти */
@@ -133,13 +141,27 @@ char *normalize_morph_form(const char *source_text,
  * во всех словоформах. Попутно создаётся массив диапазонов, каждый из
  * которых описывает, за какое исходное слово отвечает каждый блок нового
  * текста.
+ * Слова разбираются пачками до DOCUMENT_WORDS_BATCH (см.
+ * multilang_words_descriptions), а не по одному: так автомат проходит
+ * сразу несколько слов и промахи кэша перекрываются. Если язык текста по
+ * ходу пачки сменился, остаток пачки разбирается по одному слову, уже с
+ * новым языком - результат тот же, что при разборе всех слов по одному.
+ * После смены языка следующая пачка вдвое меньше (до одного слова), после
+ * пачки без смены - вдвое больше: в тексте, где языки перемешаны пословно,
+ * пачки почти не разбираются впустую.
+ * С флагом DOC_PIN_LANGUAGE ведётся счёт языков разобранных слов, и как
+ * только среди первых слов документа набирается DOCUMENT_PIN_MIN_WORDS слов
+ * с определённым языком и не меньше DOCUMENT_PIN_SHARE процентов из них - на
+ * одном языке, этот язык закрепляется: остальные слова разбираются только
+ * им (см. multilang_words_descriptions).
  */
 static char *build_text_with_ranges(const char *source_text,
+                                    uint16_t flags,
                                     MultiMorphology *morphology,
                                     size_t *text_size,
                                     WordRange **result_ranges,
                                     size_t *ranges_count) {
-  size_t text_length, description_size;
+  size_t text_length, description_size, batch_size, batch_limit, described, i, j;
   ssize_t token_size;
   const char *token_start, *token_end;
   const wchar_t *wide_token;
@@ -149,44 +171,109 @@ static char *build_text_with_ranges(const char *source_text,
   void *memo = NULL;
   StringBuffer *document_buffer = create_string_buffer();
   ArrayList *word_ranges = make_array_list(sizeof(WordRange), 10000);
-  Dictionary *suggest_language, *detected_language;
+  Dictionary *suggest_language, *detected_languages[DOCUMENT_WORDS_BATCH];
+  wchar_t *words[DOCUMENT_WORDS_BATCH];
+  size_t word_lengths[DOCUMENT_WORDS_BATCH], mb_word_lengths[DOCUMENT_WORDS_BATCH];
+  const char *mb_words[DOCUMENT_WORDS_BATCH];
+  char *descriptions[DOCUMENT_WORDS_BATCH];
+  size_t description_sizes[DOCUMENT_WORDS_BATCH];
+  int has_tokens = 1, pin_language = 0, language_switched;
+  size_t *language_counts = NULL, known_words = 0, best;
+  if (flags & DOC_PIN_LANGUAGE) {
+    language_counts = strict_calloc(morphology->languages_count, sizeof(*language_counts));
+  }
   text_cursor = normal_text = normalize_text(source_text, &text_length);
   words_counter = cursor = 0;
   first_description = NULL;
   suggest_language = NULL;
-  while ((token_size = tokenize(text_cursor, &token_start, &token_end, &wide_token, &memo)) > 0) {
-    WordRange range;
-    description = multilang_word_description(morphology, suggest_language,
-                                             wide_token, wcslen(wide_token),
-                                             token_start, (size_t)token_size,
-                                             &description_size,
-                                             &detected_language);
-    //puts(description);
-    if (detected_language != NULL && detected_language != suggest_language) {
-      suggest_language = detected_language;
+  batch_limit = DOCUMENT_WORDS_BATCH;
+  while (has_tokens) {
+    /* Широкая строка токена живёт только до следующего вызова tokenize -
+     * копируем. Многобайтовые токены указывают прямо в normal_text. */
+    for (batch_size = 0; batch_size < batch_limit; batch_size++) {
+      token_size = tokenize(text_cursor, &token_start, &token_end, &wide_token, &memo);
+      text_cursor = NULL;
+      if (token_size <= 0) {
+        has_tokens = 0;
+        break;
+      }
+      word_lengths[batch_size] = wcslen(wide_token);
+      words[batch_size] = strict_malloc(sizeof(wchar_t)*(word_lengths[batch_size] + 1));
+      wmemcpy(words[batch_size], wide_token, word_lengths[batch_size] + 1);
+      mb_words[batch_size] = token_start;
+      mb_word_lengths[batch_size] = (size_t)token_size;
     }
-    if (words_counter == 0) {
-      /* Перед первым словом надо поставить терминатор */
-      first_description = strict_malloc(description_size + 2);
-      *first_description = WORD_DESCRIPTION_TERMINATOR;
-      memcpy(first_description + 1, description, description_size + 1);
-      ++description_size;
+    /* Пачка описывается вместе до первой смены языка, дальше - по слову.
+     * Закреплённый язык не меняется, и пачка описывается целиком. */
+    described = batch_size > 1 || pin_language ?
+        multilang_words_descriptions(morphology, suggest_language, pin_language,
+                                     (const wchar_t *const *)words, word_lengths,
+                                     mb_words, mb_word_lengths, batch_size,
+                                     descriptions, description_sizes, detected_languages) : 0;
+    language_switched = 0;
+    for (i = 0; i < batch_size; i++) {
+      WordRange range;
+      if (i >= described) {
+        descriptions[i] = multilang_word_description(morphology, suggest_language, words[i], word_lengths[i],
+                                                     mb_words[i], mb_word_lengths[i],
+                                                     &description_sizes[i], &detected_languages[i]);
+      }
+      description = descriptions[i];
+      description_size = description_sizes[i];
+      //puts(description);
+      if (words_counter == 0) {
+        /* Перед первым словом надо поставить терминатор */
+        first_description = strict_malloc(description_size + 2);
+        *first_description = WORD_DESCRIPTION_TERMINATOR;
+        memcpy(first_description + 1, description, description_size + 1);
+        ++description_size;
+        strict_free(description);
+        description = first_description;
+        range.start_position = cursor;
+      } else {
+        range.start_position = cursor - 1;
+      }
+      exact_append_to_string_buffer(document_buffer, description, description_size);
       strict_free(description);
-      description = first_description;
-      range.start_position = cursor;
-    } else {
-      range.start_position = cursor - 1;
+      range.end_position = cursor + (int32_t)description_size - 1;
+      range.original_start = range.end_position - (int32_t)mb_word_lengths[i] - 1;
+      range.word_index = words_counter;
+      cursor += (int32_t)description_size;
+      ++words_counter;
+      array_list_append(word_ranges, &range);
+      if (language_counts != NULL && detected_languages[i] != NULL) {
+        for (j = 0; morphology->languages[j] != detected_languages[i]; j++);
+        language_counts[j]++;
+        known_words++;
+      }
+      if (detected_languages[i] != NULL && detected_languages[i] != suggest_language) {
+        /* Первое определение языка документа сменой не считается */
+        language_switched |= suggest_language != NULL;
+        suggest_language = detected_languages[i];
+      }
+    }
+    for (i = 0; i < batch_size; i++) {
+      strict_free(words[i]);
+    }
+    if (language_switched) {
+      batch_limit = batch_limit > 1 ? batch_limit/2 : 1;
+    } else if (batch_limit < DOCUMENT_WORDS_BATCH) {
+      batch_limit *= 2;
+    }
+    if (language_counts != NULL && known_words >= DOCUMENT_PIN_MIN_WORDS) {
+      for (best = 0, j = 1; j < morphology->languages_count; j++) {
+        if (language_counts[j] > language_counts[best]) best = j;
+      }
+      if (language_counts[best]*100 >= known_words*DOCUMENT_PIN_SHARE) {
+        suggest_language = morphology->languages[best];
+        pin_language = 1;
+      }
+      /* Решение принимается один раз, по первым словам */
+      strict_free(language_counts);
+      language_counts = NULL;
     }
-    exact_append_to_string_buffer(document_buffer, description, description_size);
-    strict_free(description);
-    range.end_position = cursor + (int32_t)description_size - 1;
-    range.original_start = range.end_position - (int32_t)token_size - 1;
-    range.word_index = words_counter;
-    cursor += (int32_t)description_size;
-    ++words_counter;
-    array_list_append(word_ranges, &range);
-    text_cursor = NULL;
   }
+  strict_free(language_counts);
   result_text = join_string_buffer(document_buffer, text_size);
   array_list_minimize(word_ranges);
   *result_ranges = array_list_data(word_ranges);
@@ -212,7 +299,7 @@ void *make_document(const char *text, uint16_t flags, MultiMorphology *morpholog
   DocumentHeader *header;
   char *alt_text;
   size_t suffix_array_byte_size, text_byte_size, ranges_byte_size;
-  alt_text = build_text_with_ranges(text, morphology, &alt_text_size,
+  alt_text = build_text_with_ranges(text, flags, morphology, &alt_text_size,
                                     &word_ranges, &ranges_count);
   suffix_array = text_to_suffix_array(alt_text, alt_text_size);
   /* Документ хранится одним большим блоком памяти, имеющим следующую
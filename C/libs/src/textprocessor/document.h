@@ -9,7 +9,7 @@
 #include "../morphology/multilang.h"
 #include "../morphology/helpers.h"
 
-enum {DOC_PACKED = 1, DOC_NO_LOADED = 2};
+enum {DOC_PACKED = 1, DOC_NO_LOADED = 2, DOC_PIN_LANGUAGE = 4};
 
 typedef struct {
   int32_t word_index;
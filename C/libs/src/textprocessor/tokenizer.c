@@ -60,7 +60,7 @@ void final_tokenize(void *memo) {
 */
 ssize_t tokenize(const char *text, const char **token_start, const char **token_end, const wchar_t **wide_token, void **memo) {
   const int error_code = -1;
-  char *old_locale;
+  locale_t old_locale;
   struct tokenizer_state *state;
   mbstate_t prev_mbstate;
   wchar_t char_buffer[2], current_symbol;
@@ -95,7 +95,7 @@ ssize_t tokenize(const char *text, const char **token_start, const char **token_
     state->code = OUTSIDE_TOKEN;
   }
   
-  old_locale = setlocale(LC_CTYPE, MORPHOLOGY_DEFAULT_LOCALE);
+  old_locale = use_morphology_locale();
   do {  
     prev_text_position = state->text_position;
     prev_mbstate = state->mbstate;
@@ -175,6 +175,6 @@ ssize_t tokenize(const char *text, const char **token_start, const char **token_
         break;
     }
   } while (state != NULL && state->code != FINAL && state->code != TOKEN_READY);
-  setlocale(LC_CTYPE, old_locale);
+  uselocale(old_locale);
   return retval;
 }
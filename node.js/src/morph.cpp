@@ -20,8 +20,13 @@ static Handle<Value> init(const Arguments& args)
     //}
 
     if (morph != NULL) {
-        morph_delete(morph);
-        morph = NULL;
+        /* Словари перечитываются в фоне, запросы тем временем обслуживает
+         * прежняя версия */
+        if (args.Length() == 0) {
+            return Number::New(morph_reload(morph, NULL) == MORPH_OK ? 1 : 0);
+        }
+        String::Utf8Value str(args[0]);
+        return Number::New(morph_reload(morph, *str) == MORPH_OK ? 1 : 0);
     }
 
     if (args.Length() == 0) {
@@ -57,7 +62,7 @@ static Handle<Value> normalize_phrase(const Arguments& args)
     
     String::Utf8Value query(args[0]);
     
-    normalize_morph_form = morph_normalize_form(*query, morph->multi_morphology, query.length());
+    normalize_morph_form = morph_normalize_form(*query, morph, query.length());
     if (normalize_morph_form == NULL) {
         return String::New("");
     }